@@ -0,0 +1,38 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_ALLOCATOR_H
+#define NSSYNC_ALLOCATOR_H
+
+#include <stddef.h>
+
+/** memory allocator used by the library
+ *
+ * A context or session given an allocator makes all of its
+ *   allocations, including those of the jansson parser and of the
+ *   crypto workers on its behalf, through it. Without one the C
+ *   library allocator is used.
+ *
+ * jansson only allows a single process wide set of allocation
+ *   functions so the library installs its own the first time an
+ *   allocator is given. That must happen before the application
+ *   makes any jansson allocations of its own. jansson allocations
+ *   made by engine decoders and change callbacks come from the
+ *   session allocator and must be released within a callback from
+ *   that session.
+ *
+ * Connection state within libcurl is not covered.
+ */
+struct nssync_allocator {
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *ctx; /* context passed to the allocation functions */
+};
+
+#endif
@@ -12,6 +12,7 @@
 struct nssync_sync_bookmarks;
 
 enum nssync_error nssync_bookmarks_new(struct nssync_sync *sync, struct nssync_sync_bookmarks **sync_bookmarks);
+enum nssync_error nssync_bookmarks_sync(struct nssync_sync_bookmarks *sync_bookmarks);
 enum nssync_error nssync_bookmarks_free(struct nssync_sync_bookmarks *sync_bookmarks);
 
 #endif
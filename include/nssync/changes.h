@@ -0,0 +1,65 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_CHANGES_H
+#define NSSYNC_CHANGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nssync/error.h>
+
+struct nssync_sync;
+struct nssync_subscription;
+
+enum nssync_change_type {
+	NSSYNC_CHANGE_ADDED, /* record not seen before */
+	NSSYNC_CHANGE_MODIFIED, /* previously seen record changed */
+	NSSYNC_CHANGE_DELETED, /* record was deleted */
+};
+
+/* a changed record within a collection */
+struct nssync_change {
+	enum nssync_change_type type;
+	const char *id; /* record id */
+	double modified; /* server modification time */
+	const uint8_t *record; /* decrypted record or NULL */
+	size_t record_length;
+};
+
+enum nssync_subscribe_flags {
+	NSSYNC_SUBSCRIBE_IDS = 0, /* only report record ids */
+	NSSYNC_SUBSCRIBE_RECORDS = 1, /* include decrypted records */
+};
+
+/** collection change callback
+ *
+ * Called during a sync pass with the records in the collection that
+ *   changed since the previous pass in collection order. A large
+ *   collection is reported in several calls of up to a page of changes
+ *   each. The change vector and records are only valid for the
+ *   duration of the call.
+ */
+typedef enum nssync_error (nssync_change_cb)(void *ctx, const char *collection, const struct nssync_change *changev, int changec);
+
+/** subscribe to changes within a collection
+ *
+ * The first pass reports every record in the collection as added.
+ *
+ * @param sync The sync session.
+ * @param collection The collection name.
+ * @param flags Flags from nssync_subscribe_flags.
+ * @param cb The callback to receive changes.
+ * @param ctx Context passed to the callback.
+ * @param subscription_out The new subscription.
+ */
+enum nssync_error nssync_sync_subscribe(struct nssync_sync *sync, const char *collection, unsigned int flags, nssync_change_cb *cb, void *ctx, struct nssync_subscription **subscription_out);
+
+enum nssync_error nssync_sync_unsubscribe(struct nssync_subscription *subscription);
+
+#endif
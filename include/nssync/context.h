@@ -0,0 +1,102 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_CONTEXT_H
+#define NSSYNC_CONTEXT_H
+
+#include <nssync/error.h>
+#include <nssync/fetcher.h>
+#include <nssync/allocator.h>
+
+/** resources shared between sync sessions
+ *
+ * A context holds everything that is not specific to an account: the
+ *   fetcher with its connection pool, DNS and TLS session caches, the
+ *   fetch scheduler, the crypto worker pool and the on-disk cache.
+ *   Many sessions may be created against one context, each then only
+ *   holds the keys and state for its own account.
+ */
+struct nssync_context;
+
+/** called as each fetch made through a context completes
+ *
+ * The fetch has its endpoint and timing set, letting the application
+ *   aggregate where time goes by endpoint or server.
+ */
+typedef void (nssync_context_fetch_hook)(void *ctx, const struct nssync_fetcher_fetch *fetch);
+
+/* context parameters
+ *
+ * Fetches beyond the limits wait, those setting up sessions first,
+ *   then by collection with history last. Accounts waiting in the same
+ *   class take turns.
+ *
+ * Fetches that fail to connect or get a 5xx status are retried after
+ *   a jittered exponential delay, never before the backoff the server
+ *   asked for.
+ *
+ * With hedging the curl fetcher duplicates a node lookup, collection
+ *   times or object fetch still unanswered after the percentile of
+ *   recent latency on a new connection, taking the first response.
+ *
+ * With a cache directory collection listings are downloaded to
+ *   unlinked files in it and parsed from a mapping, so they are held
+ *   in the page cache rather than on the heap.
+ */
+struct nssync_context_params {
+	nssync_fetcher *fetcher; /* fetcher to use or NULL for curl */
+	const char *cachedir; /* directory for persistent caches and collection downloads or NULL */
+	unsigned int workers; /* crypto worker threads, 0 for none */
+	const struct nssync_allocator *allocator; /* allocator or NULL for the C library */
+	nssync_context_fetch_hook *fetch_hook; /* completed fetch hook or NULL */
+	void *fetch_hook_ctx; /* context passed to fetch hook */
+	unsigned int max_fetches; /* fetches in progress at once, 0 for default */
+	unsigned int max_host_fetches; /* fetches in progress to a host, 0 for default */
+	int retries; /* retries of a transient fetch failure, 0 for default, negative for none */
+	unsigned int hedge_percentile; /* latency percentile after which small fetches are duplicated, 0 for none */
+	unsigned int hedge_budget; /* most duplicates per hundred small fetches, 0 for default */
+};
+
+enum nssync_error nssync_context_new(const struct nssync_context_params *params, struct nssync_context **context_out);
+
+/** free a context
+ *
+ * @return NSSYNC_ERROR_INVAL if sessions are still using the context.
+ */
+enum nssync_error nssync_context_free(struct nssync_context *context);
+
+/** cancel every fetch of a context
+ *
+ * Fetches in progress are aborted and those waiting or made later
+ *   fail with NSSYNC_ERROR_CANCELLED, so operations of every session
+ *   using the context fail promptly. It is meant for shutting down,
+ *   the sessions may then only be freed. This may be called from any
+ *   thread.
+ */
+void nssync_context_cancel(struct nssync_context *context);
+
+/** make progress on the asynchronous fetches of a context
+ *
+ * Asynchronous operations such as nssync_sync_new_async() issue
+ *   their fetches through the context and only advance as this is
+ *   called, their callbacks are made from within it. An event loop
+ *   calls this repeatedly on the one thread that starts asynchronous
+ *   operations on the context until no fetches remain active.
+ *
+ * With a fetcher other than the default curl one the application
+ *   drives its own fetches and this only starts those the fetch
+ *   scheduler held back.
+ *
+ * @param context The context to run fetches of.
+ * @param timeout Milliseconds to wait for network activity, 0 to not wait.
+ * @param active_out The number of fetches still in progress or waiting
+ *                   for the scheduler.
+ */
+enum nssync_error nssync_context_perform(struct nssync_context *context, int timeout, unsigned int *active_out);
+
+#endif
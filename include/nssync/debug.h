@@ -1,14 +0,0 @@
-/*
- * This file is part of libnssync
- *
- * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
- *
- * Released under MIT licence (see COPYING file)
- */
-
-#ifndef NSSYNC_DEBUG_H
-#define NSSYNC_DEBUG_H
-
-#define debugf(format, ...) fprintf (stderr, format, ## __VA_ARGS__)
-
-#endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_ENGINE_H
+#define NSSYNC_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nssync/error.h>
+
+struct nssync_sync;
+struct nssync_engine;
+
+/** state of a registered engine once matched against meta/global */
+enum nssync_engine_state {
+	NSSYNC_ENGINE_ENABLED = 0, /* engine in use and decodable */
+	NSSYNC_ENGINE_DISABLED, /* engine absent or declined in meta/global */
+	NSSYNC_ENGINE_VERSION, /* engine version not supported by decoder */
+	NSSYNC_ENGINE_RESET, /* syncID changed and local data needs reset */
+};
+
+/** engine decoder operations
+ *
+ * An engine provides the decoder for the records held in the
+ *   collection of the same name. The decoder declares the range of
+ *   engine storage versions (from the meta/global engines object) it
+ *   is able to interpret.
+ */
+struct nssync_engine_ops {
+	const char *name; /**< engine and collection name */
+	int min_version; /**< lowest engine version the decoder handles */
+	int max_version; /**< highest engine version the decoder handles */
+
+	/** discard local engine data as the server syncID has changed
+	 *
+	 * May be NULL in which case an engine whose syncID has changed
+	 *   remains in the NSSYNC_ENGINE_RESET state and is skipped.
+	 */
+	enum nssync_error (*reset)(void *ctx, const char *syncid);
+
+	/** decode a single decrypted record from the collection
+	 *
+	 * The id and record are only valid for the duration of the call.
+	 */
+	enum nssync_error (*decode)(void *ctx, const char *id, const uint8_t *record, size_t record_length);
+
+	/** the decoder keeps records delivered by a sync that failed
+	 *
+	 * When set a sync after one that failed part way delivers only
+	 *   the rest of the collection. Otherwise each sync delivers the
+	 *   whole collection, as a decoder that discards its records
+	 *   before syncing needs.
+	 */
+	bool resume;
+};
+
+/** register an engine decoder with a sync session
+ *
+ * The decoder is bound to the meta/global engine entry of the same
+ *   name at registration so record dispatch needs no lookups.
+ *
+ * @param sync The sync session.
+ * @param ops The decoder operations, must outlive the registration.
+ * @param syncid The engine syncID the local data was last synced
+ *               against or NULL if there is no local data.
+ * @param ctx Context passed to the decoder operations.
+ * @param engine_out The registered engine.
+ */
+enum nssync_error nssync_engine_register(struct nssync_sync *sync, const struct nssync_engine_ops *ops, const char *syncid, void *ctx, struct nssync_engine **engine_out);
+
+enum nssync_error nssync_engine_unregister(struct nssync_engine *engine);
+
+enum nssync_engine_state nssync_engine_get_state(struct nssync_engine *engine);
+
+/** get the server syncID for the engine or NULL if engine is disabled */
+const char *nssync_engine_get_syncid(struct nssync_engine *engine);
+
+/** fetch, decrypt and decode the engines collection
+ *
+ * Engines which are not in the NSSYNC_ENGINE_ENABLED state are skipped.
+ *   The whole collection is delivered unless the decoder resumes, see
+ *   nssync_engine_ops.
+ */
+enum nssync_error nssync_engine_sync(struct nssync_engine *engine);
+
+/** sync every enabled engine registered with a session */
+enum nssync_error nssync_sync_engines(struct nssync_sync *sync);
+
+#endif
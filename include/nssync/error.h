@@ -19,6 +19,8 @@ enum nssync_error {
 	NSSYNC_ERROR_HMAC, /* HMAC mismatch */
 	NSSYNC_ERROR_FETCH, /* fetcher failed (network, dns etc.) */
 	NSSYNC_ERROR_RETRY, /* async operation is in progress */
+	NSSYNC_ERROR_TIMEOUT, /* operation passed its deadline */
+	NSSYNC_ERROR_CANCELLED, /* operation was cancelled */
 };
 
 typedef enum nssync_error nssync_error;
@@ -17,6 +17,61 @@
 enum nssync_fetcher_flags {
 	NSSYNC_FETCHER_SYNC = 0,
 	NSSYNC_FETCHER_ASYNC = 1,
+	NSSYNC_FETCHER_FILE = 2, /* response written to the file in fd */
+};
+
+/** server endpoint a fetch is made to */
+enum nssync_fetcher_endpoint {
+	NSSYNC_FETCHER_ENDPOINT_OTHER = 0,
+	NSSYNC_FETCHER_ENDPOINT_NODE, /* node assignment */
+	NSSYNC_FETCHER_ENDPOINT_INFO, /* info/collections */
+	NSSYNC_FETCHER_ENDPOINT_OBJECT, /* single storage object */
+	NSSYNC_FETCHER_ENDPOINT_COLLECTION, /* collection listing */
+};
+
+/** priority class of a fetch
+ *
+ * Fetches made through a context are scheduled strictly by class so
+ *   interactive work never waits behind a bulk download. Setting up a
+ *   session, the node lookup, collection times and meta objects, comes
+ *   first and the history backfill last.
+ */
+enum nssync_fetcher_priority {
+	NSSYNC_FETCHER_PRIORITY_BOOTSTRAP = 0, /* session set up and meta objects */
+	NSSYNC_FETCHER_PRIORITY_TABS, /* open tabs */
+	NSSYNC_FETCHER_PRIORITY_BOOKMARKS, /* bookmarks */
+	NSSYNC_FETCHER_PRIORITY_OTHER, /* other collections */
+	NSSYNC_FETCHER_PRIORITY_HISTORY, /* history */
+	NSSYNC_FETCHER_PRIORITY_COUNT,
+};
+
+/** where the time of a fetch went
+ *
+ * Times are in seconds from the start of the fetch, the gaps between
+ *   them give the time spent on each stage. Fetchers that do not
+ *   record timing leave it zeroed.
+ */
+struct nssync_fetcher_timing {
+	double namelookup; /**< name resolved */
+	double connect; /**< connected to server */
+	double appconnect; /**< TLS handshake complete */
+	double pretransfer; /**< about to send request */
+	double starttransfer; /**< first response byte received */
+	double total; /**< fetch complete */
+	size_t bytes_in; /**< response bytes including headers */
+	size_t bytes_out; /**< request bytes including headers */
+	long connects; /**< new connections made, 0 when one was reused */
+};
+
+/** cancellation of a group of fetches
+ *
+ * Fetches given a cancel fail with NSSYNC_ERROR_CANCELLED once it, or
+ *   any cancel up its parent chain, is cancelled by
+ *   nssync_fetcher_cancel(). Those in progress are aborted.
+ */
+struct nssync_fetcher_cancel {
+	int cancelled; /**< set once cancelled */
+	const struct nssync_fetcher_cancel *parent; /**< enclosing cancel or NULL */
 };
 
 struct nssync_fetcher_fetch;
@@ -32,10 +87,24 @@ struct nssync_fetcher_fetch;
  * The uri, username and password allow for a uri to be retrived with
  *   authentication.
  *
+ * The share member is state the fetcher keeps between fetches (such
+ *   as a connection pool) set up by the context the fetch is made
+ *   from. It is NULL for fetchers the library did not provide.
+ *
  * The data block may be provided or if NULL be allocated by the
  *   fetcher and should be a heap block with the length stored in
  *   data_size. The fether should set how much of the block is actually
- *   used in data_used.
+ *   used in data_used. The fetcher may grow the block with the library
+ *   allocator to hold the response so a provided block must come from
+ *   it too.
+ *
+ * With NSSYNC_FETCHER_FILE the response replaces the contents of the
+ *   file open on fd instead, data stays NULL and data_used is set to
+ *   the length written. Fetchers without file support may ignore the
+ *   flag and fill the data block as usual.
+ *
+ * A fetch with an unmodified time is conditional on the resource not
+ *   having changed since, the server responds 412 if it has.
  *
  * The fetcher routine must call the completion callback having set
  *   the result code. The completion callback should be used to complete
@@ -47,6 +116,10 @@ struct nssync_fetcher_fetch;
  *   NSSYNC_ERROR_RETRY code. Upon completion of the fetch (sucessful or
  *   otherwise) the completion will be triggered allowing for release of
  *   resources or flagging error status etc.
+ *
+ * A fetch with a deadline must finish by it and one with a cancel be
+ *   abandoned once cancelled, fetchers poll nssync_fetcher_check() to
+ *   find out and fail the fetch with the error it gives.
  */
 typedef enum nssync_error(nssync_fetcher)(struct nssync_fetcher_fetch *fetch);
 
@@ -63,9 +136,40 @@ struct nssync_fetcher_fetch {
 
 	nssync_fetcher *completion; /**< called upon completion of fetch */
 	nssync_error result; /**< fetch result */
+	long http_code; /**< server response code or 0 if none */
+	unsigned int backoff; /**< seconds server asked clients to wait */
+
+	void *share; /**< fetcher state shared between fetches */
+
+	enum nssync_fetcher_endpoint endpoint; /**< endpoint being fetched */
+	enum nssync_fetcher_priority priority; /**< scheduling class */
+	struct nssync_fetcher_timing timing; /**< set by the fetcher */
+
+	uint64_t deadline; /**< time to finish by from nssync_fetcher_deadline() or 0 */
+	const struct nssync_fetcher_cancel *cancel; /**< cancel aborting the fetch or NULL */
+
+	int fd; /**< file the response is written to with NSSYNC_FETCHER_FILE */
+	double unmodified; /**< X-If-Unmodified-Since server time or 0 */
 };
 
 
 nssync_fetcher nssync_fetcher_curl;
 
+/** get the deadline a number of milliseconds from now
+ *
+ * Deadlines are on a monotonic clock so are not affected by changes
+ *   to the time of day.
+ */
+uint64_t nssync_fetcher_deadline(unsigned int timeout);
+
+/** cancel a group of fetches, this may be called from any thread */
+void nssync_fetcher_cancel(struct nssync_fetcher_cancel *cancel);
+
+/** check if a fetch may continue
+ *
+ * @return NSSYNC_ERROR_OK, NSSYNC_ERROR_CANCELLED if the fetch was
+ *         cancelled or NSSYNC_ERROR_TIMEOUT if its deadline passed.
+ */
+enum nssync_error nssync_fetcher_check(const struct nssync_fetcher_fetch *fetch);
+
 #endif
@@ -0,0 +1,63 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_LOG_H
+#define NSSYNC_LOG_H
+
+#include <nssync/error.h>
+
+/** log message severity */
+enum nssync_log_level {
+	NSSYNC_LOG_DEBUG = 0, /* per request tracing */
+	NSSYNC_LOG_INFO = 1, /* session and engine state */
+	NSSYNC_LOG_WARNING = 2, /* recoverable failures */
+	NSSYNC_LOG_ERROR = 3, /* operations that failed */
+	NSSYNC_LOG_NONE = 4, /* log nothing */
+};
+
+/** what a log message concerns, fields not known are NULL */
+struct nssync_log_fields {
+	const char *account; /* storage username of the account */
+	const char *collection; /* collection name */
+	const char *url; /* url being fetched */
+	enum nssync_error error; /* error or NSSYNC_ERROR_OK */
+};
+
+/** a log message */
+struct nssync_log_record {
+	enum nssync_log_level level;
+	const char *message; /* message text without trailing newline */
+	const struct nssync_log_fields *fields;
+	const char *file; /* source file message is from */
+	int line;
+};
+
+/** receive log messages
+ *
+ * The record is only valid for the duration of the call which may be
+ *   made from any thread.
+ */
+typedef void (nssync_log_sink)(void *ctx, const struct nssync_log_record *record);
+
+/** set where log messages are sent
+ *
+ * Messages below level are discarded before they are formatted. By
+ *   default warnings and errors are written to stderr. Messages below
+ *   the level the library was built with (NSSYNC_LOG_LEVEL in the
+ *   Makefile) are not compiled in at all.
+ *
+ * This is process wide and must be set before any context or session
+ *   is created.
+ *
+ * @param sink Function to receive messages or NULL for stderr.
+ * @param ctx Context passed to sink.
+ * @param level Lowest level to send to the sink.
+ */
+void nssync_log_set_sink(nssync_log_sink *sink, void *ctx, enum nssync_log_level level);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_METRICS_H
+#define NSSYNC_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nssync/error.h>
+
+/** library metrics
+ *
+ * Metrics are process wide. Each thread counts into its own storage
+ *   without locks and a snapshot sums them, so taking one from a
+ *   monitoring thread does not disturb syncing.
+ */
+struct nssync_metrics;
+
+/** counters */
+enum nssync_metric_counter {
+	NSSYNC_METRIC_REQUESTS_NODE = 0, /* node assignment requests */
+	NSSYNC_METRIC_REQUESTS_INFO, /* info/collections requests */
+	NSSYNC_METRIC_REQUESTS_OBJECT, /* single object requests */
+	NSSYNC_METRIC_REQUESTS_COLLECTION, /* collection listing requests */
+	NSSYNC_METRIC_BYTES_DOWNLOADED, /* response body bytes */
+	NSSYNC_METRIC_RECORDS_FETCHED, /* WBO received */
+	NSSYNC_METRIC_RECORDS_DECRYPTED, /* records successfully decrypted */
+	NSSYNC_METRIC_HMAC_FAILURES, /* records failing verification */
+	NSSYNC_METRIC_CACHE_HITS, /* node assignments found in cache */
+	NSSYNC_METRIC_CACHE_MISSES, /* node assignments not in cache */
+	NSSYNC_METRIC_ALLOCATIONS, /* library allocations */
+	NSSYNC_METRIC_CONNECTIONS, /* new connections, requests not reusing one */
+	NSSYNC_METRIC_COALESCED, /* fetches joined to an identical one in flight */
+	NSSYNC_METRIC_RETRIES, /* fetches retried after a transient failure */
+	NSSYNC_METRIC_HEDGES_WON, /* hedged fetches answered by the duplicate */
+	NSSYNC_METRIC_HEDGES_LOST, /* hedged fetches answered by the original */
+	NSSYNC_METRIC_COUNTER_COUNT,
+};
+
+/** latency histograms, values are in nanoseconds */
+enum nssync_metric_histogram {
+	NSSYNC_METRIC_FETCH = 0, /* request issue to response */
+	NSSYNC_METRIC_PARSE, /* parsing a response */
+	NSSYNC_METRIC_DECRYPT, /* verifying and decrypting a record */
+	NSSYNC_METRIC_SERVER, /* request sent to first response byte */
+	NSSYNC_METRIC_QUEUE, /* fetch waiting for the scheduler */
+	NSSYNC_METRIC_HISTOGRAM_COUNT,
+};
+
+/** take a snapshot of the metrics */
+enum nssync_error nssync_metrics_snapshot(struct nssync_metrics **metrics_out);
+
+void nssync_metrics_free(struct nssync_metrics *metrics);
+
+uint64_t nssync_metrics_counter(const struct nssync_metrics *metrics, enum nssync_metric_counter counter);
+
+/** number of values recorded in a histogram */
+uint64_t nssync_metrics_histogram_count(const struct nssync_metrics *metrics, enum nssync_metric_histogram histogram);
+
+/** value below which a fraction of a histograms values fall
+ *
+ * Values are recorded to within 1/8th of their magnitude.
+ *
+ * @param quantile Fraction between 0 and 1.
+ */
+uint64_t nssync_metrics_quantile(const struct nssync_metrics *metrics, enum nssync_metric_histogram histogram, double quantile);
+
+/** format a snapshot in the Prometheus text exposition format
+ *
+ * @param buf Buffer to format into.
+ * @param size Size of buffer.
+ * @param length_out Set to the length of the text, if it is not less
+ *                   than size the text was truncated.
+ */
+enum nssync_error nssync_metrics_prometheus(const struct nssync_metrics *metrics, char *buf, size_t size, size_t *length_out);
+
+#endif
@@ -9,9 +9,36 @@
 #ifndef NSSYNC_H
 #define NSSYNC_H
 
+/** threading
+ *
+ * Library wide settings, the log sink and tracing, should be set
+ *   before other threads use the library. Metrics may be read from any
+ *   thread at any time.
+ *
+ * A context may be shared by sessions used from different threads, its
+ *   fetcher state, workers and caches are locked internally.
+ *
+ * Each session has a single writer. Creating and freeing it, running
+ *   its schedule, syncing engines and registering engines or
+ *   subscriptions must be done by one thread at a time and callbacks
+ *   are made on that thread. The writer is also the only thread to
+ *   replace the sessions keys when crypto/keys is rotated.
+ *
+ * Any number of reader threads may decrypt records with
+ *   nssync_sync_decrypt() concurrently with each other and the writer.
+ *   Readers take no locks, they use the key set published when they
+ *   started which is only released once no reader can hold it.
+ */
+
 #include "error.h"
-#include "debug.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "allocator.h"
+#include "context.h"
 #include "sync.h"
+#include "engine.h"
+#include "changes.h"
 #include "bookmarks.h"
 #include "fetcher.h"
 
@@ -9,8 +9,14 @@
 #ifndef NSSYNC_SYNC_H
 #define NSSYNC_SYNC_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
 #include <nssync/error.h>
 #include <nssync/fetcher.h>
+#include <nssync/context.h>
+#include <nssync/allocator.h>
 
 struct nssync_sync;
 
@@ -22,7 +28,11 @@ enum nssync_provider_type {
 /* service parameters */
 struct nssync_provider {
 	enum nssync_provider_type type;
-	nssync_fetcher *fetcher;
+	struct nssync_context *context; /* shared context or NULL for own */
+	nssync_fetcher *fetcher; /* fetcher when context is not shared */
+	const char *cachedir; /* cache directory when context is not shared */
+	const struct nssync_allocator *allocator; /* allocator when context is not shared */
+	uint64_t deadline; /* time creating the session must finish by or 0 */
 	union {
 		struct {
 			const char *server;
@@ -37,4 +47,84 @@ enum nssync_error nssync_sync_new(const struct nssync_provider *provider, struct
 
 enum nssync_error nssync_sync_free(struct nssync_sync *sync);
 
+/** called when an asynchronous session creation finishes
+ *
+ * @param ret NSSYNC_ERROR_OK if the session was set up.
+ * @param sync The new session or NULL on error.
+ */
+typedef void (nssync_sync_new_cb)(void *ctx, enum nssync_error ret, struct nssync_sync *sync);
+
+/** create a session without blocking
+ *
+ * The node lookup, collection times, meta/global and crypto/keys are
+ *   fetched in turn as asynchronous fetches of the shared context the
+ *   provider must give. Each step is issued from the completion of
+ *   the one before, so nssync_context_perform() called from one event
+ *   loop thread sets up any number of accounts at once.
+ *
+ * @return NSSYNC_ERROR_RETRY once started, cb is then called exactly
+ *         once. Any other error means nothing was started and cb is
+ *         not called.
+ */
+enum nssync_error nssync_sync_new_async(const struct nssync_provider *provider, nssync_sync_new_cb *cb, void *ctx);
+
+
+/** run the scheduled work for a session
+ *
+ * When a poll is due the server collection times are fetched and the
+ *   registered engines whose collections changed since they were last
+ *   synced are synced. Polls are made frequently while changes are
+ *   seen, the interval grows while the account is idle and server
+ *   backoff requests are honoured.
+ *
+ * @param sync The session.
+ * @param next_out Set to the time the session should next be run.
+ */
+enum nssync_error nssync_sync_schedule(struct nssync_sync *sync, time_t *next_out);
+
+/** set the deadline of the operations of a session
+ *
+ * Fetches the session makes from then on, such as those of
+ *   nssync_sync_schedule() and engine syncs, fail with
+ *   NSSYNC_ERROR_TIMEOUT once it passes. It is usually set from
+ *   nssync_fetcher_deadline() before each operation.
+ *
+ * @param deadline The deadline or 0 for none.
+ */
+enum nssync_error nssync_sync_set_deadline(struct nssync_sync *sync, uint64_t deadline);
+
+/** cancel the fetches of a session
+ *
+ * Fetches in progress, on whichever thread, are aborted and those made
+ *   later fail with NSSYNC_ERROR_CANCELLED. The session may then only
+ *   be freed. This may be called from any thread.
+ */
+enum nssync_error nssync_sync_cancel(struct nssync_sync *sync);
+
+/** note the user made local changes so the next poll is brought forward */
+enum nssync_error nssync_sync_local_change(struct nssync_sync *sync);
+
+/** verify and decrypt a record of a collection
+ *
+ * This may be called from any number of threads at once and while the
+ *   session is used by its writer. Records are decrypted with the keys
+ *   of crypto/keys as last fetched, if they are rotated meanwhile a
+ *   call uses either the old or the new keys throughout.
+ *
+ * @param collection Name of the collection the record is from.
+ * @param record The encrypted record payload.
+ * @param record_length Length of the record.
+ * @param plaintext Buffer to decrypt into, the plaintext is null
+ *                  terminated.
+ * @param plaintext_size Size of buffer, at least record_length + 1.
+ * @param plaintext_length_out Set to the length of the plaintext.
+ */
+enum nssync_error nssync_sync_decrypt(struct nssync_sync *sync, const char *collection, const char *record, size_t record_length, uint8_t *plaintext, size_t plaintext_size, size_t *plaintext_length_out);
+
+/** get the allocator a session allocates from
+ *
+ * @return The allocator or NULL if the C library allocator is used.
+ */
+const struct nssync_allocator *nssync_sync_get_allocator(struct nssync_sync *sync);
+
 #endif
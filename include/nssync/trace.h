@@ -0,0 +1,31 @@
+/*
+ * This file is part of libnssync
+ *
+ * Copyright 20013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * Released under MIT licence (see COPYING file)
+ */
+
+#ifndef NSSYNC_TRACE_H
+#define NSSYNC_TRACE_H
+
+#include <nssync/error.h>
+
+/** start writing trace events
+ *
+ * Spans for node lookup, fetches, parsing, key derivation, HMAC
+ *   verification and decryption are written to a file in the Chrome
+ *   trace_event json format which Perfetto and chrome://tracing load.
+ *
+ * Tracing is only compiled in when the library is built with
+ *   NSSYNC_TRACE=yes, otherwise it costs nothing and this returns
+ *   NSSYNC_ERROR_INVAL.
+ *
+ * @param filename File to write, it is replaced.
+ */
+enum nssync_error nssync_trace_start(const char *filename);
+
+/** stop writing trace events and close the file */
+enum nssync_error nssync_trace_stop(void);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements the pluggable allocator the library allocates from
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include <nssync/allocator.h>
+
+#include "alloc.h"
+#include "metrics.h"
+
+static pthread_once_t alloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t alloc_key; /* allocator current for each thread */
+
+static pthread_once_t json_once = PTHREAD_ONCE_INIT;
+
+static void alloc_key_create(void)
+{
+	pthread_key_create(&alloc_key, NULL);
+}
+
+/* exported interface documented in alloc.h */
+const struct nssync_allocator *nssync__alloc_current(void)
+{
+	pthread_once(&alloc_once, alloc_key_create);
+
+	return pthread_getspecific(alloc_key);
+}
+
+/* exported interface documented in alloc.h */
+const struct nssync_allocator *
+nssync__alloc_enter(const struct nssync_allocator *allocator)
+{
+	const struct nssync_allocator *prev;
+
+	prev = nssync__alloc_current();
+	if (prev != allocator) {
+		pthread_setspecific(alloc_key, allocator);
+	}
+
+	return prev;
+}
+
+/* exported interface documented in alloc.h */
+void nssync__alloc_leave(const struct nssync_allocator *prev)
+{
+	if (pthread_getspecific(alloc_key) != prev) {
+		pthread_setspecific(alloc_key, prev);
+	}
+}
+
+/* exported interface documented in alloc.h */
+void *nssync__malloc(size_t size)
+{
+	const struct nssync_allocator *allocator = nssync__alloc_current();
+
+	nssync__metrics_add(NSSYNC_METRIC_ALLOCATIONS, 1);
+
+	if (allocator == NULL) {
+		return malloc(size);
+	}
+	return allocator->malloc(allocator->ctx, size);
+}
+
+/* exported interface documented in alloc.h */
+void *nssync__calloc(size_t nmemb, size_t size)
+{
+	const struct nssync_allocator *allocator = nssync__alloc_current();
+	void *ptr;
+
+	nssync__metrics_add(NSSYNC_METRIC_ALLOCATIONS, 1);
+
+	if (allocator == NULL) {
+		return calloc(nmemb, size);
+	}
+
+	if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+		return NULL;
+	}
+
+	ptr = allocator->malloc(allocator->ctx, nmemb * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+
+	return ptr;
+}
+
+/* exported interface documented in alloc.h */
+void *nssync__realloc(void *ptr, size_t size)
+{
+	const struct nssync_allocator *allocator = nssync__alloc_current();
+
+	nssync__metrics_add(NSSYNC_METRIC_ALLOCATIONS, 1);
+
+	if (allocator == NULL) {
+		return realloc(ptr, size);
+	}
+	return allocator->realloc(allocator->ctx, ptr, size);
+}
+
+/* exported interface documented in alloc.h */
+void nssync__free(void *ptr)
+{
+	const struct nssync_allocator *allocator = nssync__alloc_current();
+
+	if (allocator == NULL) {
+		free(ptr);
+	} else if (ptr != NULL) {
+		allocator->free(allocator->ctx, ptr);
+	}
+}
+
+/* exported interface documented in alloc.h */
+char *nssync__strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *newstr;
+
+	newstr = nssync__malloc(len);
+	if (newstr != NULL) {
+		memcpy(newstr, str, len);
+	}
+
+	return newstr;
+}
+
+static void json_alloc_install(void)
+{
+	json_set_alloc_funcs(nssync__malloc, nssync__free);
+}
+
+/* exported interface documented in alloc.h */
+void nssync__alloc_install_json(void)
+{
+	pthread_once(&json_once, json_alloc_install);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+struct nssync_allocator;
+
+/** library allocation functions
+ *
+ * These allocate from the allocator the calling thread has entered
+ *   or the C library if it has entered none.
+ */
+void *nssync__malloc(size_t size);
+void *nssync__calloc(size_t nmemb, size_t size);
+void *nssync__realloc(void *ptr, size_t size);
+void nssync__free(void *ptr);
+char *nssync__strdup(const char *str);
+
+/** make allocator current for the calling thread
+ *
+ * @param allocator The allocator to use or NULL for the C library.
+ * @return The previous allocator to pass to nssync__alloc_leave()
+ */
+const struct nssync_allocator *nssync__alloc_enter(const struct nssync_allocator *allocator);
+
+/** restore the allocator that was current before nssync__alloc_enter() */
+void nssync__alloc_leave(const struct nssync_allocator *prev);
+
+/** allocator current for the calling thread */
+const struct nssync_allocator *nssync__alloc_current(void);
+
+/** route jansson allocations through the current allocator */
+void nssync__alloc_install_json(void);
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements a region allocator for transient allocations
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <nssync/error.h>
+
+#include "alloc.h"
+#include "arena.h"
+
+/* alignment of every allocation */
+#define ARENA_ALIGN 16
+
+#define ARENA_ROUND(x) (((x) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+
+struct arena_block {
+	struct arena_block *next; /* previously filled block */
+	size_t size; /* usable bytes in block */
+	size_t used; /* bytes allocated from block */
+};
+
+/* allocations start after the block header */
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct arena_block))
+
+/* function to call on reset */
+struct arena_cleanup {
+	struct arena_cleanup *next; /* previously added cleanup */
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct nssync_arena {
+	struct arena_cleanup *cleanups; /* cleanups to run on reset */
+	size_t blocksize; /* usable size of normal blocks */
+	struct arena_block *current; /* block allocations come from */
+	struct arena_block *first; /* block retained over reset */
+};
+
+static struct arena_block *arena_block_new(size_t size)
+{
+	struct arena_block *block;
+
+	block = nssync__malloc(ARENA_HEADER + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+/* exported interface documented in arena.h */
+enum nssync_error
+nssync_arena_new(size_t blocksize, struct nssync_arena **arena_out)
+{
+	struct nssync_arena *arena;
+
+	arena = nssync__calloc(1, sizeof(*arena));
+	if (arena == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	arena->blocksize = ARENA_ROUND(blocksize);
+	arena->first = arena_block_new(arena->blocksize);
+	if (arena->first == NULL) {
+		nssync__free(arena);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	arena->current = arena->first;
+
+	*arena_out = arena;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in arena.h */
+void nssync_arena_reset(struct nssync_arena *arena)
+{
+	struct arena_block *block;
+	struct arena_cleanup *cleanup;
+
+	/* cleanups live in the blocks so run them before releasing */
+	for (cleanup = arena->cleanups;
+	     cleanup != NULL;
+	     cleanup = cleanup->next) {
+		cleanup->fn(cleanup->arg);
+	}
+	arena->cleanups = NULL;
+
+	while (arena->current != arena->first) {
+		block = arena->current;
+		arena->current = block->next;
+		nssync__free(block);
+	}
+	arena->first->used = 0;
+}
+
+/* exported interface documented in arena.h */
+enum nssync_error
+nssync_arena_cleanup(struct nssync_arena *arena,
+		     void (*fn)(void *arg),
+		     void *arg)
+{
+	struct arena_cleanup *cleanup;
+
+	cleanup = nssync_arena_alloc(arena, sizeof(*cleanup));
+	if (cleanup == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	cleanup->fn = fn;
+	cleanup->arg = arg;
+	cleanup->next = arena->cleanups;
+	arena->cleanups = cleanup;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in arena.h */
+void nssync_arena_free(struct nssync_arena *arena)
+{
+	nssync_arena_reset(arena);
+	nssync__free(arena->first);
+	nssync__free(arena);
+}
+
+/* exported interface documented in arena.h */
+void *nssync_arena_alloc(struct nssync_arena *arena, size_t size)
+{
+	struct arena_block *block = arena->current;
+	void *ptr;
+
+	size = ARENA_ROUND(size);
+
+	if ((block->size - block->used) < size) {
+		/* oversized allocations get a block to themselves */
+		if (size > arena->blocksize) {
+			block = arena_block_new(size);
+		} else {
+			block = arena_block_new(arena->blocksize);
+		}
+		if (block == NULL) {
+			return NULL;
+		}
+		block->next = arena->current;
+		arena->current = block;
+	}
+
+	ptr = (uint8_t *)block + ARENA_HEADER + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+/* exported interface documented in arena.h */
+void *
+nssync_arena_calloc(struct nssync_arena *arena, size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+		return NULL;
+	}
+
+	ptr = nssync_arena_alloc(arena, nmemb * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+
+	return ptr;
+}
+
+/* exported interface documented in arena.h */
+char *nssync_arena_strdup(struct nssync_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *newstr;
+
+	newstr = nssync_arena_alloc(arena, len);
+	if (newstr != NULL) {
+		memcpy(newstr, str, len);
+	}
+
+	return newstr;
+}
+
+/* exported interface documented in arena.h */
+int
+nssync_arena_saprintf(struct nssync_arena *arena,
+		      char **str_out,
+		      const char *format, ...)
+{
+	va_list ap;
+	int slen;
+	char *str;
+
+	va_start(ap, format);
+	slen = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	if (slen < 0) {
+		return slen;
+	}
+
+	str = nssync_arena_alloc(arena, slen + 1);
+	if (str == NULL) {
+		return -1;
+	}
+
+	va_start(ap, format);
+	slen = vsnprintf(str, slen + 1, format, ap);
+	va_end(ap);
+
+	if (slen >= 0) {
+		*str_out = str;
+	}
+
+	return slen;
+}
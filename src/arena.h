@@ -0,0 +1,43 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** region allocator
+ *
+ * Allocations are carved from large blocks and released together by
+ *   nssync_arena_reset() or nssync_arena_free(). An arena must only be
+ *   used from one thread at a time.
+ */
+struct nssync_arena;
+
+/** create an arena
+ *
+ * @param blocksize Size of the blocks allocations are made from.
+ */
+enum nssync_error nssync_arena_new(size_t blocksize, struct nssync_arena **arena_out);
+void nssync_arena_free(struct nssync_arena *arena);
+
+/** release every allocation keeping the first block for reuse */
+void nssync_arena_reset(struct nssync_arena *arena);
+
+/** call a function when the arena is next reset or freed
+ *
+ * Lets memory held outside the arena share its lifetime. Cleanups
+ *   run in the reverse order they were added.
+ */
+enum nssync_error nssync_arena_cleanup(struct nssync_arena *arena, void (*fn)(void *arg), void *arg);
+
+void *nssync_arena_alloc(struct nssync_arena *arena, size_t size);
+
+/** allocate zeroed memory for nmemb elements */
+void *nssync_arena_calloc(struct nssync_arena *arena, size_t nmemb, size_t size);
+
+char *nssync_arena_strdup(struct nssync_arena *arena, const char *str);
+
+/** formatted print to a string allocated from an arena */
+int nssync_arena_saprintf(struct nssync_arena *arena, char **str_out, const char *format, ...);
@@ -27,28 +27,20 @@
 
 /* RFC4648 alphabet - see http://en.wikipedia.org/wiki/Base32 */
 static const char cb32[] = "abcdefghijklmnopqrstuvwxyz234567";
-static const char cb32_ucase[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
-static unsigned char rev32[256];
-static int reverse_init = 0;
 
-
-inline static void
-base32_reverse_init(void)
-{
-	int i;
-	unsigned char c;
-
-	if (!reverse_init) {
-		memset (rev32, 0, 256);
-		for (i = 0; i < 32; i++) {
-			c = cb32[i];
-			rev32[(int) c] = i;
-			c = cb32_ucase[i];
-			rev32[(int) c] = i;
-		}
-		reverse_init = 1;
-	}
-}
+/* reverse of both alphabets, other characters decode as zero */
+static const unsigned char rev32[256] = {
+	['a'] = 0, ['b'] = 1, ['c'] = 2, ['d'] = 3, ['e'] = 4, ['f'] = 5,
+	['g'] = 6, ['h'] = 7, ['i'] = 8, ['j'] = 9, ['k'] = 10, ['l'] = 11,
+	['m'] = 12, ['n'] = 13, ['o'] = 14, ['p'] = 15, ['q'] = 16, ['r'] = 17,
+	['s'] = 18, ['t'] = 19, ['u'] = 20, ['v'] = 21, ['w'] = 22, ['x'] = 23,
+	['y'] = 24, ['z'] = 25, ['2'] = 26, ['3'] = 27, ['4'] = 28, ['5'] = 29,
+	['6'] = 30, ['7'] = 31, ['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3,
+	['E'] = 4, ['F'] = 5, ['G'] = 6, ['H'] = 7, ['I'] = 8, ['J'] = 9,
+	['K'] = 10, ['L'] = 11, ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
+	['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21,
+	['W'] = 22, ['X'] = 23, ['Y'] = 24, ['Z'] = 25,
+};
 
 int
 b32_5to8(int in)
@@ -59,7 +51,6 @@ b32_5to8(int in)
 int
 b32_8to5(int in)
 {
-	base32_reverse_init();
 	return rev32[in];
 }
 
@@ -154,8 +145,6 @@ base32_decode(void *buf, size_t buflen, const char *str, size_t slen)
 	size_t iout = 0;	/* to-be-filled output byte */
 	size_t iin = 0;	/* next input char to use in decoding */
 
-	base32_reverse_init ();
-
 	/* Note: Don't bother to optimize manually. GCC optimizes
 	   better(!) when using simplistic array indexing. */
 
@@ -2,10 +2,24 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "alloc.h"
 #include "base64.h"
 
-static uint8_t decoding_table[256];
-static uint8_t encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+/* characters outside the alphabet decode as zero */
+static const uint8_t decoding_table[256] = {
+	['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3, ['E'] = 4, ['F'] = 5,
+	['G'] = 6, ['H'] = 7, ['I'] = 8, ['J'] = 9, ['K'] = 10, ['L'] = 11,
+	['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16, ['R'] = 17,
+	['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+	['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29,
+	['e'] = 30, ['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+	['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40, ['p'] = 41,
+	['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+	['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53,
+	['2'] = 54, ['3'] = 55, ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
+	['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+};
+static const uint8_t encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
                                 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
                                 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
                                 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
@@ -13,7 +27,7 @@ static uint8_t encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
                                 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
                                 'w', 'x', 'y', 'z', '0', '1', '2', '3',
                                 '4', '5', '6', '7', '8', '9', '+', '/'};
-static unsigned int mod_table[] = {0, 2, 1};
+static const unsigned int mod_table[] = {0, 2, 1};
 
 
 uint8_t *base64_encode(const unsigned char *data,
@@ -26,7 +40,7 @@ uint8_t *base64_encode(const unsigned char *data,
 
 	*output_length = 4 * ((input_length + 2) / 3);
 
-	encoded_data = malloc(*output_length);
+	encoded_data = nssync__malloc(*output_length);
 	if (encoded_data == NULL) {
 		return NULL;
 	}
@@ -57,18 +71,10 @@ uint8_t *base64_decode(const uint8_t *data,
                              size_t input_length,
                              size_t *output_length) 
 {
-	static bool decode_initialised = false;
 	uint8_t *decoded_data;
 	size_t i;
 	size_t j;
 
-	if (!decode_initialised) {
-		for (i = 0; i < 64; i++) {
-			decoding_table[encoding_table[i]] = i;
-		}
-		decode_initialised = true;
-	}
-
 	if (input_length % 4 != 0) {
 		return NULL;
 	}
@@ -77,7 +83,7 @@ uint8_t *base64_decode(const uint8_t *data,
 	if (data[input_length - 1] == '=') (*output_length)--;
 	if (data[input_length - 2] == '=') (*output_length)--;
 
-	decoded_data = malloc(*output_length);
+	decoded_data = nssync__malloc(*output_length);
 	if (decoded_data == NULL) {
 		return NULL;
 	}
@@ -16,36 +16,156 @@
 
 #include <nssync/nssync.h>
 
+#include "alloc.h"
+#include "log.h"
+
+/* bookmarks engine storage versions the decoder handles */
+#define BOOKMARKS_MIN_VERSION 1
+#define BOOKMARKS_MAX_VERSION 2
+
 struct nssync_sync_bookmarks {
 	struct nssync_sync *sync;
+	struct nssync_engine *engine;
 
-	/* bookmarks collection object */
-	struct nssync_storage_obj **bookmarksv;
+	/* decoded bookmark records */
+	json_t **bookmarksv;
 	int bookmarksc;
 };
 
-enum nssync_error
-nssync_bookmarks_new(struct nssync_sync *sync,
-		     struct nssync_sync_bookmarks **sync_bookmarks)
+static void bookmarks_clear(struct nssync_sync_bookmarks *marks)
+{
+	int bmidx;
+
+	for (bmidx = 0; bmidx < marks->bookmarksc; bmidx++) {
+		json_decref(marks->bookmarksv[bmidx]);
+	}
+	nssync__free(marks->bookmarksv);
+	marks->bookmarksv = NULL;
+	marks->bookmarksc = 0;
+}
+
+static enum nssync_error bookmarks_reset(void *ctx, const char *syncid)
+{
+	bookmarks_clear(ctx);
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+bookmarks_decode(void *ctx,
+		 const char *id,
+		 const uint8_t *record,
+		 size_t record_length)
+{
+	struct nssync_sync_bookmarks *marks = ctx;
+	json_t *root;
+	json_error_t error;
+	json_t **newv;
+
+	root = json_loadb((const char *)record, record_length, 0, &error);
+	if (!root) {
+		log_warning(LOG_FIELDS(.collection = "bookmarks"),
+			    "bookmark %s error: on line %d: %s",
+			    id, error.line, error.text);
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+
+	if (!json_is_object(root)) {
+		log_warning(LOG_FIELDS(.collection = "bookmarks"),
+			    "bookmark %s is not an object", id);
+		json_decref(root);
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+
+	/* deleted records are tombstones and carry no bookmark */
+	if (json_is_true(json_object_get(root, "deleted"))) {
+		json_decref(root);
+		return NSSYNC_ERROR_OK;
+	}
+
+	newv = nssync__realloc(marks->bookmarksv,
+		       (marks->bookmarksc + 1) * sizeof(*newv));
+	if (newv == NULL) {
+		json_decref(root);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	newv[marks->bookmarksc++] = root;
+	marks->bookmarksv = newv;
+
+	return NSSYNC_ERROR_OK;
+}
+
+static const struct nssync_engine_ops bookmarks_ops = {
+	.name = "bookmarks",
+	.min_version = BOOKMARKS_MIN_VERSION,
+	.max_version = BOOKMARKS_MAX_VERSION,
+	.reset = bookmarks_reset,
+	.decode = bookmarks_decode,
+};
+
+static enum nssync_error
+bookmarks_new(struct nssync_sync *sync,
+	      struct nssync_sync_bookmarks **sync_bookmarks)
 {
+	enum nssync_error ret;
 	struct nssync_sync_bookmarks *newmarks;
-	struct nssync_fetcher_param *fetch;
 
-	newmarks = calloc(1, sizeof(*newmarks));
+	newmarks = nssync__calloc(1, sizeof(*newmarks));
 	if (newmarks == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
 
 	newmarks->sync = sync;
 
+	ret = nssync_engine_register(sync, &bookmarks_ops, NULL,
+				     newmarks, &newmarks->engine);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(newmarks);
+		return ret;
+	}
+
 	*sync_bookmarks = newmarks;
 
 	return NSSYNC_ERROR_OK;
 }
 
+enum nssync_error
+nssync_bookmarks_new(struct nssync_sync *sync,
+		     struct nssync_sync_bookmarks **sync_bookmarks)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_sync_get_allocator(sync));
+	ret = bookmarks_new(sync, sync_bookmarks);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+enum nssync_error
+nssync_bookmarks_sync(struct nssync_sync_bookmarks *sync_bookmarks)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_sync_get_allocator(sync_bookmarks->sync));
+	bookmarks_clear(sync_bookmarks);
+	ret = nssync_engine_sync(sync_bookmarks->engine);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
 enum nssync_error
 nssync_bookmarks_free(struct nssync_sync_bookmarks *sync_bookmarks)
 {
-	free(sync_bookmarks);
+	const struct nssync_allocator *prev;
+
+	prev = nssync__alloc_enter(nssync_sync_get_allocator(sync_bookmarks->sync));
+	nssync_engine_unregister(sync_bookmarks->engine);
+	bookmarks_clear(sync_bookmarks);
+	nssync__free(sync_bookmarks);
+	nssync__alloc_leave(prev);
+
 	return NSSYNC_ERROR_OK;
 }
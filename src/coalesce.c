@@ -0,0 +1,396 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements coalescing of identical fetches in flight
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+#include <nssync/fetcher.h>
+
+#include "alloc.h"
+#include "scheduler.h"
+#include "retry.h"
+#include "coalesce.h"
+#include "metrics.h"
+
+/* a request in flight and the fetches joined to it */
+struct flight {
+	struct nssync_fetcher_fetch fetch; /* the request made */
+	struct nssync_coalesce *coalesce;
+
+	bool async;
+	bool done; /* result given to every fetch */
+	unsigned int attempt; /* retries of an asynchronous request */
+	unsigned int refs; /* synchronous fetches yet to see the result */
+	pthread_cond_t cond; /* signalled when done */
+
+	struct nssync_fetcher_fetch **fetchv; /* joined fetches */
+	int fetchc;
+
+	struct flight *next;
+};
+
+struct nssync_coalesce {
+	struct nssync_scheduler *scheduler;
+	struct nssync_retry *retry;
+
+	pthread_mutex_t lock;
+	struct flight *flights; /* requests in flight */
+};
+
+/** can a fetch wait on a request
+ *
+ * The request must be cancelled along with the fetch and have a
+ *   deadline no later, a fetch may then time out a little early.
+ */
+static bool
+flight_covers(const struct flight *flight, const struct nssync_fetcher_fetch *fetch)
+{
+	if (flight->fetch.cancel != fetch->cancel) {
+		return false;
+	}
+	if (fetch->deadline == 0) {
+		return flight->fetch.deadline == 0;
+	}
+	return (flight->fetch.deadline != 0) &&
+		(flight->fetch.deadline <= fetch->deadline);
+}
+
+static bool string_equal(const char *a, const char *b)
+{
+	if ((a == NULL) || (b == NULL)) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+/** find the request in flight a fetch may join */
+static struct flight *
+flight_find(struct nssync_coalesce *coalesce,
+	    struct nssync_fetcher_fetch *fetch,
+	    bool async)
+{
+	struct flight *flight;
+
+	for (flight = coalesce->flights; flight != NULL; flight = flight->next) {
+		if ((flight->async == async) &&
+		    (!flight->done) &&
+		    flight_covers(flight, fetch) &&
+		    (flight->fetch.unmodified == fetch->unmodified) &&
+		    (strcmp(flight->fetch.url, fetch->url) == 0) &&
+		    string_equal(flight->fetch.username, fetch->username) &&
+		    string_equal(flight->fetch.password, fetch->password)) {
+			return flight;
+		}
+	}
+
+	return NULL;
+}
+
+static enum nssync_error
+flight_join(struct flight *flight, struct nssync_fetcher_fetch *fetch)
+{
+	struct nssync_fetcher_fetch **fetchv;
+
+	fetchv = nssync__realloc(flight->fetchv,
+				 (flight->fetchc + 1) * sizeof(*fetchv));
+	if (fetchv == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	fetchv[flight->fetchc++] = fetch;
+	flight->fetchv = fetchv;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** create a request for a fetch, it is the first joined */
+static struct flight *
+flight_new(struct nssync_coalesce *coalesce,
+	   struct nssync_fetcher_fetch *fetch,
+	   bool async)
+{
+	struct flight *flight;
+
+	flight = nssync__calloc(1, sizeof(*flight));
+	if (flight == NULL) {
+		return NULL;
+	}
+
+	if (flight_join(flight, fetch) != NSSYNC_ERROR_OK) {
+		nssync__free(flight);
+		return NULL;
+	}
+
+	/* the joined fetches keep the url and credentials until completed */
+	flight->fetch.flags = fetch->flags;
+	flight->fetch.url = fetch->url;
+	flight->fetch.username = fetch->username;
+	flight->fetch.password = fetch->password;
+	flight->fetch.share = fetch->share;
+	flight->fetch.endpoint = fetch->endpoint;
+	flight->fetch.priority = fetch->priority;
+	flight->fetch.deadline = fetch->deadline;
+	flight->fetch.cancel = fetch->cancel;
+	flight->fetch.unmodified = fetch->unmodified;
+
+	flight->coalesce = coalesce;
+	flight->async = async;
+
+	flight->next = coalesce->flights;
+	coalesce->flights = flight;
+
+	return flight;
+}
+
+static void flight_unlink(struct nssync_coalesce *coalesce, struct flight *flight)
+{
+	struct flight **pflight;
+
+	for (pflight = &coalesce->flights; *pflight != flight; pflight = &(*pflight)->next);
+	*pflight = flight->next;
+}
+
+static void flight_free(struct flight *flight)
+{
+	nssync__free(flight->fetch.data);
+	nssync__free(flight->fetchv);
+	nssync__free(flight);
+}
+
+/** give the result of the request to every joined fetch
+ *
+ * The last fetch takes the response buffer, the others get copies
+ *   and the network timing is only reported by the first.
+ */
+static void flight_deliver(struct flight *flight)
+{
+	struct nssync_fetcher_fetch *fetch;
+	int fetchidx;
+
+	for (fetchidx = 0; fetchidx < flight->fetchc; fetchidx++) {
+		fetch = flight->fetchv[fetchidx];
+
+		fetch->result = flight->fetch.result;
+		fetch->http_code = flight->fetch.http_code;
+		fetch->backoff = flight->fetch.backoff;
+		fetch->timing = flight->fetch.timing;
+		if (fetchidx > 0) {
+			fetch->timing.connects = 0;
+			fetch->timing.bytes_in = 0;
+			fetch->timing.bytes_out = 0;
+		}
+
+		if (flight->fetch.data == NULL) {
+			continue;
+		}
+
+		if (fetchidx == (flight->fetchc - 1)) {
+			fetch->data = flight->fetch.data;
+			fetch->data_size = flight->fetch.data_size;
+			flight->fetch.data = NULL;
+		} else {
+			/* copy the zero terminator too */
+			fetch->data = nssync__malloc(flight->fetch.data_used + 1);
+			if (fetch->data == NULL) {
+				fetch->result = NSSYNC_ERROR_NOMEM;
+				continue;
+			}
+			memcpy(fetch->data, flight->fetch.data,
+			       flight->fetch.data_used + 1);
+			fetch->data_size = flight->fetch.data_used + 1;
+		}
+		fetch->data_used = flight->fetch.data_used;
+	}
+}
+
+/** finish a synchronous fetch as the fetcher would have */
+static enum nssync_error sync_finish(struct nssync_fetcher_fetch *fetch)
+{
+	if (fetch->completion != NULL) {
+		return fetch->completion(fetch);
+	}
+	return fetch->result;
+}
+
+static enum nssync_error
+sync_fetch(struct nssync_coalesce *coalesce, struct nssync_fetcher_fetch *fetch)
+{
+	struct flight *flight;
+	bool last;
+
+	pthread_mutex_lock(&coalesce->lock);
+
+	flight = flight_find(coalesce, fetch, false);
+	if ((flight != NULL) && (flight_join(flight, fetch) == NSSYNC_ERROR_OK)) {
+		nssync__metrics_add(NSSYNC_METRIC_COALESCED, 1);
+
+		flight->refs++;
+		while (!flight->done) {
+			pthread_cond_wait(&flight->cond, &coalesce->lock);
+		}
+		last = (--flight->refs == 0);
+		pthread_mutex_unlock(&coalesce->lock);
+
+		if (last) {
+			pthread_cond_destroy(&flight->cond);
+			flight_free(flight);
+		}
+
+		return sync_finish(fetch);
+	}
+
+	flight = flight_new(coalesce, fetch, false);
+	if (flight == NULL) {
+		pthread_mutex_unlock(&coalesce->lock);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	pthread_cond_init(&flight->cond, NULL);
+	flight->refs = 1;
+	pthread_mutex_unlock(&coalesce->lock);
+
+	flight->fetch.result = nssync_retry_fetch(coalesce->retry, &flight->fetch);
+
+	pthread_mutex_lock(&coalesce->lock);
+	flight_unlink(coalesce, flight);
+	flight_deliver(flight);
+	flight->done = true;
+	pthread_cond_broadcast(&flight->cond);
+	last = (--flight->refs == 0);
+	pthread_mutex_unlock(&coalesce->lock);
+
+	if (last) {
+		pthread_cond_destroy(&flight->cond);
+		flight_free(flight);
+	}
+
+	return sync_finish(fetch);
+}
+
+/** completion of an asynchronous request, completes the joined fetches */
+static enum nssync_error flight_complete(struct nssync_fetcher_fetch *fetch)
+{
+	struct flight *flight = (struct flight *)fetch;
+	struct nssync_coalesce *coalesce = flight->coalesce;
+	struct nssync_fetcher_fetch *joined;
+	int fetchidx;
+
+	nssync_scheduler_complete(coalesce->scheduler, fetch, 0);
+
+	/* joined fetches wait on and still share a retried request */
+	if (nssync_retry_later(coalesce->retry, fetch, flight->attempt)) {
+		flight->attempt++;
+		return NSSYNC_ERROR_OK;
+	}
+
+	pthread_mutex_lock(&coalesce->lock);
+	flight_unlink(coalesce, flight);
+	flight_deliver(flight);
+	flight->done = true;
+	pthread_mutex_unlock(&coalesce->lock);
+
+	for (fetchidx = 0; fetchidx < flight->fetchc; fetchidx++) {
+		joined = flight->fetchv[fetchidx];
+		if (joined->completion != NULL) {
+			joined->completion(joined);
+		}
+	}
+
+	flight_free(flight);
+
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+async_fetch(struct nssync_coalesce *coalesce, struct nssync_fetcher_fetch *fetch)
+{
+	struct flight *flight;
+	enum nssync_error ret;
+
+	pthread_mutex_lock(&coalesce->lock);
+
+	flight = flight_find(coalesce, fetch, true);
+	if ((flight != NULL) && (flight_join(flight, fetch) == NSSYNC_ERROR_OK)) {
+		pthread_mutex_unlock(&coalesce->lock);
+		nssync__metrics_add(NSSYNC_METRIC_COALESCED, 1);
+		return NSSYNC_ERROR_RETRY;
+	}
+
+	flight = flight_new(coalesce, fetch, true);
+	if (flight == NULL) {
+		pthread_mutex_unlock(&coalesce->lock);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	flight->fetch.completion = flight_complete;
+	pthread_mutex_unlock(&coalesce->lock);
+
+	ret = nssync_scheduler_fetch(coalesce->scheduler, &flight->fetch);
+	if (ret != NSSYNC_ERROR_RETRY) {
+		/* not queued so nothing else has joined on this thread */
+		pthread_mutex_lock(&coalesce->lock);
+		flight_unlink(coalesce, flight);
+		pthread_mutex_unlock(&coalesce->lock);
+		flight_free(flight);
+	}
+
+	return ret;
+}
+
+/* exported interface documented in coalesce.h */
+enum nssync_error
+nssync_coalesce_fetch(struct nssync_coalesce *coalesce,
+		      struct nssync_fetcher_fetch *fetch)
+{
+	if ((fetch->data != NULL) ||
+	    ((fetch->flags & NSSYNC_FETCHER_FILE) != 0)) {
+		/* responses into a given buffer or file cannot be shared */
+		if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+			return nssync_scheduler_fetch(coalesce->scheduler, fetch);
+		}
+		return nssync_retry_fetch(coalesce->retry, fetch);
+	}
+
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+		return async_fetch(coalesce, fetch);
+	}
+
+	return sync_fetch(coalesce, fetch);
+}
+
+/* exported interface documented in coalesce.h */
+enum nssync_error
+nssync_coalesce_new(struct nssync_scheduler *scheduler,
+		    struct nssync_retry *retry,
+		    struct nssync_coalesce **coalesce_out)
+{
+	struct nssync_coalesce *coalesce;
+
+	coalesce = nssync__calloc(1, sizeof(*coalesce));
+	if (coalesce == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	coalesce->scheduler = scheduler;
+	coalesce->retry = retry;
+	pthread_mutex_init(&coalesce->lock, NULL);
+
+	*coalesce_out = coalesce;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in coalesce.h */
+void nssync_coalesce_free(struct nssync_coalesce *coalesce)
+{
+	pthread_mutex_destroy(&coalesce->lock);
+	nssync__free(coalesce);
+}
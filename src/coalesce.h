@@ -0,0 +1,41 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** in flight fetch coalescing
+ *
+ * A fetch of a url with the same credentials as one already in flight
+ *   joins it rather than making a request of its own, so a burst of
+ *   sessions reconnecting asks the storage node for info/collections
+ *   and meta/global once. When the one request completes every fetch
+ *   joined to it gets the result and its completion is called.
+ *
+ * Synchronous and asynchronous fetches only join their own kind. Each
+ *   fetch still gets a response buffer it owns as callers keep and
+ *   parse responses in place, the buffer of the request goes to one of
+ *   them and the others get copies.
+ */
+
+struct nssync_coalesce;
+struct nssync_scheduler;
+struct nssync_retry;
+
+/** create coalescing in front of a scheduler
+ *
+ * Requests are retried by \a retry, the fetches joined to them see
+ *   only the final result.
+ */
+enum nssync_error nssync_coalesce_new(struct nssync_scheduler *scheduler, struct nssync_retry *retry, struct nssync_coalesce **coalesce_out);
+
+void nssync_coalesce_free(struct nssync_coalesce *coalesce);
+
+/** make a fetch, joining an identical one in flight if there is one
+ *
+ * @return As nssync_scheduler_fetch().
+ */
+enum nssync_error nssync_coalesce_fetch(struct nssync_coalesce *coalesce, struct nssync_fetcher_fetch *fetch);
@@ -0,0 +1,389 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements the resources shared between sync sessions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include <nssync/error.h>
+#include <nssync/fetcher.h>
+#include <nssync/context.h>
+#include <nssync/allocator.h>
+
+#include "alloc.h"
+#include "fetcher.h"
+#include "workqueue.h"
+#include "scheduler.h"
+#include "retry.h"
+#include "coalesce.h"
+#include "context.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* fetches in progress at once unless the parameters say */
+#define DEFAULT_MAX_FETCHES 16
+
+/* fetches in progress to one host at once unless the parameters say */
+#define DEFAULT_MAX_HOST_FETCHES 6
+
+/* retries of a transient fetch failure unless the parameters say */
+#define DEFAULT_RETRIES 3
+
+/* hedges per hundred small fetches unless the parameters say */
+#define DEFAULT_HEDGE_BUDGET 5
+
+/* contexts using curl, its global setup is not thread safe in older
+ * releases so it is only made by the first and undone by the last
+ */
+static pthread_once_t curl_users_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t curl_users_lock;
+static unsigned int curl_users;
+
+static void context_curl_once(void)
+{
+	pthread_mutex_init(&curl_users_lock, NULL);
+}
+
+static void context_curl_init(void)
+{
+	pthread_once(&curl_users_once, context_curl_once);
+
+	pthread_mutex_lock(&curl_users_lock);
+	if (curl_users++ == 0) {
+		curl_global_init(CURL_GLOBAL_ALL);
+	}
+	pthread_mutex_unlock(&curl_users_lock);
+}
+
+static void context_curl_fini(void)
+{
+	pthread_mutex_lock(&curl_users_lock);
+	if (--curl_users == 0) {
+		curl_global_cleanup();
+	}
+	pthread_mutex_unlock(&curl_users_lock);
+}
+
+struct nssync_context {
+	nssync_fetcher *fetcher; /* fetcher to retrive data */
+	void *share; /* fetcher connection, DNS and TLS caches */
+	struct nssync_scheduler *scheduler; /* orders and limits fetches */
+	struct nssync_retry *retry; /* retries transient failures */
+	struct nssync_coalesce *coalesce; /* joins identical fetches */
+
+	char *cachedir; /* directory for persistent caches */
+
+	struct nssync_workqueue *workqueue; /* crypto workers */
+
+	struct nssync_allocator allocator; /* allocator copy */
+	const struct nssync_allocator *alloc; /* allocator or NULL for libc */
+
+	nssync_context_fetch_hook *fetch_hook; /* completed fetch hook */
+	void *fetch_hook_ctx;
+
+	struct nssync_fetcher_cancel cancel; /* cancels every fetch */
+
+	pthread_mutex_t lock;
+	int sessions; /* number of sessions using the context */
+};
+
+static enum nssync_error context_free(struct nssync_context *context);
+
+static enum nssync_error
+context_new(const struct nssync_context_params *params,
+	    struct nssync_context **context_out)
+{
+	enum nssync_error ret;
+	struct nssync_context *newctx;
+
+	newctx = nssync__calloc(1, sizeof(*newctx));
+	if (newctx == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	pthread_mutex_init(&newctx->lock, NULL);
+
+	newctx->fetch_hook = params->fetch_hook;
+	newctx->fetch_hook_ctx = params->fetch_hook_ctx;
+
+	if (params->allocator != NULL) {
+		newctx->allocator = *params->allocator;
+		newctx->alloc = &newctx->allocator;
+		nssync__alloc_install_json();
+	}
+
+	/* an explicit curl fetcher gets the same shared setup as the default */
+	if ((params->fetcher == NULL) ||
+	    (params->fetcher == nssync_fetcher_curl)) {
+		context_curl_init();
+		newctx->fetcher = nssync_fetcher_curl;
+		newctx->share = nssync_fetcher_curl_share_new();
+		if (newctx->share == NULL) {
+			context_free(newctx);
+			return NSSYNC_ERROR_NOMEM;
+		}
+		nssync_fetcher_curl_share_hedge(newctx->share,
+						params->hedge_percentile,
+						(params->hedge_budget > 0) ?
+						params->hedge_budget :
+						DEFAULT_HEDGE_BUDGET);
+	} else {
+		newctx->fetcher = params->fetcher;
+	}
+
+	ret = nssync_scheduler_new(newctx->fetcher,
+				   (params->max_fetches > 0) ?
+				   params->max_fetches : DEFAULT_MAX_FETCHES,
+				   (params->max_host_fetches > 0) ?
+				   params->max_host_fetches : DEFAULT_MAX_HOST_FETCHES,
+				   &newctx->scheduler);
+	if (ret != NSSYNC_ERROR_OK) {
+		context_free(newctx);
+		return ret;
+	}
+
+	ret = nssync_retry_new(newctx->scheduler,
+			       (params->retries > 0) ? params->retries :
+			       (params->retries == 0) ? DEFAULT_RETRIES : 0,
+			       &newctx->retry);
+	if (ret != NSSYNC_ERROR_OK) {
+		context_free(newctx);
+		return ret;
+	}
+
+	ret = nssync_coalesce_new(newctx->scheduler,
+				  newctx->retry,
+				  &newctx->coalesce);
+	if (ret != NSSYNC_ERROR_OK) {
+		context_free(newctx);
+		return ret;
+	}
+
+	if (params->cachedir != NULL) {
+		newctx->cachedir = nssync__strdup(params->cachedir);
+		if (newctx->cachedir == NULL) {
+			context_free(newctx);
+			return NSSYNC_ERROR_NOMEM;
+		}
+	}
+
+	ret = nssync_workqueue_new(params->workers, &newctx->workqueue);
+	if (ret != NSSYNC_ERROR_OK) {
+		context_free(newctx);
+		return ret;
+	}
+
+	*context_out = newctx;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/context.h */
+enum nssync_error
+nssync_context_new(const struct nssync_context_params *params,
+		   struct nssync_context **context_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(params->allocator);
+	ret = context_new(params, context_out);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error context_free(struct nssync_context *context)
+{
+	if (context->workqueue != NULL) {
+		nssync_workqueue_free(context->workqueue);
+	}
+
+	if (context->coalesce != NULL) {
+		nssync_coalesce_free(context->coalesce);
+	}
+
+	if (context->retry != NULL) {
+		nssync_retry_free(context->retry);
+	}
+
+	if (context->scheduler != NULL) {
+		nssync_scheduler_free(context->scheduler);
+	}
+
+	if (context->fetcher == nssync_fetcher_curl) {
+		if (context->share != NULL) {
+			nssync_fetcher_curl_share_free(context->share);
+		}
+		context_curl_fini();
+	}
+
+	pthread_mutex_destroy(&context->lock);
+	nssync__free(context->cachedir);
+	nssync__free(context);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/context.h */
+enum nssync_error
+nssync_context_free(struct nssync_context *context)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	pthread_mutex_lock(&context->lock);
+	if (context->sessions > 0) {
+		pthread_mutex_unlock(&context->lock);
+		return NSSYNC_ERROR_INVAL;
+	}
+	pthread_mutex_unlock(&context->lock);
+
+	prev = nssync__alloc_enter(context->alloc);
+	ret = context_free(context);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+/* exported interface documented in context.h */
+enum nssync_error
+nssync_context_fetch(struct nssync_context *context,
+		     struct nssync_fetcher_fetch *fetch)
+{
+	fetch->share = context->share;
+
+	return nssync_coalesce_fetch(context->coalesce, fetch);
+}
+
+/* exported interface documented in nssync/context.h */
+enum nssync_error
+nssync_context_perform(struct nssync_context *context,
+		       int timeout,
+		       unsigned int *active_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+	unsigned int active = 0;
+	unsigned int retries;
+	int wait;
+
+	prev = nssync__alloc_enter(context->alloc);
+
+	/* reissue retries that are due and start fetches the scheduler
+	 * let through since the last call
+	 */
+	retries = nssync_retry_run(context->retry, &wait);
+	nssync_scheduler_run(context->scheduler);
+
+	/* do not sleep past the next retry */
+	if ((wait >= 0) && (wait < timeout)) {
+		timeout = wait;
+	}
+
+	/* other fetchers run their own asynchronous fetches */
+	if (context->fetcher == nssync_fetcher_curl) {
+		ret = nssync_fetcher_curl_perform(context->share, timeout, &active);
+	}
+
+	*active_out = active + retries + nssync_scheduler_run(context->scheduler);
+
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+/* exported interface documented in context.h */
+void
+nssync_context_fetch_complete(struct nssync_context *context,
+			      const struct nssync_fetcher_fetch *fetch)
+{
+	const struct nssync_fetcher_timing *timing = &fetch->timing;
+
+	TRACE_PAST(timing->total * 1e9, "net", "fetch", fetch->url);
+
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+		nssync_scheduler_complete(context->scheduler, fetch, 0);
+	}
+
+	nssync__metrics_add(NSSYNC_METRIC_CONNECTIONS, timing->connects);
+	if (timing->starttransfer > timing->pretransfer) {
+		nssync__metrics_record(NSSYNC_METRIC_SERVER,
+				       (timing->starttransfer - timing->pretransfer) * 1e9);
+	}
+
+	if (context->fetch_hook != NULL) {
+		context->fetch_hook(context->fetch_hook_ctx, fetch);
+	}
+}
+
+/* exported interface documented in nssync/context.h */
+void nssync_context_cancel(struct nssync_context *context)
+{
+	nssync_fetcher_cancel(&context->cancel);
+	nssync_context_wake(context);
+}
+
+/* exported interface documented in context.h */
+void nssync_context_wake(struct nssync_context *context)
+{
+	nssync_scheduler_wake(context->scheduler);
+}
+
+/* exported interface documented in context.h */
+struct nssync_fetcher_cancel *nssync_context_get_cancel(struct nssync_context *context)
+{
+	return &context->cancel;
+}
+
+/* exported interface documented in context.h */
+time_t nssync_context_get_backoff(struct nssync_context *context, const char *url)
+{
+	return nssync_retry_get_backoff(context->retry, url);
+}
+
+/* exported interface documented in context.h */
+const char *nssync_context_get_cachedir(struct nssync_context *context)
+{
+	return context->cachedir;
+}
+
+/* exported interface documented in context.h */
+const struct nssync_allocator *
+nssync_context_get_allocator(struct nssync_context *context)
+{
+	return context->alloc;
+}
+
+/* exported interface documented in context.h */
+struct nssync_workqueue *
+nssync_context_get_workqueue(struct nssync_context *context)
+{
+	return context->workqueue;
+}
+
+/* exported interface documented in context.h */
+void nssync_context_attach(struct nssync_context *context)
+{
+	pthread_mutex_lock(&context->lock);
+	context->sessions++;
+	pthread_mutex_unlock(&context->lock);
+}
+
+/* exported interface documented in context.h */
+void nssync_context_detach(struct nssync_context *context)
+{
+	pthread_mutex_lock(&context->lock);
+	context->sessions--;
+	pthread_mutex_unlock(&context->lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+#include <time.h>
+
+struct nssync_workqueue;
+
+/** issue a fetch through the contexts fetcher */
+enum nssync_error nssync_context_fetch(struct nssync_context *context, struct nssync_fetcher_fetch *fetch);
+
+/** account for a completed fetch
+ *
+ * Must be called once for every fetch as it completes, synchronous
+ *   fetches after nssync_context_fetch() returns and asynchronous ones
+ *   from their completion.
+ */
+void nssync_context_fetch_complete(struct nssync_context *context, const struct nssync_fetcher_fetch *fetch);
+
+/** wake fetches waiting to start so cancelled ones give up */
+void nssync_context_wake(struct nssync_context *context);
+
+/** cancel the fetches of a context are part of */
+struct nssync_fetcher_cancel *nssync_context_get_cancel(struct nssync_context *context);
+
+/** time before which the server of a url asked for no requests
+ *
+ * Backoff any fetch through the context was given applies to every
+ *   session using that server.
+ */
+time_t nssync_context_get_backoff(struct nssync_context *context, const char *url);
+
+const char *nssync_context_get_cachedir(struct nssync_context *context);
+
+struct nssync_workqueue *nssync_context_get_workqueue(struct nssync_context *context);
+
+/** allocator sessions using the context allocate from, NULL for libc */
+const struct nssync_allocator *nssync_context_get_allocator(struct nssync_context *context);
+
+/** note a session has started or stopped using a context */
+void nssync_context_attach(struct nssync_context *context);
+void nssync_context_detach(struct nssync_context *context);
@@ -1,19 +1,23 @@
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
-#include <jansson.h>
-
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
 #include <openssl/aes.h>
 
 #include <nssync/nssync.h>
 
+#include "alloc.h"
 #include "crypto.h"
 #include "base32.h"
 #include "base64.h"
 #include "hex16.h"
+#include "wbo.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define SYNCKEY_LENGTH 16
 #define BASE32_SYNCKEY_LENGTH 26
@@ -67,7 +71,7 @@ nssync_crypto_synckey_encode(const uint8_t *key, char **key_out)
 
 	base32_encode((uint8_t*)key32, &buflen, key, SYNCKEY_LENGTH);
 
-	genkey = malloc(ENCODED_SYNCKEY_LENGTH + 1); /* allow for zero pad */
+	genkey = nssync__malloc(ENCODED_SYNCKEY_LENGTH + 1); /* allow for zero pad */
 	if (genkey == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
@@ -96,7 +100,7 @@ nssync_crypto_synckey_decode(const char *key, uint8_t **key_out)
 	int keyidx = 0;
 	int ret;
 
-	synckey = malloc(SYNCKEY_LENGTH);
+	synckey = nssync__malloc(SYNCKEY_LENGTH);
 	if (synckey == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
@@ -113,7 +117,7 @@ nssync_crypto_synckey_decode(const char *key, uint8_t **key_out)
 	ret = base32_decode(synckey, SYNCKEY_LENGTH, key32, BASE32_SYNCKEY_LENGTH);
 
 	if (ret != SYNCKEY_LENGTH) {
-		free(synckey);
+		nssync__free(synckey);
 		return -2;
 	}
 
@@ -139,7 +143,7 @@ nssync_crypto_keybundle_new_b64(const char *key_b64,
 			   &key_length);
 
 	if ((key == NULL) || (key_length != ENCRYPTION_KEY_LENGTH)) {
-		free(key);
+		nssync__free(key);
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
@@ -149,23 +153,23 @@ nssync_crypto_keybundle_new_b64(const char *key_b64,
 
 
 	if ((hmac == NULL) || (hmac_length != HMAC_KEY_LENGTH)) {
-		free(key);
-		free(hmac);
+		nssync__free(key);
+		nssync__free(hmac);
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
-	keybundle = calloc(1, sizeof(*keybundle));
+	keybundle = nssync__calloc(1, sizeof(*keybundle));
 	if (keybundle == NULL) {
-		free(key);
-		free(hmac);
+		nssync__free(key);
+		nssync__free(hmac);
 		return NSSYNC_ERROR_NOMEM;
 	}
 
 	memcpy(keybundle->encryption, key, ENCRYPTION_KEY_LENGTH);
-	free(key);
+	nssync__free(key);
 
 	memcpy(keybundle->hmac, hmac, HMAC_KEY_LENGTH);
-	free(hmac);
+	nssync__free(hmac);
 
 	*keybundle_out = keybundle;
 
@@ -186,7 +190,7 @@ nssync_crypto_keybundle_new_user_synckey(const char *user_synckey,
 	}
 
 	ret = nssync_crypto_keybundle_new_synckey(synckey, accountname, keybundle_out);
-	free(synckey);
+	nssync__free(synckey);
 	return ret;
 }
 
@@ -201,8 +205,9 @@ nssync_crypto_keybundle_new_synckey(const uint8_t *sync_key,
 	unsigned int encryption_key_len = ENCRYPTION_KEY_LENGTH;
 	unsigned int hmac_key_len = HMAC_KEY_LENGTH;
 	const char *hmac_input = "Sync-AES_256_CBC-HMAC256";
+	TRACE_BEGIN(span);
 
-	keybundle = calloc(1, sizeof(*keybundle));
+	keybundle = nssync__calloc(1, sizeof(*keybundle));
 	if (keybundle == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
@@ -232,25 +237,28 @@ nssync_crypto_keybundle_new_synckey(const uint8_t *sync_key,
 	     data, data_len,
 	     keybundle->hmac, &hmac_key_len);
 
+	TRACE_END(span, "crypto", "key derivation", accountname);
+
 	*keybundle_out = keybundle;
 	return NSSYNC_ERROR_OK;
 }
 
 
-enum nssync_error
-nssync_crypto_decrypt_record(const char *record,
-			     struct nssync_crypto_keybundle *keybundle,
-			     uint8_t **plaintext_out,
-			     size_t *plaintext_length_out)
+/** verify and decrypt a record */
+static enum nssync_error
+decrypt_record(const char *record,
+	       size_t record_length,
+	       struct nssync_crypto_keybundle *keybundle,
+	       uint8_t *plaintext,
+	       size_t plaintext_size,
+	       size_t *plaintext_length_out)
 {
-	/* json objects */
-	json_t *root;
-	json_error_t error;
-	json_t *hmac_hex16_json;
-	json_t *ciphertext_b64_json;
-	json_t *iv_b64_json;
-
-	/* text from json */
+	enum nssync_error ret;
+
+	/* record fields */
+	struct nssync_wbo_field fieldv[3] = {
+		{ .name = "hmac" }, { .name = "ciphertext" }, { .name = "IV" }
+	};
 	const char *hmac_hex16;
 	const char *ciphertext_b64;
 	const char *iv_b64;
@@ -272,105 +280,112 @@ nssync_crypto_decrypt_record(const char *record,
 	/* AES state */
 	AES_KEY aeskey;
 
-	/* decypted data */
-	uint8_t *plaintext;
-
-	/* json load */
-	root = json_loads(record, 0, &error);
-	if (!root) {
-		debugf("error: on line %d of reply: %s\n",
-			error.line, error.text);
-		return NSSYNC_ERROR_PROTOCOL;
+	/* the record is parsed in place within the plaintext buffer,
+	 * the fields are finished with before decrypting over them.
+	 */
+	if (record_length >= plaintext_size) {
+		return NSSYNC_ERROR_INVAL;
 	}
+	memcpy(plaintext, record, record_length);
+	plaintext[record_length] = 0;
 
-	if(!json_is_object(root)) {
-		debugf("error: root is not an object\n");
-		json_decref(root);
-		return NSSYNC_ERROR_PROTOCOL;
+	ret = nssync_wbo_parse((char *)plaintext,
+			       (char *)plaintext + record_length,
+			       fieldv, 3, NULL);
+	if (ret != NSSYNC_ERROR_OK) {
+		log_warning(LOG_FIELDS(.error = ret), "record is not an object");
+		return ret;
 	}
 
 	/* extract ciphertext from record (undecoded) */
-
-	hmac_hex16_json = json_object_get(root, "hmac");
-	ciphertext_b64_json = json_object_get(root, "ciphertext");
-	iv_b64_json = json_object_get(root, "IV");
-	if ((!json_is_string(hmac_hex16_json)) ||
-	    (!json_is_string(ciphertext_b64_json)) ||
-	    (!json_is_string(iv_b64_json))) {
-		debugf("missing or incorrectly formatted fields in record\n");
-		json_decref(root);
+	if ((fieldv[0].type != NSSYNC_WBO_STRING) ||
+	    (fieldv[1].type != NSSYNC_WBO_STRING) ||
+	    (fieldv[2].type != NSSYNC_WBO_STRING)) {
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL),
+			    "missing or incorrectly formatted fields in record");
 		return NSSYNC_ERROR_PROTOCOL;
 	}
-	hmac_hex16 = json_string_value(hmac_hex16_json);
-	ciphertext_b64 = json_string_value(ciphertext_b64_json);
-	iv_b64 = json_string_value(iv_b64_json);
+	hmac_hex16 = fieldv[0].str;
+	ciphertext_b64 = fieldv[1].str;
+	iv_b64 = fieldv[2].str;
 
 	/* hex16 decode hmac from record */
 	record_hmac = hex16_decode((uint8_t *)hmac_hex16,
-				   strlen(hmac_hex16),
+				   fieldv[0].length,
 				   &record_hmac_length);
 	if (record_hmac_length != HMAC_KEY_LENGTH) {
-		debugf("record hmac length %zu incorrect (should be %d)\n",
-			record_hmac_length, HMAC_KEY_LENGTH);
-		json_decref(root);
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL),
+			    "record hmac length %zu incorrect (should be %d)",
+			    record_hmac_length, HMAC_KEY_LENGTH);
+		nssync__free(record_hmac);
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
 	/* calculate local hmac value */
+	TRACE_BEGIN(hmac_span);
 	HMAC(EVP_sha256(),
 	     keybundle->hmac, HMAC_KEY_LENGTH,
-	     (uint8_t *)ciphertext_b64, strlen(ciphertext_b64),
+	     (uint8_t *)ciphertext_b64, fieldv[1].length,
 	     local_hmac, &local_hmac_length);
+	TRACE_END(hmac_span, "crypto", "hmac verify", NULL);
 
 	/* verify hmac */
 	if (memcmp(record_hmac, local_hmac, SHA256_DIGEST_LENGTH) != 0) {
-		debugf("record hmac does not match computed. bad key?\n");
-		free(record_hmac);
-		json_decref(root);
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_HMAC),
+			    "record hmac does not match computed. bad key?");
+		nssync__free(record_hmac);
 		return NSSYNC_ERROR_HMAC;
 	}
-	free(record_hmac);
+	nssync__free(record_hmac);
 
 	/* base64 decode iv from record */
+	TRACE_BEGIN(base64_span);
 	iv = base64_decode((uint8_t *)iv_b64,
-			   strlen(iv_b64),
+			   fieldv[2].length,
 			   &iv_length);
 	if ((iv == NULL) || (iv_length != IV_LENGTH)) {
-		debugf("IV data was size %zu (expected %d)\n",
-			iv_length, IV_LENGTH);
-		json_decref(root);
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL),
+			    "IV data was size %zu (expected %d)",
+			    iv_length, IV_LENGTH);
+		nssync__free(iv);
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
 	/* base64 decode ciphertext */
 	ciphertext = base64_decode((uint8_t *)ciphertext_b64,
-				   strlen(ciphertext_b64),
+				   fieldv[1].length,
 				   &ciphertext_length);
 	if (ciphertext == NULL) {
-		json_decref(root);
-		free(iv);
+		nssync__free(iv);
 		return NSSYNC_ERROR_NOMEM;
 	}
-
-	/* json unref */
-	json_decref(root);
+	TRACE_END(base64_span, "crypto", "base64 decode", NULL);
 
 	/* decrypt data */
-	plaintext = malloc(ciphertext_length + 1);
-	if (plaintext == NULL) {
-		free(ciphertext);
-		free(iv);
-		return NSSYNC_ERROR_NOMEM;
+	if (ciphertext_length >= plaintext_size) {
+		nssync__free(ciphertext);
+		nssync__free(iv);
+		return NSSYNC_ERROR_INVAL;
 	}
 	plaintext[ciphertext_length] = 0;
 
+	TRACE_BEGIN(aes_span);
 	AES_set_decrypt_key(keybundle->encryption, 256, &aeskey);
 	AES_cbc_encrypt(ciphertext, plaintext, ciphertext_length, &aeskey, iv, AES_DECRYPT);
+	TRACE_END(aes_span, "crypto", "aes decrypt", NULL);
+
+	nssync__free(ciphertext);
+	nssync__free(iv);
+
+	/* remove PKCS#7 padding so callers get the exact record */
+	if ((ciphertext_length > 0) &&
+	    (plaintext[ciphertext_length - 1] > 0) &&
+	    (plaintext[ciphertext_length - 1] <= AES_BLOCK_SIZE) &&
+	    (plaintext[ciphertext_length - 1] <= ciphertext_length)) {
+		ciphertext_length -= plaintext[ciphertext_length - 1];
+		plaintext[ciphertext_length] = 0;
+	}
 
-	free(ciphertext);
-	free(iv);
-
-	*plaintext_out = plaintext;
 	if (plaintext_length_out != NULL) {
 		*plaintext_length_out = ciphertext_length;
 	}
@@ -378,6 +393,72 @@ nssync_crypto_decrypt_record(const char *record,
 	return NSSYNC_ERROR_OK;
 }
 
+/* exported interface documented in crypto.h */
+enum nssync_error
+nssync_crypto_decrypt_record_buf(const char *record,
+				 size_t record_length,
+				 struct nssync_crypto_keybundle *keybundle,
+				 uint8_t *plaintext,
+				 size_t plaintext_size,
+				 size_t *plaintext_length_out)
+{
+	enum nssync_error ret;
+	uint64_t start;
+
+	start = nssync__metrics_now();
+	ret = decrypt_record(record, record_length, keybundle,
+			     plaintext, plaintext_size, plaintext_length_out);
+	nssync__metrics_since(NSSYNC_METRIC_DECRYPT, start);
+	TRACE_END(start, "crypto", "decrypt record", NULL);
+
+	if (ret == NSSYNC_ERROR_OK) {
+		nssync__metrics_add(NSSYNC_METRIC_RECORDS_DECRYPTED, 1);
+	} else if (ret == NSSYNC_ERROR_HMAC) {
+		nssync__metrics_add(NSSYNC_METRIC_HMAC_FAILURES, 1);
+	}
+
+	return ret;
+}
+
+/* exported interface documented in crypto.h */
+enum nssync_error
+nssync_crypto_decrypt_record(const char *record,
+			     struct nssync_crypto_keybundle *keybundle,
+			     uint8_t **plaintext_out,
+			     size_t *plaintext_length_out)
+{
+	enum nssync_error ret;
+	uint8_t *plaintext;
+	size_t plaintext_size;
+
+	plaintext_size = nssync_crypto_decrypt_record_size(strlen(record));
+	plaintext = nssync__malloc(plaintext_size);
+	if (plaintext == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	ret = nssync_crypto_decrypt_record_buf(record, strlen(record), keybundle,
+					       plaintext, plaintext_size,
+					       plaintext_length_out);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(plaintext);
+		return ret;
+	}
+
+	*plaintext_out = plaintext;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in crypto.h */
+size_t nssync_crypto_decrypt_record_size(size_t record_length)
+{
+	/* the base64 ciphertext is within the record so its decoded
+	 * length (and hence the plaintext) can never be longer.
+	 */
+	return record_length + 1;
+}
+
 enum nssync_error
 nssync_crypto_keybundle_get_encryption(struct nssync_crypto_keybundle *keybundle, uint8_t **encryption_out, size_t *encryption_length_out)
 {
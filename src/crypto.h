@@ -35,3 +35,18 @@ enum nssync_error nssync_crypto_keybundle_get_hmac(struct nssync_crypto_keybundl
  * @param record null terminated json string
  */
 enum nssync_error nssync_crypto_decrypt_record(const char *record, struct nssync_crypto_keybundle *keybundle, uint8_t **plaintext_out, size_t *plaintext_length_out);
+
+/** decrypt sync record into a caller supplied buffer
+ *
+ * The plaintext is null terminated.
+ *
+ * @param record json record which need not be null terminated.
+ * @param record_length Length of the record.
+ * @param plaintext Buffer to decrypt into.
+ * @param plaintext_size Size of buffer, at least that returned by
+ *                       nssync_crypto_decrypt_record_size().
+ */
+enum nssync_error nssync_crypto_decrypt_record_buf(const char *record, size_t record_length, struct nssync_crypto_keybundle *keybundle, uint8_t *plaintext, size_t plaintext_size, size_t *plaintext_length_out);
+
+/** buffer size sufficient to decrypt a sync record into */
+size_t nssync_crypto_decrypt_record_size(size_t record_length);
@@ -1,90 +1,955 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <curl/curl.h>
 
 #include <nssync/fetcher.h>
-#include <nssync/debug.h>
 
-#define BUFFER_SIZE  (256 * 1024)  /* 256 KB */
+#include "alloc.h"
+#include "fetcher.h"
+#include "log.h"
+#include "metrics.h"
+
+/* initial size of a response buffer, it doubles as the response needs */
+#define BUFFER_SIZE  (16 * 1024)  /* 16 KB */
+
+/* largest response accepted once decompressed */
+#define RESPONSE_MAX  (64 * 1024 * 1024)  /* 64 MB */
+
+/* seconds to connect to a server */
+#define CONNECT_TIMEOUT 30
+
+/* seconds a transfer may make no progress before it fails */
+#define STALL_TIME 60
+
+/* nanoseconds curl may time out ahead of a deadline */
+#define DEADLINE_SLACK 50000000
+
+/* latencies of recent small fetches kept to pick the hedge delay */
+#define HEDGE_SAMPLES 64
+
+/* latencies needed before any fetch is hedged */
+#define HEDGE_MIN_SAMPLES 20
+
+/* most hedges the budget saves up for a burst of slow fetches */
+#define HEDGE_BURST 10
+
+/* ms a synchronous fetch waits for network activity at a time */
+#define SYNC_WAIT 100
+
+/* a fetch in progress and the duplicate made if it was slow */
+struct curl_transfer {
+	struct nssync_fetcher_fetch *fetch;
+	CURL *curl; /* request or NULL once it failed */
+	struct curl_slist *headers; /* request headers of both requests */
+	uint64_t start; /* time the fetch started */
+	uint64_t hedge_at; /* time to send a duplicate or 0 for never */
+
+	CURL *hedge; /* duplicate request or NULL */
+	struct nssync_fetcher_fetch hedge_fetch; /* response of the duplicate */
+	bool hedged; /* a duplicate was sent */
+
+	struct curl_transfer *next;
+};
+
+/* state shared between fetches */
+struct curl_share {
+	CURLSH *share;
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+
+	CURLM *multi; /* asynchronous fetches in progress */
+	struct curl_transfer *transfers; /* asynchronous transfers */
+
+	/* hedging of small fetches */
+	pthread_mutex_t hedge_lock;
+	unsigned int hedge_percentile; /* latency percentile to hedge after, 0 for off */
+	unsigned int hedge_budget; /* hedges per hundred small fetches */
+	unsigned int hedge_tokens; /* hundredths of a hedge available */
+	uint64_t samples[HEDGE_SAMPLES]; /* recent latencies */
+	unsigned int samplec; /* latencies recorded */
+};
+
+static void
+share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	struct curl_share *cshare = userptr;
+
+	pthread_mutex_lock(&cshare->locks[data]);
+}
+
+static void
+share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	struct curl_share *cshare = userptr;
+
+	pthread_mutex_unlock(&cshare->locks[data]);
+}
+
+/* exported interface documented in fetcher.h */
+void *nssync_fetcher_curl_share_new(void)
+{
+	struct curl_share *cshare;
+	int lockidx;
+
+	cshare = nssync__calloc(1, sizeof(*cshare));
+	if (cshare == NULL) {
+		return NULL;
+	}
+
+	cshare->share = curl_share_init();
+	if (cshare->share == NULL) {
+		nssync__free(cshare);
+		return NULL;
+	}
+
+	cshare->multi = curl_multi_init();
+	if (cshare->multi == NULL) {
+		curl_share_cleanup(cshare->share);
+		nssync__free(cshare);
+		return NULL;
+	}
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt(cshare->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+
+	for (lockidx = 0; lockidx < CURL_LOCK_DATA_LAST; lockidx++) {
+		pthread_mutex_init(&cshare->locks[lockidx], NULL);
+	}
+	pthread_mutex_init(&cshare->hedge_lock, NULL);
+
+	curl_share_setopt(cshare->share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(cshare->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(cshare->share, CURLSHOPT_USERDATA, cshare);
+
+	curl_share_setopt(cshare->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(cshare->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(cshare->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+	return cshare;
+}
+
+/* exported interface documented in fetcher.h */
+void nssync_fetcher_curl_share_free(void *share)
+{
+	struct curl_share *cshare = share;
+	int lockidx;
+
+	curl_multi_cleanup(cshare->multi);
+	curl_share_cleanup(cshare->share);
+
+	for (lockidx = 0; lockidx < CURL_LOCK_DATA_LAST; lockidx++) {
+		pthread_mutex_destroy(&cshare->locks[lockidx]);
+	}
+	pthread_mutex_destroy(&cshare->hedge_lock);
+	nssync__free(cshare);
+}
+
+/* exported interface documented in fetcher.h */
+void
+nssync_fetcher_curl_share_hedge(void *share,
+				unsigned int percentile,
+				unsigned int budget)
+{
+	struct curl_share *cshare = share;
+
+	if (percentile > 99) {
+		percentile = 99;
+	}
+
+	pthread_mutex_lock(&cshare->hedge_lock);
+	cshare->hedge_percentile = percentile;
+	cshare->hedge_budget = budget;
+	pthread_mutex_unlock(&cshare->hedge_lock);
+}
 
 
 static size_t write_response(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	struct nssync_fetcher_fetch *fetch = stream;
+	size_t length = size * nmemb;
+	size_t data_size;
+	void *data;
 
-	if ((fetch->data_used + size * nmemb) >= (fetch->data_size - 1)) {
-		fprintf(stderr, "error: too small buffer\n");
-		return 0;
+	/* grow the buffer leaving room for a terminator */
+	if ((fetch->data_used + length) >= fetch->data_size) {
+		data_size = fetch->data_size;
+		while ((fetch->data_used + length) >= data_size) {
+			data_size *= 2;
+		}
+
+		if (data_size > RESPONSE_MAX) {
+			log_error(LOG_FIELDS(.url = fetch->url),
+				  "response too large");
+			return 0;
+		}
+
+		data = nssync__realloc(fetch->data, data_size);
+		if (data == NULL) {
+			log_error(LOG_FIELDS(.url = fetch->url, .error = NSSYNC_ERROR_NOMEM),
+				  "unable to grow response buffer");
+			return 0;
+		}
+		fetch->data = data;
+		fetch->data_size = data_size;
 	}
 
-	memcpy(((uint8_t *)fetch->data) + fetch->data_used, ptr, size * nmemb);
-	fetch->data_used += size * nmemb;
+	memcpy(((uint8_t *)fetch->data) + fetch->data_used, ptr, length);
+	fetch->data_used += length;
 
-	return size * nmemb;
+	return length;
 }
 
+/** write response to the file of a fetch */
+static size_t write_file(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	struct nssync_fetcher_fetch *fetch = stream;
+	size_t length = size * nmemb;
+	size_t done = 0;
+	ssize_t written;
 
-enum nssync_error
-nssync_fetcher_curl(struct nssync_fetcher_fetch *fetch)
+	while (done < length) {
+		written = write(fetch->fd, (uint8_t *)ptr + done, length - done);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error(LOG_FIELDS(.url = fetch->url),
+				  "unable to write response: %s",
+				  strerror(errno));
+			return 0;
+		}
+		done += written;
+	}
+	fetch->data_used += length;
+
+	return length;
+}
+
+/** match a header name returning the value or NULL */
+static const char *
+header_value(const char *header, size_t length, const char *name)
 {
-	CURL *curl;
-	CURLcode status;
-	long code;
+	size_t namelen = strlen(name);
+
+	if ((length <= namelen) ||
+	    (strncasecmp(header, name, namelen) != 0) ||
+	    (header[namelen] != ':')) {
+		return NULL;
+	}
+	return header + namelen + 1;
+}
 
-	debugf("fetching:%s\n", fetch->url);
+/** server signals within response headers */
+static size_t write_header(char *ptr, size_t size, size_t nmemb, void *stream)
+{
+	struct nssync_fetcher_fetch *fetch = stream;
+	size_t length = size * nmemb;
+	const char *value;
+	unsigned long backoff;
 
-	if (fetch->data == NULL) {
-		fetch->data_size = BUFFER_SIZE;
-		fetch->data = malloc(fetch->data_size);
-		fetch->data_used = 0;
+	value = header_value(ptr, length, "X-Weave-Backoff");
+	if (value == NULL) {
+		value = header_value(ptr, length, "Retry-After");
 	}
 
-	if (fetch->data == NULL) {
-		return NSSYNC_ERROR_NOMEM;
+	if (value != NULL) {
+		/* header lines are not terminated but end with CRLF */
+		backoff = strtoul(value, NULL, 10);
+		if (backoff > fetch->backoff) {
+			fetch->backoff = backoff;
+		}
 	}
 
-	curl = curl_easy_init();
+	return length;
+}
 
-	if (!curl) {
-		return NSSYNC_ERROR_FETCH;
+/* exported interface documented in nssync/fetcher.h */
+uint64_t nssync_fetcher_deadline(unsigned int timeout)
+{
+	return nssync__metrics_now() + ((uint64_t)timeout * 1000000);
+}
+
+/* exported interface documented in nssync/fetcher.h */
+void nssync_fetcher_cancel(struct nssync_fetcher_cancel *cancel)
+{
+	__atomic_store_n(&cancel->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+/* exported interface documented in nssync/fetcher.h */
+enum nssync_error nssync_fetcher_check(const struct nssync_fetcher_fetch *fetch)
+{
+	const struct nssync_fetcher_cancel *cancel;
+
+	for (cancel = fetch->cancel; cancel != NULL; cancel = cancel->parent) {
+		if (__atomic_load_n(&cancel->cancelled, __ATOMIC_ACQUIRE) != 0) {
+			return NSSYNC_ERROR_CANCELLED;
+		}
+	}
+
+	if ((fetch->deadline != 0) && (nssync__metrics_now() >= fetch->deadline)) {
+		return NSSYNC_ERROR_TIMEOUT;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** abort transfers of cancelled fetches */
+static int
+fetch_progress(void *clientp,
+	       curl_off_t dltotal,
+	       curl_off_t dlnow,
+	       curl_off_t ultotal,
+	       curl_off_t ulnow)
+{
+	struct nssync_fetcher_fetch *fetch = clientp;
+
+	return nssync_fetcher_check(fetch) != NSSYNC_ERROR_OK;
+}
+
+/** fill a fetches timing from the curl handle */
+static void fetch_timing(CURL *curl, struct nssync_fetcher_fetch *fetch)
+{
+	struct nssync_fetcher_timing *timing = &fetch->timing;
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t size_download = 0;
+	curl_off_t size_upload = 0;
+#else
+	double size_download = 0;
+	double size_upload = 0;
+#endif
+	long header_size = 0;
+	long request_size = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &timing->namelookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &timing->connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &timing->appconnect);
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &timing->pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &timing->starttransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &timing->total);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &timing->connects);
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size_download);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &size_upload);
+#else
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &size_download);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD, &size_upload);
+#endif
+
+	curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+	timing->bytes_in = size_download + header_size;
+
+	curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+	timing->bytes_out = size_upload + request_size;
+}
+
+/** headers a fetch adds to the request, NULL if none */
+static struct curl_slist *fetch_headers(struct nssync_fetcher_fetch *fetch)
+{
+	char header[64];
+
+	if (fetch->unmodified == 0) {
+		return NULL;
+	}
+
+	snprintf(header, sizeof(header),
+		 "X-If-Unmodified-Since: %.2f", fetch->unmodified);
+
+	return curl_slist_append(NULL, header);
+}
+
+/** create a curl handle set up for a fetch
+ *
+ * @param headers Request headers which must outlive the handle or NULL.
+ */
+static CURL *fetch_setup(struct nssync_fetcher_fetch *fetch, struct curl_slist *headers)
+{
+	CURL *curl;
+	uint64_t now;
+	long timeout;
+
+	curl = curl_easy_init();
+	if (curl == NULL) {
+		return NULL;
 	}
 
 	curl_easy_setopt(curl, CURLOPT_URL, fetch->url);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
+	if ((fetch->flags & NSSYNC_FETCHER_FILE) != 0) {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
+	}
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, fetch);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, fetch);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, fetch);
+
+	/* a stalled server fails the fetch rather than hanging it */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)STALL_TIME);
+
+	/* any encoding curl can decode, responses are stored decoded */
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	/* HTTP/2 where the server offers it, asynchronous fetches to a
+	 * node then share one connection rather than opening several
+	 */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+	if (fetch->deadline != 0) {
+		/* rounded up so the deadline has passed when curl gives up,
+		 * one already passed times out at once
+		 */
+		now = nssync__metrics_now();
+		timeout = 1;
+		if (fetch->deadline > now) {
+			timeout = (long)((fetch->deadline - now) / 1000000) + 1;
+		}
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+	}
+
+	if (fetch->cancel != NULL) {
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, fetch_progress);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, fetch);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	}
+
+	if (headers != NULL) {
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	}
+
+	if (fetch->share != NULL) {
+		curl_easy_setopt(curl, CURLOPT_SHARE,
+				 ((struct curl_share *)fetch->share)->share);
+	}
 
 	if (fetch->username != NULL) {
 		curl_easy_setopt(curl, CURLOPT_USERNAME, fetch->username);
 		curl_easy_setopt(curl, CURLOPT_PASSWORD, fetch->password);
 	}
 
-	status = curl_easy_perform(curl);
+	return curl;
+}
+
+/** set the result of a finished transfer and release its handle */
+static void
+fetch_finish(CURL *curl, struct nssync_fetcher_fetch *fetch, CURLcode status)
+{
+	enum nssync_error ret;
+	long code;
+
 	if (status != 0) {
-		fprintf(stderr, "error: unable to request data from %s:\n", fetch->url);
-		fprintf(stderr, "%s\n", curl_easy_strerror(status));
-		curl_easy_cleanup(curl);
-		return NSSYNC_ERROR_FETCH;
+		/* aborted or timed out transfers report why */
+		ret = nssync_fetcher_check(fetch);
+		if ((ret == NSSYNC_ERROR_OK) &&
+		    (status == CURLE_OPERATION_TIMEDOUT) &&
+		    (fetch->deadline != 0) &&
+		    (fetch->deadline < (nssync__metrics_now() + DEADLINE_SLACK))) {
+			ret = NSSYNC_ERROR_TIMEOUT;
+		} else if (ret == NSSYNC_ERROR_OK) {
+			ret = NSSYNC_ERROR_FETCH;
+		}
+		log_warning(LOG_FIELDS(.url = fetch->url, .error = ret),
+			    "unable to request data: %s",
+			    curl_easy_strerror(status));
+		fetch->result = ret;
+	} else {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		fetch->http_code = code;
+		if (code != 200) {
+			log_warning(LOG_FIELDS(.url = fetch->url,
+					       .error = NSSYNC_ERROR_FETCH),
+				    "server responded with code %ld", code);
+			fetch->result = NSSYNC_ERROR_FETCH;
+		} else {
+			fetch->result = NSSYNC_ERROR_OK;
+		}
+
+		/* zero-terminate the result */
+		if (fetch->data != NULL) {
+			((uint8_t *)fetch->data)[fetch->data_used] = '\0';
+		}
 	}
 
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-	if (code != 200) {
-		fprintf(stderr, "error: server responded with code %ld\n", code);
-		curl_easy_cleanup(curl);
-		return NSSYNC_ERROR_FETCH;
+	fetch_timing(curl, fetch);
+
+	curl_easy_cleanup(curl);
+}
+
+/** only small idempotent requests are hedged */
+static bool hedgeable(const struct nssync_fetcher_fetch *fetch)
+{
+	/* a file can only take one response */
+	if ((fetch->flags & NSSYNC_FETCHER_FILE) != 0) {
+		return false;
+	}
+
+	return (fetch->endpoint == NSSYNC_FETCHER_ENDPOINT_NODE) ||
+		(fetch->endpoint == NSSYNC_FETCHER_ENDPOINT_INFO) ||
+		(fetch->endpoint == NSSYNC_FETCHER_ENDPOINT_OBJECT);
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	uint64_t sa = *(const uint64_t *)a;
+	uint64_t sb = *(const uint64_t *)b;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/** decide when a transfer starting now is hedged
+ *
+ * Each small fetch adds to the budget so hedges stay a fixed share of
+ *   them however slow the server gets.
+ *
+ * @return The time to send a duplicate or 0 for never.
+ */
+static uint64_t hedge_time(struct curl_share *cshare, struct curl_transfer *transfer)
+{
+	uint64_t sorted[HEDGE_SAMPLES];
+	unsigned int samplec;
+	uint64_t hedge_at = 0;
+
+	if ((cshare == NULL) || !hedgeable(transfer->fetch)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&cshare->hedge_lock);
+	if ((cshare->hedge_percentile > 0) &&
+	    (cshare->samplec >= HEDGE_MIN_SAMPLES)) {
+		cshare->hedge_tokens += cshare->hedge_budget;
+		if (cshare->hedge_tokens > (HEDGE_BURST * 100)) {
+			cshare->hedge_tokens = HEDGE_BURST * 100;
+		}
+
+		samplec = (cshare->samplec < HEDGE_SAMPLES) ?
+			cshare->samplec : HEDGE_SAMPLES;
+		memcpy(sorted, cshare->samples, samplec * sizeof(uint64_t));
+		qsort(sorted, samplec, sizeof(uint64_t), sample_cmp);
+		hedge_at = transfer->start +
+			sorted[(samplec * cshare->hedge_percentile) / 100];
+	}
+	pthread_mutex_unlock(&cshare->hedge_lock);
+
+	return hedge_at;
+}
+
+/** note how long a small fetch took */
+static void hedge_sample(struct curl_share *cshare, struct curl_transfer *transfer)
+{
+	if ((cshare == NULL) ||
+	    !hedgeable(transfer->fetch) ||
+	    (transfer->fetch->result != NSSYNC_ERROR_OK)) {
+		return;
+	}
+
+	pthread_mutex_lock(&cshare->hedge_lock);
+	cshare->samples[cshare->samplec++ % HEDGE_SAMPLES] =
+		nssync__metrics_now() - transfer->start;
+	if (cshare->samplec == (HEDGE_SAMPLES * 2)) {
+		/* keep the count from wrapping */
+		cshare->samplec = HEDGE_SAMPLES;
+	}
+	pthread_mutex_unlock(&cshare->hedge_lock);
+}
+
+/** send a duplicate of a slow transfer on a new connection
+ *
+ * Only done if the budget allows, a transfer is hedged at most once.
+ */
+static void
+hedge_start(struct curl_share *cshare, CURLM *multi, struct curl_transfer *transfer)
+{
+	struct nssync_fetcher_fetch *fetch = transfer->fetch;
+	struct nssync_fetcher_fetch *hedge = &transfer->hedge_fetch;
+	bool allowed;
+
+	transfer->hedge_at = 0;
+
+	pthread_mutex_lock(&cshare->hedge_lock);
+	allowed = (cshare->hedge_tokens >= 100);
+	if (allowed) {
+		cshare->hedge_tokens -= 100;
+	}
+	pthread_mutex_unlock(&cshare->hedge_lock);
+	if (!allowed) {
+		return;
 	}
 
+	memset(hedge, 0, sizeof(*hedge));
+	hedge->flags = fetch->flags;
+	hedge->url = fetch->url;
+	hedge->username = fetch->username;
+	hedge->password = fetch->password;
+	hedge->share = fetch->share;
+	hedge->endpoint = fetch->endpoint;
+	hedge->deadline = fetch->deadline;
+	hedge->cancel = fetch->cancel;
+	hedge->unmodified = fetch->unmodified;
+
+	hedge->data_size = BUFFER_SIZE;
+	hedge->data = nssync__malloc(hedge->data_size);
+	if (hedge->data == NULL) {
+		return;
+	}
+
+	transfer->hedge = fetch_setup(hedge, transfer->headers);
+	if (transfer->hedge == NULL) {
+		nssync__free(hedge->data);
+		return;
+	}
+	/* a duplicate on the connection of the slow request gains nothing */
+	curl_easy_setopt(transfer->hedge, CURLOPT_FRESH_CONNECT, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	curl_easy_setopt(transfer->hedge, CURLOPT_PIPEWAIT, 0L);
+#endif
+	curl_easy_setopt(transfer->hedge, CURLOPT_PRIVATE, transfer);
+
+	if (curl_multi_add_handle(multi, transfer->hedge) != CURLM_OK) {
+		curl_easy_cleanup(transfer->hedge);
+		transfer->hedge = NULL;
+		nssync__free(hedge->data);
+		return;
+	}
+	transfer->hedged = true;
+
+	log_debug(LOG_FIELDS(.url = fetch->url), "hedging slow fetch");
+}
+
+/** drop a request of a transfer that is no longer wanted */
+static void transfer_drop(CURLM *multi, struct curl_transfer *transfer, CURL *curl)
+{
+	curl_multi_remove_handle(multi, curl);
 	curl_easy_cleanup(curl);
-	curl_global_cleanup();
 
-	/* zero-terminate the result */
-	((uint8_t *)fetch->data)[fetch->data_used] = '\0';
+	if (curl == transfer->curl) {
+		transfer->curl = NULL;
+	} else {
+		transfer->hedge = NULL;
+		nssync__free(transfer->hedge_fetch.data);
+	}
+}
+
+/** handle a finished request of a transfer
+ *
+ * The first request to finish gives the response unless it failed to
+ *   get one while the other is still going.
+ *
+ * @return true when the fetch of the transfer is finished.
+ */
+static bool
+transfer_done(CURLM *multi,
+	      struct curl_transfer *transfer,
+	      CURL *curl,
+	      CURLcode status)
+{
+	struct nssync_fetcher_fetch *fetch = transfer->fetch;
+	struct nssync_fetcher_fetch *hedge = &transfer->hedge_fetch;
+	bool primary = (curl == transfer->curl);
+	CURL *other;
+
+	other = primary ? transfer->hedge : transfer->curl;
+
+	if ((status != CURLE_OK) &&
+	    (other != NULL) &&
+	    (nssync_fetcher_check(fetch) == NSSYNC_ERROR_OK)) {
+		transfer_drop(multi, transfer, curl);
+		return false;
+	}
+
+	if (other != NULL) {
+		transfer_drop(multi, transfer, other);
+	}
+	if (transfer->hedged) {
+		nssync__metrics_add(primary ?
+				    NSSYNC_METRIC_HEDGES_LOST :
+				    NSSYNC_METRIC_HEDGES_WON, 1);
+	}
+
+	curl_multi_remove_handle(multi, curl);
+	if (primary) {
+		fetch_finish(curl, fetch, status);
+		return true;
+	}
+
+	/* the duplicate answered so its response is the fetches */
+	fetch_finish(curl, hedge, status);
+	nssync__free(fetch->data);
+	fetch->data = hedge->data;
+	fetch->data_size = hedge->data_size;
+	fetch->data_used = hedge->data_used;
+	fetch->result = hedge->result;
+	fetch->http_code = hedge->http_code;
+	fetch->backoff = hedge->backoff;
+	fetch->timing = hedge->timing;
+	transfer->hedge = NULL;
+
+	return true;
+}
+
+/** milliseconds to wait for network activity before the next hedge */
+static int hedge_wait(struct curl_transfer *transfer, int timeout, uint64_t now)
+{
+	uint64_t wait;
+
+	if ((transfer->hedge_at == 0) || (transfer->hedge != NULL)) {
+		return timeout;
+	}
+	if (transfer->hedge_at <= now) {
+		return 0;
+	}
+	wait = ((transfer->hedge_at - now) / 1000000) + 1;
+	if (wait < (uint64_t)timeout) {
+		return wait;
+	}
+	return timeout;
+}
+
+/** make a synchronous transfer that may be hedged
+ *
+ * The requests run on a multi handle of their own so a duplicate can
+ *   be added while the first is in progress.
+ */
+static void transfer_perform(struct curl_share *cshare, struct curl_transfer *transfer)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	CURL *curl;
+	CURLcode status;
+	bool finished = false;
+	int running;
+	int msgc;
+
+	multi = curl_multi_init();
+	if ((multi == NULL) ||
+	    (curl_multi_add_handle(multi, transfer->curl) != CURLM_OK)) {
+		if (multi != NULL) {
+			curl_multi_cleanup(multi);
+		}
+		status = curl_easy_perform(transfer->curl);
+		fetch_finish(transfer->curl, transfer->fetch, status);
+		return;
+	}
+
+	while (!finished) {
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &msgc)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl = msg->easy_handle;
+			status = msg->data.result;
+			if (transfer_done(multi, transfer, curl, status)) {
+				finished = true;
+				break;
+			}
+		}
+		if (finished) {
+			break;
+		}
+
+		if ((transfer->hedge_at != 0) &&
+		    (transfer->hedge_at <= nssync__metrics_now())) {
+			hedge_start(cshare, multi, transfer);
+		}
+
+		curl_multi_wait(multi, NULL, 0,
+				hedge_wait(transfer, SYNC_WAIT, nssync__metrics_now()),
+				NULL);
+	}
+
+	curl_multi_cleanup(multi);
+}
+
+enum nssync_error
+nssync_fetcher_curl(struct nssync_fetcher_fetch *fetch)
+{
+	struct curl_share *cshare = fetch->share;
+	struct curl_transfer *transfer;
+	struct curl_transfer local;
+	struct curl_slist *headers;
+	CURL *curl;
+	CURLcode status;
+	enum nssync_error ret;
+
+	log_debug(LOG_FIELDS(.url = fetch->url), "fetching");
+
+	ret = nssync_fetcher_check(fetch);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	if ((fetch->flags & NSSYNC_FETCHER_FILE) != 0) {
+		/* the response replaces anything an earlier attempt wrote */
+		if ((lseek(fetch->fd, 0, SEEK_SET) != 0) ||
+		    (ftruncate(fetch->fd, 0) != 0)) {
+			log_error(LOG_FIELDS(.url = fetch->url),
+				  "unable to reset response file: %s",
+				  strerror(errno));
+			return NSSYNC_ERROR_FETCH;
+		}
+		fetch->data_used = 0;
+	} else {
+		if (fetch->data == NULL) {
+			fetch->data_size = BUFFER_SIZE;
+			fetch->data = nssync__malloc(fetch->data_size);
+			fetch->data_used = 0;
+		}
+
+		if (fetch->data == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+	}
+
+	headers = fetch_headers(fetch);
+	if ((headers == NULL) && (fetch->unmodified != 0)) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	curl = fetch_setup(fetch, headers);
+	if (curl == NULL) {
+		curl_slist_free_all(headers);
+		return NSSYNC_ERROR_FETCH;
+	}
+
+	/* asynchronous fetches complete from nssync_fetcher_curl_perform */
+	if (((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) && (cshare != NULL)) {
+		transfer = nssync__calloc(1, sizeof(*transfer));
+		if (transfer == NULL) {
+			curl_easy_cleanup(curl);
+			curl_slist_free_all(headers);
+			return NSSYNC_ERROR_NOMEM;
+		}
+		transfer->fetch = fetch;
+		transfer->curl = curl;
+		transfer->headers = headers;
+		transfer->start = nssync__metrics_now();
+		transfer->hedge_at = hedge_time(cshare, transfer);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+
+		if (curl_multi_add_handle(cshare->multi, curl) != CURLM_OK) {
+			curl_easy_cleanup(curl);
+			curl_slist_free_all(headers);
+			nssync__free(transfer);
+			return NSSYNC_ERROR_FETCH;
+		}
+		transfer->next = cshare->transfers;
+		cshare->transfers = transfer;
+		return NSSYNC_ERROR_RETRY;
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.fetch = fetch;
+	local.curl = curl;
+	local.headers = headers;
+	local.start = nssync__metrics_now();
+	local.hedge_at = hedge_time(cshare, &local);
+	if (local.hedge_at != 0) {
+		transfer_perform(cshare, &local);
+	} else {
+		status = curl_easy_perform(curl);
+		fetch_finish(curl, fetch, status);
+	}
+	hedge_sample(cshare, &local);
+	curl_slist_free_all(headers);
 
 	/* call the callback */
 	if (fetch->completion != NULL) {
 		return fetch->completion(fetch);
 	}
 
+	return fetch->result;
+}
+
+/* exported interface documented in fetcher.h */
+enum nssync_error
+nssync_fetcher_curl_perform(void *share, int timeout, unsigned int *active_out)
+{
+	struct curl_share *cshare = share;
+	struct curl_transfer **ptransfer;
+	struct curl_transfer *transfer;
+	struct nssync_fetcher_fetch *fetch;
+	CURLMsg *msg;
+	CURLcode status;
+	CURL *curl;
+	char *private;
+	unsigned int active = 0;
+	uint64_t now;
+	int running;
+	int msgc;
+
+	if (curl_multi_perform(cshare->multi, &running) != CURLM_OK) {
+		return NSSYNC_ERROR_FETCH;
+	}
+
+	/* duplicate slow transfers and wake for the next that will be */
+	now = nssync__metrics_now();
+	for (transfer = cshare->transfers; transfer != NULL; transfer = transfer->next) {
+		if ((transfer->hedge_at != 0) && (transfer->hedge_at <= now)) {
+			hedge_start(cshare, cshare->multi, transfer);
+		}
+		timeout = hedge_wait(transfer, timeout, now);
+	}
+
+	if ((running > 0) && (timeout > 0)) {
+		curl_multi_wait(cshare->multi, NULL, 0, timeout, NULL);
+	}
+	if (curl_multi_perform(cshare->multi, &running) != CURLM_OK) {
+		return NSSYNC_ERROR_FETCH;
+	}
+
+	while ((msg = curl_multi_info_read(cshare->multi, &msgc)) != NULL) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		curl = msg->easy_handle;
+		status = msg->data.result;
+
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, &private);
+		transfer = (struct curl_transfer *)private;
+
+		/* msg is invalid once the handle is removed */
+		if (!transfer_done(cshare->multi, transfer, curl, status)) {
+			continue;
+		}
+
+		for (ptransfer = &cshare->transfers;
+		     *ptransfer != transfer;
+		     ptransfer = &(*ptransfer)->next);
+		*ptransfer = transfer->next;
+
+		fetch = transfer->fetch;
+		hedge_sample(cshare, transfer);
+		curl_slist_free_all(transfer->headers);
+		nssync__free(transfer);
+
+		if (fetch->completion != NULL) {
+			fetch->completion(fetch);
+		}
+	}
+
+	for (transfer = cshare->transfers; transfer != NULL; transfer = transfer->next) {
+		active++;
+	}
+
+	if (active_out != NULL) {
+		*active_out = active;
+	}
+
 	return NSSYNC_ERROR_OK;
 }
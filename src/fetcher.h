@@ -0,0 +1,43 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** create state shared between curl fetches
+ *
+ * The shared state holds the connection pool, DNS cache and TLS
+ *   session cache so fetches from every session using it can reuse
+ *   connections. It is passed to nssync_fetcher_curl in the fetch
+ *   share member.
+ */
+void *nssync_fetcher_curl_share_new(void);
+
+void nssync_fetcher_curl_share_free(void *share);
+
+/** hedge small fetches made with a share
+ *
+ * A node, collection times or single object fetch that has not
+ *   finished after the given percentile of recent such fetches is
+ *   duplicated on a new connection and the first response used.
+ *
+ * @param percentile Latency percentile to hedge after, 0 for never.
+ * @param budget Most hedges per hundred small fetches.
+ */
+void nssync_fetcher_curl_share_hedge(void *share, unsigned int percentile, unsigned int budget);
+
+/** run asynchronous curl fetches
+ *
+ * Fetches made with the NSSYNC_FETCHER_ASYNC flag and a share are
+ *   added to the share and make progress only when this is called,
+ *   their completions are called from here once they finish. The
+ *   share must only be used for asynchronous fetches by one thread.
+ *
+ * @param share The shared state the fetches were made with.
+ * @param timeout Milliseconds to wait for network activity or 0.
+ * @param active_out The number of fetches still in progress.
+ */
+enum nssync_error nssync_fetcher_curl_perform(void *share, int timeout, unsigned int *active_out);
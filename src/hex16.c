@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "alloc.h"
 #include "hex16.h"
 
 uint8_t *hex16_encode(const unsigned char *data,
@@ -27,7 +28,7 @@ uint8_t *hex16_decode(const uint8_t *data,
 	size_t dloop;
 
 	decoded_length = input_length / 2; /* 4 bits per input byte */
-	decoded = malloc(decoded_length);
+	decoded = nssync__malloc(decoded_length);
 
 	if (decoded == NULL) {
 		return NULL;
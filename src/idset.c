@@ -0,0 +1,150 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements a set of record ids kept as a sorted vector
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <nssync/error.h>
+
+#include "alloc.h"
+#include "idset.h"
+
+struct nssync_idset {
+	char **idv; /* sorted ids */
+	size_t idc; /* number of ids in set */
+	size_t ida; /* number of ids allocated */
+};
+
+/** find the index of an id or where it should be inserted */
+static size_t idset_find(struct nssync_idset *idset, const char *id, bool *found_out)
+{
+	size_t lo = 0;
+	size_t hi = idset->idc;
+	size_t mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		cmp = strcmp(idset->idv[mid], id);
+		if (cmp == 0) {
+			*found_out = true;
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*found_out = false;
+	return lo;
+}
+
+/* exported interface documented in idset.h */
+enum nssync_error nssync_idset_new(struct nssync_idset **idset_out)
+{
+	struct nssync_idset *idset;
+
+	idset = nssync__calloc(1, sizeof(*idset));
+	if (idset == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	*idset_out = idset;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in idset.h */
+enum nssync_error nssync_idset_free(struct nssync_idset *idset)
+{
+	size_t ididx;
+
+	for (ididx = 0; ididx < idset->idc; ididx++) {
+		nssync__free(idset->idv[ididx]);
+	}
+	nssync__free(idset->idv);
+	nssync__free(idset);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in idset.h */
+enum nssync_error
+nssync_idset_add(struct nssync_idset *idset, const char *id, bool *added_out)
+{
+	size_t ididx;
+	bool found;
+	char **idv;
+	char *newid;
+
+	ididx = idset_find(idset, id, &found);
+	if (found) {
+		*added_out = false;
+		return NSSYNC_ERROR_OK;
+	}
+
+	if (idset->idc == idset->ida) {
+		idv = nssync__realloc(idset->idv,
+			      ((idset->ida * 2) + 16) * sizeof(*idv));
+		if (idv == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+		idset->idv = idv;
+		idset->ida = (idset->ida * 2) + 16;
+	}
+
+	newid = nssync__strdup(id);
+	if (newid == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	memmove(&idset->idv[ididx + 1],
+		&idset->idv[ididx],
+		(idset->idc - ididx) * sizeof(*idset->idv));
+	idset->idv[ididx] = newid;
+	idset->idc++;
+
+	*added_out = true;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in idset.h */
+bool nssync_idset_remove(struct nssync_idset *idset, const char *id)
+{
+	size_t ididx;
+	bool found;
+
+	ididx = idset_find(idset, id, &found);
+	if (!found) {
+		return false;
+	}
+
+	nssync__free(idset->idv[ididx]);
+	idset->idc--;
+	memmove(&idset->idv[ididx],
+		&idset->idv[ididx + 1],
+		(idset->idc - ididx) * sizeof(*idset->idv));
+
+	return true;
+}
+
+/* exported interface documented in idset.h */
+bool nssync_idset_contains(struct nssync_idset *idset, const char *id)
+{
+	bool found;
+
+	idset_find(idset, id, &found);
+
+	return found;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** set of record ids */
+struct nssync_idset;
+
+enum nssync_error nssync_idset_new(struct nssync_idset **idset_out);
+enum nssync_error nssync_idset_free(struct nssync_idset *idset);
+
+/** add an id to the set
+ *
+ * @param added_out Set to true if the id was not already in the set.
+ */
+enum nssync_error nssync_idset_add(struct nssync_idset *idset, const char *id, bool *added_out);
+
+/** remove an id from the set
+ *
+ * @return true if the id was in the set.
+ */
+bool nssync_idset_remove(struct nssync_idset *idset, const char *id);
+
+/** check if an id is in the set */
+bool nssync_idset_contains(struct nssync_idset *idset, const char *id);
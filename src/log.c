@@ -0,0 +1,116 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements the log sink
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <nssync/error.h>
+#include <nssync/log.h>
+
+#include "log.h"
+
+/* longest message passed to the sink, longer ones are truncated */
+#define LOG_MESSAGE_SIZE 512
+
+static void log_stderr(void *ctx, const struct nssync_log_record *record);
+
+enum nssync_log_level nssync__log_level = NSSYNC_LOG_WARNING;
+
+static nssync_log_sink *log_sink = log_stderr;
+static void *log_ctx;
+
+static const char *log_level_names[] = {
+	"debug", "info", "warning", "error",
+};
+
+/* default sink writing a line to stderr */
+static void log_stderr(void *ctx, const struct nssync_log_record *record)
+{
+	const struct nssync_log_fields *fields = record->fields;
+	char line[LOG_MESSAGE_SIZE * 2];
+	int used;
+
+	used = snprintf(line, sizeof(line), "nssync %s: %s",
+			log_level_names[record->level], record->message);
+
+	if ((fields->account != NULL) && (used < (int)sizeof(line))) {
+		used += snprintf(line + used, sizeof(line) - used,
+				 " account=%s", fields->account);
+	}
+	if ((fields->collection != NULL) && (used < (int)sizeof(line))) {
+		used += snprintf(line + used, sizeof(line) - used,
+				 " collection=%s", fields->collection);
+	}
+	if ((fields->url != NULL) && (used < (int)sizeof(line))) {
+		used += snprintf(line + used, sizeof(line) - used,
+				 " url=%s", fields->url);
+	}
+	if ((fields->error != NSSYNC_ERROR_OK) && (used < (int)sizeof(line))) {
+		used += snprintf(line + used, sizeof(line) - used,
+				 " error=%d", fields->error);
+	}
+
+	/* a single write so lines from different threads do not mix */
+	fprintf(stderr, "%.*s\n", (int)sizeof(line) - 1, line);
+}
+
+/* exported interface documented in nssync/log.h */
+void
+nssync_log_set_sink(nssync_log_sink *sink, void *ctx, enum nssync_log_level level)
+{
+	if (sink == NULL) {
+		log_sink = log_stderr;
+		log_ctx = NULL;
+	} else {
+		log_sink = sink;
+		log_ctx = ctx;
+	}
+	nssync__log_level = level;
+}
+
+/* exported interface documented in log.h */
+void
+nssync__log(enum nssync_log_level level,
+	    const struct nssync_log_fields *fields,
+	    const char *file,
+	    int line,
+	    const char *format, ...)
+{
+	static const struct nssync_log_fields nofields;
+	struct nssync_log_record record;
+	char message[LOG_MESSAGE_SIZE];
+	va_list ap;
+	int length;
+
+	va_start(ap, format);
+	length = vsnprintf(message, sizeof(message), format, ap);
+	va_end(ap);
+
+	if (length < 0) {
+		return;
+	}
+	if (length >= (int)sizeof(message)) {
+		length = sizeof(message) - 1;
+	}
+
+	/* messages are lines to the sink */
+	while ((length > 0) && (message[length - 1] == '\n')) {
+		message[--length] = 0;
+	}
+
+	record.level = level;
+	record.message = message;
+	record.fields = (fields != NULL) ? fields : &nofields;
+	record.file = file;
+	record.line = line;
+
+	log_sink(log_ctx, &record);
+}
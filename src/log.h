@@ -0,0 +1,66 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** library logging
+ *
+ * Each level has a macro taking the fields the message concerns, or
+ *   NULL, then a format and its arguments:
+ *
+ *   log_warning(LOG_FIELDS(.url = url, .error = ret), "fetch failed");
+ *
+ * Levels below NSSYNC_LOG_COMPILE_LEVEL compile to nothing and levels
+ *   below the runtime level cost a comparison, the message is only
+ *   formatted when it will be sent to the sink.
+ */
+
+#include <nssync/log.h>
+
+#ifndef NSSYNC_LOG_COMPILE_LEVEL
+#define NSSYNC_LOG_COMPILE_LEVEL 0
+#endif
+
+/** lowest level sent to the sink */
+extern enum nssync_log_level nssync__log_level;
+
+/** format and send a message to the sink */
+void nssync__log(enum nssync_log_level level, const struct nssync_log_fields *fields, const char *file, int line, const char *format, ...);
+
+/** fields for a log message */
+#define LOG_FIELDS(...) (&(const struct nssync_log_fields){ __VA_ARGS__ })
+
+#define NSSYNC__LOG(level, fields, ...) do {				\
+		if ((level) >= nssync__log_level) {			\
+			nssync__log((level), (fields),			\
+				    __FILE__, __LINE__, __VA_ARGS__);	\
+		}							\
+	} while (0)
+
+#if NSSYNC_LOG_COMPILE_LEVEL <= 0
+#define log_debug(fields, ...) NSSYNC__LOG(NSSYNC_LOG_DEBUG, fields, __VA_ARGS__)
+#else
+#define log_debug(fields, ...) do { } while (0)
+#endif
+
+#if NSSYNC_LOG_COMPILE_LEVEL <= 1
+#define log_info(fields, ...) NSSYNC__LOG(NSSYNC_LOG_INFO, fields, __VA_ARGS__)
+#else
+#define log_info(fields, ...) do { } while (0)
+#endif
+
+#if NSSYNC_LOG_COMPILE_LEVEL <= 2
+#define log_warning(fields, ...) NSSYNC__LOG(NSSYNC_LOG_WARNING, fields, __VA_ARGS__)
+#else
+#define log_warning(fields, ...) do { } while (0)
+#endif
+
+#if NSSYNC_LOG_COMPILE_LEVEL <= 3
+#define log_error(fields, ...) NSSYNC__LOG(NSSYNC_LOG_ERROR, fields, __VA_ARGS__)
+#else
+#define log_error(fields, ...) do { } while (0)
+#endif
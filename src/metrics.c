@@ -0,0 +1,467 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements per thread metrics aggregated on read
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+#include <nssync/metrics.h>
+
+#include "alloc.h"
+#include "metrics.h"
+
+/* sub buckets within each power of two, giving 1/8th resolution */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* values of 2^HIST_MAX_EXP ns (39 hours) and above share a bucket */
+#define HIST_MAX_EXP 47
+
+#define HIST_BUCKETS ((HIST_MAX_EXP - 1) * HIST_SUB)
+
+/* each shard has one writer so plain loads and stores suffice, the
+ * atomics only stop a reader seeing torn values.
+ */
+#if defined(__GNUC__)
+#define METRIC_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define METRIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define METRIC_LOAD(p) (*(p))
+#define METRIC_STORE(p, v) (*(p) = (v))
+#endif
+
+#define METRIC_ADD(p, v) METRIC_STORE((p), METRIC_LOAD(p) + (v))
+
+struct metrics_histogram {
+	uint64_t count;
+	uint64_t sum; /* total of values recorded */
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/* metrics of one thread */
+struct metrics_shard {
+	struct metrics_shard *next;
+	bool in_use; /* owned by a running thread */
+	uint64_t counters[NSSYNC_METRIC_COUNTER_COUNT];
+	struct metrics_histogram histograms[NSSYNC_METRIC_HISTOGRAM_COUNT];
+};
+
+/* snapshot */
+struct nssync_metrics {
+	uint64_t counters[NSSYNC_METRIC_COUNTER_COUNT];
+	struct metrics_histogram histograms[NSSYNC_METRIC_HISTOGRAM_COUNT];
+};
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key; /* shard of each thread */
+
+/* every shard ever created, shards of exited threads are reused so
+ * their counts are kept.
+ */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *metrics_shards;
+
+static void metrics_shard_release(void *arg)
+{
+	struct metrics_shard *shard = arg;
+
+	pthread_mutex_lock(&metrics_lock);
+	shard->in_use = false;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void metrics_key_create(void)
+{
+	pthread_key_create(&metrics_key, metrics_shard_release);
+}
+
+/** get the calling threads shard
+ *
+ * Shards come from the C library rather than the library allocator
+ *   as they outlive any context and allocations are counted here.
+ */
+static struct metrics_shard *metrics_shard(void)
+{
+	struct metrics_shard *shard;
+
+	pthread_once(&metrics_once, metrics_key_create);
+
+	shard = pthread_getspecific(metrics_key);
+	if (shard != NULL) {
+		return shard;
+	}
+
+	pthread_mutex_lock(&metrics_lock);
+	for (shard = metrics_shards; shard != NULL; shard = shard->next) {
+		if (!shard->in_use) {
+			break;
+		}
+	}
+	if (shard == NULL) {
+		shard = calloc(1, sizeof(*shard));
+		if (shard != NULL) {
+			shard->next = metrics_shards;
+			metrics_shards = shard;
+		}
+	}
+	if (shard != NULL) {
+		shard->in_use = true;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	if (shard != NULL) {
+		pthread_setspecific(metrics_key, shard);
+	}
+
+	return shard;
+}
+
+static int metrics_msb(uint64_t value)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(value);
+#else
+	int msb = 0;
+
+	while (value >>= 1) {
+		msb++;
+	}
+	return msb;
+#endif
+}
+
+/** bucket a value is counted in */
+static int histogram_bucket(uint64_t value)
+{
+	int exp;
+
+	if (value < HIST_SUB) {
+		return value;
+	}
+
+	exp = metrics_msb(value);
+	if (exp > HIST_MAX_EXP) {
+		return HIST_BUCKETS - 1;
+	}
+
+	return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/** highest value counted in a bucket */
+static uint64_t histogram_bucket_limit(int bucket)
+{
+	int exp;
+	uint64_t sub;
+
+	if (bucket < HIST_SUB) {
+		return bucket;
+	}
+
+	exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = bucket & (HIST_SUB - 1);
+
+	return ((HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+/* exported interface documented in metrics.h */
+void nssync__metrics_add(enum nssync_metric_counter counter, uint64_t value)
+{
+	struct metrics_shard *shard = metrics_shard();
+
+	if (shard != NULL) {
+		METRIC_ADD(&shard->counters[counter], value);
+	}
+}
+
+/* exported interface documented in metrics.h */
+uint64_t nssync__metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* exported interface documented in metrics.h */
+void
+nssync__metrics_since(enum nssync_metric_histogram histogram, uint64_t start)
+{
+	nssync__metrics_record(histogram, nssync__metrics_now() - start);
+}
+
+/* exported interface documented in metrics.h */
+void
+nssync__metrics_record(enum nssync_metric_histogram histogram, uint64_t value)
+{
+	struct metrics_shard *shard = metrics_shard();
+	struct metrics_histogram *hist;
+
+	if (shard == NULL) {
+		return;
+	}
+	hist = &shard->histograms[histogram];
+
+	METRIC_ADD(&hist->buckets[histogram_bucket(value)], 1);
+	METRIC_ADD(&hist->sum, value);
+	METRIC_ADD(&hist->count, 1);
+}
+
+/* exported interface documented in nssync/metrics.h */
+enum nssync_error nssync_metrics_snapshot(struct nssync_metrics **metrics_out)
+{
+	struct nssync_metrics *metrics;
+	struct metrics_shard *shard;
+	struct metrics_histogram *hist;
+	int idx;
+	int hidx;
+	int bucket;
+
+	metrics = nssync__calloc(1, sizeof(*metrics));
+	if (metrics == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	pthread_mutex_lock(&metrics_lock);
+	for (shard = metrics_shards; shard != NULL; shard = shard->next) {
+		for (idx = 0; idx < NSSYNC_METRIC_COUNTER_COUNT; idx++) {
+			metrics->counters[idx] += METRIC_LOAD(&shard->counters[idx]);
+		}
+
+		for (hidx = 0; hidx < NSSYNC_METRIC_HISTOGRAM_COUNT; hidx++) {
+			hist = &shard->histograms[hidx];
+			metrics->histograms[hidx].count += METRIC_LOAD(&hist->count);
+			metrics->histograms[hidx].sum += METRIC_LOAD(&hist->sum);
+			for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+				metrics->histograms[hidx].buckets[bucket] +=
+					METRIC_LOAD(&hist->buckets[bucket]);
+			}
+		}
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	*metrics_out = metrics;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/metrics.h */
+void nssync_metrics_free(struct nssync_metrics *metrics)
+{
+	nssync__free(metrics);
+}
+
+/* exported interface documented in nssync/metrics.h */
+uint64_t
+nssync_metrics_counter(const struct nssync_metrics *metrics,
+		       enum nssync_metric_counter counter)
+{
+	return metrics->counters[counter];
+}
+
+/* exported interface documented in nssync/metrics.h */
+uint64_t
+nssync_metrics_histogram_count(const struct nssync_metrics *metrics,
+			       enum nssync_metric_histogram histogram)
+{
+	return metrics->histograms[histogram].count;
+}
+
+/* exported interface documented in nssync/metrics.h */
+uint64_t
+nssync_metrics_quantile(const struct nssync_metrics *metrics,
+			enum nssync_metric_histogram histogram,
+			double quantile)
+{
+	const struct metrics_histogram *hist = &metrics->histograms[histogram];
+	uint64_t target;
+	uint64_t seen = 0;
+	int bucket;
+
+	if (hist->count == 0) {
+		return 0;
+	}
+
+	if (quantile <= 0) {
+		target = 1;
+	} else if (quantile >= 1) {
+		target = hist->count;
+	} else {
+		target = (quantile * hist->count) + 0.5;
+		if (target == 0) {
+			target = 1;
+		}
+	}
+
+	/* a snapshot may be taken between a bucket and the count
+	 * being incremented so the buckets can hold fewer values.
+	 */
+	for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= target) {
+			return histogram_bucket_limit(bucket);
+		}
+	}
+
+	return histogram_bucket_limit(HIST_BUCKETS - 1);
+}
+
+/* text being formatted */
+struct prometheus_text {
+	char *buf;
+	size_t size;
+	size_t used; /* length of text even when beyond size */
+};
+
+static void prometheus_printf(struct prometheus_text *text, const char *format, ...)
+{
+	va_list ap;
+	int length;
+
+	va_start(ap, format);
+	if (text->used < text->size) {
+		length = vsnprintf(text->buf + text->used,
+				   text->size - text->used, format, ap);
+	} else {
+		length = vsnprintf(NULL, 0, format, ap);
+	}
+	va_end(ap);
+
+	if (length > 0) {
+		text->used += length;
+	}
+}
+
+/* prometheus counter names in nssync_metric_counter order */
+static const struct {
+	const char *name;
+	const char *labels;
+	const char *help;
+} prometheus_counters[NSSYNC_METRIC_COUNTER_COUNT] = {
+	{ "nssync_requests_total", "endpoint=\"node\"", "Requests made by endpoint." },
+	{ "nssync_requests_total", "endpoint=\"info\"", NULL },
+	{ "nssync_requests_total", "endpoint=\"object\"", NULL },
+	{ "nssync_requests_total", "endpoint=\"collection\"", NULL },
+	{ "nssync_downloaded_bytes_total", NULL, "Response body bytes received." },
+	{ "nssync_records_fetched_total", NULL, "Records received." },
+	{ "nssync_records_decrypted_total", NULL, "Records decrypted." },
+	{ "nssync_hmac_failures_total", NULL, "Records failing HMAC verification." },
+	{ "nssync_node_cache_total", "result=\"hit\"", "Node assignment cache lookups by result." },
+	{ "nssync_node_cache_total", "result=\"miss\"", NULL },
+	{ "nssync_allocations_total", NULL, "Library allocations." },
+	{ "nssync_connections_total", NULL, "New connections made." },
+	{ "nssync_coalesced_requests_total", NULL, "Fetches served by an identical request in flight." },
+	{ "nssync_retries_total", NULL, "Fetches retried after a transient failure." },
+	{ "nssync_hedged_requests_total", "result=\"won\"", "Duplicates sent for slow small fetches by which answered first." },
+	{ "nssync_hedged_requests_total", "result=\"lost\"", NULL },
+};
+
+/* prometheus histogram names in nssync_metric_histogram order */
+static const struct {
+	const char *name;
+	const char *help;
+} prometheus_histograms[NSSYNC_METRIC_HISTOGRAM_COUNT] = {
+	{ "nssync_fetch_duration_seconds", "Time from request to response." },
+	{ "nssync_parse_duration_seconds", "Time parsing responses." },
+	{ "nssync_decrypt_duration_seconds", "Time verifying and decrypting records." },
+	{ "nssync_server_duration_seconds", "Time from request sent to first response byte." },
+	{ "nssync_queue_duration_seconds", "Time fetches waited to be scheduled." },
+};
+
+/* exported bucket boundaries in nanoseconds */
+static const uint64_t prometheus_bounds[] = {
+	10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000ULL,
+};
+
+/* exported interface documented in nssync/metrics.h */
+enum nssync_error
+nssync_metrics_prometheus(const struct nssync_metrics *metrics,
+			  char *buf,
+			  size_t size,
+			  size_t *length_out)
+{
+	struct prometheus_text text = { buf, size, 0 };
+	const struct metrics_histogram *hist;
+	uint64_t cumulative;
+	unsigned int bound;
+	int bucket;
+	int idx;
+
+	for (idx = 0; idx < NSSYNC_METRIC_COUNTER_COUNT; idx++) {
+		if (prometheus_counters[idx].help != NULL) {
+			prometheus_printf(&text, "# HELP %s %s\n# TYPE %s counter\n",
+					  prometheus_counters[idx].name,
+					  prometheus_counters[idx].help,
+					  prometheus_counters[idx].name);
+		}
+		if (prometheus_counters[idx].labels != NULL) {
+			prometheus_printf(&text, "%s{%s} %llu\n",
+					  prometheus_counters[idx].name,
+					  prometheus_counters[idx].labels,
+					  (unsigned long long)metrics->counters[idx]);
+		} else {
+			prometheus_printf(&text, "%s %llu\n",
+					  prometheus_counters[idx].name,
+					  (unsigned long long)metrics->counters[idx]);
+		}
+	}
+
+	for (idx = 0; idx < NSSYNC_METRIC_HISTOGRAM_COUNT; idx++) {
+		hist = &metrics->histograms[idx];
+
+		prometheus_printf(&text, "# HELP %s %s\n# TYPE %s histogram\n",
+				  prometheus_histograms[idx].name,
+				  prometheus_histograms[idx].help,
+				  prometheus_histograms[idx].name);
+
+		/* a bucket is exported within the first bound it fits */
+		cumulative = 0;
+		bucket = 0;
+		for (bound = 0;
+		     bound < sizeof(prometheus_bounds) / sizeof(prometheus_bounds[0]);
+		     bound++) {
+			while ((bucket < HIST_BUCKETS) &&
+			       (histogram_bucket_limit(bucket) < prometheus_bounds[bound])) {
+				cumulative += hist->buckets[bucket];
+				bucket++;
+			}
+			prometheus_printf(&text, "%s_bucket{le=\"%g\"} %llu\n",
+					  prometheus_histograms[idx].name,
+					  prometheus_bounds[bound] / 1e9,
+					  (unsigned long long)cumulative);
+		}
+		prometheus_printf(&text, "%s_bucket{le=\"+Inf\"} %llu\n",
+				  prometheus_histograms[idx].name,
+				  (unsigned long long)hist->count);
+		prometheus_printf(&text, "%s_sum %.9f\n",
+				  prometheus_histograms[idx].name,
+				  hist->sum / 1e9);
+		prometheus_printf(&text, "%s_count %llu\n",
+				  prometheus_histograms[idx].name,
+				  (unsigned long long)hist->count);
+	}
+
+	if (length_out != NULL) {
+		*length_out = text.used;
+	}
+
+	if (text.used >= size) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+#include <nssync/metrics.h>
+
+/** add to a counter of the calling thread */
+void nssync__metrics_add(enum nssync_metric_counter counter, uint64_t value);
+
+/** monotonic time in nanoseconds to measure latency from */
+uint64_t nssync__metrics_now(void);
+
+/** record a value in a histogram of the calling thread */
+void nssync__metrics_record(enum nssync_metric_histogram histogram, uint64_t value);
+
+/** record the time since start in a histogram of the calling thread */
+void nssync__metrics_since(enum nssync_metric_histogram histogram, uint64_t start);
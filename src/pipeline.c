@@ -0,0 +1,528 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements the staged fetch, decrypt and delivery of collections
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <nssync/nssync.h>
+
+#include "alloc.h"
+#include "arena.h"
+#include "log.h"
+#include "crypto.h"
+#include "registration.h"
+#include "storage.h"
+#include "workqueue.h"
+#include "pipeline.h"
+#include "trace.h"
+
+/* records requested in each page */
+#define PIPELINE_PAGE_RECORDS 100
+
+/* pages in flight, one per stage and one queued */
+#define PIPELINE_DEPTH 4
+
+/* size of the blocks page allocations are made from */
+#define PIPELINE_ARENA_BLOCKSIZE (64 * 1024)
+
+enum pipeline_slot_state {
+	SLOT_FREE = 0, /* waiting to be fetched into */
+	SLOT_FETCHED, /* parsed and waiting for decryption */
+	SLOT_DECRYPTED, /* waiting for delivery */
+};
+
+struct pipeline_slot {
+	struct nssync_pipeline_page page;
+	enum pipeline_slot_state state;
+};
+
+struct pipeline {
+	struct nssync_storage *store;
+	struct nssync_workqueue *workqueue;
+	int collection;
+	struct nssync_storage_collection_ref ref; /* for the fetch stage */
+	struct nssync_storage_checkpoint *checkpoint; /* progress, updated on delivery */
+	double from; /* newer time pages are fetched with */
+	double unmodified; /* collection time pages are conditional on */
+	int offset; /* records before the first page */
+	struct nssync_crypto_keybundle *keybundle;
+	const struct nssync_allocator *allocator; /* allocator of the caller */
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed; /* signalled when any slot changes state */
+	bool stop; /* a stage failed or delivery gave up */
+	enum nssync_error ret; /* error of the failed stage */
+	int pagec; /* pages in the collection or 0 until the last is fetched */
+
+	/* page sequence numbers map to slots round robin */
+	struct pipeline_slot slotv[PIPELINE_DEPTH];
+};
+
+/** fetch and parse a page of the collection */
+static enum nssync_error
+pipeline_fetch(struct pipeline *pl, struct nssync_pipeline_page *page, int seq)
+{
+	nssync_arena_reset(page->arena);
+	page->objv = NULL;
+	page->objc = 0;
+
+	return nssync_storage_collection_fetch_async(pl->store,
+						     page->arena,
+						     &pl->ref,
+						     pl->from,
+						     pl->unmodified,
+						     pl->offset + (seq * PIPELINE_PAGE_RECORDS),
+						     PIPELINE_PAGE_RECORDS,
+						     &page->objv,
+						     &page->objc);
+}
+
+/* record decryption job run on the crypto workers */
+struct decrypt_job {
+	struct nssync_storage_obj *obj; /* object to decrypt */
+	struct nssync_crypto_keybundle *keybundle; /* key to decrypt with */
+	struct nssync_pipeline_record *record; /* record to decrypt into */
+	size_t record_size; /* size of record buffer */
+};
+
+static void decrypt_job(void *arg)
+{
+	struct decrypt_job *job = arg;
+	const char *payload;
+	size_t payload_length;
+
+	payload = nssync_storage_obj_payload(job->obj, &payload_length);
+
+	job->record->ret = nssync_crypto_decrypt_record_buf(payload,
+							    payload_length,
+							    job->keybundle,
+							    job->record->record,
+							    job->record_size,
+							    &job->record->record_length);
+}
+
+/** verify and decrypt a page on the shared workers
+ *
+ * The jobs and record buffers are allocated from the page arena
+ *   before the workers start as the arena is not thread safe.
+ */
+static enum nssync_error
+pipeline_decrypt(struct pipeline *pl, struct nssync_pipeline_page *page)
+{
+	struct decrypt_job *jobv;
+	size_t payload_length;
+	int objidx;
+
+	page->recordv = nssync_arena_calloc(page->arena,
+					    page->objc + 1,
+					    sizeof(*page->recordv));
+	jobv = nssync_arena_calloc(page->arena, page->objc + 1, sizeof(*jobv));
+	if ((page->recordv == NULL) || (jobv == NULL)) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	for (objidx = 0; objidx < page->objc; objidx++) {
+		nssync_storage_obj_payload(&page->objv[objidx], &payload_length);
+
+		jobv[objidx].obj = &page->objv[objidx];
+		jobv[objidx].keybundle = pl->keybundle;
+		jobv[objidx].record = &page->recordv[objidx];
+		jobv[objidx].record_size = nssync_crypto_decrypt_record_size(payload_length);
+		page->recordv[objidx].record = nssync_arena_alloc(page->arena,
+						jobv[objidx].record_size);
+		if (page->recordv[objidx].record == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+	}
+
+	return nssync_workqueue_run(pl->workqueue,
+				    decrypt_job, jobv, sizeof(*jobv),
+				    page->objc);
+}
+
+/** decide where a run starts from its checkpoint
+ *
+ * A checkpoint of a download with another newer time is of no use.
+ *   Otherwise the download continues after the delivered records, or
+ *   after the high water mark when the collection changed since and
+ *   the offsets have moved.
+ */
+static void pipeline_resume(struct pipeline *pl, double newer)
+{
+	struct nssync_storage_checkpoint *checkpoint = pl->checkpoint;
+	double modified;
+
+	modified = nssync_storage_collection_modified(pl->store, pl->collection);
+
+	if ((!checkpoint->active) || (checkpoint->newer != newer)) {
+		/* one may have been saved by an earlier process */
+		checkpoint->active = false;
+		nssync_storage_checkpoint_load(pl->store, pl->collection,
+					       newer, checkpoint);
+	}
+
+	if (!checkpoint->active) {
+		checkpoint->newer = newer;
+		checkpoint->from = newer;
+		checkpoint->unmodified = modified;
+		checkpoint->offset = 0;
+		checkpoint->high_water = newer;
+	} else if (checkpoint->unmodified != modified) {
+		checkpoint->from = checkpoint->high_water;
+		checkpoint->unmodified = modified;
+		checkpoint->offset = 0;
+		log_info(LOG_FIELDS(.collection = nssync_storage_collection_name(pl->store, pl->collection)),
+			 "collection changed, resuming after %.2f",
+			 checkpoint->from);
+	} else {
+		log_info(LOG_FIELDS(.collection = nssync_storage_collection_name(pl->store, pl->collection)),
+			 "resuming after %d records", checkpoint->offset);
+	}
+
+	pl->from = checkpoint->from;
+	pl->unmodified = checkpoint->unmodified;
+	pl->offset = checkpoint->offset;
+}
+
+/** record a delivered page in the checkpoint
+ *
+ * Records sharing the time of the last in the page may continue on
+ *   the next page so only older ones raise the high water mark.
+ */
+static void
+pipeline_checkpoint(struct pipeline *pl, struct nssync_pipeline_page *page)
+{
+	struct nssync_storage_checkpoint *checkpoint = pl->checkpoint;
+	double modified;
+	double last;
+	int objidx;
+
+	if (page->objc == 0) {
+		return;
+	}
+
+	last = nssync_storage_obj_modified(&page->objv[page->objc - 1]);
+	for (objidx = 0; objidx < page->objc; objidx++) {
+		modified = nssync_storage_obj_modified(&page->objv[objidx]);
+		if ((modified < last) && (modified > checkpoint->high_water)) {
+			checkpoint->high_water = modified;
+		}
+	}
+	checkpoint->offset += page->objc;
+	checkpoint->active = true;
+
+	nssync_storage_checkpoint_save(pl->store, pl->collection, checkpoint);
+}
+
+/** stop the pipeline, must be called with the lock held */
+static void pipeline_fail(struct pipeline *pl, enum nssync_error ret)
+{
+	if (!pl->stop) {
+		pl->stop = true;
+		pl->ret = ret;
+	}
+	pthread_cond_broadcast(&pl->changed);
+}
+
+/** wait for a slot to reach a state
+ *
+ * Must be called with the lock held.
+ *
+ * @return false if the pipeline stopped instead.
+ */
+static bool
+pipeline_wait(struct pipeline *pl,
+	      struct pipeline_slot *slot,
+	      enum pipeline_slot_state state)
+{
+	while ((!pl->stop) && (slot->state != state)) {
+		pthread_cond_wait(&pl->changed, &pl->lock);
+	}
+	return !pl->stop;
+}
+
+/** move a slot on to the next stage, must be called with the lock held
+ *
+ * @return true if the slot holds the last page of the collection.
+ */
+static bool
+pipeline_advance(struct pipeline *pl,
+		 struct pipeline_slot *slot,
+		 enum pipeline_slot_state state,
+		 int seq)
+{
+	slot->state = state;
+	pthread_cond_broadcast(&pl->changed);
+
+	return (pl->pagec == seq + 1);
+}
+
+static void *pipeline_fetch_stage(void *arg)
+{
+	struct pipeline *pl = arg;
+	const struct nssync_allocator *prev;
+	struct pipeline_slot *slot;
+	enum nssync_error ret;
+	bool last = false;
+	int seq;
+
+	prev = nssync__alloc_enter(pl->allocator);
+
+	for (seq = 0; !last; seq++) {
+		slot = &pl->slotv[seq % PIPELINE_DEPTH];
+
+		pthread_mutex_lock(&pl->lock);
+		if (!pipeline_wait(pl, slot, SLOT_FREE)) {
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pl->lock);
+
+		ret = pipeline_fetch(pl, &slot->page, seq);
+
+		pthread_mutex_lock(&pl->lock);
+		if (ret != NSSYNC_ERROR_OK) {
+			pipeline_fail(pl, ret);
+			last = true;
+		} else {
+			/* a short page is the end of the collection */
+			if (slot->page.objc < PIPELINE_PAGE_RECORDS) {
+				pl->pagec = seq + 1;
+			}
+			last = pipeline_advance(pl, slot, SLOT_FETCHED, seq);
+		}
+		pthread_mutex_unlock(&pl->lock);
+	}
+
+	nssync__alloc_leave(prev);
+
+	return NULL;
+}
+
+static void *pipeline_decrypt_stage(void *arg)
+{
+	struct pipeline *pl = arg;
+	const struct nssync_allocator *prev;
+	struct pipeline_slot *slot;
+	enum nssync_error ret;
+	bool last = false;
+	int seq;
+
+	prev = nssync__alloc_enter(pl->allocator);
+
+	for (seq = 0; !last; seq++) {
+		slot = &pl->slotv[seq % PIPELINE_DEPTH];
+
+		pthread_mutex_lock(&pl->lock);
+		if (!pipeline_wait(pl, slot, SLOT_FETCHED)) {
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pl->lock);
+
+		ret = pipeline_decrypt(pl, &slot->page);
+
+		pthread_mutex_lock(&pl->lock);
+		if (ret != NSSYNC_ERROR_OK) {
+			pipeline_fail(pl, ret);
+			last = true;
+		} else {
+			last = pipeline_advance(pl, slot, SLOT_DECRYPTED, seq);
+		}
+		pthread_mutex_unlock(&pl->lock);
+	}
+
+	nssync__alloc_leave(prev);
+
+	return NULL;
+}
+
+/** deliver pages as the stage threads make them ready */
+static enum nssync_error
+pipeline_deliver_stage(struct pipeline *pl,
+		       nssync_pipeline_deliver *deliver,
+		       void *ctx)
+{
+	struct pipeline_slot *slot;
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+	bool last = false;
+	int seq;
+
+	for (seq = 0; !last; seq++) {
+		slot = &pl->slotv[seq % PIPELINE_DEPTH];
+
+		pthread_mutex_lock(&pl->lock);
+		if (!pipeline_wait(pl, slot, SLOT_DECRYPTED)) {
+			ret = pl->ret;
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pl->lock);
+
+		TRACE_BEGIN(span);
+		ret = deliver(ctx, &slot->page);
+		TRACE_END(span, "sync", "deliver", NULL);
+		if (ret == NSSYNC_ERROR_OK) {
+			pipeline_checkpoint(pl, &slot->page);
+		}
+
+		pthread_mutex_lock(&pl->lock);
+		if (ret != NSSYNC_ERROR_OK) {
+			pipeline_fail(pl, ret);
+			last = true;
+		} else {
+			last = pipeline_advance(pl, slot, SLOT_FREE, seq);
+		}
+		pthread_mutex_unlock(&pl->lock);
+	}
+
+	return ret;
+}
+
+/** run every stage of each page in turn on the calling thread */
+static enum nssync_error
+pipeline_run_serial(struct pipeline *pl,
+		    nssync_pipeline_deliver *deliver,
+		    void *ctx)
+{
+	struct nssync_pipeline_page *page = &pl->slotv[0].page;
+	enum nssync_error ret;
+	int seq;
+
+	for (seq = 0; ; seq++) {
+		ret = pipeline_fetch(pl, page, seq);
+		if (ret != NSSYNC_ERROR_OK) {
+			break;
+		}
+
+		ret = pipeline_decrypt(pl, page);
+		if (ret != NSSYNC_ERROR_OK) {
+			break;
+		}
+
+		TRACE_BEGIN(span);
+		ret = deliver(ctx, page);
+		TRACE_END(span, "sync", "deliver", NULL);
+		if (ret != NSSYNC_ERROR_OK) {
+			break;
+		}
+		pipeline_checkpoint(pl, page);
+		if (page->objc < PIPELINE_PAGE_RECORDS) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/** run the fetch and decrypt stages on threads of their own */
+static enum nssync_error
+pipeline_run_threaded(struct pipeline *pl,
+		      nssync_pipeline_deliver *deliver,
+		      void *ctx)
+{
+	pthread_t fetch_thread;
+	pthread_t decrypt_thread;
+	enum nssync_error ret;
+
+	if (pthread_create(&fetch_thread, NULL, pipeline_fetch_stage, pl) != 0) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	if (pthread_create(&decrypt_thread, NULL, pipeline_decrypt_stage, pl) != 0) {
+		pthread_mutex_lock(&pl->lock);
+		pipeline_fail(pl, NSSYNC_ERROR_NOMEM);
+		pthread_mutex_unlock(&pl->lock);
+		pthread_join(fetch_thread, NULL);
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	ret = pipeline_deliver_stage(pl, deliver, ctx);
+
+	/* release stages still waiting on pages that will not come */
+	pthread_mutex_lock(&pl->lock);
+	pipeline_fail(pl, ret);
+	pthread_mutex_unlock(&pl->lock);
+
+	pthread_join(fetch_thread, NULL);
+	pthread_join(decrypt_thread, NULL);
+
+	return ret;
+}
+
+/* exported interface documented in pipeline.h */
+enum nssync_error
+nssync_pipeline_run(struct nssync_storage *store,
+		    struct nssync_workqueue *workqueue,
+		    int collection,
+		    double newer,
+		    struct nssync_storage_checkpoint *checkpoint,
+		    struct nssync_crypto_keybundle *keybundle,
+		    nssync_pipeline_deliver *deliver,
+		    void *ctx)
+{
+	struct pipeline pl = {
+		.store = store,
+		.workqueue = workqueue,
+		.collection = collection,
+		.checkpoint = checkpoint,
+		.keybundle = keybundle,
+		.allocator = nssync__alloc_current(),
+	};
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+	int slotidx;
+
+	pipeline_resume(&pl, newer);
+
+	/* the deliver callback may intern collections moving this one */
+	ret = nssync_storage_collection_ref_init(store, collection, &pl.ref);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	for (slotidx = 0; slotidx < PIPELINE_DEPTH; slotidx++) {
+		ret = nssync_arena_new(PIPELINE_ARENA_BLOCKSIZE,
+				       &pl.slotv[slotidx].page.arena);
+		if (ret != NSSYNC_ERROR_OK) {
+			break;
+		}
+	}
+
+	if (ret == NSSYNC_ERROR_OK) {
+		if (nssync_workqueue_get_threadc(workqueue) == 0) {
+			ret = pipeline_run_serial(&pl, deliver, ctx);
+		} else {
+			pthread_mutex_init(&pl.lock, NULL);
+			pthread_cond_init(&pl.changed, NULL);
+
+			ret = pipeline_run_threaded(&pl, deliver, ctx);
+
+			pthread_cond_destroy(&pl.changed);
+			pthread_mutex_destroy(&pl.lock);
+		}
+	}
+
+	for (slotidx = 0; slotidx < PIPELINE_DEPTH; slotidx++) {
+		if (pl.slotv[slotidx].page.arena != NULL) {
+			nssync_arena_free(pl.slotv[slotidx].page.arena);
+		}
+	}
+	nssync_storage_collection_ref_fini(&pl.ref);
+
+	/* a finished download has nothing to resume */
+	if ((ret == NSSYNC_ERROR_OK) && checkpoint->active) {
+		checkpoint->active = false;
+		nssync_storage_checkpoint_save(store, collection, checkpoint);
+	}
+
+	return ret;
+}
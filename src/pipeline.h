@@ -0,0 +1,66 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** collection sync pipeline
+ *
+ * A collection is fetched a page of records at a time. Each page is
+ *   fetched and parsed, then verified and decrypted on the shared
+ *   workers and finally delivered in order on the calling thread. The
+ *   stages run concurrently on different pages so a sync is limited
+ *   by its slowest stage. Only a few pages are in flight at once which
+ *   keeps memory use flat however large the collection is.
+ *
+ * Progress is checkpointed as each page is delivered, so a run that
+ *   fails part way is continued by the next run with the same newer
+ *   time rather than fetching every page again. Pages are conditional
+ *   on the collection time the download started at, a collection that
+ *   changed since continues from the newest record delivered.
+ */
+
+struct nssync_storage;
+struct nssync_storage_obj;
+struct nssync_workqueue;
+struct nssync_crypto_keybundle;
+struct nssync_arena;
+struct nssync_storage_checkpoint;
+
+/** a decrypted record of a page */
+struct nssync_pipeline_record {
+	uint8_t *record; /* decrypted record */
+	size_t record_length;
+	enum nssync_error ret; /* result of verification and decryption */
+};
+
+/** a page of records being delivered */
+struct nssync_pipeline_page {
+	struct nssync_arena *arena; /* released when the page is reused */
+	struct nssync_storage_obj *objv; /* objects of the page */
+	struct nssync_pipeline_record *recordv; /* record of each object */
+	int objc;
+};
+
+/** deliver a page of records, called in collection order
+ *
+ * The page and everything allocated from its arena is only valid for
+ *   the duration of the call.
+ */
+typedef enum nssync_error (nssync_pipeline_deliver)(void *ctx, struct nssync_pipeline_page *page);
+
+/** sync a collection through the pipeline
+ *
+ * When the workqueue has threads the fetch and decrypt stages run on
+ *   threads of their own while the store is used, otherwise every
+ *   stage runs in turn on the calling thread. Either way deliver is
+ *   only called on the calling thread.
+ *
+ * @param newer Only fetch objects modified after this time unless 0.
+ * @param checkpoint Progress of the download kept between runs, it is
+ *   saved to the cache directory too if there is one.
+ */
+enum nssync_error nssync_pipeline_run(struct nssync_storage *store, struct nssync_workqueue *workqueue, int collection, double newer, struct nssync_storage_checkpoint *checkpoint, struct nssync_crypto_keybundle *keybundle, nssync_pipeline_deliver *deliver, void *ctx);
@@ -14,20 +14,38 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <openssl/sha.h>
 
 #include <nssync/error.h>
 #include <nssync/fetcher.h>
+#include <nssync/context.h>
 
+#include "alloc.h"
 #include "util.h"
+#include "context.h"
 #include "base32.h"
 #include "registration.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define WEAVE_PATH "%suser/1.0/%s/node/weave"
 
+/* node assignment cache file within the cache directory */
+#define NODE_CACHE_FILE "%s/nodes"
+
+/* how long a cached node assignment remains valid in seconds */
+#define NODE_CACHE_TTL (24 * 60 * 60)
+
+/* longest node assignment cache line */
+#define NODE_CACHE_LINE 2048
+
 struct nssync_registration {
-	nssync_fetcher *fetcher;
+	struct nssync_context *context; /* context fetches are made from */
+	char *nodecache; /* node assignment cache file or NULL */
 
 	char *server; /* registration server */
 	char *account; /* users account name */
@@ -35,6 +53,9 @@ struct nssync_registration {
 
 	char *username; /* username used with services (not account!) */
 	char *storage_server; /* storage server */
+
+	const struct nssync_fetcher_cancel *cancel; /* cancel of account fetches */
+	uint64_t deadline; /* deadline of account fetches or 0 */
 };
 
 
@@ -55,7 +76,7 @@ static char *strduptolower(const char *s) {
 	char *ret;
 	int sloop = 0;
 
-	ret = malloc(strlen(s) + 1);
+	ret = nssync__malloc(strlen(s) + 1);
 	if (ret != NULL) {
 		while (s[sloop] != 0) {
 			ret[sloop] = tolower(s[sloop]);
@@ -88,7 +109,7 @@ static char *moz_sync_username_from_accountname(const char *accountname)
 	SHA1_Update(&context, accountname, strlen(accountname));
 	SHA1_Final(digest, &context);
 
-	username = calloc(1, bufflen);
+	username = nssync__calloc(1, bufflen);
 	if (username != NULL) {
 		base32_encode((uint8_t*)username, &bufflen, digest, sizeof(digest));
 	}
@@ -96,25 +117,217 @@ static char *moz_sync_username_from_accountname(const char *accountname)
 	return username;
 }
 
+/** split a node assignment cache line into its fields
+ *
+ * Lines are of the form "<expiry> <server> <username> <node>"
+ *
+ * @return true if the line was valid and the fields have been set.
+ */
+static bool
+node_cache_parse(char *line,
+		 time_t *expiry_out,
+		 char **server_out,
+		 char **username_out,
+		 char **node_out)
+{
+	char *fields[4];
+	int fieldidx;
+	char *end;
+
+	end = strchr(line, '\n');
+	if (end == NULL) {
+		return false;
+	}
+	*end = 0;
+
+	fields[0] = line;
+	for (fieldidx = 1; fieldidx < 4; fieldidx++) {
+		end = strchr(fields[fieldidx - 1], ' ');
+		if (end == NULL) {
+			return false;
+		}
+		*end = 0;
+		fields[fieldidx] = end + 1;
+	}
+
+	*expiry_out = strtol(fields[0], &end, 10);
+	if (*end != 0) {
+		return false;
+	}
+	*server_out = fields[1];
+	*username_out = fields[2];
+	*node_out = fields[3];
+
+	return true;
+}
+
+/** find an unexpired node assignment in the cache */
+static char *node_cache_find(struct nssync_registration *reg)
+{
+	FILE *fp;
+	char line[NODE_CACHE_LINE];
+	time_t now;
+	time_t expiry;
+	char *server;
+	char *username;
+	char *node;
+	char *found = NULL;
+
+	if (reg->nodecache == NULL) {
+		return NULL;
+	}
+
+	fp = fopen(reg->nodecache, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	now = time(NULL);
+	while ((found == NULL) && (fgets(line, sizeof(line), fp) != NULL)) {
+		if (node_cache_parse(line, &expiry, &server, &username, &node) &&
+		    (expiry > now) &&
+		    (strcmp(server, reg->server) == 0) &&
+		    (strcmp(username, reg->username) == 0)) {
+			found = nssync__strdup(node);
+		}
+	}
+	fclose(fp);
+
+	return found;
+}
+
+/* sessions on other threads rewrite the cache one at a time so no
+ * update is lost to a concurrent rewrite.
+ */
+static pthread_mutex_t node_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** rewrite the cache replacing or removing the entry for a registration
+ *
+ * Expired entries are dropped and the new cache is atomically renamed
+ *   into place so concurrent readers always see a complete file.
+ *
+ * @param reg The registration whose entry is updated.
+ * @param node The node to store or NULL to remove the entry.
+ */
+static void node_cache_rewrite(struct nssync_registration *reg, const char *node)
+{
+	FILE *infp;
+	FILE *outfp;
+	char *tmpname;
+	char line[NODE_CACHE_LINE];
+	char keep[NODE_CACHE_LINE];
+	time_t now;
+	time_t expiry;
+	char *server;
+	char *username;
+	char *oldnode;
+	int fd;
+
+	if (reg->nodecache == NULL) {
+		return;
+	}
+
+	if (nssync__saprintf(&tmpname, "%s.XXXXXX", reg->nodecache) < 0) {
+		return;
+	}
+
+	fd = mkstemp(tmpname);
+	if (fd == -1) {
+		nssync__free(tmpname);
+		return;
+	}
+
+	outfp = fdopen(fd, "w");
+	if (outfp == NULL) {
+		close(fd);
+		remove(tmpname);
+		nssync__free(tmpname);
+		return;
+	}
+
+	now = time(NULL);
+	infp = fopen(reg->nodecache, "r");
+	if (infp != NULL) {
+		while (fgets(line, sizeof(line), infp) != NULL) {
+			memcpy(keep, line, sizeof(keep));
+			if (!node_cache_parse(line, &expiry, &server, &username, &oldnode) ||
+			    (expiry <= now) ||
+			    ((strcmp(server, reg->server) == 0) &&
+			     (strcmp(username, reg->username) == 0))) {
+				continue;
+			}
+			fputs(keep, outfp);
+		}
+		fclose(infp);
+	}
+
+	if (node != NULL) {
+		fprintf(outfp, "%ld %s %s %s\n",
+			(long)(now + NODE_CACHE_TTL),
+			reg->server, reg->username, node);
+	}
+
+	if (fclose(outfp) == 0) {
+		rename(tmpname, reg->nodecache);
+	} else {
+		remove(tmpname);
+	}
+	nssync__free(tmpname);
+}
+
+static void node_cache_update(struct nssync_registration *reg, const char *node)
+{
+	pthread_mutex_lock(&node_cache_lock);
+	node_cache_rewrite(reg, node);
+	pthread_mutex_unlock(&node_cache_lock);
+}
+
+/** check a node assignment is usable as a storage server
+ *
+ * Servers may end the node with a newline so trailing whitespace is
+ *   removed, any within it makes the node unusable.
+ */
+static bool isvalidnode(char *node)
+{
+	size_t length;
+
+	if (node == NULL) {
+		return false;
+	}
+
+	length = strlen(node);
+	while ((length > 0) && isspace((unsigned char)node[length - 1])) {
+		node[--length] = 0;
+	}
+
+	if ((strncmp(node, "http://", 7) != 0) &&
+	    (strncmp(node, "https://", 8) != 0)) {
+		return false;
+	}
+	return (strpbrk(node, " \t\r\n") == NULL);
+}
+
 /* exported interface documented in registration.h */
 enum nssync_error
 nssync_registration_new(const char *server,
 			const char *account,
 			const char *password,
-			nssync_fetcher *fetcher,
+			struct nssync_context *context,
 			struct nssync_registration **reg_out)
 {
 	struct nssync_registration *newreg;
+	const char *cachedir;
 
-	newreg = calloc(1, sizeof(*newreg));
+	newreg = nssync__calloc(1, sizeof(*newreg));
 	if (newreg == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
 
-	newreg->fetcher = fetcher;
-	newreg->server = strdup(server);
-	newreg->account = strdup(account);
-	newreg->password = strdup(password);
+	newreg->context = context;
+	newreg->cancel = nssync_context_get_cancel(context);
+	newreg->server = nssync__strdup(server);
+	newreg->account = nssync__strdup(account);
+	newreg->password = nssync__strdup(password);
 
 	newreg->username = moz_sync_username_from_accountname(account);
 	if (newreg->username == NULL) {
@@ -122,6 +335,13 @@ nssync_registration_new(const char *server,
 		return NSSYNC_ERROR_NOMEM;
 	}
 
+	cachedir = nssync_context_get_cachedir(context);
+	if ((cachedir != NULL) &&
+	    (nssync__saprintf(&newreg->nodecache, NODE_CACHE_FILE, cachedir) < 0)) {
+		nssync_registration_free(newreg);
+		return NSSYNC_ERROR_NOMEM;
+	}
+
 	*reg_out = newreg;
 	return NSSYNC_ERROR_OK;
 }
@@ -130,13 +350,14 @@ nssync_registration_new(const char *server,
 enum nssync_error
 nssync_registration_free(struct nssync_registration *reg)
 {
-	free(reg->storage_server);
-	free(reg->username);
-	free(reg->server);
-	free(reg->account);
-	free(reg->password);
+	nssync__free(reg->storage_server);
+	nssync__free(reg->nodecache);
+	nssync__free(reg->username);
+	nssync__free(reg->server);
+	nssync__free(reg->account);
+	nssync__free(reg->password);
 
-	free(reg);
+	nssync__free(reg);
 
 	return NSSYNC_ERROR_OK;
 }
@@ -144,25 +365,119 @@ nssync_registration_free(struct nssync_registration *reg)
 
 /* exported interface documented in registration.h */
 char *
-nssync_registration_get_storage_server(struct nssync_registration *reg)
+nssync_registration_cached_storage_server(struct nssync_registration *reg)
 {
-	struct nssync_fetcher_fetch fetch = {
-		.username = reg->username,
-		.password = reg->password,
-	};
+	if ((reg->storage_server == NULL) && (reg->nodecache != NULL)) {
+		reg->storage_server = node_cache_find(reg);
+		nssync__metrics_add((reg->storage_server != NULL) ?
+				    NSSYNC_METRIC_CACHE_HITS :
+				    NSSYNC_METRIC_CACHE_MISSES, 1);
+	}
 
-	if (reg->storage_server == NULL) {
-		if (nssync__saprintf(&fetch.url, WEAVE_PATH, reg->server, reg->username) >= 0) {
-			if (reg->fetcher(&fetch) == NSSYNC_ERROR_OK) {
-				reg->storage_server = fetch.data;
-			}
-			free(fetch.url);
+	return reg->storage_server;
+}
+
+/* exported interface documented in registration.h */
+enum nssync_error
+nssync_registration_node_fetch_init(struct nssync_registration *reg,
+				    struct nssync_fetcher_fetch *fetch)
+{
+	fetch->username = reg->username;
+	fetch->password = reg->password;
+	fetch->endpoint = NSSYNC_FETCHER_ENDPOINT_NODE;
+	nssync_registration_fetch_deadline(reg, fetch);
+
+	if (nssync__saprintf(&fetch->url, WEAVE_PATH, reg->server, reg->username) < 0) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	nssync__metrics_add(NSSYNC_METRIC_REQUESTS_NODE, 1);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in registration.h */
+enum nssync_error
+nssync_registration_node_fetch_complete(struct nssync_registration *reg,
+					struct nssync_fetcher_fetch *fetch,
+					uint64_t start)
+{
+	enum nssync_error ret = fetch->result;
+
+	nssync__metrics_since(NSSYNC_METRIC_FETCH, start);
+	nssync__metrics_add(NSSYNC_METRIC_BYTES_DOWNLOADED, fetch->data_used);
+	nssync_context_fetch_complete(reg->context, fetch);
+
+	if ((ret == NSSYNC_ERROR_OK) && isvalidnode(fetch->data)) {
+		nssync__free(reg->storage_server);
+		reg->storage_server = fetch->data;
+		node_cache_update(reg, reg->storage_server);
+	} else {
+		if (ret == NSSYNC_ERROR_OK) {
+			ret = NSSYNC_ERROR_REGISTRATION;
+		}
+		nssync__free(fetch->data);
+	}
+	fetch->data = NULL;
+
+	nssync__free(fetch->url);
+	fetch->url = NULL;
+
+	TRACE_END(start, "sync", "node lookup", reg->username);
+
+	return ret;
+}
+
+/* exported interface documented in registration.h */
+char *
+nssync_registration_get_storage_server(struct nssync_registration *reg)
+{
+	struct nssync_fetcher_fetch fetch;
+	uint64_t start;
+
+	if (nssync_registration_cached_storage_server(reg) == NULL) {
+		memset(&fetch, 0, sizeof(fetch));
+		if (nssync_registration_node_fetch_init(reg, &fetch) == NSSYNC_ERROR_OK) {
+			start = nssync__metrics_now();
+			fetch.result = nssync_context_fetch(reg->context, &fetch);
+			nssync_registration_node_fetch_complete(reg, &fetch, start);
 		}
 	}
 
 	return reg->storage_server;
 }
 
+/* exported interface documented in registration.h */
+void
+nssync_registration_set_deadline(struct nssync_registration *reg,
+				 const struct nssync_fetcher_cancel *cancel,
+				 uint64_t deadline)
+{
+	reg->cancel = cancel;
+	reg->deadline = deadline;
+}
+
+/* exported interface documented in registration.h */
+void
+nssync_registration_fetch_deadline(struct nssync_registration *reg,
+				   struct nssync_fetcher_fetch *fetch)
+{
+	fetch->cancel = reg->cancel;
+	fetch->deadline = reg->deadline;
+}
+
+/* exported interface documented in registration.h */
+enum nssync_error
+nssync_registration_invalidate_storage_server(struct nssync_registration *reg)
+{
+	nssync__free(reg->storage_server);
+	reg->storage_server = NULL;
+
+	node_cache_update(reg, NULL);
+
+	return NSSYNC_ERROR_OK;
+}
+
 char *
 nssync_registration_get_username(struct nssync_registration *reg)
 {
@@ -9,10 +9,63 @@
 
 struct nssync_registration;
 
-enum nssync_error nssync_registration_new(const char *server, const char *account, const char *password, nssync_fetcher *fetcher, struct nssync_registration **registration_out);
+/** create a registration
+ *
+ * @param context The context providing the fetcher and the cache
+ *                directory for the persistent node assignment cache.
+ */
+enum nssync_error nssync_registration_new(const char *server, const char *account, const char *password, struct nssync_context *context, struct nssync_registration **registration_out);
 
 enum nssync_error nssync_registration_free(struct nssync_registration *registration);
 
+/** get the storage server node assigned to the user
+ *
+ * The node is taken from the node assignment cache when possible
+ *   otherwise it is looked up on the registration server.
+ */
 char *nssync_registration_get_storage_server(struct nssync_registration *registration);
+
+/** get the storage server node without looking it up
+ *
+ * @return The node from memory or the node assignment cache, NULL
+ *         when it must be looked up on the registration server.
+ */
+char *nssync_registration_cached_storage_server(struct nssync_registration *registration);
+
+/** set up a fetch that looks up the storage server node
+ *
+ * The fetch is issued by the caller, synchronously or not, and
+ *   finished with nssync_registration_node_fetch_complete().
+ */
+enum nssync_error nssync_registration_node_fetch_init(struct nssync_registration *registration, struct nssync_fetcher_fetch *fetch);
+
+/** finish a storage server node lookup
+ *
+ * Accounts for the fetch, takes its data as the node if it is valid
+ *   and releases the url and data of the fetch.
+ *
+ * @param start Time the fetch was issued from nssync__metrics_now().
+ */
+enum nssync_error nssync_registration_node_fetch_complete(struct nssync_registration *registration, struct nssync_fetcher_fetch *fetch, uint64_t start);
+
+/** set the cancel and deadline of the fetches for the account
+ *
+ * They apply to fetches the registration and the stores using it
+ *   make from then on.
+ *
+ * @param deadline Deadline from nssync_fetcher_deadline() or 0 for none.
+ */
+void nssync_registration_set_deadline(struct nssync_registration *registration, const struct nssync_fetcher_cancel *cancel, uint64_t deadline);
+
+/** give a fetch for the account its cancel and deadline */
+void nssync_registration_fetch_deadline(struct nssync_registration *registration, struct nssync_fetcher_fetch *fetch);
+
+/** discard the node assignment
+ *
+ * Used when the storage server rejects the user (401) or is
+ *   unavailable (503) so the next lookup asks the registration server.
+ */
+enum nssync_error nssync_registration_invalidate_storage_server(struct nssync_registration *registration);
+
 char *nssync_registration_get_username(struct nssync_registration *registration);
 char *nssync_registration_get_password(struct nssync_registration *registration);
@@ -0,0 +1,469 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements retrying fetches with backoff
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+#include <nssync/fetcher.h>
+
+#include "alloc.h"
+#include "util.h"
+#include "scheduler.h"
+#include "retry.h"
+#include "log.h"
+#include "metrics.h"
+
+/* longest delay before the first retry in milliseconds, it doubles
+ * with each retry
+ */
+#define RETRY_BASE_DELAY 250
+
+/* longest a retry may wait in seconds, if the server asks for longer
+ * the fetch fails
+ */
+#define RETRY_MAX_DELAY 30
+
+/* longest a waiting fetch goes without checking if it was cancelled
+ * in milliseconds
+ */
+#define RETRY_SLICE 50
+
+/* a host that asked for backoff */
+struct retry_host {
+	char *name;
+	time_t until; /* no requests before this time */
+	struct retry_host *next;
+};
+
+/* an asynchronous fetch waiting to be retried */
+struct retry_timer {
+	struct nssync_fetcher_fetch *fetch;
+	uint64_t due; /* nssync__metrics_now() time to retry at */
+	struct retry_timer *next;
+};
+
+struct nssync_retry {
+	struct nssync_scheduler *scheduler;
+	unsigned int retries; /* most retries of a fetch */
+
+	pthread_mutex_t lock;
+	uint64_t jitter; /* random state for delay jitter */
+	struct retry_host *hosts;
+	struct retry_timer *timers; /* waiting retries soonest first */
+};
+
+/** is a failure one that may succeed if tried again
+ *
+ * A fetch with no response failed to connect or lost its connection,
+ *   a 5xx status is the server failing. Any other status is an answer
+ *   that will not change.
+ */
+static bool transient(const struct nssync_fetcher_fetch *fetch)
+{
+	if (fetch->result != NSSYNC_ERROR_FETCH) {
+		return false;
+	}
+
+	return (fetch->http_code == 0) || (fetch->http_code >= 500);
+}
+
+/** note the backoff a server asked for */
+static void note_backoff(struct nssync_retry *retry, const struct nssync_fetcher_fetch *fetch)
+{
+	struct retry_host *host;
+	const char *name;
+	size_t length;
+	time_t until;
+
+	if (fetch->backoff == 0) {
+		return;
+	}
+
+	until = time(NULL) + fetch->backoff;
+	name = nssync__url_host(fetch->url, &length);
+
+	for (host = retry->hosts; host != NULL; host = host->next) {
+		if ((strncmp(host->name, name, length) == 0) &&
+		    (host->name[length] == 0)) {
+			break;
+		}
+	}
+
+	if (host == NULL) {
+		host = nssync__calloc(1, sizeof(*host));
+		if (host == NULL) {
+			return;
+		}
+		host->name = nssync__malloc(length + 1);
+		if (host->name == NULL) {
+			nssync__free(host);
+			return;
+		}
+		memcpy(host->name, name, length);
+		host->name[length] = 0;
+		host->next = retry->hosts;
+		retry->hosts = host;
+	}
+
+	if (until > host->until) {
+		host->until = until;
+	}
+}
+
+static time_t host_backoff(struct nssync_retry *retry, const char *url)
+{
+	struct retry_host *host;
+	const char *name;
+	size_t length;
+
+	name = nssync__url_host(url, &length);
+
+	for (host = retry->hosts; host != NULL; host = host->next) {
+		if ((strncmp(host->name, name, length) == 0) &&
+		    (host->name[length] == 0)) {
+			return host->until;
+		}
+	}
+
+	return 0;
+}
+
+/** decide if a fetch is retried and how long to wait first
+ *
+ * Called with the lock held. The delay is half the doubled base delay
+ *   plus a random part up to as much again so retries from many
+ *   clients spread out, it is never before the backoff of the host.
+ *
+ * @param delay_out Set to the delay in nanoseconds.
+ */
+static bool
+retry_delay(struct nssync_retry *retry,
+	    const struct nssync_fetcher_fetch *fetch,
+	    unsigned int attempt,
+	    uint64_t *delay_out)
+{
+	uint64_t delay;
+	time_t until;
+	time_t now;
+
+	note_backoff(retry, fetch);
+
+	if ((attempt >= retry->retries) || !transient(fetch)) {
+		return false;
+	}
+
+	/* xorshift is plenty for spreading retries */
+	retry->jitter ^= retry->jitter << 13;
+	retry->jitter ^= retry->jitter >> 7;
+	retry->jitter ^= retry->jitter << 17;
+
+	delay = (uint64_t)RETRY_BASE_DELAY << attempt;
+	delay = (delay / 2) + (retry->jitter % ((delay / 2) + 1));
+	delay *= 1000000;
+
+	now = time(NULL);
+	until = host_backoff(retry, fetch->url);
+	if ((until > now) && (delay < ((uint64_t)(until - now) * 1000000000))) {
+		delay = (uint64_t)(until - now) * 1000000000;
+	}
+
+	if (delay > ((uint64_t)RETRY_MAX_DELAY * 1000000000)) {
+		return false;
+	}
+
+	/* a retry that cannot finish in time is not worth making */
+	if ((fetch->deadline != 0) &&
+	    ((nssync__metrics_now() + delay) >= fetch->deadline)) {
+		return false;
+	}
+
+	*delay_out = delay;
+
+	return true;
+}
+
+/** clear the result of a fetch so it can be made again */
+static void retry_reset(struct nssync_fetcher_fetch *fetch)
+{
+	fetch->data_used = 0;
+	fetch->result = NSSYNC_ERROR_OK;
+	fetch->http_code = 0;
+	fetch->backoff = 0;
+	memset(&fetch->timing, 0, sizeof(fetch->timing));
+}
+
+static void
+retry_log(const struct nssync_fetcher_fetch *fetch,
+	  unsigned int attempt,
+	  uint64_t delay)
+{
+	log_info(LOG_FIELDS(.url = fetch->url, .error = fetch->result),
+		 "retry %u in %llums after status %ld",
+		 attempt + 1,
+		 (unsigned long long)(delay / 1000000),
+		 fetch->http_code);
+	nssync__metrics_add(NSSYNC_METRIC_RETRIES, 1);
+}
+
+/** wait before making a fetch
+ *
+ * The wait is made in slices so a cancelled fetch or one that passes
+ *   its deadline stops waiting promptly.
+ *
+ * @param delay The wait in nanoseconds.
+ * @return NSSYNC_ERROR_OK once the wait is over or why the fetch was
+ *   abandoned.
+ */
+static enum nssync_error
+retry_sleep(const struct nssync_fetcher_fetch *fetch, uint64_t delay)
+{
+	struct timespec sleep;
+	enum nssync_error ret;
+	uint64_t until;
+	uint64_t now;
+
+	until = nssync__metrics_now() + delay;
+
+	while ((ret = nssync_fetcher_check(fetch)) == NSSYNC_ERROR_OK) {
+		now = nssync__metrics_now();
+		if (now >= until) {
+			break;
+		}
+
+		delay = until - now;
+		if (delay > ((uint64_t)RETRY_SLICE * 1000000)) {
+			delay = (uint64_t)RETRY_SLICE * 1000000;
+		}
+		sleep.tv_sec = delay / 1000000000;
+		sleep.tv_nsec = delay % 1000000000;
+		nanosleep(&sleep, NULL);
+	}
+
+	return ret;
+}
+
+/** wait out backoff the server asked for before the first attempt
+ *
+ * A fetch whose server asked for longer than a retry may wait, or
+ *   beyond its deadline, fails without being made.
+ */
+static enum nssync_error
+retry_backoff(struct nssync_retry *retry, const struct nssync_fetcher_fetch *fetch)
+{
+	time_t until;
+	time_t now;
+	uint64_t delay;
+
+	until = nssync_retry_get_backoff(retry, fetch->url);
+	now = time(NULL);
+	if (until <= now) {
+		return NSSYNC_ERROR_OK;
+	}
+
+	if ((until - now) > RETRY_MAX_DELAY) {
+		return NSSYNC_ERROR_FETCH;
+	}
+
+	delay = (uint64_t)(until - now) * 1000000000;
+	if ((fetch->deadline != 0) &&
+	    ((nssync__metrics_now() + delay) >= fetch->deadline)) {
+		return NSSYNC_ERROR_TIMEOUT;
+	}
+
+	log_info(LOG_FIELDS(.url = fetch->url),
+		 "waiting %lds for server backoff", (long)(until - now));
+
+	return retry_sleep(fetch, delay);
+}
+
+/* exported interface documented in retry.h */
+enum nssync_error
+nssync_retry_fetch(struct nssync_retry *retry, struct nssync_fetcher_fetch *fetch)
+{
+	nssync_fetcher *completion = fetch->completion;
+	enum nssync_error ret;
+	unsigned int attempt;
+	uint64_t delay;
+	bool again;
+
+	/* the fetcher would call the completion with each result */
+	fetch->completion = NULL;
+
+	ret = retry_backoff(retry, fetch);
+
+	for (attempt = 0; ret == NSSYNC_ERROR_OK; attempt++) {
+		fetch->result = nssync_scheduler_fetch(retry->scheduler, fetch);
+
+		pthread_mutex_lock(&retry->lock);
+		again = retry_delay(retry, fetch, attempt, &delay);
+		pthread_mutex_unlock(&retry->lock);
+		if (!again) {
+			break;
+		}
+
+		retry_log(fetch, attempt, delay);
+
+		ret = retry_sleep(fetch, delay);
+		if (ret == NSSYNC_ERROR_OK) {
+			retry_reset(fetch);
+		}
+	}
+
+	/* abandoned waiting for backoff or a retry */
+	if (ret != NSSYNC_ERROR_OK) {
+		fetch->result = ret;
+	}
+
+	fetch->completion = completion;
+	if (completion != NULL) {
+		return completion(fetch);
+	}
+
+	return fetch->result;
+}
+
+/* exported interface documented in retry.h */
+bool
+nssync_retry_later(struct nssync_retry *retry,
+		   struct nssync_fetcher_fetch *fetch,
+		   unsigned int attempt)
+{
+	struct retry_timer **ptimer;
+	struct retry_timer *timer;
+	uint64_t delay;
+
+	timer = nssync__malloc(sizeof(*timer));
+	if (timer == NULL) {
+		return false;
+	}
+
+	pthread_mutex_lock(&retry->lock);
+	if (!retry_delay(retry, fetch, attempt, &delay)) {
+		pthread_mutex_unlock(&retry->lock);
+		nssync__free(timer);
+		return false;
+	}
+
+	timer->fetch = fetch;
+	timer->due = nssync__metrics_now() + delay;
+
+	for (ptimer = &retry->timers;
+	     (*ptimer != NULL) && ((*ptimer)->due <= timer->due);
+	     ptimer = &(*ptimer)->next);
+	timer->next = *ptimer;
+	*ptimer = timer;
+	pthread_mutex_unlock(&retry->lock);
+
+	retry_log(fetch, attempt, delay);
+	retry_reset(fetch);
+
+	return true;
+}
+
+/* exported interface documented in retry.h */
+unsigned int nssync_retry_run(struct nssync_retry *retry, int *wait_out)
+{
+	struct nssync_fetcher_fetch *fetch;
+	struct retry_timer *timer;
+	unsigned int waiting = 0;
+	enum nssync_error ret;
+	uint64_t now;
+
+	pthread_mutex_lock(&retry->lock);
+	now = nssync__metrics_now();
+	while (((timer = retry->timers) != NULL) && (timer->due <= now)) {
+		retry->timers = timer->next;
+		pthread_mutex_unlock(&retry->lock);
+
+		fetch = timer->fetch;
+		nssync__free(timer);
+
+		ret = nssync_scheduler_fetch(retry->scheduler, fetch);
+		if (ret != NSSYNC_ERROR_RETRY) {
+			/* could not be queued so it completes here */
+			fetch->result = ret;
+			fetch->completion(fetch);
+		}
+
+		pthread_mutex_lock(&retry->lock);
+	}
+
+	*wait_out = -1;
+	if (retry->timers != NULL) {
+		*wait_out = ((retry->timers->due - now) / 1000000) + 1;
+		for (timer = retry->timers; timer != NULL; timer = timer->next) {
+			waiting++;
+		}
+	}
+	pthread_mutex_unlock(&retry->lock);
+
+	return waiting;
+}
+
+/* exported interface documented in retry.h */
+time_t nssync_retry_get_backoff(struct nssync_retry *retry, const char *url)
+{
+	time_t until;
+
+	pthread_mutex_lock(&retry->lock);
+	until = host_backoff(retry, url);
+	pthread_mutex_unlock(&retry->lock);
+
+	return until;
+}
+
+/* exported interface documented in retry.h */
+enum nssync_error
+nssync_retry_new(struct nssync_scheduler *scheduler,
+		 unsigned int retries,
+		 struct nssync_retry **retry_out)
+{
+	struct nssync_retry *retry;
+
+	retry = nssync__calloc(1, sizeof(*retry));
+	if (retry == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	retry->scheduler = scheduler;
+	retry->retries = retries;
+	retry->jitter = nssync__metrics_now() | 1;
+	pthread_mutex_init(&retry->lock, NULL);
+
+	*retry_out = retry;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in retry.h */
+void nssync_retry_free(struct nssync_retry *retry)
+{
+	struct retry_host *host;
+	struct retry_timer *timer;
+
+	while ((host = retry->hosts) != NULL) {
+		retry->hosts = host->next;
+		nssync__free(host->name);
+		nssync__free(host);
+	}
+
+	while ((timer = retry->timers) != NULL) {
+		retry->timers = timer->next;
+		nssync__free(timer);
+	}
+
+	pthread_mutex_destroy(&retry->lock);
+	nssync__free(retry);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** fetch retries
+ *
+ * Transient failures, where the connection failed or the server
+ *   answered with a 5xx status, are retried after a jittered delay
+ *   doubling with each attempt up to a budget of retries per fetch.
+ *   Other failures such as 401 or 404 are returned at once.
+ *
+ * Backoff a server asks for with X-Weave-Backoff or Retry-After
+ *   applies to every fetch to that host, a retry never goes before it
+ *   and a fetch whose server asks for longer than a retry may wait
+ *   fails instead.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct nssync_retry;
+struct nssync_scheduler;
+
+/** create retries in front of a scheduler
+ *
+ * @param retries Most retries of a fetch.
+ */
+enum nssync_error nssync_retry_new(struct nssync_scheduler *scheduler, unsigned int retries, struct nssync_retry **retry_out);
+
+void nssync_retry_free(struct nssync_retry *retry);
+
+/** make a synchronous fetch, retrying transient failures
+ *
+ * The first attempt waits out any backoff of the server. Waits end
+ *   early when the fetch is cancelled or passes its deadline.
+ *
+ * The completion of the fetch, if any, is only called with the final
+ *   result.
+ */
+enum nssync_error nssync_retry_fetch(struct nssync_retry *retry, struct nssync_fetcher_fetch *fetch);
+
+/** decide if a completed asynchronous fetch is retried
+ *
+ * When it is the fetch is reset and made again from
+ *   nssync_retry_run() once its delay passes, its completion is then
+ *   called again.
+ *
+ * @param attempt Number of retries of the fetch so far.
+ * @return true if the fetch will be retried.
+ */
+bool nssync_retry_later(struct nssync_retry *retry, struct nssync_fetcher_fetch *fetch, unsigned int attempt);
+
+/** make the asynchronous retries that are due
+ *
+ * @param wait_out Set to the milliseconds until the next retry is due.
+ * @return The number of retries still waiting.
+ */
+unsigned int nssync_retry_run(struct nssync_retry *retry, int *wait_out);
+
+/** time before which the server of a url asked for no requests */
+time_t nssync_retry_get_backoff(struct nssync_retry *retry, const char *url);
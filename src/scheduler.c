@@ -0,0 +1,662 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements the fetch scheduler
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+#include <nssync/fetcher.h>
+
+#include "alloc.h"
+#include "util.h"
+#include "scheduler.h"
+#include "metrics.h"
+
+/* a fetch waiting for or holding a slot */
+struct sched_wait {
+	struct nssync_fetcher_fetch *fetch;
+	struct sched_host *host; /* host fetch is made to */
+	uint64_t queued; /* time the fetch was queued */
+
+	bool async;
+	unsigned int id; /* identifies a started asynchronous fetch */
+	bool granted; /* slot was granted */
+	pthread_cond_t cond; /* synchronous waiter is signalled on grant */
+
+	struct sched_wait *next;
+};
+
+/* an account with fetches waiting in a priority class */
+struct sched_account {
+	char *name;
+	struct sched_wait *waits; /* waiting fetches in order */
+	struct sched_wait **waits_tail;
+	struct sched_account *next;
+};
+
+/* a host fetches are made to */
+struct sched_host {
+	char *name;
+	unsigned int active; /* fetches in progress */
+	unsigned int refs; /* fetches waiting or in progress */
+	struct sched_host *next;
+};
+
+struct nssync_scheduler {
+	nssync_fetcher *fetcher;
+	unsigned int limit; /* most fetches in progress */
+	unsigned int host_limit; /* most fetches in progress to a host */
+	unsigned int active; /* fetches in progress */
+	unsigned int waiting; /* asynchronous fetches not yet started */
+
+	pthread_mutex_t lock;
+	pthread_condattr_t condattr; /* waits time out on the monotonic clock */
+
+	/* accounts with waiting fetches in the order they take turns */
+	struct sched_account *classes[NSSYNC_FETCHER_PRIORITY_COUNT];
+
+	struct sched_wait *ready; /* granted asynchronous fetches to start */
+	struct sched_wait **ready_tail;
+	struct sched_wait *running; /* started asynchronous fetches */
+
+	struct sched_host *hosts;
+	unsigned int ids; /* last asynchronous fetch id */
+
+	pthread_t loop; /* thread running asynchronous fetches */
+	bool loop_set;
+};
+
+/** find or add the host of a url */
+static struct sched_host *
+host_ref(struct nssync_scheduler *scheduler, const char *url)
+{
+	struct sched_host *host;
+	size_t length;
+
+	url = nssync__url_host(url, &length);
+
+	for (host = scheduler->hosts; host != NULL; host = host->next) {
+		if ((strncmp(host->name, url, length) == 0) &&
+		    (host->name[length] == 0)) {
+			host->refs++;
+			return host;
+		}
+	}
+
+	host = nssync__calloc(1, sizeof(*host));
+	if (host == NULL) {
+		return NULL;
+	}
+	host->name = nssync__malloc(length + 1);
+	if (host->name == NULL) {
+		nssync__free(host);
+		return NULL;
+	}
+	memcpy(host->name, url, length);
+	host->name[length] = 0;
+
+	host->refs = 1;
+	host->next = scheduler->hosts;
+	scheduler->hosts = host;
+
+	return host;
+}
+
+static void host_unref(struct nssync_scheduler *scheduler, struct sched_host *host)
+{
+	struct sched_host **phost;
+
+	if (--host->refs > 0) {
+		return;
+	}
+
+	for (phost = &scheduler->hosts; *phost != host; phost = &(*phost)->next);
+	*phost = host->next;
+
+	nssync__free(host->name);
+	nssync__free(host);
+}
+
+/** queue a fetch behind the others of its account and class */
+static enum nssync_error
+wait_enqueue(struct nssync_scheduler *scheduler, struct sched_wait *wait)
+{
+	struct sched_account **paccount;
+	struct sched_account *account;
+	const char *name;
+
+	name = (wait->fetch->username != NULL) ? wait->fetch->username : "";
+
+	paccount = &scheduler->classes[wait->fetch->priority];
+	for (account = *paccount; account != NULL; account = account->next) {
+		if (strcmp(account->name, name) == 0) {
+			break;
+		}
+		paccount = &account->next;
+	}
+
+	if (account == NULL) {
+		/* a new account takes its turn after those waiting */
+		account = nssync__calloc(1, sizeof(*account));
+		if (account == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+		account->name = nssync__strdup(name);
+		if (account->name == NULL) {
+			nssync__free(account);
+			return NSSYNC_ERROR_NOMEM;
+		}
+		account->waits_tail = &account->waits;
+		*paccount = account;
+	}
+
+	wait->next = NULL;
+	*account->waits_tail = wait;
+	account->waits_tail = &wait->next;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** take the next fetch allowed to start
+ *
+ * The highest class with a fetch whose host is below its limit is
+ *   used. Within it accounts take turns, the account a fetch is taken
+ *   from goes to the back.
+ */
+static struct sched_wait *wait_dequeue(struct nssync_scheduler *scheduler)
+{
+	enum nssync_fetcher_priority priority;
+	struct sched_account **paccount;
+	struct sched_account *account;
+	struct sched_wait **pwait;
+	struct sched_wait *wait;
+
+	for (priority = 0; priority < NSSYNC_FETCHER_PRIORITY_COUNT; priority++) {
+		paccount = &scheduler->classes[priority];
+		while ((account = *paccount) != NULL) {
+			pwait = &account->waits;
+			while (((wait = *pwait) != NULL) &&
+			       (wait->host->active >= scheduler->host_limit)) {
+				pwait = &wait->next;
+			}
+			if (wait == NULL) {
+				paccount = &account->next;
+				continue;
+			}
+
+			/* unlink the fetch */
+			*pwait = wait->next;
+			if (account->waits_tail == &wait->next) {
+				account->waits_tail = pwait;
+			}
+
+			/* move the account to the back or drop it */
+			*paccount = account->next;
+			if (account->waits == NULL) {
+				nssync__free(account->name);
+				nssync__free(account);
+			} else {
+				account->next = NULL;
+				while (*paccount != NULL) {
+					paccount = &(*paccount)->next;
+				}
+				*paccount = account;
+			}
+
+			return wait;
+		}
+	}
+
+	return NULL;
+}
+
+/** take the waiting fetches matching a filter out of the queues
+ *
+ * @return The fetches taken linked through next.
+ */
+static struct sched_wait *
+wait_remove(struct nssync_scheduler *scheduler,
+	    bool (*match)(struct sched_wait *wait, void *ctx),
+	    void *ctx)
+{
+	enum nssync_fetcher_priority priority;
+	struct sched_account **paccount;
+	struct sched_account *account;
+	struct sched_wait **pwait;
+	struct sched_wait *wait;
+	struct sched_wait *removed = NULL;
+
+	for (priority = 0; priority < NSSYNC_FETCHER_PRIORITY_COUNT; priority++) {
+		paccount = &scheduler->classes[priority];
+		while ((account = *paccount) != NULL) {
+			pwait = &account->waits;
+			while ((wait = *pwait) != NULL) {
+				if (!match(wait, ctx)) {
+					pwait = &wait->next;
+					continue;
+				}
+				*pwait = wait->next;
+				wait->next = removed;
+				removed = wait;
+			}
+			account->waits_tail = pwait;
+
+			if (account->waits == NULL) {
+				*paccount = account->next;
+				nssync__free(account->name);
+				nssync__free(account);
+			} else {
+				paccount = &account->next;
+			}
+		}
+	}
+
+	return removed;
+}
+
+static bool match_wait(struct sched_wait *wait, void *ctx)
+{
+	return wait == ctx;
+}
+
+static bool match_async(struct sched_wait *wait, void *ctx)
+{
+	return wait->async;
+}
+
+/** match asynchronous fetches that were cancelled or passed their deadline */
+static bool match_expired(struct sched_wait *wait, void *ctx)
+{
+	return wait->async && (nssync_fetcher_check(wait->fetch) != NSSYNC_ERROR_OK);
+}
+
+static void wait_grant(struct nssync_scheduler *scheduler, struct sched_wait *wait)
+{
+	scheduler->active++;
+	wait->host->active++;
+	wait->granted = true;
+
+	if (wait->async) {
+		/* started from the loop thread by nssync_scheduler_run() */
+		wait->next = NULL;
+		*scheduler->ready_tail = wait;
+		scheduler->ready_tail = &wait->next;
+	} else {
+		pthread_cond_signal(&wait->cond);
+	}
+}
+
+/** grant slots to waiting fetches while the limits allow */
+static void dispatch(struct nssync_scheduler *scheduler)
+{
+	struct sched_wait *wait;
+
+	while (scheduler->active < scheduler->limit) {
+		wait = wait_dequeue(scheduler);
+		if (wait == NULL) {
+			break;
+		}
+		wait_grant(scheduler, wait);
+	}
+}
+
+/** give back the slot of a finished fetch */
+static void release(struct nssync_scheduler *scheduler, struct sched_wait *wait)
+{
+	scheduler->active--;
+	wait->host->active--;
+	host_unref(scheduler, wait->host);
+
+	dispatch(scheduler);
+}
+
+/** start a granted asynchronous fetch
+ *
+ * A fetch that fails without calling its completion is completed
+ *   here so the caller always hears of it.
+ */
+static void async_start(struct nssync_scheduler *scheduler, struct sched_wait *wait)
+{
+	struct nssync_fetcher_fetch *fetch = wait->fetch;
+	struct sched_wait *running;
+	unsigned int id = wait->id;
+	enum nssync_error ret;
+
+	nssync__metrics_since(NSSYNC_METRIC_QUEUE, wait->queued);
+
+	ret = nssync_fetcher_check(fetch);
+	if (ret == NSSYNC_ERROR_OK) {
+		ret = scheduler->fetcher(fetch);
+	}
+	if (ret == NSSYNC_ERROR_RETRY) {
+		return;
+	}
+
+	/* the wait is gone if the completion accounted for the fetch */
+	pthread_mutex_lock(&scheduler->lock);
+	for (running = scheduler->running; running != NULL; running = running->next) {
+		if (running->id == id) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if ((running != NULL) && (fetch->completion != NULL)) {
+		fetch->result = ret;
+		fetch->completion(fetch);
+	}
+
+	/* release the slot if the completion did not */
+	nssync_scheduler_complete(scheduler, fetch, id);
+}
+
+/* exported interface documented in scheduler.h */
+unsigned int nssync_scheduler_run(struct nssync_scheduler *scheduler)
+{
+	struct nssync_fetcher_fetch *fetch;
+	struct sched_wait *expired;
+	struct sched_wait *wait;
+	unsigned int waiting;
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->loop = pthread_self();
+	scheduler->loop_set = true;
+
+	/* waiting fetches that can no longer be made */
+	expired = wait_remove(scheduler, match_expired, NULL);
+	for (wait = expired; wait != NULL; wait = wait->next) {
+		scheduler->waiting--;
+		host_unref(scheduler, wait->host);
+	}
+
+	while ((wait = scheduler->ready) != NULL) {
+		scheduler->ready = wait->next;
+		if (scheduler->ready == NULL) {
+			scheduler->ready_tail = &scheduler->ready;
+		}
+		scheduler->waiting--;
+		wait->next = scheduler->running;
+		scheduler->running = wait;
+
+		pthread_mutex_unlock(&scheduler->lock);
+		async_start(scheduler, wait);
+		pthread_mutex_lock(&scheduler->lock);
+	}
+	waiting = scheduler->waiting;
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	while ((wait = expired) != NULL) {
+		expired = wait->next;
+		fetch = wait->fetch;
+		nssync__free(wait);
+
+		fetch->result = nssync_fetcher_check(fetch);
+		if (fetch->completion != NULL) {
+			fetch->completion(fetch);
+		}
+	}
+
+	return waiting;
+}
+
+/* exported interface documented in scheduler.h */
+void nssync_scheduler_wake(struct nssync_scheduler *scheduler)
+{
+	enum nssync_fetcher_priority priority;
+	struct sched_account *account;
+	struct sched_wait *wait;
+
+	pthread_mutex_lock(&scheduler->lock);
+	for (priority = 0; priority < NSSYNC_FETCHER_PRIORITY_COUNT; priority++) {
+		for (account = scheduler->classes[priority];
+		     account != NULL;
+		     account = account->next) {
+			for (wait = account->waits; wait != NULL; wait = wait->next) {
+				if (!wait->async) {
+					pthread_cond_signal(&wait->cond);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+/* exported interface documented in scheduler.h */
+void
+nssync_scheduler_complete(struct nssync_scheduler *scheduler,
+			  const struct nssync_fetcher_fetch *fetch,
+			  unsigned int id)
+{
+	struct sched_wait **pwait;
+	struct sched_wait *wait;
+
+	pthread_mutex_lock(&scheduler->lock);
+	for (pwait = &scheduler->running; (wait = *pwait) != NULL; pwait = &wait->next) {
+		if ((wait->fetch == fetch) && ((id == 0) || (wait->id == id))) {
+			break;
+		}
+	}
+	if (wait != NULL) {
+		*pwait = wait->next;
+		release(scheduler, wait);
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	nssync__free(wait);
+}
+
+/** is the calling thread the one running asynchronous fetches */
+static bool on_loop(struct nssync_scheduler *scheduler)
+{
+	return scheduler->loop_set && pthread_equal(scheduler->loop, pthread_self());
+}
+
+/** make a synchronous fetch once it is granted a slot */
+static enum nssync_error
+sync_fetch(struct nssync_scheduler *scheduler, struct nssync_fetcher_fetch *fetch)
+{
+	struct sched_wait wait;
+	enum nssync_error ret;
+	struct timespec deadline;
+
+	memset(&wait, 0, sizeof(wait));
+	wait.fetch = fetch;
+	wait.queued = nssync__metrics_now();
+
+	pthread_mutex_lock(&scheduler->lock);
+	wait.host = host_ref(scheduler, fetch->url);
+	if (wait.host == NULL) {
+		pthread_mutex_unlock(&scheduler->lock);
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	if (on_loop(scheduler)) {
+		/* the fetches it would wait for can only finish on this thread */
+		scheduler->active++;
+		wait.host->active++;
+	} else {
+		ret = wait_enqueue(scheduler, &wait);
+		if (ret != NSSYNC_ERROR_OK) {
+			host_unref(scheduler, wait.host);
+			pthread_mutex_unlock(&scheduler->lock);
+			return ret;
+		}
+
+		deadline.tv_sec = fetch->deadline / 1000000000;
+		deadline.tv_nsec = fetch->deadline % 1000000000;
+
+		pthread_cond_init(&wait.cond, &scheduler->condattr);
+		dispatch(scheduler);
+		while ((!wait.granted) &&
+		       ((ret = nssync_fetcher_check(fetch)) == NSSYNC_ERROR_OK)) {
+			if (fetch->deadline != 0) {
+				pthread_cond_timedwait(&wait.cond,
+						       &scheduler->lock,
+						       &deadline);
+			} else {
+				pthread_cond_wait(&wait.cond, &scheduler->lock);
+			}
+		}
+		pthread_cond_destroy(&wait.cond);
+
+		if (!wait.granted) {
+			/* cancelled or out of time while waiting */
+			wait_remove(scheduler, match_wait, &wait);
+			host_unref(scheduler, wait.host);
+			pthread_mutex_unlock(&scheduler->lock);
+			return ret;
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	nssync__metrics_since(NSSYNC_METRIC_QUEUE, wait.queued);
+
+	ret = nssync_fetcher_check(fetch);
+	if (ret == NSSYNC_ERROR_OK) {
+		ret = scheduler->fetcher(fetch);
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+	release(scheduler, &wait);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return ret;
+}
+
+/* exported interface documented in scheduler.h */
+enum nssync_error
+nssync_scheduler_fetch(struct nssync_scheduler *scheduler,
+		       struct nssync_fetcher_fetch *fetch)
+{
+	struct sched_wait *wait;
+	enum nssync_error ret;
+
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) == 0) {
+		return sync_fetch(scheduler, fetch);
+	}
+
+	wait = nssync__calloc(1, sizeof(*wait));
+	if (wait == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	wait->fetch = fetch;
+	wait->async = true;
+	wait->queued = nssync__metrics_now();
+
+	pthread_mutex_lock(&scheduler->lock);
+	wait->id = ++scheduler->ids;
+	if (wait->id == 0) {
+		wait->id = ++scheduler->ids;
+	}
+	wait->host = host_ref(scheduler, fetch->url);
+	if (wait->host == NULL) {
+		pthread_mutex_unlock(&scheduler->lock);
+		nssync__free(wait);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	ret = wait_enqueue(scheduler, wait);
+	if (ret != NSSYNC_ERROR_OK) {
+		host_unref(scheduler, wait->host);
+		pthread_mutex_unlock(&scheduler->lock);
+		nssync__free(wait);
+		return ret;
+	}
+	scheduler->waiting++;
+	dispatch(scheduler);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	/* asynchronous fetches are only made from the loop thread */
+	nssync_scheduler_run(scheduler);
+
+	return NSSYNC_ERROR_RETRY;
+}
+
+/* exported interface documented in scheduler.h */
+enum nssync_error
+nssync_scheduler_new(nssync_fetcher *fetcher,
+		     unsigned int limit,
+		     unsigned int host_limit,
+		     struct nssync_scheduler **scheduler_out)
+{
+	struct nssync_scheduler *scheduler;
+
+	if ((limit == 0) || (host_limit == 0)) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	scheduler = nssync__calloc(1, sizeof(*scheduler));
+	if (scheduler == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	scheduler->fetcher = fetcher;
+	scheduler->limit = limit;
+	scheduler->host_limit = host_limit;
+	scheduler->ready_tail = &scheduler->ready;
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_condattr_init(&scheduler->condattr);
+	pthread_condattr_setclock(&scheduler->condattr, CLOCK_MONOTONIC);
+
+	*scheduler_out = scheduler;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in scheduler.h */
+void nssync_scheduler_free(struct nssync_scheduler *scheduler)
+{
+	struct nssync_fetcher_fetch *fetch;
+	struct sched_wait *cancelled;
+	struct sched_wait *wait;
+	struct sched_host *host;
+
+	/* asynchronous fetches never started are completed as cancelled */
+	pthread_mutex_lock(&scheduler->lock);
+	cancelled = wait_remove(scheduler, match_async, NULL);
+	while ((wait = scheduler->ready) != NULL) {
+		scheduler->ready = wait->next;
+		scheduler->active--;
+		wait->next = cancelled;
+		cancelled = wait;
+	}
+	scheduler->ready_tail = &scheduler->ready;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	while ((wait = cancelled) != NULL) {
+		cancelled = wait->next;
+		fetch = wait->fetch;
+		nssync__free(wait);
+
+		fetch->result = NSSYNC_ERROR_CANCELLED;
+		if (fetch->completion != NULL) {
+			fetch->completion(fetch);
+		}
+	}
+
+	while ((wait = scheduler->running) != NULL) {
+		scheduler->running = wait->next;
+		nssync__free(wait);
+	}
+
+	while ((host = scheduler->hosts) != NULL) {
+		scheduler->hosts = host->next;
+		nssync__free(host->name);
+		nssync__free(host);
+	}
+
+	pthread_condattr_destroy(&scheduler->condattr);
+	pthread_mutex_destroy(&scheduler->lock);
+	nssync__free(scheduler);
+}
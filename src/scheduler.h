@@ -0,0 +1,74 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** fetch scheduler
+ *
+ * Every fetch of a context passes through its scheduler which bounds
+ *   the fetches in progress overall and to each host. Waiting fetches
+ *   are started strictly by priority class and within a class in turn
+ *   by account, so one account with a large backlog cannot hold up
+ *   the others.
+ *
+ * Synchronous fetches block the calling thread until they may start.
+ *   Asynchronous fetches are queued and started from
+ *   nssync_scheduler_run() on the thread running asynchronous fetches,
+ *   their completion is always called even if the fetcher fails them
+ *   without doing so.
+ *
+ * Fetches cancelled or passing their deadline while waiting fail
+ *   without being made.
+ */
+
+struct nssync_scheduler;
+
+/** create a scheduler
+ *
+ * @param fetcher The fetcher fetches are made with.
+ * @param limit Most fetches in progress at once.
+ * @param host_limit Most fetches in progress to one host at once.
+ */
+enum nssync_error nssync_scheduler_new(nssync_fetcher *fetcher, unsigned int limit, unsigned int host_limit, struct nssync_scheduler **scheduler_out);
+
+/** free a scheduler
+ *
+ * Asynchronous fetches still waiting to start are completed with
+ *   NSSYNC_ERROR_CANCELLED.
+ */
+void nssync_scheduler_free(struct nssync_scheduler *scheduler);
+
+/** make a fetch once the limits allow
+ *
+ * @return The fetcher result for synchronous fetches, asynchronous
+ *         ones return NSSYNC_ERROR_RETRY and report through their
+ *         completion.
+ */
+enum nssync_error nssync_scheduler_fetch(struct nssync_scheduler *scheduler, struct nssync_fetcher_fetch *fetch);
+
+/** give back the slot of a completed asynchronous fetch
+ *
+ * Called as the fetch completes, it does nothing for fetches the
+ *   scheduler does not hold a slot for.
+ *
+ * @param id Which start of the fetch completed or 0 for the current.
+ */
+void nssync_scheduler_complete(struct nssync_scheduler *scheduler, const struct nssync_fetcher_fetch *fetch, unsigned int id);
+
+/** wake waiting synchronous fetches so cancelled ones give up */
+void nssync_scheduler_wake(struct nssync_scheduler *scheduler);
+
+/** start the asynchronous fetches allowed to run
+ *
+ * Called repeatedly from the one thread asynchronous fetches are made
+ *   and completed on. Synchronous fetches made from that thread are
+ *   never held back as the fetches they would wait for can only
+ *   complete on it.
+ *
+ * @return The number of asynchronous fetches still waiting to start.
+ */
+unsigned int nssync_scheduler_run(struct nssync_scheduler *scheduler);
@@ -7,44 +7,68 @@
  *
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <jansson.h>
 
 #include <nssync/error.h>
 #include <nssync/fetcher.h>
-#include <nssync/debug.h>
+#include <nssync/context.h>
 
+#include "alloc.h"
 #include "util.h"
+#include "context.h"
 #include "registration.h"
 #include "storage.h"
-
-/* container for object */
-struct nssync_storage_obj {
-	char *id;
-	char *payload;
-	time_t modified;
-	int sortindex;
-	int ttl;
+#include "arena.h"
+#include "wbo.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* fields of a WBO in the order of WBO_FIELDS */
+enum wbo_field {
+	WBO_ID = 0,
+	WBO_PAYLOAD,
+	WBO_MODIFIED,
+	WBO_SORTINDEX,
+	WBO_TTL,
+	WBO_FIELD_COUNT,
 };
 
-/* container for collection */
+#define WBO_FIELDS {				\
+		{ .name = "id" },			\
+		{ .name = "payload" },			\
+		{ .name = "modified" },			\
+		{ .name = "sortindex" },		\
+		{ .name = "ttl" },			\
+	}
+
+/* interned collection, its handle is the index in the store */
 struct nssync_storage_collection {
 	char *name;
-	time_t modified;
+	double modified; /* server timestamp of last change */
 
-	unsigned int objc; /* number of objects in collection */
-	struct nssync_storage_obj **objv; /* list of objects within collection */
+	char *url; /* url of the collection */
+	size_t url_length;
+
+	enum nssync_fetcher_priority priority; /* class of its fetches */
 };
 
 /* storage server */
 struct nssync_storage {
-	nssync_fetcher *fetcher; /* fetcher to retrive data */
+	struct nssync_context *context; /* context fetches are made from */
+	struct nssync_registration *reg; /* registration storage node is from */
 
 	char *username;
 	char *password;
@@ -53,84 +77,250 @@ struct nssync_storage {
 
 	int collectionc;
 	struct nssync_storage_collection *collections;
+
+	pthread_mutex_t lock; /* node signals, pipeline fetches complete off thread */
+	time_t backoff; /* no requests should be made before this time */
 };
 
-/** fetch the list of collections available on a storage server */
-static nssync_error fetch_collections(struct nssync_storage *store)
+/** account for a storage fetch response and check it for server signals
+ *
+ * The storage server responds with 401 when the user is not known to
+ * the node and 503 when the node is unavailable, in both cases the
+ * node assignment must be looked up again.
+ *
+ * The server may also ask clients to back off for a time.
+ *
+ * Pipeline fetches complete on their own thread so the signals are
+ *   recorded under the store lock.
+ */
+static void
+storage_check_node(struct nssync_storage *store,
+		   struct nssync_fetcher_fetch *fetch,
+		   uint64_t start)
 {
-	enum nssync_error ret;
+	time_t backoff;
+
+	nssync__metrics_since(NSSYNC_METRIC_FETCH, start);
+	nssync__metrics_add(NSSYNC_METRIC_BYTES_DOWNLOADED, fetch->data_used);
+	nssync_context_fetch_complete(store->context, fetch);
+
+	if ((fetch->http_code == 401) || (fetch->http_code == 503)) {
+		log_info(LOG_FIELDS(.account = store->username,
+				    .url = fetch->url),
+			 "storage node responded %ld", fetch->http_code);
+		pthread_mutex_lock(&store->lock);
+		nssync_registration_invalidate_storage_server(store->reg);
+		pthread_mutex_unlock(&store->lock);
+	}
+
+	if (fetch->backoff > 0) {
+		pthread_mutex_lock(&store->lock);
+		backoff = time(NULL) + fetch->backoff;
+		if (backoff > store->backoff) {
+			log_info(LOG_FIELDS(.account = store->username,
+					    .url = fetch->url),
+				 "storage node backoff %us", fetch->backoff);
+			store->backoff = backoff;
+		}
+		pthread_mutex_unlock(&store->lock);
+	}
+}
+
+/* scheduling class of each collection, others are ..._OTHER */
+static const struct {
+	const char *name;
+	enum nssync_fetcher_priority priority;
+} collection_priorities[] = {
+	{ "meta", NSSYNC_FETCHER_PRIORITY_BOOTSTRAP },
+	{ "crypto", NSSYNC_FETCHER_PRIORITY_BOOTSTRAP },
+	{ "tabs", NSSYNC_FETCHER_PRIORITY_TABS },
+	{ "bookmarks", NSSYNC_FETCHER_PRIORITY_BOOKMARKS },
+	{ "history", NSSYNC_FETCHER_PRIORITY_HISTORY },
+};
+
+static enum nssync_fetcher_priority collection_priority(const char *name)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < sizeof(collection_priorities) / sizeof(collection_priorities[0]); idx++) {
+		if (strcmp(collection_priorities[idx].name, name) == 0) {
+			return collection_priorities[idx].priority;
+		}
+	}
+	return NSSYNC_FETCHER_PRIORITY_OTHER;
+}
+
+/** intern a collection name
+ *
+ * Names are only compared here, everything after works with handles.
+ */
+static nssync_error
+collection_intern(struct nssync_storage *store, const char *name, int *handle_out)
+{
+	struct nssync_storage_collection *collections;
+	struct nssync_storage_collection *collection;
+	int colidx; /* collection index */
+
+	for (colidx = 0; colidx < store->collectionc; colidx++) {
+		if (strcmp(store->collections[colidx].name, name) == 0) {
+			*handle_out = colidx;
+			return NSSYNC_ERROR_OK;
+		}
+	}
+
+	collections = nssync__realloc(store->collections,
+				      (colidx + 1) * sizeof(*collections));
+	if (collections == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	store->collections = collections;
+
+	collection = &collections[colidx];
+	collection->modified = 0;
+	collection->name = nssync__strdup(name);
+	if (collection->name == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	if (nssync__saprintf(&collection->url, "%s/storage/%s",
+			     store->base, name) < 0) {
+		nssync__free(collection->name);
+		return NSSYNC_ERROR_NOMEM;
+	}
+	collection->url_length = strlen(collection->url);
+	collection->priority = collection_priority(name);
+
+	store->collectionc++;
+
+	*handle_out = colidx;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_collections_fetch_init(struct nssync_storage *store,
+				      struct nssync_fetcher_fetch *fetch)
+{
+	fetch->username = store->username;
+	fetch->password = store->password;
+	fetch->endpoint = NSSYNC_FETCHER_ENDPOINT_INFO;
+	nssync_registration_fetch_deadline(store->reg, fetch);
+
+	if (nssync__saprintf(&fetch->url, "%s/info/collections", store->base) < 0) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	nssync__metrics_add(NSSYNC_METRIC_REQUESTS_INFO, 1);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_collections_fetch_complete(struct nssync_storage *store,
+					  struct nssync_fetcher_fetch *fetch,
+					  uint64_t start)
+{
+	enum nssync_error ret = fetch->result;
 	json_t *root;
 	json_error_t error;
 	const char *key;
 	json_t *value;
 	int colidx; /* collection index */
-	struct nssync_fetcher_fetch fetch = {
-		.username = store->username,
-		.password = store->password,
-	};
-
-	if (nssync__saprintf(&fetch.url, "%s/info/collections", store->base) < 0) {
-		return -1;
-	}
 
-	ret = store->fetcher(&fetch);
-	free(fetch.url);
+	storage_check_node(store, fetch, start);
+	nssync__free(fetch->url);
+	fetch->url = NULL;
 	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(fetch->data);
+		fetch->data = NULL;
 		return ret;
 	}
 
-	root = json_loads(fetch.data, 0, &error);
-	free(fetch.data);
-	store->collectionc = json_object_size(root);
-	if (store->collectionc == 0) {
-		fprintf(stderr, "error: root is not an object\n");
+	start = nssync__metrics_now();
+	root = json_loads(fetch->data, 0, &error);
+	nssync__metrics_since(NSSYNC_METRIC_PARSE, start);
+	TRACE_END(start, "parse", "info/collections", NULL);
+	nssync__free(fetch->data);
+	fetch->data = NULL;
+	if ((!json_is_object(root)) || (json_object_size(root) == 0)) {
+		log_warning(LOG_FIELDS(.account = store->username,
+				       .error = NSSYNC_ERROR_PROTOCOL),
+			    "collection times are not an object");
 		json_decref(root);
-		return -1;
+		return NSSYNC_ERROR_PROTOCOL;
 	}
 
-	store->collections = calloc(store->collectionc,
-				    sizeof(struct nssync_storage_collection));
-	if (store->collections == NULL) {
-		return -1;
+	for (colidx = 0; colidx < store->collectionc; colidx++) {
+		store->collections[colidx].modified = 0;
 	}
 
-	colidx = 0;
 	json_object_foreach(root, key, value) {
-		store->collections[colidx].name = strdup(key);
-		store->collections[colidx].modified = json_real_value(value);
-		colidx++;
+		ret = collection_intern(store, key, &colidx);
+		if (ret != NSSYNC_ERROR_OK) {
+			json_decref(root);
+			return ret;
+		}
+
+		store->collections[colidx].modified = json_number_value(value);
 	}
 
 	json_decref(root);
 
-	return 0;
+	return NSSYNC_ERROR_OK;
+}
+
+/** fetch the list of collections available on a storage server
+ *
+ * Collections already known have their modification time updated and
+ * new collections are interned. Known collections no longer on the
+ * server have their modification time cleared.
+ */
+static nssync_error fetch_collections(struct nssync_storage *store)
+{
+	enum nssync_error ret;
+	uint64_t start;
+	struct nssync_fetcher_fetch fetch;
+
+	memset(&fetch, 0, sizeof(fetch));
+	ret = nssync_storage_collections_fetch_init(store, &fetch);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	start = nssync__metrics_now();
+	fetch.result = nssync_context_fetch(store->context, &fetch);
+
+	return nssync_storage_collections_fetch_complete(store, &fetch, start);
 }
 
 /* exported interface documented in storage.h */
 nssync_error
-nssync_storage_new(struct nssync_registration *reg,
-		   const char *pathname,
-		   nssync_fetcher *fetcher,
-		   struct nssync_storage **store_out)
+nssync_storage_open(struct nssync_registration *reg,
+		    const char *pathname,
+		    struct nssync_context *context,
+		    struct nssync_storage **store_out)
 {
 	char *server;
 	struct nssync_storage *newstore; /* new storage service */
 	const char *fmt;
-	int ret;
 
-	server = nssync_registration_get_storage_server(reg);
+	server = nssync_registration_cached_storage_server(reg);
 	if (server == NULL) {
-		return -1;
+		return NSSYNC_ERROR_REGISTRATION;
 	}
 
-	newstore = calloc(1, sizeof(*newstore));
+	newstore = nssync__calloc(1, sizeof(*newstore));
 	if (newstore == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
 
-	newstore->fetcher = fetcher;
-	newstore->username = strdup(nssync_registration_get_username(reg));
-	newstore->password = strdup(nssync_registration_get_password(reg));
+	pthread_mutex_init(&newstore->lock, NULL);
+	newstore->context = context;
+	newstore->reg = reg;
+	newstore->username = nssync__strdup(nssync_registration_get_username(reg));
+	newstore->password = nssync__strdup(nssync_registration_get_password(reg));
 
 	/* alter the format specifier depending on separator requirements */
 	if (server[strlen(server) - 1] ==  '/') {
@@ -152,7 +342,39 @@ nssync_storage_new(struct nssync_registration *reg,
 	if (nssync__saprintf(&newstore->base, fmt, server, pathname,
 		     newstore->username) < 0) {
 		nssync_storage_free(newstore);
-		return -1;
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	*store_out = newstore;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_new(struct nssync_registration *reg,
+		   const char *pathname,
+		   struct nssync_context *context,
+		   struct nssync_storage **store_out)
+{
+	struct nssync_storage *newstore; /* new storage service */
+	struct nssync_fetcher_fetch fetch;
+	int ret;
+
+	if (nssync_registration_get_storage_server(reg) == NULL) {
+		/* a lookup given up on reports why */
+		memset(&fetch, 0, sizeof(fetch));
+		nssync_registration_fetch_deadline(reg, &fetch);
+		ret = nssync_fetcher_check(&fetch);
+		if (ret == NSSYNC_ERROR_OK) {
+			ret = NSSYNC_ERROR_REGISTRATION;
+		}
+		return ret;
+	}
+
+	ret = nssync_storage_open(reg, pathname, context, &newstore);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
 	}
 
 	/* fetch the collection information */
@@ -167,255 +389,738 @@ nssync_storage_new(struct nssync_registration *reg,
 	return NSSYNC_ERROR_OK;
 }
 
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_collections_refresh(struct nssync_storage *store)
+{
+	return fetch_collections(store);
+}
+
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_collection_intern(struct nssync_storage *store,
+				 const char *name,
+				 int *collection_out)
+{
+	return collection_intern(store, name, collection_out);
+}
+
+/* exported interface documented in storage.h */
+const char *
+nssync_storage_collection_name(struct nssync_storage *store, int collection)
+{
+	return store->collections[collection].name;
+}
+
+/* exported interface documented in storage.h */
+double
+nssync_storage_collection_modified(struct nssync_storage *store,
+				   int collection)
+{
+	return store->collections[collection].modified;
+}
+
+/* exported interface documented in storage.h */
+time_t
+nssync_storage_get_backoff(struct nssync_storage *store)
+{
+	time_t backoff;
+
+	/* other sessions on the node may have been asked to back off */
+	backoff = nssync_context_get_backoff(store->context, store->base);
+	pthread_mutex_lock(&store->lock);
+	if (backoff < store->backoff) {
+		backoff = store->backoff;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	return backoff;
+}
+
 /* exported interface documented in storage.h */
 nssync_error
 nssync_storage_free(struct nssync_storage *store)
 {
-	free(store->base);
-	free(store->username);
-	free(store->password);
-	free(store);
+	int colidx;
+
+	if (store == NULL) {
+		return NSSYNC_ERROR_OK;
+	}
+
+	for (colidx = 0; colidx < store->collectionc; colidx++) {
+		nssync__free(store->collections[colidx].name);
+		nssync__free(store->collections[colidx].url);
+	}
+	nssync__free(store->collections);
+	nssync__free(store->base);
+	nssync__free(store->username);
+	nssync__free(store->password);
+	pthread_mutex_destroy(&store->lock);
+	nssync__free(store);
+
+	return NSSYNC_ERROR_OK;
+}
+
+
+/** fill a storage object from the fields of a parsed WBO
+ *
+ * The id and payload are views of the parsed response.
+ */
+static nssync_error
+storage_obj_from_wbo(const struct nssync_wbo_field *fieldv,
+		     struct nssync_storage_obj *obj)
+{
+	/* id string */
+	if (fieldv[WBO_ID].type != NSSYNC_WBO_STRING) {
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL),
+			    "WBO id is not a string");
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+	obj->id = fieldv[WBO_ID].str;
+
+	/* payload string */
+	if (fieldv[WBO_PAYLOAD].type != NSSYNC_WBO_STRING) {
+		log_warning(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL),
+			    "WBO payload is not a string");
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+	obj->payload = fieldv[WBO_PAYLOAD].str;
+	obj->payload_length = fieldv[WBO_PAYLOAD].length;
+
+	/* modified time */
+	if (fieldv[WBO_MODIFIED].type == NSSYNC_WBO_NUMBER) {
+		obj->modified = fieldv[WBO_MODIFIED].number;
+	}
+
+	/* ttl integer */
+	if (fieldv[WBO_TTL].type == NSSYNC_WBO_NUMBER) {
+		obj->ttl = fieldv[WBO_TTL].number;
+	}
+
+	/* sortindex integer */
+	if (fieldv[WBO_SORTINDEX].type == NSSYNC_WBO_NUMBER) {
+		obj->sortindex = fieldv[WBO_SORTINDEX].number;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** copy a storage object into a single allocation */
+static nssync_error
+storage_obj_dup(const struct nssync_storage_obj *obj,
+		struct nssync_storage_obj **obj_out)
+{
+	struct nssync_storage_obj *newobj;
+	size_t id_length;
+	char *data;
+
+	id_length = strlen(obj->id) + 1;
+
+	newobj = nssync__malloc(sizeof(*newobj) + id_length +
+				obj->payload_length + 1);
+	if (newobj == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	*newobj = *obj;
+
+	/* strings follow the header */
+	data = (char *)(newobj + 1);
+	memcpy(data, obj->id, id_length);
+	newobj->id = data;
+
+	data += id_length;
+	memcpy(data, obj->payload, obj->payload_length);
+	data[obj->payload_length] = 0;
+	newobj->payload = data;
+
+	*obj_out = newobj;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_obj_fetch_init(struct nssync_storage *store,
+			      int collection,
+			      const char *object,
+			      struct nssync_fetcher_fetch *fetch)
+{
+	fetch->username = store->username;
+	fetch->password = store->password;
+	fetch->endpoint = NSSYNC_FETCHER_ENDPOINT_OBJECT;
+	fetch->priority = store->collections[collection].priority;
+	nssync_registration_fetch_deadline(store->reg, fetch);
+
+	/* build object url */
+	if (nssync__saprintf(&fetch->url, "%s/%s",
+			     store->collections[collection].url, object) < 0) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	nssync__metrics_add(NSSYNC_METRIC_REQUESTS_OBJECT, 1);
 
 	return NSSYNC_ERROR_OK;
 }
 
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_obj_fetch_complete(struct nssync_storage *store,
+				  int collection,
+				  struct nssync_fetcher_fetch *fetch,
+				  uint64_t start,
+				  struct nssync_storage_obj **obj_out)
+{
+	enum nssync_error ret = fetch->result;
+	struct nssync_wbo_field fieldv[WBO_FIELD_COUNT] = WBO_FIELDS;
+	struct nssync_storage_obj obj = { NULL, NULL, 0, 0, 0, 0 };
+
+	storage_check_node(store, fetch, start);
+	if (ret != NSSYNC_ERROR_OK) {
+		goto obj_fetch_complete_error;
+	}
+
+	start = nssync__metrics_now();
+	ret = nssync_wbo_parse(fetch->data,
+			       (char *)fetch->data + fetch->data_used,
+			       fieldv, WBO_FIELD_COUNT, NULL);
+	nssync__metrics_since(NSSYNC_METRIC_PARSE, start);
+	TRACE_END(start, "parse", "object", fetch->url);
+	if (ret != NSSYNC_ERROR_OK) {
+		log_warning(LOG_FIELDS(.account = store->username,
+				       .collection = store->collections[collection].name,
+				       .url = fetch->url,
+				       .error = ret),
+			    "object reply is not a WBO");
+	} else {
+		ret = storage_obj_from_wbo(fieldv, &obj);
+	}
+	if (ret == NSSYNC_ERROR_OK) {
+		nssync__metrics_add(NSSYNC_METRIC_RECORDS_FETCHED, 1);
+		ret = storage_obj_dup(&obj, obj_out);
+	}
+
+obj_fetch_complete_error:
+	nssync__free(fetch->data);
+	fetch->data = NULL;
+	nssync__free(fetch->url);
+	fetch->url = NULL;
+
+	return ret;
+}
 
 /* exported interface documented in storage.h */
 nssync_error
 nssync_storage_obj_fetch(struct nssync_storage *store,
-			 const char *collection,
+			 int collection,
 			 const char *object,
 			 struct nssync_storage_obj **obj_out)
 {
 	enum nssync_error ret;
-	struct nssync_storage_obj *obj;
-	char *url;
-	json_t *root;
-	json_error_t error;
-	json_t *value;
-
-	struct nssync_fetcher_fetch fetch = {
-		.username = store->username,
-		.password = store->password,
-		.data = NULL,
-	};
-
-	/* build object url */
-	if (nssync__saprintf(&url, "%s/storage/%s/%s", store->base,
-			    collection, object) < 0) {
-		return NSSYNC_ERROR_NOMEM;
-	}
+	uint64_t start;
+	struct nssync_fetcher_fetch fetch;
 
-	/* issue fetch for ojbect */
-	fetch.url = url;
-	ret = store->fetcher(&fetch);
-	free(url);
+	memset(&fetch, 0, sizeof(fetch));
+	ret = nssync_storage_obj_fetch_init(store, collection, object, &fetch);
 	if (ret != NSSYNC_ERROR_OK) {
 		return ret;
 	}
 
-	obj = calloc(1, sizeof(*obj));
-	if (obj == NULL) {
-		free(fetch.data);
-		return NSSYNC_ERROR_NOMEM;
-	}
+	/* issue fetch for ojbect */
+	start = nssync__metrics_now();
+	fetch.result = nssync_context_fetch(store->context, &fetch);
 
-	root = json_loads(fetch.data, 0, &error);
-	free(fetch.data);
-	if (!root) {
-		debugf("error: on line %d of reply: %s\n",
-			error.line, error.text);
-		return NSSYNC_ERROR_PROTOCOL;
+	return nssync_storage_obj_fetch_complete(store, collection, &fetch,
+						 start, obj_out);
+}
+
+/* checkpoint file of a collection download of an account by an owner */
+#define CHECKPOINT_FILE "%s/checkpoint-%s-%s-%s-%.2f"
+
+/* longest line of a checkpoint file */
+#define CHECKPOINT_LINE 128
+
+/** check a name from the server is safe to use in a file name
+ *
+ * Collection names come from the server so only letters, digits,
+ *   underscore and hyphen are allowed, keeping paths in the cachedir.
+ */
+static bool checkpoint_name_valid(const char *name)
+{
+	const char *c;
+
+	if ((name == NULL) || (*name == 0)) {
+		return false;
+	}
+	for (c = name; *c != 0; c++) {
+		if (!(((*c >= 'a') && (*c <= 'z')) ||
+		      ((*c >= 'A') && (*c <= 'Z')) ||
+		      ((*c >= '0') && (*c <= '9')) ||
+		      (*c == '_') ||
+		      (*c == '-'))) {
+			return false;
+		}
 	}
+	return true;
+}
 
-	if (!json_is_object(root)) {
-		debugf("error: root is not an object\n");
-		json_decref(root);
-		return NSSYNC_ERROR_PROTOCOL;
+/** name of the checkpoint file of a download or NULL if it is not saved */
+static char *
+checkpoint_file(struct nssync_storage *store,
+		int collection,
+		const struct nssync_storage_checkpoint *checkpoint,
+		double newer)
+{
+	const char *cachedir;
+	char *pathname;
+
+	cachedir = nssync_context_get_cachedir(store->context);
+	if ((cachedir == NULL) ||
+	    (checkpoint->owner[0] == 0) ||
+	    !checkpoint_name_valid(store->username) ||
+	    !checkpoint_name_valid(store->collections[collection].name) ||
+	    (nssync__saprintf(&pathname, CHECKPOINT_FILE, cachedir,
+			      store->username,
+			      store->collections[collection].name,
+			      checkpoint->owner,
+			      newer) < 0)) {
+		return NULL;
 	}
 
-	/* id string */
-	value = json_object_get(root, "id");
-	if (!json_is_string(value)) {
-		debugf("error: id is not a string\n");
-		json_decref(root);
-		return NSSYNC_ERROR_PROTOCOL;
+	return pathname;
+}
+
+/* exported interface documented in storage.h */
+bool
+nssync_storage_checkpoint_load(struct nssync_storage *store,
+			       int collection,
+			       double newer,
+			       struct nssync_storage_checkpoint *checkpoint)
+{
+	char line[CHECKPOINT_LINE];
+	char *pathname;
+	FILE *fp;
+	bool found = false;
+
+	pathname = checkpoint_file(store, collection, checkpoint, newer);
+	if (pathname == NULL) {
+		return false;
 	}
 
-	obj->id = strdup(json_string_value(value));
-	if (obj->id == NULL) {
-		json_decref(root);
-		return NSSYNC_ERROR_NOMEM;
+	fp = fopen(pathname, "r");
+	nssync__free(pathname);
+	if (fp == NULL) {
+		return false;
 	}
 
-	/* payload string */
-	value = json_object_get(root, "payload");
-	if (!json_is_string(value)) {
-		debugf("error: payload is not a string\n");
-		json_decref(root);
-		return NSSYNC_ERROR_PROTOCOL;
+	if ((fgets(line, sizeof(line), fp) != NULL) &&
+	    (sscanf(line, "%lf %lf %d %lf",
+		    &checkpoint->from,
+		    &checkpoint->unmodified,
+		    &checkpoint->offset,
+		    &checkpoint->high_water) == 4)) {
+		checkpoint->active = true;
+		checkpoint->newer = newer;
+		found = true;
 	}
+	fclose(fp);
 
-	obj->payload = strdup(json_string_value(value));
-	if (obj->payload == NULL) {
-		json_decref(root);
-		return NSSYNC_ERROR_NOMEM;
+	return found;
+}
+
+/* exported interface documented in storage.h */
+void
+nssync_storage_checkpoint_save(struct nssync_storage *store,
+			       int collection,
+			       const struct nssync_storage_checkpoint *checkpoint)
+{
+	char *pathname;
+	char *tmpname;
+	FILE *fp;
+	int fd;
+
+	pathname = checkpoint_file(store, collection, checkpoint,
+				   checkpoint->newer);
+	if (pathname == NULL) {
+		return;
 	}
 
-	/* modified time */
-	value = json_object_get(root, "payload");
-	if (json_is_real(value)) {
-		obj->modified = json_real_value(value);
+	if (!checkpoint->active) {
+		remove(pathname);
+		nssync__free(pathname);
+		return;
 	}
 
-	/* ttl integer */
-	value = json_object_get(root, "ttl");
-	if (json_is_integer(value)) {
-		obj->ttl = json_integer_value(value);
+	if (nssync__saprintf(&tmpname, "%s.XXXXXX", pathname) < 0) {
+		nssync__free(pathname);
+		return;
 	}
 
-	/* sortindex integer */
-	value = json_object_get(root, "sortindex");
-	if (json_is_integer(value)) {
-		obj->sortindex = json_integer_value(value);
+	/* replaced whole so a crash leaves the old or new checkpoint */
+	fp = NULL;
+	fd = mkstemp(tmpname);
+	if (fd != -1) {
+		fp = fdopen(fd, "w");
+		if (fp == NULL) {
+			close(fd);
+			remove(tmpname);
+		}
+	}
+	if (fp != NULL) {
+		fprintf(fp, "%.2f %.2f %d %.2f\n",
+			checkpoint->from,
+			checkpoint->unmodified,
+			checkpoint->offset,
+			checkpoint->high_water);
+		if (fclose(fp) == 0) {
+			rename(tmpname, pathname);
+		} else {
+			remove(tmpname);
+		}
 	}
 
-	json_decref(root);
+	nssync__free(tmpname);
+	nssync__free(pathname);
+}
 
-	*obj_out = obj;
+/* space for the query appended to a collection url */
+#define COLLECTION_QUERY_SIZE 128
 
-	return NSSYNC_ERROR_OK;
-}
+/* template of the files collection listings are downloaded to */
+#define COLLECTION_FILE "%s/collection-XXXXXX"
+
+/* a file a collection listing is downloaded to and its mapping */
+struct collection_file {
+	int fd;
+	void *map;
+	size_t length;
+};
 
 struct collection_fetch {
 	struct nssync_fetcher_fetch fetch;
-	struct nssync_storage_obj ***pobjv;
+	struct nssync_storage *store;
+	struct nssync_arena *arena; /* arena objects are allocated from */
+	struct collection_file *file; /* file downloaded to or NULL */
+	struct nssync_storage_obj **pobjv;
 	int *pobjc;
+	uint64_t start; /* time fetch was issued */
 };
 
+/* release a collection response held by an arena */
+static void storage_data_release(void *data)
+{
+	nssync__free(data);
+}
+
+/* release a collection file held by an arena */
+static void storage_file_release(void *arg)
+{
+	struct collection_file *file = arg;
+
+	if (file->map != NULL) {
+		munmap(file->map, file->length);
+	}
+	close(file->fd);
+}
+
+/** download a collection listing to a file in the cache directory
+ *
+ * The file is unlinked at once so nothing is left behind, it is
+ *   closed when the arena is released. Failing to create it leaves
+ *   the fetch to the heap.
+ */
+static void collection_file(struct collection_fetch *cfetch, const char *cachedir)
+{
+	struct collection_file *file;
+	char *pathname;
+	int fd;
+
+	file = nssync_arena_calloc(cfetch->arena, 1, sizeof(*file));
+	if ((file == NULL) ||
+	    (nssync__saprintf(&pathname, COLLECTION_FILE, cachedir) < 0)) {
+		return;
+	}
+
+	fd = mkstemp(pathname);
+	if (fd == -1) {
+		log_warning(LOG_FIELDS(.account = cfetch->store->username),
+			    "unable to create %s: %s", pathname, strerror(errno));
+		nssync__free(pathname);
+		return;
+	}
+	unlink(pathname);
+	nssync__free(pathname);
+
+	file->fd = fd;
+	if (nssync_arena_cleanup(cfetch->arena, storage_file_release, file) != NSSYNC_ERROR_OK) {
+		close(fd);
+		return;
+	}
+
+	cfetch->file = file;
+	cfetch->fetch.flags |= NSSYNC_FETCHER_FILE;
+	cfetch->fetch.fd = fd;
+}
+
+/** map a downloaded collection listing
+ *
+ * The mapping is private so parsing in place never changes the file.
+ *   A zero byte is written after the listing and mapped with it as the
+ *   parser needs the buffer null terminated.
+ */
+static enum nssync_error
+collection_file_map(struct collection_file *file, size_t length, char **data_out)
+{
+	static char empty[1];
+	void *map;
+
+	if (length == 0) {
+		*data_out = empty;
+		return NSSYNC_ERROR_OK;
+	}
+
+	if (pwrite(file->fd, "", 1, length) != 1) {
+		return NSSYNC_ERROR_FETCH;
+	}
+
+	map = mmap(NULL, length + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, file->fd, 0);
+	if (map == MAP_FAILED) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	posix_madvise(map, length + 1, POSIX_MADV_SEQUENTIAL);
+
+	file->map = map;
+	file->length = length + 1;
+	*data_out = map;
+
+	return NSSYNC_ERROR_OK;
+}
+
 static nssync_error
 nssync_storage_collection_fetch_complete(struct nssync_fetcher_fetch *fetch)
 {
 	struct collection_fetch *cfetch = (struct collection_fetch *)fetch;
 	nssync_error ret;
-	json_t *root;
-	json_error_t error;
+	struct nssync_wbo_field fieldv[WBO_FIELD_COUNT] = WBO_FIELDS;
+	struct nssync_storage_obj *objv;
+	int objc;
+	int count;
+	char *data;
+	char *end;
+	bool found;
+	uint64_t start;
+
+	storage_check_node(cfetch->store, &cfetch->fetch, cfetch->start);
 
 	ret = cfetch->fetch.result;
 	if (ret != NSSYNC_ERROR_OK) {
 		goto fetch_error;
 	}
 
-	root = json_loads(cfetch->fetch.data, 0, &error);
-	if (!root) {
-		debugf("error: on line %d of reply: %s\n",
-			error.line, error.text);
-		ret = NSSYNC_ERROR_PROTOCOL;
-		goto fetch_error;
+	start = nssync__metrics_now();
+
+	data = cfetch->fetch.data;
+	if ((data == NULL) && (cfetch->file != NULL)) {
+		ret = collection_file_map(cfetch->file, cfetch->fetch.data_used, &data);
+		if (ret != NSSYNC_ERROR_OK) {
+			log_warning(LOG_FIELDS(.account = cfetch->store->username,
+					       .url = cfetch->fetch.url,
+					       .error = ret),
+				    "unable to map collection listing: %s",
+				    strerror(errno));
+			goto fetch_error;
+		}
 	}
+	end = data + cfetch->fetch.data_used;
 
-	if (!json_is_object(root)) {
-		debugf("error: root is not an object\n");
-		json_decref(root);
-		ret = NSSYNC_ERROR_PROTOCOL;
+	/* full collection listings are an array or lines of WBO */
+	ret = nssync_wbo_list_count(data, end, &count);
+	if (ret != NSSYNC_ERROR_OK) {
+		log_warning(LOG_FIELDS(.account = cfetch->store->username,
+				       .url = cfetch->fetch.url,
+				       .error = ret),
+			    "collection listing is not a list of WBO");
 		goto fetch_error;
 	}
 
-#if 0
-	enum nssync_error ret;
-	struct nssync_storage_obj *obj;
-	json_t *root;
-	json_error_t error;
-	json_t *payload;
-	obj = calloc(1, sizeof(*obj));
-	if (obj == NULL) {
-		free(fetch.data);
-		return NSSYNC_ERROR_NOMEM;
+	/* the objects are views of the response so it lives as long */
+	if (cfetch->fetch.data != NULL) {
+		ret = nssync_arena_cleanup(cfetch->arena, storage_data_release, data);
+		if (ret != NSSYNC_ERROR_OK) {
+			goto fetch_error;
+		}
+		cfetch->fetch.data = NULL;
 	}
 
-	payload = json_object_get(root, "payload");
-	if (!json_is_string(payload)) {
-		fprintf(stderr, "error: payload is not a string\n");
-		json_decref(root);
-		return NSSYNC_ERROR_PROTOCOL;
+	/* one slab of object headers for the whole listing */
+	objv = nssync_arena_calloc(cfetch->arena, count + 1, sizeof(*objv));
+	if (objv == NULL) {
+		ret = NSSYNC_ERROR_NOMEM;
+		goto fetch_error;
 	}
 
-		obj->payload = (uint8_t*)strdup(json_string_value(payload));
-		if (obj->payload == NULL) {
-			json_decref(root);
-			return NSSYNC_ERROR_NOMEM;
+	for (objc = 0; objc < count; objc++) {
+		ret = nssync_wbo_list_next(&data, end,
+					   fieldv, WBO_FIELD_COUNT, &found);
+		if ((ret != NSSYNC_ERROR_OK) || (!found)) {
+			break;
 		}
 
-	json_decref(root);
+		ret = storage_obj_from_wbo(fieldv, &objv[objc]);
+		if (ret != NSSYNC_ERROR_OK) {
+			break;
+		}
+	}
+
+	nssync__metrics_since(NSSYNC_METRIC_PARSE, start);
+	TRACE_END(start, "parse", "collection", cfetch->fetch.url);
+
+	if (ret != NSSYNC_ERROR_OK) {
+		goto fetch_error;
+	}
 
-	*obj_out = obj;
+	nssync__metrics_add(NSSYNC_METRIC_RECORDS_FETCHED, objc);
 
-	ret = NSSYNC_ERROR_OK;
-#else
-	ret = NSSYNC_ERROR_PROTOCOL;
-#endif
+	*cfetch->pobjv = objv;
+	*cfetch->pobjc = objc;
 
 fetch_error:
 
-	free(cfetch->fetch.data);
-	free(cfetch->fetch.url);
-	free(cfetch);
+	nssync__free(cfetch->fetch.data);
 
 	return ret;
 }
 
+/* exported interface documented in storage.h */
+nssync_error
+nssync_storage_collection_ref_init(struct nssync_storage *store,
+				   int collection,
+				   struct nssync_storage_collection_ref *ref)
+{
+	struct nssync_storage_collection *col = &store->collections[collection];
+
+	ref->url = nssync__strdup(col->url);
+	if (ref->url == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+	ref->url_length = col->url_length;
+	ref->priority = col->priority;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in storage.h */
+void
+nssync_storage_collection_ref_fini(struct nssync_storage_collection_ref *ref)
+{
+	nssync__free(ref->url);
+	ref->url = NULL;
+}
+
 /* exported interface documented in storage.h */
 nssync_error
 nssync_storage_collection_fetch_async(struct nssync_storage *store,
-				      const char *collection,
-				      struct nssync_storage_obj ***objv_out,
+				      struct nssync_arena *arena,
+				      const struct nssync_storage_collection_ref *ref,
+				      double newer,
+				      double unmodified,
+				      int offset,
+				      int limit,
+				      struct nssync_storage_obj **objv_out,
 				      int *objc_out)
 {
 	struct collection_fetch *cfetch;
+	const char *cachedir;
+	char *url;
+	char *query;
+	size_t query_size = COLLECTION_QUERY_SIZE;
+	int length;
 
 	/* setup the fetch */
-	cfetch = calloc(1, sizeof(*cfetch));
+	cfetch = nssync_arena_calloc(arena, 1, sizeof(*cfetch));
 	if (cfetch == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
 
+	cfetch->store = store;
+	cfetch->arena = arena;
 	cfetch->pobjv = objv_out;
 	cfetch->pobjc = objc_out;
 
-	if (nssync__saprintf(&cfetch->fetch.url,
-			     "%s/storage/%s?full=1",
-			     store->base, collection) < 0) {
-		free(cfetch);
+	/* the collection url is prebuilt so only the query is formatted */
+	url = nssync_arena_alloc(arena, ref->url_length + COLLECTION_QUERY_SIZE);
+	if (url == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
+	memcpy(url, ref->url, ref->url_length);
+	query = url + ref->url_length;
+	length = snprintf(query, query_size, "?full=1");
+	if (newer > 0) {
+		length += snprintf(query + length, query_size - length,
+				   "&newer=%.2f", newer);
+	}
+	if (limit > 0) {
+		snprintf(query + length, query_size - length,
+			 "&sort=oldest&limit=%d&offset=%d", limit, offset);
+	}
+	cfetch->fetch.url = url;
 
 	cfetch->fetch.username = store->username;
 	cfetch->fetch.password = store->password;
 	cfetch->fetch.completion = nssync_storage_collection_fetch_complete;
+	cfetch->fetch.endpoint = NSSYNC_FETCHER_ENDPOINT_COLLECTION;
+	cfetch->fetch.priority = ref->priority;
+	cfetch->fetch.unmodified = unmodified;
+	nssync_registration_fetch_deadline(store->reg, &cfetch->fetch);
+
+	cachedir = nssync_context_get_cachedir(store->context);
+	if (cachedir != NULL) {
+		collection_file(cfetch, cachedir);
+	}
 
-	return store->fetcher(&cfetch->fetch);
+	nssync__metrics_add(NSSYNC_METRIC_REQUESTS_COLLECTION, 1);
+	cfetch->start = nssync__metrics_now();
+
+	return nssync_context_fetch(store->context, &cfetch->fetch);
 }
 
 nssync_error
 nssync_storage_collection_enum(struct nssync_storage *store,
-			       const char *collection,
+			       int collection,
 			       struct nssync_storage_obj **obj_out)
 {
 	return NSSYNC_ERROR_PROTOCOL;
 }
 
+/* exported interface documented in storage.h */
 int
 nssync_storage_obj_free(struct nssync_storage_obj *obj)
 {
-	if (obj->payload) {
-		free(obj->payload);
-	}
-	free(obj);
+	/* strings are held in the same allocation */
+	nssync__free(obj);
 	return 0;
 }
 
-char *
-nssync_storage_obj_payload(struct nssync_storage_obj *obj)
+/* exported interface documented in storage.h */
+const char *
+nssync_storage_obj_payload(struct nssync_storage_obj *obj,
+			   size_t *payload_length_out)
 {
+	if (payload_length_out != NULL) {
+		*payload_length_out = obj->payload_length;
+	}
 	return obj->payload;
 }
+
+/* exported interface documented in storage.h */
+const char *
+nssync_storage_obj_id(struct nssync_storage_obj *obj)
+{
+	return obj->id;
+}
+
+/* exported interface documented in storage.h */
+double
+nssync_storage_obj_modified(struct nssync_storage_obj *obj)
+{
+	return obj->modified;
+}
@@ -1,20 +1,178 @@
 struct nssync_storage;
-struct nssync_storage_obj;
+struct nssync_arena;
+
+/** container for object
+ *
+ * Defined here so collection listings can be a slab of objects. The
+ *   id and payload are views, for objects from a collection listing
+ *   they point into the retained response rather than being copied.
+ */
+struct nssync_storage_obj {
+	const char *id; /* null terminated record id */
+	const char *payload; /* record payload */
+	size_t payload_length; /* length of payload */
+	double modified; /* server timestamp of last change */
+	int sortindex;
+	int ttl;
+};
 
 /** create a new storage state for retriving objects */
-nssync_error nssync_storage_new(struct nssync_registration *registration, const char *pathname, nssync_fetcher *fetcher, struct nssync_storage **store_out);
+nssync_error nssync_storage_new(struct nssync_registration *registration, const char *pathname, struct nssync_context *context, struct nssync_storage **store_out);
 nssync_error nssync_storage_free(struct nssync_storage *store);
 
-/** fetch storage object from storage server */
-enum nssync_error nssync_storage_obj_fetch(struct nssync_storage *store, const char *collection, const char *object, struct nssync_storage_obj **obj_out);
+/** create a storage state without fetching the collection times
+ *
+ * The storage server node must already be known to the registration.
+ */
+nssync_error nssync_storage_open(struct nssync_registration *registration, const char *pathname, struct nssync_context *context, struct nssync_storage **store_out);
+
+/** set up a fetch of the collection modification times
+ *
+ * The fetch is issued by the caller and finished with
+ *   nssync_storage_collections_fetch_complete() which releases its
+ *   url and data.
+ */
+nssync_error nssync_storage_collections_fetch_init(struct nssync_storage *store, struct nssync_fetcher_fetch *fetch);
+
+/** finish a fetch of the collection modification times
+ *
+ * @param start Time the fetch was issued from nssync__metrics_now().
+ */
+nssync_error nssync_storage_collections_fetch_complete(struct nssync_storage *store, struct nssync_fetcher_fetch *fetch, uint64_t start);
+
+/** refetch the collection modification times from the server */
+nssync_error nssync_storage_collections_refresh(struct nssync_storage *store);
+
+/** intern a collection name
+ *
+ * Collections are referred to by handle everywhere else so requests
+ *   need no name lookups or url formatting. Collections on the server
+ *   are interned when the collection times are fetched, others may be
+ *   interned before they exist.
+ *
+ * @param collection_out Set to the collection handle.
+ */
+nssync_error nssync_storage_collection_intern(struct nssync_storage *store, const char *name, int *collection_out);
+
+/** get the name of an interned collection */
+const char *nssync_storage_collection_name(struct nssync_storage *store, int collection);
+
+/** get the server modification time of a collection
+ *
+ * @return The modification time or 0 if the collection is not present.
+ */
+double nssync_storage_collection_modified(struct nssync_storage *store, int collection);
+
+/** get the time before which the server asked for no requests */
+time_t nssync_storage_get_backoff(struct nssync_storage *store);
+
+/** fetch storage object from storage server
+ *
+ * The object is a single allocation released with
+ *   nssync_storage_obj_free(), its payload is null terminated.
+ */
+enum nssync_error nssync_storage_obj_fetch(struct nssync_storage *store, int collection, const char *object, struct nssync_storage_obj **obj_out);
+
+/** set up a fetch of a storage object
+ *
+ * The fetch is issued by the caller and finished with
+ *   nssync_storage_obj_fetch_complete() which releases its url and
+ *   data.
+ */
+enum nssync_error nssync_storage_obj_fetch_init(struct nssync_storage *store, int collection, const char *object, struct nssync_fetcher_fetch *fetch);
 
-nssync_error nssync_storage_collection_fetch_async(struct nssync_storage *store, const char *collection, struct nssync_storage_obj ***objv_out, int *objc_out);
+/** finish a fetch of a storage object
+ *
+ * @param start Time the fetch was issued from nssync__metrics_now().
+ */
+enum nssync_error nssync_storage_obj_fetch_complete(struct nssync_storage *store, int collection, struct nssync_fetcher_fetch *fetch, uint64_t start, struct nssync_storage_obj **obj_out);
+
+/** what a fetch of a collection needs, copied from the collection
+ *
+ * Interning a collection may move the others, so fetches made off the
+ *   thread interning collections use a copy made beforehand.
+ */
+struct nssync_storage_collection_ref {
+	char *url; /* url of the collection */
+	size_t url_length;
+	enum nssync_fetcher_priority priority; /* class of its fetches */
+};
+
+/** copy what a fetch of a collection needs
+ *
+ * The copy is released with nssync_storage_collection_ref_fini().
+ */
+nssync_error nssync_storage_collection_ref_init(struct nssync_storage *store, int collection, struct nssync_storage_collection_ref *ref);
+
+void nssync_storage_collection_ref_fini(struct nssync_storage_collection_ref *ref);
+
+/** fetch the objects in a collection
+ *
+ * Only objects modified after newer are fetched unless it is 0. The
+ *   object vector is set once the fetch completes. It is a single slab
+ *   of objects whose ids and payloads are views of the response, all
+ *   of which is held by the arena and released with it. When the
+ *   context has a cache directory the response is downloaded to a
+ *   file there and the views are of a mapping of it.
+ *
+ * A collection may be fetched in pages of limit objects starting at
+ *   offset. Pages are ordered oldest first so objects changed while
+ *   paging move to the end rather than shifting the pages before.
+ *
+ * @param unmodified Collection time the listing is conditional on or 0,
+ *   if the collection changed since the fetch fails with status 412.
+ * @param offset Number of objects to skip.
+ * @param limit Most objects to fetch or 0 for all of them.
+ */
+nssync_error nssync_storage_collection_fetch_async(struct nssync_storage *store, struct nssync_arena *arena, const struct nssync_storage_collection_ref *ref, double newer, double unmodified, int offset, int limit, struct nssync_storage_obj **objv_out, int *objc_out);
+
+/** progress of a paged collection download
+ *
+ * Pages are ordered oldest first, so once the records up to offset
+ *   are delivered a download can continue from there as long as the
+ *   collection is unchanged, or from after high_water if it changed.
+ */
+struct nssync_storage_checkpoint {
+	char owner[24]; /* consumer the download is for, empty to not save it */
+	bool active; /* a download stopped part way */
+	double newer; /* newer time the download was asked for */
+	double from; /* newer time the pages are fetched with */
+	double unmodified; /* collection time the pages are conditional on */
+	int offset; /* records delivered from the first page */
+	double high_water; /* every record up to this time is delivered */
+};
+
+/** read the saved checkpoint of a collection download
+ *
+ * Checkpoints are only saved with a cache directory and an owner,
+ *   each owner has its own so a download is only resumed by the
+ *   consumer that was delivered the records before it.
+ *
+ * @param newer Newer time of the download.
+ * @return true if a checkpoint was read.
+ */
+bool nssync_storage_checkpoint_load(struct nssync_storage *store, int collection, double newer, struct nssync_storage_checkpoint *checkpoint);
+
+/** save the checkpoint of a collection download
+ *
+ * An inactive checkpoint removes the one saved.
+ */
+void nssync_storage_checkpoint_save(struct nssync_storage *store, int collection, const struct nssync_storage_checkpoint *checkpoint);
 
 nssync_error
 nssync_storage_collection_enum(struct nssync_storage *store,
-			       const char *collection,
+			       int collection,
 			       struct nssync_storage_obj **obj_out);
 
 int nssync_storage_obj_free(struct nssync_storage_obj *obj);
 
-char *nssync_storage_obj_payload(struct nssync_storage_obj *obj);
+
+/** get a view of an objects payload
+ *
+ * @param payload_length_out Set to the payload length if not NULL.
+ */
+const char *nssync_storage_obj_payload(struct nssync_storage_obj *obj, size_t *payload_length_out);
+
+/** get an objects null terminated id */
+const char *nssync_storage_obj_id(struct nssync_storage_obj *obj);
+double nssync_storage_obj_modified(struct nssync_storage_obj *obj);
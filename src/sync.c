@@ -8,28 +8,98 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <jansson.h>
 
 #include <nssync/nssync.h>
 
+#include "alloc.h"
 #include "crypto.h"
 #include "registration.h"
 #include "storage.h"
+#include "context.h"
+#include "idset.h"
+#include "arena.h"
+#include "pipeline.h"
+#include "wbo.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
 /* supported storage version */
 #define STORAGE_VERSION 5
 
+/* seconds between polls of the server while changes are happening */
+#define SCHEDULE_ACTIVE_INTERVAL 60
+
+/* longest seconds between polls when nothing has changed */
+#define SCHEDULE_IDLE_INTERVAL (30 * 60)
+
+/* account a session logs messages against */
+#define SYNC_ACCOUNT(sync) nssync_registration_get_username((sync)->reg)
+
+/* keys a session decrypts collections with
+ *
+ * A set is never changed once published. Rotation builds a new set
+ *   and swaps the sessions pointer so readers need no lock, replaced
+ *   sets are retired until no reader can still be using them.
+ */
+struct sync_keys {
+	struct sync_keys *retired; /* next set awaiting release */
+	struct nssync_crypto_keybundle *default_keybundle;
+	int keybundlec;
+	struct nssync_crypto_keybundle **keybundlev; /* keys by collection handle */
+	char **namev; /* collection names by handle */
+};
+
 struct nssync_sync_engine {
 	char *name;
 	int version;
 	char *syncid;
+	bool declined; /* engine has been declined by the user */
+};
+
+/* engine decoder registered with a session */
+struct nssync_engine {
+	struct nssync_engine *next; /* next registered engine */
+	struct nssync_sync *sync; /* session engine is registered with */
+
+	const struct nssync_engine_ops *ops; /* decoder operations */
+	void *ctx; /* decoder context */
+
+	struct nssync_sync_engine *meta; /* meta/global entry for engine */
+	int collection; /* handle of the engines collection */
+	enum nssync_engine_state state;
+
+	double synced; /* collection modification time last synced */
+	struct nssync_storage_checkpoint checkpoint; /* interrupted download */
+};
+
+/* collection change subscription */
+struct nssync_subscription {
+	struct nssync_subscription *next; /* next subscription */
+	struct nssync_sync *sync; /* session subscription is made on */
+
+	int collection; /* collection handle */
+	unsigned int flags; /* nssync_subscribe_flags */
+	nssync_change_cb *cb; /* change callback */
+	void *ctx; /* callback context */
+
+	struct nssync_idset *known; /* ids of records in collection */
+	double synced; /* newest modification time reported */
+	struct nssync_storage_checkpoint checkpoint; /* interrupted download */
 };
 
 struct nssync_sync {
+	struct nssync_context *context; /* shared resources */
+	bool own_context; /* context was created for this session */
+
 	struct nssync_registration *reg;
 	struct nssync_storage *store;
 	struct nssync_crypto_keybundle *sync_keybundle;
@@ -40,283 +110,1799 @@ struct nssync_sync {
 	int enginec;
 	struct nssync_sync_engine *engines;
 
+	struct nssync_fetcher_cancel cancel; /* cancels fetches of the session */
+
 	struct nssync_storage_obj *cryptokeys_obj;
-	struct nssync_crypto_keybundle *default_keybundle;
+	int crypto; /* handle of the crypto collection */
+	double cryptokeys_modified; /* crypto collection time keys are from */
+
+	/* only the writer stores keys, readers load it within a read
+	 * section counted by readers.
+	 */
+	struct sync_keys *keys;
+	struct sync_keys *retired; /* replaced sets, owned by the writer */
+	unsigned int readers;
+#if !defined(__GNUC__)
+	pthread_mutex_t keys_lock; /* read sections without atomics */
+#endif
+
+	struct nssync_engine *registered; /* registered engine decoders */
+	struct nssync_subscription *subscriptions; /* change subscriptions */
+
+	/* scheduling */
+	bool collections_current; /* collection times need no refresh */
+	unsigned int interval; /* seconds between polls */
+	time_t next_poll; /* time of next poll */
 };
 
+static void free_engines(int enginec, struct nssync_sync_engine *engines)
+{
+	int engidx;
+
+	for (engidx = 0; engidx < enginec; engidx++) {
+		nssync__free(engines[engidx].name);
+		nssync__free(engines[engidx].syncid);
+	}
+	nssync__free(engines);
+}
+
 /* extract the data engine list from json object
  *
  * engines in the sync protocol are the versioning infomation for how
- * to interpret the objects held in each collection type.
+ * to interpret the objects held in each collection type. Engines the
+ * user has declined are listed seperately and are added to the list
+ * without a version.
  */
 static enum nssync_error
 get_engines(json_t *enginej,
+	    json_t *declinedj,
 	    int *enginec_out,
 	    struct nssync_sync_engine **engines_out)
 {
 	json_t *engine;
 	json_t *value;
 	const char *key;
+	size_t decidx;
 
 	int enginec;
 	struct nssync_sync_engine *engines;
 	int engidx;
+	int dupidx;
+
+	enginec = 0;
+	if (json_is_object(enginej)) {
+		enginec += json_object_size(enginej);
+	}
+	if (json_is_array(declinedj)) {
+		enginec += json_array_size(declinedj);
+	}
 
-	enginec = json_object_size(enginej);
-	if ((!json_is_object(enginej)) ||
-	    (enginec == 0)) {
+	if (enginec == 0) {
 		/* no engines is valid (if useless) */
 		*enginec_out = 0;
 		*engines_out = NULL;
 		return NSSYNC_ERROR_OK;
 	}
 
-	engines = calloc(enginec, sizeof(struct nssync_sync_engine));
+	engines = nssync__calloc(enginec, sizeof(struct nssync_sync_engine));
 	if (engines == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
 
 	engidx = 0;
-	json_object_foreach(enginej, key, engine) {
-		engines[engidx].name = strdup(key);
-		value = json_object_get(engine, "version");
-		engines[engidx].version = json_integer_value(value);
-		value = json_object_get(engine, "syncID");
-		engines[engidx].syncid = strdup(json_string_value(value));
+	if (json_is_object(enginej)) {
+		json_object_foreach(enginej, key, engine) {
+			value = json_object_get(engine, "syncID");
+			if (!json_is_string(value)) {
+				log_warning(LOG_FIELDS(.collection = key),
+					    "engine has no syncID");
+				continue;
+			}
+			engines[engidx].syncid = nssync__strdup(json_string_value(value));
+			engines[engidx].name = nssync__strdup(key);
+			if ((engines[engidx].name == NULL) ||
+			    (engines[engidx].syncid == NULL)) {
+				free_engines(engidx + 1, engines);
+				return NSSYNC_ERROR_NOMEM;
+			}
+
+			value = json_object_get(engine, "version");
+			engines[engidx].version = json_integer_value(value);
+
+			log_debug(LOG_FIELDS(.collection = engines[engidx].name),
+				  "engine version %d syncID %s",
+				  engines[engidx].version, engines[engidx].syncid);
+			engidx++;
+		}
+	}
 
-		debugf("%s: %d %s\n", engines[engidx].name, engines[engidx].version, engines[engidx].syncid);
-		engidx++;
+	if (json_is_array(declinedj)) {
+		enginec = engidx;
+		for (decidx = 0; decidx < json_array_size(declinedj); decidx++) {
+			value = json_array_get(declinedj, decidx);
+			if (!json_is_string(value)) {
+				continue;
+			}
+
+			/* a declined engine may still have an entry */
+			for (dupidx = 0; dupidx < enginec; dupidx++) {
+				if (strcmp(engines[dupidx].name,
+					   json_string_value(value)) == 0) {
+					engines[dupidx].declined = true;
+					break;
+				}
+			}
+			if (dupidx < enginec) {
+				continue;
+			}
+
+			engines[engidx].name = nssync__strdup(json_string_value(value));
+			if (engines[engidx].name == NULL) {
+				free_engines(engidx, engines);
+				return NSSYNC_ERROR_NOMEM;
+			}
+			engines[engidx].declined = true;
+
+			log_debug(LOG_FIELDS(.collection = engines[engidx].name),
+				  "engine declined");
+			engidx++;
+		}
 	}
 
-	*enginec_out = enginec;
+	*enginec_out = engidx;
 	*engines_out = engines;
 	return NSSYNC_ERROR_OK;
 }
 
-/** fetch and verify the metaglobal object
- *
- */
-static enum nssync_error meta_global(struct nssync_sync *sync)
+/** verify the fetched metaglobal object */
+static enum nssync_error meta_global_parse(struct nssync_sync *sync)
 {
 	enum nssync_error ret;
+	const char *payload;
+	size_t payload_length;
 
 	json_t *value;
 	json_t *root;
 	json_error_t error;
 
-	ret = nssync_storage_obj_fetch(sync->store,
-				       "meta", "global",
-				       &sync->metaglobal_obj);
-	if (ret != 0) {
-		debugf("unable to retrive metaglobal object\n");
-		return ret;
-	}
-
-	root = json_loads((char *)nssync_storage_obj_payload(sync->metaglobal_obj), 0, &error);
+	payload = nssync_storage_obj_payload(sync->metaglobal_obj,
+					     &payload_length);
+	TRACE_BEGIN(span);
+	root = json_loadb(payload, payload_length, 0, &error);
+	TRACE_END(span, "parse", "meta/global", NULL);
 
 	if (!root) {
-		debugf("error: on line %d: %s\n", error.line, error.text);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = NSSYNC_ERROR_PROTOCOL),
+			  "meta/global error on line %d: %s",
+			  error.line, error.text);
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
 	if (!json_is_object(root)) {
-		debugf("error: root is not an object\n");
-		return NSSYNC_ERROR_PROTOCOL;
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = NSSYNC_ERROR_PROTOCOL),
+			  "meta/global is not an object");
+		ret = NSSYNC_ERROR_PROTOCOL;
+		goto meta_global_error;
 	}
 
 	/* check storage version */
 	value = json_object_get(root, "storageVersion");
 	if (json_integer_value(value) != STORAGE_VERSION) {
-		return NSSYNC_ERROR_VERSION;
+		ret = NSSYNC_ERROR_VERSION;
+		goto meta_global_error;
 	}
 
 	/* retrive syncid */
 	value = json_object_get(root, "syncID");
-	sync->metaglobal_syncid = strdup(json_string_value(value));
+	if (!json_is_string(value)) {
+		ret = NSSYNC_ERROR_PROTOCOL;
+		goto meta_global_error;
+	}
+	sync->metaglobal_syncid = nssync__strdup(json_string_value(value));
+	if (sync->metaglobal_syncid == NULL) {
+		ret = NSSYNC_ERROR_NOMEM;
+		goto meta_global_error;
+	}
 
 	/* retrive data engines */
 	ret = get_engines(json_object_get(root, "engines"),
+			  json_object_get(root, "declined"),
 			  &sync->enginec, &sync->engines);
 	if (ret != 0) {
-		debugf("error retriving engine data\n");
-		return ret;
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = ret),
+			  "error retriving engine data");
 	}
 
+meta_global_error:
 	json_decref(root);
 
-	return NSSYNC_ERROR_OK;
+	return ret;
 }
 
-
-/** fetch and verify the cryptokeys object
+/** fetch and verify the metaglobal object
  *
  */
-static enum nssync_error crypto_keys(struct nssync_sync *sync)
+static enum nssync_error meta_global(struct nssync_sync *sync)
 {
 	enum nssync_error ret;
-	struct nssync_storage_obj *cryptokeys_obj;
-	char *record;
-
-	json_t *root;
-	json_error_t error;
+	int meta;
 
-	json_t *value;
-	json_t *default_key;
-	json_t *default_hmac;
+	ret = nssync_storage_collection_intern(sync->store, "meta", &meta);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
 
-	/* get crypto/keys object from storage */
 	ret = nssync_storage_obj_fetch(sync->store,
-				       "crypto", "keys",
-				       &cryptokeys_obj);
+				       meta, "global",
+				       &sync->metaglobal_obj);
 	if (ret != 0) {
-		debugf("unable to retrive crypto/keys object\n");
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = ret),
+			  "unable to retrive meta/global object");
 		return ret;
 	}
 
-	/* decrypt record */
-	ret = nssync_crypto_decrypt_record(nssync_storage_obj_payload(cryptokeys_obj),
-					   sync->sync_keybundle,
-					   (uint8_t **)&record,
-					   NULL);
+	return meta_global_parse(sync);
+}
+
+
+static void sync_keys_free(struct sync_keys *keys)
+{
+	int collection;
+
+	nssync__free(keys->default_keybundle);
+	for (collection = 0; collection < keys->keybundlec; collection++) {
+		nssync__free(keys->keybundlev[collection]);
+		nssync__free(keys->namev[collection]);
+	}
+	nssync__free(keys->keybundlev);
+	nssync__free(keys->namev);
+	nssync__free(keys);
+}
+
+/** free retired key sets */
+static void sync_keys_release(struct nssync_sync *sync)
+{
+	struct sync_keys *keys;
+
+	while (sync->retired != NULL) {
+		keys = sync->retired;
+		sync->retired = keys->retired;
+		sync_keys_free(keys);
+	}
+}
+
+/** enter a read section returning the published keys
+ *
+ * The keys remain valid until keys_read_end() is called.
+ */
+static struct sync_keys *keys_read_begin(struct nssync_sync *sync)
+{
+#if defined(__GNUC__)
+	__atomic_add_fetch(&sync->readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&sync->keys, __ATOMIC_SEQ_CST);
+#else
+	pthread_mutex_lock(&sync->keys_lock);
+	return sync->keys;
+#endif
+}
+
+static void keys_read_end(struct nssync_sync *sync)
+{
+#if defined(__GNUC__)
+	__atomic_sub_fetch(&sync->readers, 1, __ATOMIC_SEQ_CST);
+#else
+	pthread_mutex_unlock(&sync->keys_lock);
+#endif
+}
+
+/** publish a key set replacing the current one, only the writer may */
+static void keys_publish(struct nssync_sync *sync, struct sync_keys *keys)
+{
+	struct sync_keys *old;
+
+#if defined(__GNUC__)
+	old = __atomic_exchange_n(&sync->keys, keys, __ATOMIC_SEQ_CST);
+#else
+	pthread_mutex_lock(&sync->keys_lock);
+	old = sync->keys;
+	sync->keys = keys;
+	pthread_mutex_unlock(&sync->keys_lock);
+#endif
+
+	if (old != NULL) {
+		old->retired = sync->retired;
+		sync->retired = old;
+	}
+
+	/* readers entering after the exchange see the new set so with
+	 * none inside a read section no reader can hold a retired one.
+	 */
+#if defined(__GNUC__)
+	if (__atomic_load_n(&sync->readers, __ATOMIC_SEQ_CST) != 0) {
+		return;
+	}
+#endif
+	sync_keys_release(sync);
+}
+
+/** set the keybundle for a collection from a crypto/keys entry */
+static enum nssync_error
+collection_keybundle_set(struct nssync_sync *sync,
+			 struct sync_keys *keys,
+			 const char *name,
+			 json_t *keyj)
+{
+	enum nssync_error ret;
+	struct nssync_crypto_keybundle **keybundlev;
+	char **namev;
+	json_t *key;
+	json_t *hmac;
+	int collection;
+
+	key = json_array_get(keyj, 0);
+	hmac = json_array_get(keyj, 1);
+	if ((!json_is_string(key)) || (!json_is_string(hmac))) {
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+
+	ret = nssync_storage_collection_intern(sync->store, name, &collection);
 	if (ret != NSSYNC_ERROR_OK) {
 		return ret;
 	}
 
-	/* process decrypted record */
-	root = json_loads(record, JSON_DISABLE_EOF_CHECK, &error);
-	free(record);
-	if (!root) {
-		debugf("error: on line %d: %s\n", error.line, error.text);
-		free(cryptokeys_obj);
-		return NSSYNC_ERROR_PROTOCOL;
+	if (collection >= keys->keybundlec) {
+		keybundlev = nssync__realloc(keys->keybundlev,
+				(collection + 1) * sizeof(*keybundlev));
+		if (keybundlev == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+		keys->keybundlev = keybundlev;
+
+		namev = nssync__realloc(keys->namev,
+				(collection + 1) * sizeof(*namev));
+		if (namev == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+		keys->namev = namev;
+
+		memset(keybundlev + keys->keybundlec, 0,
+		       (collection + 1 - keys->keybundlec) * sizeof(*keybundlev));
+		memset(namev + keys->keybundlec, 0,
+		       (collection + 1 - keys->keybundlec) * sizeof(*namev));
+		keys->keybundlec = collection + 1;
+	}
+
+	if (keys->namev[collection] == NULL) {
+		keys->namev[collection] = nssync__strdup(name);
+		if (keys->namev[collection] == NULL) {
+			return NSSYNC_ERROR_NOMEM;
+		}
+	}
+
+	nssync__free(keys->keybundlev[collection]);
+	keys->keybundlev[collection] = NULL;
+
+	return nssync_crypto_keybundle_new_b64(json_string_value(key),
+					       json_string_value(hmac),
+					       &keys->keybundlev[collection]);
+}
+
+/** keybundle the records of a collection are encrypted with
+ *
+ * Only for the writer which is the only thread to change the keys.
+ */
+static struct nssync_crypto_keybundle *
+collection_keybundle(struct nssync_sync *sync, int collection)
+{
+	struct sync_keys *keys = sync->keys;
+
+	if ((collection < keys->keybundlec) &&
+	    (keys->keybundlev[collection] != NULL)) {
+		return keys->keybundlev[collection];
 	}
+	return keys->default_keybundle;
+}
+
+/** build a key set from a decrypted crypto/keys record */
+static enum nssync_error
+crypto_keys_parse(struct nssync_sync *sync,
+		  json_t *root,
+		  struct sync_keys **keys_out)
+{
+	enum nssync_error ret;
+	struct sync_keys *keys;
+	json_t *value;
+	json_t *default_key;
+	json_t *default_hmac;
+	const char *name;
+	json_t *keyj;
 
 	if (!json_is_object(root)) {
-		debugf("error: root is not an object\n");
-		free(cryptokeys_obj);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = NSSYNC_ERROR_PROTOCOL),
+			  "crypto/keys is not an object");
 		return NSSYNC_ERROR_PROTOCOL;
 	}
 
 	/* default keybundle */
 	value = json_object_get(root, "default");
 	if (!json_is_array(value)) {
-		free(cryptokeys_obj);
 		return NSSYNC_ERROR_VERSION;
 	}
 
 	default_key = json_array_get(value, 0);
 	default_hmac = json_array_get(value, 1);
+	if ((!json_is_string(default_key)) || (!json_is_string(default_hmac))) {
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+
+	keys = nssync__calloc(1, sizeof(*keys));
+	if (keys == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
 
 	ret = nssync_crypto_keybundle_new_b64(json_string_value(default_key),
 					      json_string_value(default_hmac),
-					      &sync->default_keybundle);
+					      &keys->default_keybundle);
+	if (ret != NSSYNC_ERROR_OK) {
+		sync_keys_free(keys);
+		return ret;
+	}
+
+	/* collections with their own keys */
+	value = json_object_get(root, "collections");
+	if (json_is_object(value)) {
+		json_object_foreach(value, name, keyj) {
+			ret = collection_keybundle_set(sync, keys, name, keyj);
+			if (ret != NSSYNC_ERROR_OK) {
+				sync_keys_free(keys);
+				return ret;
+			}
+		}
+	}
+
+	*keys_out = keys;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** verify the fetched cryptokeys object and publish its keys
+ *
+ * The keys are built into a new set which is published whole, readers
+ *   decrypting meanwhile carry on with the set they started with. The
+ *   object is kept by the session or freed on error.
+ */
+static enum nssync_error
+crypto_keys_publish(struct nssync_sync *sync,
+		    struct nssync_storage_obj *cryptokeys_obj)
+{
+	enum nssync_error ret;
+	struct sync_keys *keys;
+	char *record;
+	json_t *root;
+	json_error_t error;
+
+	/* decrypt record */
+	ret = nssync_crypto_decrypt_record(nssync_storage_obj_payload(cryptokeys_obj, NULL),
+					   sync->sync_keybundle,
+					   (uint8_t **)&record,
+					   NULL);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync_storage_obj_free(cryptokeys_obj);
+		return ret;
+	}
 
-	/** @todo extract the keys from the "collections" object */
+	/* process decrypted record */
+	TRACE_BEGIN(span);
+	root = json_loads(record, JSON_DISABLE_EOF_CHECK, &error);
+	TRACE_END(span, "parse", "crypto/keys", NULL);
+	nssync__free(record);
+	if (!root) {
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = NSSYNC_ERROR_PROTOCOL),
+			  "crypto/keys error on line %d: %s",
+			  error.line, error.text);
+		nssync_storage_obj_free(cryptokeys_obj);
+		return NSSYNC_ERROR_PROTOCOL;
+	}
 
+	ret = crypto_keys_parse(sync, root, &keys);
 	json_decref(root);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync_storage_obj_free(cryptokeys_obj);
+		return ret;
+	}
+
+	keys_publish(sync, keys);
 
+	nssync_storage_obj_free(sync->cryptokeys_obj);
 	sync->cryptokeys_obj = cryptokeys_obj;
+	sync->cryptokeys_modified = nssync_storage_collection_modified(sync->store,
+								       sync->crypto);
 
 	return NSSYNC_ERROR_OK;
 }
 
-enum nssync_error
-nssync_sync_new(const struct nssync_provider *provider,
-		struct nssync_sync **sync_out)
+/** fetch and verify the cryptokeys object */
+static enum nssync_error crypto_keys(struct nssync_sync *sync)
+{
+	enum nssync_error ret;
+	struct nssync_storage_obj *cryptokeys_obj;
+
+	ret = nssync_storage_collection_intern(sync->store, "crypto", &sync->crypto);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	/* get crypto/keys object from storage */
+	ret = nssync_storage_obj_fetch(sync->store,
+				       sync->crypto, "keys",
+				       &cryptokeys_obj);
+	if (ret != 0) {
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = ret),
+			  "unable to retrive crypto/keys object");
+		return ret;
+	}
+
+	return crypto_keys_publish(sync, cryptokeys_obj);
+}
+
+/** release the sessions use of its context
+ *
+ * This must be the last thing a session does as the allocator may be
+ *   freed with its context.
+ */
+static void
+sync_context_release(struct nssync_context *context, bool own_context)
+{
+	nssync_context_detach(context);
+	if (own_context) {
+		nssync_context_free(context);
+	}
+}
+
+/** create a session with its registration and sync key
+ *
+ * Nothing is fetched, the session is then set up from the server
+ *   either in turn by sync_new() or by an asynchronous bootstrap.
+ */
+static enum nssync_error
+sync_create(const struct nssync_provider *provider,
+	    struct nssync_sync **sync_out)
 {
 	enum nssync_error ret;
 	struct nssync_sync *newsync;
-	nssync_fetcher *fetcher; /* fetcher to retrive data */
+	struct nssync_context_params params;
 
 	if (provider->type != NSSYNC_SERVICE_MOZILLA) {
 		return NSSYNC_ERROR_INVAL;
 	}
 
-	newsync = calloc(1, sizeof(*newsync));
+	newsync = nssync__calloc(1, sizeof(*newsync));
 	if (newsync == NULL) {
 		return NSSYNC_ERROR_NOMEM;
 	}
+#if !defined(__GNUC__)
+	pthread_mutex_init(&newsync->keys_lock, NULL);
+#endif
 
-	/* setup the fetcher to call */
-	if (provider->fetcher == NULL) {
-		fetcher = nssync_fetcher_curl;
+	/* use the shared context or make one for this session */
+	if (provider->context != NULL) {
+		newsync->context = provider->context;
 	} else {
-		fetcher = provider->fetcher;
+		memset(&params, 0, sizeof(params));
+		params.fetcher = provider->fetcher;
+		params.cachedir = provider->cachedir;
+		params.allocator = provider->allocator;
+		ret = nssync_context_new(&params, &newsync->context);
+		if (ret != NSSYNC_ERROR_OK) {
+			nssync__free(newsync);
+			return ret;
+		}
+		newsync->own_context = true;
 	}
+	nssync_context_attach(newsync->context);
 
 	/* create registration from parameters */
 	ret = nssync_registration_new(provider->params.mozilla.server,
 				      provider->params.mozilla.account,
 				      provider->params.mozilla.password,
-				      fetcher,
+				      newsync->context,
 				      &newsync->reg);
 	if (ret != NSSYNC_ERROR_OK) {
+		sync_context_release(newsync->context, newsync->own_context);
+		nssync__free(newsync);
 		return NSSYNC_ERROR_REGISTRATION;
 	}
 
+	/* until the session is handed out only the context can cancel
+	 * its fetches, which lets them join those of other sessions
+	 */
+	newsync->cancel.parent = nssync_context_get_cancel(newsync->context);
+	nssync_registration_set_deadline(newsync->reg,
+					 newsync->cancel.parent,
+					 provider->deadline);
+
 	/* create sync key bundle */
 	ret = nssync_crypto_keybundle_new_user_synckey(provider->params.mozilla.key,
 				nssync_registration_get_username(newsync->reg),
 				&newsync->sync_keybundle);
 	if (ret != NSSYNC_ERROR_OK) {
-		debugf("unable to create sync key: %d\n", ret);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(newsync),
+				     .error = ret),
+			  "unable to create sync key");
 		nssync_registration_free(newsync->reg);
-		free(newsync);
+		sync_context_release(newsync->context, newsync->own_context);
+		nssync__free(newsync);
+		return ret;
+	}
+
+	*sync_out = newsync;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** note a session is set up so it can be used */
+static void sync_ready(struct nssync_sync *sync)
+{
+	/* collection times were just fetched so first poll can use them */
+	sync->collections_current = true;
+	sync->interval = SCHEDULE_ACTIVE_INTERVAL;
+
+	nssync_registration_set_deadline(sync->reg, &sync->cancel, 0);
+}
+
+static enum nssync_error
+sync_new(const struct nssync_provider *provider,
+	 struct nssync_sync **sync_out)
+{
+	enum nssync_error ret;
+	struct nssync_sync *newsync;
+
+	ret = sync_create(provider, &newsync);
+	if (ret != NSSYNC_ERROR_OK) {
 		return ret;
 	}
 
 	/* create data store connection using reg data */
-	ret = nssync_storage_new(newsync->reg, "", fetcher, &newsync->store);
+	ret = nssync_storage_new(newsync->reg, "", newsync->context, &newsync->store);
 	if (ret != NSSYNC_ERROR_OK) {
-		debugf("unable to create store: %d\n", ret);
-		nssync_registration_free(newsync->reg);
-		free(newsync->sync_keybundle);
-		free(newsync);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(newsync),
+				     .error = ret),
+			  "unable to create store");
+		nssync_sync_free(newsync);
 		return ret;
 	}
 
 	ret = meta_global(newsync);
 	if (ret != NSSYNC_ERROR_OK) {
-		debugf("error with meta/global object: %d\n", ret);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(newsync),
+				     .error = ret),
+			  "error with meta/global object");
 		nssync_sync_free(newsync);
 		return ret;
 	}
 
 	ret = crypto_keys(newsync);
 	if (ret != NSSYNC_ERROR_OK) {
-		debugf("error with crypto/keys object: %d\n", ret);
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(newsync),
+				     .error = ret),
+			  "error with crypto/keys object");
 		nssync_sync_free(newsync);
 		return ret;
 	}
 
+	sync_ready(newsync);
+
 	*sync_out = newsync;
 
 	return NSSYNC_ERROR_OK;
 }
 
+/* exported interface documented in nssync/sync.h */
 enum nssync_error
-nssync_sync_free(struct nssync_sync *sync)
+nssync_sync_new(const struct nssync_provider *provider,
+		struct nssync_sync **sync_out)
 {
-	nssync_storage_obj_free(sync->metaglobal_obj);
-	nssync_storage_free(sync->store);
-	nssync_registration_free(sync->reg);
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
 
-	free(sync);
+	if (provider->context != NULL) {
+		prev = nssync__alloc_enter(nssync_context_get_allocator(provider->context));
+	} else {
+		prev = nssync__alloc_enter(provider->allocator);
+	}
+	ret = sync_new(provider, sync_out);
+	nssync__alloc_leave(prev);
 
-	return  NSSYNC_ERROR_OK;
+	return ret;
 }
-#if 0
-nssync_error
-nssync_sync_collection_open(struct nssync_sync *sync, const char *collection)
+
+/** steps of an asynchronous session creation, one fetch each */
+enum sync_bootstrap_state {
+	BOOTSTRAP_NODE, /* look up the storage node */
+	BOOTSTRAP_COLLECTIONS, /* fetch the collection times */
+	BOOTSTRAP_META, /* fetch meta/global */
+	BOOTSTRAP_KEYS, /* fetch crypto/keys */
+	BOOTSTRAP_DONE,
+};
+
+/** an asynchronous session creation */
+struct sync_bootstrap {
+	struct nssync_fetcher_fetch fetch; /* fetch of the current step */
+	struct nssync_sync *sync;
+	enum sync_bootstrap_state state;
+	int collection; /* collection of the object being fetched */
+	uint64_t start; /* time the fetch was issued */
+
+	/* a fetcher may complete the fetch before returning */
+	bool issuing; /* fetch is being issued */
+	bool completed; /* completion was called while issuing */
+	enum nssync_error ret; /* result of that completion */
+
+	nssync_sync_new_cb *cb;
+	void *ctx;
+};
+
+static enum nssync_error bootstrap_fetch_complete(struct nssync_fetcher_fetch *fetch);
+
+/** end a bootstrap, calling back with the session or the error */
+static void
+bootstrap_finish(struct sync_bootstrap *bootstrap, enum nssync_error ret)
 {
-	nssync_error ret;
-	struct nssync_crypto_keybundle *keybundle;
+	struct nssync_sync *sync = bootstrap->sync;
+	nssync_sync_new_cb *cb = bootstrap->cb;
+	void *ctx = bootstrap->ctx;
 
-	ret = nssync_storage_collection_fetch_async(sync->store,
-				      keybundle,
-				      collection,
-				      struct nssync_storage_obj ***objv_out,
-				      int *objc_out);
+	nssync__free(bootstrap);
 
-}
-#endif
+	if (ret == NSSYNC_ERROR_OK) {
+		sync_ready(sync);
+	} else {
+		log_error(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				     .error = ret),
+			  "unable to set up session");
+		nssync_sync_free(sync);
+		sync = NULL;
+	}
+
+	cb(ctx, ret, sync);
+}
+
+/** set up the fetch of the current bootstrap step */
+static enum nssync_error bootstrap_fetch_init(struct sync_bootstrap *bootstrap)
+{
+	struct nssync_sync *sync = bootstrap->sync;
+	enum nssync_error ret;
+
+	memset(&bootstrap->fetch, 0, sizeof(bootstrap->fetch));
+
+	switch (bootstrap->state) {
+	case BOOTSTRAP_NODE:
+		if (nssync_registration_cached_storage_server(sync->reg) == NULL) {
+			return nssync_registration_node_fetch_init(sync->reg,
+								   &bootstrap->fetch);
+		}
+
+		/* node is known so go straight on to the store */
+		ret = nssync_storage_open(sync->reg, "", sync->context, &sync->store);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+		bootstrap->state = BOOTSTRAP_COLLECTIONS;
+		return nssync_storage_collections_fetch_init(sync->store,
+							     &bootstrap->fetch);
+
+	case BOOTSTRAP_COLLECTIONS:
+		return nssync_storage_collections_fetch_init(sync->store,
+							     &bootstrap->fetch);
+
+	case BOOTSTRAP_META:
+		ret = nssync_storage_collection_intern(sync->store, "meta",
+						       &bootstrap->collection);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+		return nssync_storage_obj_fetch_init(sync->store,
+						     bootstrap->collection,
+						     "global",
+						     &bootstrap->fetch);
+
+	case BOOTSTRAP_KEYS:
+		ret = nssync_storage_collection_intern(sync->store, "crypto",
+						       &sync->crypto);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+		bootstrap->collection = sync->crypto;
+		return nssync_storage_obj_fetch_init(sync->store,
+						     bootstrap->collection,
+						     "keys",
+						     &bootstrap->fetch);
+
+	case BOOTSTRAP_DONE:
+		break;
+	}
+
+	return NSSYNC_ERROR_INVAL;
+}
+
+/** process the response of the current bootstrap step and move on */
+static enum nssync_error bootstrap_fetch_done(struct sync_bootstrap *bootstrap)
+{
+	struct nssync_sync *sync = bootstrap->sync;
+	struct nssync_storage_obj *cryptokeys_obj;
+	enum nssync_error ret = NSSYNC_ERROR_INVAL;
+
+	switch (bootstrap->state) {
+	case BOOTSTRAP_NODE:
+		ret = nssync_registration_node_fetch_complete(sync->reg,
+							      &bootstrap->fetch,
+							      bootstrap->start);
+		if (ret == NSSYNC_ERROR_OK) {
+			ret = nssync_storage_open(sync->reg, "", sync->context,
+						  &sync->store);
+		}
+		break;
+
+	case BOOTSTRAP_COLLECTIONS:
+		ret = nssync_storage_collections_fetch_complete(sync->store,
+								&bootstrap->fetch,
+								bootstrap->start);
+		break;
+
+	case BOOTSTRAP_META:
+		ret = nssync_storage_obj_fetch_complete(sync->store,
+							bootstrap->collection,
+							&bootstrap->fetch,
+							bootstrap->start,
+							&sync->metaglobal_obj);
+		if (ret == NSSYNC_ERROR_OK) {
+			ret = meta_global_parse(sync);
+		}
+		break;
+
+	case BOOTSTRAP_KEYS:
+		ret = nssync_storage_obj_fetch_complete(sync->store,
+							bootstrap->collection,
+							&bootstrap->fetch,
+							bootstrap->start,
+							&cryptokeys_obj);
+		if (ret == NSSYNC_ERROR_OK) {
+			ret = crypto_keys_publish(sync, cryptokeys_obj);
+		}
+		break;
+
+	case BOOTSTRAP_DONE:
+		break;
+	}
+
+	if (ret == NSSYNC_ERROR_OK) {
+		bootstrap->state++;
+	}
+
+	return ret;
+}
+
+/** issue bootstrap fetches until one is in flight or all are done
+ *
+ * The bootstrap is finished, and freed, when this returns other than
+ *   for a fetch in flight.
+ */
+static void bootstrap_run(struct sync_bootstrap *bootstrap)
+{
+	enum nssync_error ret;
+
+	while (bootstrap->state != BOOTSTRAP_DONE) {
+		ret = bootstrap_fetch_init(bootstrap);
+		if (ret != NSSYNC_ERROR_OK) {
+			nssync__free(bootstrap->fetch.url);
+			bootstrap_finish(bootstrap, ret);
+			return;
+		}
+
+		bootstrap->fetch.flags = NSSYNC_FETCHER_ASYNC;
+		bootstrap->fetch.completion = bootstrap_fetch_complete;
+		bootstrap->issuing = true;
+		bootstrap->completed = false;
+		bootstrap->start = nssync__metrics_now();
+		ret = nssync_context_fetch(bootstrap->sync->context,
+					   &bootstrap->fetch);
+		bootstrap->issuing = false;
+
+		if (bootstrap->completed) {
+			/* fetcher completed the fetch before returning */
+			ret = bootstrap->ret;
+		} else if (ret == NSSYNC_ERROR_RETRY) {
+			/* in flight, continued from the completion */
+			return;
+		} else {
+			/* fetch failed without completing */
+			bootstrap->fetch.result = ret;
+			ret = bootstrap_fetch_done(bootstrap);
+		}
+
+		if (ret != NSSYNC_ERROR_OK) {
+			bootstrap_finish(bootstrap, ret);
+			return;
+		}
+	}
+
+	bootstrap_finish(bootstrap, NSSYNC_ERROR_OK);
+}
+
+/** completion of a bootstrap fetch */
+static enum nssync_error
+bootstrap_fetch_complete(struct nssync_fetcher_fetch *fetch)
+{
+	struct sync_bootstrap *bootstrap = (struct sync_bootstrap *)fetch;
+	enum nssync_error ret;
+
+	ret = bootstrap_fetch_done(bootstrap);
+
+	if (bootstrap->issuing) {
+		/* left to bootstrap_run which issued the fetch */
+		bootstrap->completed = true;
+		bootstrap->ret = ret;
+		return ret;
+	}
+
+	if (ret != NSSYNC_ERROR_OK) {
+		bootstrap_finish(bootstrap, ret);
+		return ret;
+	}
+
+	bootstrap_run(bootstrap);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_new_async(const struct nssync_provider *provider,
+		      nssync_sync_new_cb *cb,
+		      void *ctx)
+{
+	const struct nssync_allocator *prev;
+	struct sync_bootstrap *bootstrap;
+	enum nssync_error ret;
+
+	if ((provider->context == NULL) || (cb == NULL)) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(provider->context));
+
+	bootstrap = nssync__calloc(1, sizeof(*bootstrap));
+	if (bootstrap == NULL) {
+		nssync__alloc_leave(prev);
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	ret = sync_create(provider, &bootstrap->sync);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(bootstrap);
+		nssync__alloc_leave(prev);
+		return ret;
+	}
+
+	bootstrap->state = BOOTSTRAP_NODE;
+	bootstrap->cb = cb;
+	bootstrap->ctx = ctx;
+
+	bootstrap_run(bootstrap);
+
+	nssync__alloc_leave(prev);
+
+	return NSSYNC_ERROR_RETRY;
+}
+
+static enum nssync_error
+sync_free(struct nssync_sync *sync)
+{
+	struct nssync_context *context = sync->context;
+	bool own_context = sync->own_context;
+
+	while (sync->registered != NULL) {
+		nssync_engine_unregister(sync->registered);
+	}
+
+	while (sync->subscriptions != NULL) {
+		nssync_sync_unsubscribe(sync->subscriptions);
+	}
+
+	free_engines(sync->enginec, sync->engines);
+	nssync__free(sync->metaglobal_syncid);
+	nssync_storage_obj_free(sync->metaglobal_obj);
+	nssync_storage_obj_free(sync->cryptokeys_obj);
+	if (sync->keys != NULL) {
+		sync_keys_free(sync->keys);
+	}
+	sync_keys_release(sync);
+#if !defined(__GNUC__)
+	pthread_mutex_destroy(&sync->keys_lock);
+#endif
+	nssync__free(sync->sync_keybundle);
+	nssync_storage_free(sync->store);
+	nssync_registration_free(sync->reg);
+	nssync__free(sync);
+
+	sync_context_release(context, own_context);
+
+	return  NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_free(struct nssync_sync *sync)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = sync_free(sync);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error
+engine_register(struct nssync_sync *sync,
+		const struct nssync_engine_ops *ops,
+		const char *syncid,
+		void *ctx,
+		struct nssync_engine **engine_out)
+{
+	enum nssync_error ret;
+	struct nssync_engine *engine;
+	int engidx;
+
+	if ((ops == NULL) || (ops->name == NULL) || (ops->decode == NULL)) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	engine = nssync__calloc(1, sizeof(*engine));
+	if (engine == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	ret = nssync_storage_collection_intern(sync->store, ops->name,
+					       &engine->collection);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(engine);
+		return ret;
+	}
+
+	engine->sync = sync;
+	engine->ops = ops;
+	engine->ctx = ctx;
+	engine->state = NSSYNC_ENGINE_DISABLED;
+	if (ops->resume) {
+		/* only a resuming decoder saves its progress */
+		snprintf(engine->checkpoint.owner,
+			 sizeof(engine->checkpoint.owner), "engine");
+	}
+
+	/* bind to the meta/global entry once here so collection
+	 * records can be dispatched without name lookups.
+	 */
+	for (engidx = 0; engidx < sync->enginec; engidx++) {
+		if (strcmp(sync->engines[engidx].name, ops->name) == 0) {
+			engine->meta = &sync->engines[engidx];
+			break;
+		}
+	}
+
+	if ((engine->meta != NULL) && (!engine->meta->declined)) {
+		if ((engine->meta->version < ops->min_version) ||
+		    (engine->meta->version > ops->max_version)) {
+			log_warning(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+					       .collection = ops->name,
+					       .error = NSSYNC_ERROR_VERSION),
+				    "engine version %d unsupported",
+				    engine->meta->version);
+			engine->state = NSSYNC_ENGINE_VERSION;
+		} else if ((syncid != NULL) &&
+			   (strcmp(syncid, engine->meta->syncid) != 0)) {
+			engine->state = NSSYNC_ENGINE_RESET;
+			if ((ops->reset != NULL) &&
+			    (ops->reset(ctx, engine->meta->syncid) == NSSYNC_ERROR_OK)) {
+				engine->state = NSSYNC_ENGINE_ENABLED;
+			}
+		} else {
+			engine->state = NSSYNC_ENGINE_ENABLED;
+		}
+	}
+
+	engine->next = sync->registered;
+	sync->registered = engine;
+
+	*engine_out = engine;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/engine.h */
+enum nssync_error
+nssync_engine_register(struct nssync_sync *sync,
+		       const struct nssync_engine_ops *ops,
+		       const char *syncid,
+		       void *ctx,
+		       struct nssync_engine **engine_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = engine_register(sync, ops, syncid, ctx, engine_out);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error
+engine_unregister(struct nssync_engine *engine)
+{
+	struct nssync_engine **prev;
+
+	prev = &engine->sync->registered;
+	while (*prev != NULL) {
+		if (*prev == engine) {
+			*prev = engine->next;
+			break;
+		}
+		prev = &(*prev)->next;
+	}
+
+	nssync__free(engine);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/engine.h */
+enum nssync_error
+nssync_engine_unregister(struct nssync_engine *engine)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(engine->sync->context));
+	ret = engine_unregister(engine);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+/* exported interface documented in nssync/engine.h */
+enum nssync_engine_state
+nssync_engine_get_state(struct nssync_engine *engine)
+{
+	return engine->state;
+}
+
+/* exported interface documented in nssync/engine.h */
+const char *
+nssync_engine_get_syncid(struct nssync_engine *engine)
+{
+	if ((engine->meta == NULL) || (engine->meta->declined)) {
+		return NULL;
+	}
+	return engine->meta->syncid;
+}
+
+/** decode a page of an engines collection in collection order */
+static enum nssync_error
+engine_deliver(void *ctx, struct nssync_pipeline_page *page)
+{
+	struct nssync_engine *engine = ctx;
+	enum nssync_error ret;
+	int objidx;
+
+	for (objidx = 0; objidx < page->objc; objidx++) {
+		ret = page->recordv[objidx].ret;
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+
+		ret = engine->ops->decode(engine->ctx,
+					  nssync_storage_obj_id(&page->objv[objidx]),
+					  page->recordv[objidx].record,
+					  page->recordv[objidx].record_length);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+engine_sync(struct nssync_engine *engine)
+{
+	enum nssync_error ret;
+	struct nssync_sync *sync = engine->sync;
+	double modified;
+
+	if (engine->state != NSSYNC_ENGINE_ENABLED) {
+		/* disabled or awaiting reset so skip collection */
+		return NSSYNC_ERROR_OK;
+	}
+
+	modified = nssync_storage_collection_modified(sync->store,
+						      engine->collection);
+
+	if (!engine->ops->resume) {
+		/* the records an interrupted sync delivered are gone */
+		engine->checkpoint.active = false;
+	}
+
+	ret = nssync_pipeline_run(sync->store,
+				  nssync_context_get_workqueue(sync->context),
+				  engine->collection,
+				  0,
+				  &engine->checkpoint,
+				  collection_keybundle(sync, engine->collection),
+				  engine_deliver,
+				  engine);
+	if (ret != NSSYNC_ERROR_OK) {
+		log_warning(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				       .collection = engine->ops->name,
+				       .error = ret),
+			    "unable to sync collection");
+		return ret;
+	}
+
+	engine->synced = modified;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/engine.h */
+enum nssync_error
+nssync_engine_sync(struct nssync_engine *engine)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(engine->sync->context));
+	ret = engine_sync(engine);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error
+sync_engines(struct nssync_sync *sync)
+{
+	enum nssync_error ret;
+	struct nssync_engine *engine;
+
+	for (engine = sync->registered; engine != NULL; engine = engine->next) {
+		ret = nssync_engine_sync(engine);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/engine.h */
+enum nssync_error
+nssync_sync_engines(struct nssync_sync *sync)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = sync_engines(sync);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error
+sync_subscribe(struct nssync_sync *sync,
+	       const char *collection,
+	       unsigned int flags,
+	       nssync_change_cb *cb,
+	       void *ctx,
+	       struct nssync_subscription **subscription_out)
+{
+	enum nssync_error ret;
+	struct nssync_subscription *sub;
+	struct nssync_subscription *other;
+	unsigned int alike = 0;
+
+	if ((collection == NULL) || (cb == NULL)) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	sub = nssync__calloc(1, sizeof(*sub));
+	if (sub == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	ret = nssync_storage_collection_intern(sync->store, collection,
+					       &sub->collection);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(sub);
+		return ret;
+	}
+
+	ret = nssync_idset_new(&sub->known);
+	if (ret != NSSYNC_ERROR_OK) {
+		nssync__free(sub);
+		return ret;
+	}
+
+	sub->sync = sync;
+	sub->flags = flags;
+	sub->cb = cb;
+	sub->ctx = ctx;
+
+	/* subscriptions alike are told apart by the order they were made */
+	for (other = sync->subscriptions; other != NULL; other = other->next) {
+		if ((other->collection == sub->collection) &&
+		    (other->flags == sub->flags)) {
+			alike++;
+		}
+	}
+	snprintf(sub->checkpoint.owner, sizeof(sub->checkpoint.owner),
+		 "sub%x.%u", flags, alike);
+
+	sub->next = sync->subscriptions;
+	sync->subscriptions = sub;
+
+	*subscription_out = sub;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/changes.h */
+enum nssync_error
+nssync_sync_subscribe(struct nssync_sync *sync,
+		      const char *collection,
+		      unsigned int flags,
+		      nssync_change_cb *cb,
+		      void *ctx,
+		      struct nssync_subscription **subscription_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = sync_subscribe(sync, collection, flags, cb, ctx, subscription_out);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+static enum nssync_error
+sync_unsubscribe(struct nssync_subscription *subscription)
+{
+	struct nssync_subscription **prev;
+
+	prev = &subscription->sync->subscriptions;
+	while (*prev != NULL) {
+		if (*prev == subscription) {
+			*prev = subscription->next;
+			break;
+		}
+		prev = &(*prev)->next;
+	}
+
+	nssync_idset_free(subscription->known);
+	nssync__free(subscription);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/changes.h */
+enum nssync_error
+nssync_sync_unsubscribe(struct nssync_subscription *subscription)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(subscription->sync->context));
+	ret = sync_unsubscribe(subscription);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+/** check if a decrypted record is a deletion tombstone
+ *
+ * The record is parsed from a copy in scratch as parsing modifies the
+ *   buffer and the record may yet be given to the subscriber.
+ */
+static bool
+record_deleted(const uint8_t *record, size_t record_length, char *scratch)
+{
+	struct nssync_wbo_field field = { .name = "deleted" };
+
+	memcpy(scratch, record, record_length);
+	scratch[record_length] = 0;
+
+	if (nssync_wbo_parse(scratch, scratch + record_length,
+			     &field, 1, NULL) != NSSYNC_ERROR_OK) {
+		return false;
+	}
+
+	return (field.type == NSSYNC_WBO_OTHER) &&
+		(field.length == 4) &&
+		(strncmp(field.str, "true", 4) == 0);
+}
+
+/* state of a subscription pass across the pages delivered */
+struct subscription_pass {
+	struct nssync_subscription *sub;
+	double modified; /* newest modification time seen */
+};
+
+/** check if a subscriber knows an id once earlier changes in a page apply */
+static bool
+subscription_known(struct nssync_subscription *sub,
+		   struct nssync_change *changev,
+		   int changec,
+		   const char *id)
+{
+	while (changec-- > 0) {
+		if (strcmp(changev[changec].id, id) == 0) {
+			return changev[changec].type != NSSYNC_CHANGE_DELETED;
+		}
+	}
+
+	return nssync_idset_contains(sub->known, id);
+}
+
+/** report the changed records of a page to a subscriber
+ *
+ * The set of known ids is only updated once the subscriber has
+ *   accepted the changes so a failed page is reported again.
+ */
+static enum nssync_error
+subscription_deliver(void *ctx, struct nssync_pipeline_page *page)
+{
+	struct subscription_pass *pass = ctx;
+	struct nssync_subscription *sub = pass->sub;
+	struct nssync_sync *sync = sub->sync;
+	enum nssync_error ret;
+	struct nssync_storage_obj *obj;
+	struct nssync_pipeline_record *record;
+	struct nssync_change *changev;
+	int changec = 0;
+	int objidx;
+	int changeidx;
+	bool added;
+	size_t scratch_size = 0;
+	char *scratch;
+
+	changev = nssync_arena_calloc(page->arena, page->objc + 1, sizeof(*changev));
+	if (changev == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	/* one scratch buffer for checking each record of the page */
+	for (objidx = 0; objidx < page->objc; objidx++) {
+		if (page->recordv[objidx].record_length > scratch_size) {
+			scratch_size = page->recordv[objidx].record_length;
+		}
+	}
+	scratch = nssync_arena_alloc(page->arena, scratch_size + 1);
+	if (scratch == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	for (objidx = 0; objidx < page->objc; objidx++) {
+		obj = &page->objv[objidx];
+		record = &page->recordv[objidx];
+
+		if (record->ret != NSSYNC_ERROR_OK) {
+			return record->ret;
+		}
+
+		changev[changec].id = nssync_storage_obj_id(obj);
+
+		if (record_deleted(record->record, record->record_length, scratch)) {
+			if (!subscription_known(sub, changev, changec,
+						changev[changec].id)) {
+				/* never reported so nothing to delete */
+				continue;
+			}
+			changev[changec].type = NSSYNC_CHANGE_DELETED;
+		} else {
+			if (subscription_known(sub, changev, changec,
+					       changev[changec].id)) {
+				changev[changec].type = NSSYNC_CHANGE_MODIFIED;
+			} else {
+				changev[changec].type = NSSYNC_CHANGE_ADDED;
+			}
+			if ((sub->flags & NSSYNC_SUBSCRIBE_RECORDS) != 0) {
+				changev[changec].record = record->record;
+				changev[changec].record_length = record->record_length;
+			}
+		}
+
+		/* records may have changed since the collection time */
+		changev[changec].modified = nssync_storage_obj_modified(obj);
+		changec++;
+	}
+
+	if (changec == 0) {
+		return NSSYNC_ERROR_OK;
+	}
+
+	ret = sub->cb(sub->ctx,
+		      nssync_storage_collection_name(sync->store,
+						     sub->collection),
+		      changev, changec);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	for (changeidx = 0; changeidx < changec; changeidx++) {
+		if (changev[changeidx].type == NSSYNC_CHANGE_DELETED) {
+			nssync_idset_remove(sub->known, changev[changeidx].id);
+		} else {
+			ret = nssync_idset_add(sub->known,
+					       changev[changeidx].id,
+					       &added);
+			if (ret != NSSYNC_ERROR_OK) {
+				return ret;
+			}
+		}
+		if (changev[changeidx].modified > pass->modified) {
+			pass->modified = changev[changeidx].modified;
+		}
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** report the records changed in a collection since the last pass
+ *
+ * Only records newer than the last reported modification time are
+ *   fetched. Whether a record was added or modified is decided by
+ *   the set of ids already reported.
+ */
+static enum nssync_error
+subscription_sync(struct nssync_subscription *sub)
+{
+	enum nssync_error ret;
+	struct nssync_sync *sync = sub->sync;
+	struct subscription_pass pass = {
+		.sub = sub,
+	};
+
+	pass.modified = nssync_storage_collection_modified(sync->store,
+							   sub->collection);
+
+	ret = nssync_pipeline_run(sync->store,
+				  nssync_context_get_workqueue(sync->context),
+				  sub->collection,
+				  sub->synced,
+				  &sub->checkpoint,
+				  collection_keybundle(sync, sub->collection),
+				  subscription_deliver,
+				  &pass);
+	if (ret != NSSYNC_ERROR_OK) {
+		log_warning(LOG_FIELDS(.account = SYNC_ACCOUNT(sync),
+				       .collection = nssync_storage_collection_name(sync->store,
+										    sub->collection),
+				       .error = ret),
+			    "unable to sync collection");
+		return ret;
+	}
+
+	sub->synced = pass.modified;
+
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+sync_schedule(struct nssync_sync *sync, time_t *next_out)
+{
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+	struct nssync_engine *engine;
+	struct nssync_subscription *sub;
+	bool changed = false;
+	time_t now;
+	time_t backoff;
+
+	now = time(NULL);
+	backoff = nssync_storage_get_backoff(sync->store);
+	if ((now < sync->next_poll) || (now < backoff)) {
+		/* not due or server asked for no requests */
+		if (backoff > sync->next_poll) {
+			sync->next_poll = backoff;
+		}
+		*next_out = sync->next_poll;
+		return NSSYNC_ERROR_OK;
+	}
+
+	if (!sync->collections_current) {
+		ret = nssync_storage_collections_refresh(sync->store);
+	}
+	sync->collections_current = false;
+
+	/* keys rotated by another client are refetched before records */
+	if ((ret == NSSYNC_ERROR_OK) &&
+	    (nssync_storage_collection_modified(sync->store,
+						sync->crypto) > sync->cryptokeys_modified)) {
+		log_info(LOG_FIELDS(.account = SYNC_ACCOUNT(sync)),
+			 "crypto/keys changed");
+		ret = crypto_keys(sync);
+	}
+
+	/* only sync engines whose collection moved since last synced */
+	if (ret == NSSYNC_ERROR_OK) {
+		for (engine = sync->registered;
+		     engine != NULL;
+		     engine = engine->next) {
+			if ((engine->state != NSSYNC_ENGINE_ENABLED) ||
+			    (nssync_storage_collection_modified(sync->store,
+					engine->collection) <= engine->synced)) {
+				continue;
+			}
+			changed = true;
+			ret = nssync_engine_sync(engine);
+			if (ret != NSSYNC_ERROR_OK) {
+				break;
+			}
+		}
+	}
+
+	/* then tell subscribers what changed in their collections */
+	if (ret == NSSYNC_ERROR_OK) {
+		for (sub = sync->subscriptions; sub != NULL; sub = sub->next) {
+			if (nssync_storage_collection_modified(sync->store,
+					sub->collection) <= sub->synced) {
+				continue;
+			}
+			changed = true;
+			ret = subscription_sync(sub);
+			if (ret != NSSYNC_ERROR_OK) {
+				break;
+			}
+		}
+	}
+
+	/* poll often while changes happen and back away while idle */
+	if (changed) {
+		sync->interval = SCHEDULE_ACTIVE_INTERVAL;
+	} else {
+		sync->interval *= 2;
+		if (sync->interval > SCHEDULE_IDLE_INTERVAL) {
+			sync->interval = SCHEDULE_IDLE_INTERVAL;
+		}
+	}
+
+	sync->next_poll = now + sync->interval;
+	backoff = nssync_storage_get_backoff(sync->store);
+	if (backoff > sync->next_poll) {
+		sync->next_poll = backoff;
+	}
+
+	*next_out = sync->next_poll;
+
+	return ret;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_schedule(struct nssync_sync *sync, time_t *next_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = sync_schedule(sync, next_out);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_set_deadline(struct nssync_sync *sync, uint64_t deadline)
+{
+	nssync_registration_set_deadline(sync->reg, &sync->cancel, deadline);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error nssync_sync_cancel(struct nssync_sync *sync)
+{
+	nssync_fetcher_cancel(&sync->cancel);
+	nssync_context_wake(sync->context);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in nssync/sync.h */
+const struct nssync_allocator *
+nssync_sync_get_allocator(struct nssync_sync *sync)
+{
+	return nssync_context_get_allocator(sync->context);
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_local_change(struct nssync_sync *sync)
+{
+	time_t next_poll;
+
+	sync->interval = SCHEDULE_ACTIVE_INTERVAL;
+
+	next_poll = time(NULL) + SCHEDULE_ACTIVE_INTERVAL;
+	if (next_poll < sync->next_poll) {
+		sync->next_poll = next_poll;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+sync_decrypt(struct nssync_sync *sync,
+	     const char *collection,
+	     const char *record,
+	     size_t record_length,
+	     uint8_t *plaintext,
+	     size_t plaintext_size,
+	     size_t *plaintext_length_out)
+{
+	enum nssync_error ret;
+	struct sync_keys *keys;
+	struct nssync_crypto_keybundle *keybundle;
+	int handle;
+
+	keys = keys_read_begin(sync);
+
+	/* collections are matched by name as interning is for the writer */
+	keybundle = keys->default_keybundle;
+	for (handle = 0; handle < keys->keybundlec; handle++) {
+		if ((keys->namev[handle] != NULL) &&
+		    (strcmp(keys->namev[handle], collection) == 0)) {
+			keybundle = keys->keybundlev[handle];
+			break;
+		}
+	}
+
+	ret = nssync_crypto_decrypt_record_buf(record, record_length,
+					       keybundle,
+					       plaintext, plaintext_size,
+					       plaintext_length_out);
+
+	keys_read_end(sync);
+
+	return ret;
+}
+
+/* exported interface documented in nssync/sync.h */
+enum nssync_error
+nssync_sync_decrypt(struct nssync_sync *sync,
+		    const char *collection,
+		    const char *record,
+		    size_t record_length,
+		    uint8_t *plaintext,
+		    size_t plaintext_size,
+		    size_t *plaintext_length_out)
+{
+	const struct nssync_allocator *prev;
+	enum nssync_error ret;
+
+	prev = nssync__alloc_enter(nssync_context_get_allocator(sync->context));
+	ret = sync_decrypt(sync, collection, record, record_length,
+			   plaintext, plaintext_size, plaintext_length_out);
+	nssync__alloc_leave(prev);
+
+	return ret;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements Chrome trace_event output
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+#include <nssync/trace.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+#ifdef NSSYNC_TRACE
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file; /* protected by trace_lock */
+static bool trace_first; /* no event has been written yet */
+
+/* set while trace_file is open, read without the lock */
+static volatile int trace_active;
+
+/* small per thread ids, they read better than pthread_t values */
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_tid_key;
+static unsigned long trace_next_tid; /* protected by trace_lock */
+
+static void trace_key_create(void)
+{
+	pthread_key_create(&trace_tid_key, NULL);
+}
+
+/* id of the calling thread, must be called with trace_lock held */
+static unsigned long trace_tid(void)
+{
+	unsigned long tid;
+
+	pthread_once(&trace_once, trace_key_create);
+
+	tid = (unsigned long)(uintptr_t)pthread_getspecific(trace_tid_key);
+	if (tid == 0) {
+		tid = ++trace_next_tid;
+		pthread_setspecific(trace_tid_key, (void *)(uintptr_t)tid);
+	}
+	return tid;
+}
+
+/* write a json string value */
+static void trace_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str != 0; str++) {
+		unsigned char c = *str;
+
+		if ((c == '"') || (c == '\\')) {
+			fputc('\\', file);
+			fputc(c, file);
+		} else if (c < 0x20) {
+			fprintf(file, "\\u%04x", c);
+		} else {
+			fputc(c, file);
+		}
+	}
+	fputc('"', file);
+}
+
+/* exported interface documented in trace.h */
+uint64_t nssync__trace_begin(void)
+{
+	if (!trace_active) {
+		return 0;
+	}
+	return nssync__metrics_now();
+}
+
+/* exported interface documented in trace.h */
+void
+nssync__trace_end(uint64_t start,
+		  const char *category,
+		  const char *name,
+		  const char *detail)
+{
+	uint64_t end;
+
+	if (!trace_active) {
+		return;
+	}
+	end = nssync__metrics_now();
+
+	pthread_mutex_lock(&trace_lock);
+
+	/* tracing may have stopped while the span was open */
+	if (trace_file != NULL) {
+		if (!trace_first) {
+			fputs(",\n", trace_file);
+		}
+		trace_first = false;
+
+		fprintf(trace_file,
+			"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%lu",
+			name,
+			category,
+			start / 1000.0,
+			(end - start) / 1000.0,
+			(long)getpid(),
+			trace_tid());
+		if (detail != NULL) {
+			fputs(",\"args\":{\"detail\":", trace_file);
+			trace_string(trace_file, detail);
+			fputc('}', trace_file);
+		}
+		fputc('}', trace_file);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* exported interface documented in nssync/trace.h */
+enum nssync_error nssync_trace_start(const char *filename)
+{
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_file != NULL) {
+		ret = NSSYNC_ERROR_INVAL;
+	} else {
+		trace_file = fopen(filename, "w");
+		if (trace_file == NULL) {
+			ret = NSSYNC_ERROR_INVAL;
+		} else {
+			fputs("[\n", trace_file);
+			trace_first = true;
+			trace_active = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+/* exported interface documented in nssync/trace.h */
+enum nssync_error nssync_trace_stop(void)
+{
+	enum nssync_error ret = NSSYNC_ERROR_OK;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_file == NULL) {
+		ret = NSSYNC_ERROR_INVAL;
+	} else {
+		trace_active = 0;
+		fputs("\n]\n", trace_file);
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+#else
+
+/* exported interface documented in nssync/trace.h */
+enum nssync_error nssync_trace_start(const char *filename)
+{
+	return NSSYNC_ERROR_INVAL;
+}
+
+/* exported interface documented in nssync/trace.h */
+enum nssync_error nssync_trace_stop(void)
+{
+	return NSSYNC_ERROR_INVAL;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** trace spans
+ *
+ * A span is opened with TRACE_BEGIN(span) which declares a variable
+ *   and closed with TRACE_END(span, category, name, detail) where
+ *   detail is a string shown with the span or NULL. Both compile to
+ *   nothing unless NSSYNC_TRACE is defined and then only cost a test
+ *   of whether tracing was started.
+ *
+ * Span starts are nssync__metrics_now() times so TRACE_END may also
+ *   close a span at a start taken for a latency metric.
+ *
+ * TRACE_PAST(duration, category, name, detail) writes a span of
+ *   duration nanoseconds ending now, for work timed elsewhere.
+ */
+
+#include <stdint.h>
+
+#include <nssync/trace.h>
+
+#ifdef NSSYNC_TRACE
+
+/** start time of a span or 0 if tracing is not started */
+uint64_t nssync__trace_begin(void);
+
+/** write a span from start until now */
+void nssync__trace_end(uint64_t start, const char *category, const char *name, const char *detail);
+
+#define TRACE_BEGIN(span) uint64_t span = nssync__trace_begin()
+
+#define TRACE_PAST(duration, category, name, detail) do {		\
+		uint64_t trace_now = nssync__trace_begin();		\
+		if (trace_now != 0) {					\
+			nssync__trace_end(trace_now - (duration),	\
+					  (category), (name), (detail)); \
+		}							\
+	} while (0)
+
+#define TRACE_END(span, category, name, detail) do {			\
+		if ((span) != 0) {					\
+			nssync__trace_end((span), (category), (name), (detail)); \
+		}							\
+	} while (0)
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_PAST(duration, category, name, detail) do { } while (0)
+#define TRACE_END(span, category, name, detail) do { } while (0)
+
+#endif
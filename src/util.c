@@ -10,7 +10,9 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "alloc.h"
 #include "util.h"
 
 int nssync__saprintf(char **str_out, const char *format, ...)
@@ -23,7 +25,7 @@ int nssync__saprintf(char **str_out, const char *format, ...)
 	slen = vsnprintf(str, slen, format, ap);
 	va_end(ap);
 
-	str = malloc(slen + 1);
+	str = nssync__malloc(slen + 1);
 	if (str == NULL) {
 		return -1;
 	}
@@ -33,10 +35,24 @@ int nssync__saprintf(char **str_out, const char *format, ...)
 	va_end(ap);
 
 	if (slen < 0) {
-		free(str);
+		nssync__free(str);
 	} else {
 		*str_out = str;
 	}
 
 	return slen;
 }
+
+/* exported interface documented in util.h */
+const char *nssync__url_host(const char *url, size_t *length_out)
+{
+	const char *start;
+
+	start = strstr(url, "://");
+	if (start != NULL) {
+		url = start + 3;
+	}
+	*length_out = strcspn(url, "/");
+
+	return url;
+}
@@ -7,4 +7,13 @@
  *
  */
 
+#include <stddef.h>
+
 int nssync__saprintf(char **str_out, const char *format, ...);
+
+/** find the host, with any port, of a url
+ *
+ * @param length_out Set to the length of the host.
+ * @return The start of the host within the url.
+ */
+const char *nssync__url_host(const char *url, size_t *length_out);
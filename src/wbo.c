@@ -0,0 +1,468 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements an in place parser for the WBO schemas
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define WBO_SSE2 1
+#endif
+
+#include <nssync/error.h>
+
+#include "wbo.h"
+
+static const char *skip_space(const char *p, const char *end)
+{
+	while ((p < end) &&
+	       ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r'))) {
+		p++;
+	}
+	return p;
+}
+
+/** skip the whitespace and separators between listing objects */
+static const char *skip_separators(const char *p, const char *end)
+{
+	while ((p < end) &&
+	       ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r') ||
+		(*p == '[') || (*p == ','))) {
+		p++;
+	}
+	return p;
+}
+
+/** find the next quote or backslash
+ *
+ * Payloads are long strings so this is where parsing spends its time,
+ *   sixteen bytes are checked at once where SSE2 is available.
+ */
+static const char *scan_string(const char *p, const char *end)
+{
+#ifdef WBO_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	__m128i chunk;
+	int mask;
+
+	while ((end - p) >= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+						      _mm_cmpeq_epi8(chunk, bslash)));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while ((p < end) && (*p != '"') && (*p != '\\')) {
+		p++;
+	}
+	return p;
+}
+
+/** skip a string returning the position after it or NULL on error */
+static const char *skip_string(const char *p, const char *end)
+{
+	p++; /* opening quote */
+	for (;;) {
+		p = scan_string(p, end);
+		if (p >= end) {
+			return NULL;
+		}
+		if (*p == '"') {
+			return p + 1;
+		}
+		p += 2; /* escape */
+	}
+}
+
+/** skip a value of any type returning the position after it */
+static const char *skip_value(const char *p, const char *end)
+{
+	int depth = 0;
+	const char *start;
+
+	do {
+		p = skip_space(p, end);
+		if (p >= end) {
+			return NULL;
+		}
+
+		switch (*p) {
+		case '"':
+			p = skip_string(p, end);
+			if (p == NULL) {
+				return NULL;
+			}
+			break;
+
+		case '{':
+		case '[':
+			depth++;
+			p++;
+			break;
+
+		case '}':
+		case ']':
+			if (depth == 0) {
+				return NULL;
+			}
+			depth--;
+			p++;
+			break;
+
+		default:
+			/* separators, numbers and literals */
+			start = p;
+			while ((p < end) &&
+			       (strchr(",:{}[]\" \t\r\n", *p) == NULL)) {
+				p++;
+			}
+			if (depth == 0) {
+				if (p == start) {
+					return NULL;
+				}
+			} else if (p == start) {
+				p++;
+			}
+			break;
+		}
+	} while (depth > 0);
+
+	return p;
+}
+
+static bool parse_hex4(const char *p, const char *end, unsigned long *cp_out)
+{
+	unsigned long cp = 0;
+	int idx;
+
+	if ((end - p) < 4) {
+		return false;
+	}
+
+	for (idx = 0; idx < 4; idx++) {
+		cp <<= 4;
+		if ((p[idx] >= '0') && (p[idx] <= '9')) {
+			cp |= p[idx] - '0';
+		} else if ((p[idx] >= 'a') && (p[idx] <= 'f')) {
+			cp |= p[idx] - 'a' + 10;
+		} else if ((p[idx] >= 'A') && (p[idx] <= 'F')) {
+			cp |= p[idx] - 'A' + 10;
+		} else {
+			return false;
+		}
+	}
+
+	*cp_out = cp;
+	return true;
+}
+
+/** utf-8 encode a code point returning the number of bytes */
+static size_t utf8_encode(unsigned long cp, char *dst)
+{
+	if (cp < 0x80) {
+		dst[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		dst[0] = 0xc0 | (cp >> 6);
+		dst[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		dst[0] = 0xe0 | (cp >> 12);
+		dst[1] = 0x80 | ((cp >> 6) & 0x3f);
+		dst[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	dst[0] = 0xf0 | (cp >> 18);
+	dst[1] = 0x80 | ((cp >> 12) & 0x3f);
+	dst[2] = 0x80 | ((cp >> 6) & 0x3f);
+	dst[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+/** unescape a string in place
+ *
+ * An escape is never shorter than what it decodes to so the string is
+ *   written over itself, the closing quote becomes the terminator.
+ */
+static enum nssync_error
+parse_string(char **pos, char *end, const char **str_out, size_t *length_out)
+{
+	char *src = *pos + 1; /* skip opening quote */
+	char *dst = src;
+	char *str = src;
+	char *stop;
+	unsigned long cp;
+	unsigned long lo;
+
+	for (;;) {
+		stop = (char *)scan_string(src, end);
+		if (stop >= end) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		if (dst != src) {
+			memmove(dst, src, stop - src);
+		}
+		dst += stop - src;
+		src = stop;
+
+		if (*src == '"') {
+			break;
+		}
+
+		/* escape sequence */
+		if ((end - src) < 2) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		switch (src[1]) {
+		case '"':
+		case '\\':
+		case '/':
+			*dst++ = src[1];
+			break;
+
+		case 'b':
+			*dst++ = '\b';
+			break;
+
+		case 'f':
+			*dst++ = '\f';
+			break;
+
+		case 'n':
+			*dst++ = '\n';
+			break;
+
+		case 'r':
+			*dst++ = '\r';
+			break;
+
+		case 't':
+			*dst++ = '\t';
+			break;
+
+		case 'u':
+			if (!parse_hex4(src + 2, end, &cp)) {
+				return NSSYNC_ERROR_PROTOCOL;
+			}
+			if ((cp >= 0xdc00) && (cp <= 0xdfff)) {
+				return NSSYNC_ERROR_PROTOCOL;
+			}
+			if ((cp >= 0xd800) && (cp <= 0xdbff)) {
+				/* surrogate pair */
+				if (((end - src) < 12) ||
+				    (src[6] != '\\') ||
+				    (src[7] != 'u') ||
+				    (!parse_hex4(src + 8, end, &lo)) ||
+				    (lo < 0xdc00) || (lo > 0xdfff)) {
+					return NSSYNC_ERROR_PROTOCOL;
+				}
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+				src += 6;
+			}
+			dst += utf8_encode(cp, dst);
+			src += 4;
+			break;
+
+		default:
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		src += 2;
+	}
+
+	*dst = 0;
+
+	*str_out = str;
+	*length_out = dst - str;
+	*pos = src + 1;
+
+	return NSSYNC_ERROR_OK;
+}
+
+static struct nssync_wbo_field *
+find_field(struct nssync_wbo_field *fieldv, int fieldc, const char *key)
+{
+	int fieldidx;
+
+	for (fieldidx = 0; fieldidx < fieldc; fieldidx++) {
+		if (strcmp(fieldv[fieldidx].name, key) == 0) {
+			return &fieldv[fieldidx];
+		}
+	}
+	return NULL;
+}
+
+static enum nssync_error
+parse_value(char **pos, char *end, struct nssync_wbo_field *field)
+{
+	char *p = *pos;
+	char *numend;
+
+	if (*p == '"') {
+		field->type = NSSYNC_WBO_STRING;
+		return parse_string(pos, end, &field->str, &field->length);
+	}
+
+	if ((*p == '-') || ((*p >= '0') && (*p <= '9'))) {
+		field->number = strtod(p, &numend);
+		if ((numend == p) || (numend > end)) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		field->type = NSSYNC_WBO_NUMBER;
+		*pos = numend;
+		return NSSYNC_ERROR_OK;
+	}
+
+	*pos = (char *)skip_value(p, end);
+	if (*pos == NULL) {
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+	field->type = NSSYNC_WBO_OTHER;
+	field->str = p;
+	field->length = *pos - p;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in wbo.h */
+enum nssync_error
+nssync_wbo_parse(char *buf,
+		 char *end,
+		 struct nssync_wbo_field *fieldv,
+		 int fieldc,
+		 char **next_out)
+{
+	enum nssync_error ret;
+	struct nssync_wbo_field *field;
+	const char *key;
+	size_t key_length;
+	char *p;
+	int fieldidx;
+
+	for (fieldidx = 0; fieldidx < fieldc; fieldidx++) {
+		fieldv[fieldidx].type = NSSYNC_WBO_ABSENT;
+	}
+
+	p = (char *)skip_space(buf, end);
+	if ((p >= end) || (*p != '{')) {
+		return NSSYNC_ERROR_PROTOCOL;
+	}
+	p = (char *)skip_space(p + 1, end);
+
+	if ((p < end) && (*p == '}')) {
+		p++;
+	} else for (;;) {
+		/* key */
+		if ((p >= end) || (*p != '"')) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		ret = parse_string(&p, end, &key, &key_length);
+		if (ret != NSSYNC_ERROR_OK) {
+			return ret;
+		}
+
+		p = (char *)skip_space(p, end);
+		if ((p >= end) || (*p != ':')) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		p = (char *)skip_space(p + 1, end);
+		if (p >= end) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+
+		/* value */
+		field = find_field(fieldv, fieldc, key);
+		if (field == NULL) {
+			p = (char *)skip_value(p, end);
+			if (p == NULL) {
+				return NSSYNC_ERROR_PROTOCOL;
+			}
+		} else {
+			ret = parse_value(&p, end, field);
+			if (ret != NSSYNC_ERROR_OK) {
+				return ret;
+			}
+		}
+
+		p = (char *)skip_space(p, end);
+		if (p >= end) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		if (*p == '}') {
+			p++;
+			break;
+		}
+		if (*p != ',') {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		p = (char *)skip_space(p + 1, end);
+	}
+
+	if (next_out != NULL) {
+		*next_out = p;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in wbo.h */
+enum nssync_error
+nssync_wbo_list_count(const char *buf, const char *end, int *count_out)
+{
+	const char *p = buf;
+	int count = 0;
+
+	for (;;) {
+		p = skip_separators(p, end);
+		if ((p >= end) || (*p == ']')) {
+			break;
+		}
+		if (*p != '{') {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		p = skip_value(p, end);
+		if (p == NULL) {
+			return NSSYNC_ERROR_PROTOCOL;
+		}
+		count++;
+	}
+
+	*count_out = count;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in wbo.h */
+enum nssync_error
+nssync_wbo_list_next(char **cursor,
+		     char *end,
+		     struct nssync_wbo_field *fieldv,
+		     int fieldc,
+		     bool *found_out)
+{
+	char *p;
+
+	p = (char *)skip_separators(*cursor, end);
+	if ((p >= end) || (*p == ']')) {
+		*cursor = end;
+		*found_out = false;
+		return NSSYNC_ERROR_OK;
+	}
+
+	*found_out = true;
+
+	return nssync_wbo_parse(p, end, fieldv, fieldc, cursor);
+}
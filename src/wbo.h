@@ -0,0 +1,62 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+/** WBO parser
+ *
+ * Parses the fixed schemas the storage server exchanges, the WBO
+ *   envelope, the encrypted record within its payload and collection
+ *   listings, without building a json tree. Only the fields asked for
+ *   are extracted, everything else is skipped.
+ *
+ * Strings are unescaped in place and null terminated so the buffer
+ *   being parsed is modified and the extracted fields are views of
+ *   it. No allocation is made. Buffers must be null terminated.
+ */
+
+/** type of an extracted field */
+enum nssync_wbo_type {
+	NSSYNC_WBO_ABSENT = 0, /* field was not present */
+	NSSYNC_WBO_STRING,
+	NSSYNC_WBO_NUMBER,
+	NSSYNC_WBO_OTHER, /* object, array, boolean or null */
+};
+
+/** field to extract from an object */
+struct nssync_wbo_field {
+	const char *name; /* key of the field */
+	enum nssync_wbo_type type; /* type of value found */
+	const char *str; /* null terminated string value, or the unterminated json text of other values */
+	size_t length; /* length of string value or json text */
+	double number; /* numeric value */
+};
+
+/** parse an object extracting fields
+ *
+ * @param buf Start of the object.
+ * @param end End of the buffer.
+ * @param fieldv Fields to extract, those not present are set absent.
+ * @param fieldc Number of fields.
+ * @param next_out Set to the position after the object if not NULL.
+ */
+enum nssync_error nssync_wbo_parse(char *buf, char *end, struct nssync_wbo_field *fieldv, int fieldc, char **next_out);
+
+/** count the objects in a collection listing
+ *
+ * Listings are either a json array of objects or objects separated
+ *   by newlines. The listing is not modified.
+ */
+enum nssync_error nssync_wbo_list_count(const char *buf, const char *end, int *count_out);
+
+/** parse the next object of a collection listing
+ *
+ * @param cursor Position in the listing, advanced past the object.
+ * @param end End of the listing.
+ * @param found_out Set false when there are no more objects.
+ */
+enum nssync_error nssync_wbo_list_next(char **cursor, char *end, struct nssync_wbo_field *fieldv, int fieldc, bool *found_out);
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ * This implements a pool of worker threads shared between sessions
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <nssync/error.h>
+
+#include "alloc.h"
+#include "workqueue.h"
+
+/* batch of jobs submitted together */
+struct workqueue_batch {
+	struct workqueue_batch *next; /* next batch in the run ring */
+
+	nssync_workqueue_job *job;
+	uint8_t *argv;
+	size_t argsize;
+	size_t argc;
+	const struct nssync_allocator *allocator; /* allocator of submitter */
+
+	size_t next_arg; /* index of next job to start */
+	size_t done; /* number of completed jobs */
+	pthread_cond_t complete; /* signalled when all jobs are done */
+};
+
+struct nssync_workqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* signalled when batches are queued */
+	bool stop; /* workers should exit */
+
+	/* batches with jobs still to start, workers take one job from
+	 * each batch in turn.
+	 */
+	struct workqueue_batch *cursor;
+
+	unsigned int threadc;
+	pthread_t *threadv;
+};
+
+/** take the next job from the ring
+ *
+ * must be called with the lock held and a non empty ring.
+ */
+static struct workqueue_batch *
+next_job(struct nssync_workqueue *wq, size_t *argidx_out)
+{
+	struct workqueue_batch *batch = wq->cursor;
+	struct workqueue_batch *prev;
+
+	*argidx_out = batch->next_arg++;
+
+	if (batch->next_arg == batch->argc) {
+		/* all jobs started, remove batch from ring */
+		if (batch->next == batch) {
+			wq->cursor = NULL;
+		} else {
+			prev = batch;
+			while (prev->next != batch) {
+				prev = prev->next;
+			}
+			prev->next = batch->next;
+			wq->cursor = batch->next;
+		}
+		batch->next = NULL;
+	} else {
+		wq->cursor = batch->next;
+	}
+
+	return batch;
+}
+
+/** run a job and account for its completion
+ *
+ * called with the lock held which is dropped while the job runs
+ */
+static void
+run_job(struct nssync_workqueue *wq, struct workqueue_batch *batch, size_t argidx)
+{
+	const struct nssync_allocator *prev;
+
+	pthread_mutex_unlock(&wq->lock);
+	prev = nssync__alloc_enter(batch->allocator);
+	batch->job(batch->argv + (argidx * batch->argsize));
+	nssync__alloc_leave(prev);
+	pthread_mutex_lock(&wq->lock);
+
+	batch->done++;
+	if (batch->done == batch->argc) {
+		pthread_cond_signal(&batch->complete);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct nssync_workqueue *wq = arg;
+	struct workqueue_batch *batch;
+	size_t argidx;
+
+	pthread_mutex_lock(&wq->lock);
+	while (!wq->stop) {
+		if (wq->cursor == NULL) {
+			pthread_cond_wait(&wq->work, &wq->lock);
+			continue;
+		}
+		batch = next_job(wq, &argidx);
+		run_job(wq, batch, argidx);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+/* exported interface documented in workqueue.h */
+enum nssync_error
+nssync_workqueue_new(unsigned int threadc,
+		     struct nssync_workqueue **workqueue_out)
+{
+	struct nssync_workqueue *wq;
+
+	wq = nssync__calloc(1, sizeof(*wq));
+	if (wq == NULL) {
+		return NSSYNC_ERROR_NOMEM;
+	}
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->work, NULL);
+
+	if (threadc > 0) {
+		wq->threadv = nssync__calloc(threadc, sizeof(pthread_t));
+		if (wq->threadv == NULL) {
+			nssync_workqueue_free(wq);
+			return NSSYNC_ERROR_NOMEM;
+		}
+	}
+
+	while (wq->threadc < threadc) {
+		if (pthread_create(&wq->threadv[wq->threadc], NULL,
+				   worker, wq) != 0) {
+			nssync_workqueue_free(wq);
+			return NSSYNC_ERROR_NOMEM;
+		}
+		wq->threadc++;
+	}
+
+	*workqueue_out = wq;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in workqueue.h */
+enum nssync_error
+nssync_workqueue_free(struct nssync_workqueue *wq)
+{
+	unsigned int thridx;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->work);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (thridx = 0; thridx < wq->threadc; thridx++) {
+		pthread_join(wq->threadv[thridx], NULL);
+	}
+
+	pthread_cond_destroy(&wq->work);
+	pthread_mutex_destroy(&wq->lock);
+	nssync__free(wq->threadv);
+	nssync__free(wq);
+
+	return NSSYNC_ERROR_OK;
+}
+
+/* exported interface documented in workqueue.h */
+unsigned int nssync_workqueue_get_threadc(struct nssync_workqueue *wq)
+{
+	if (wq == NULL) {
+		return 0;
+	}
+	return wq->threadc;
+}
+
+/* exported interface documented in workqueue.h */
+enum nssync_error
+nssync_workqueue_run(struct nssync_workqueue *wq,
+		     nssync_workqueue_job *job,
+		     void *argv,
+		     size_t argsize,
+		     size_t argc)
+{
+	struct workqueue_batch batch = {
+		.job = job,
+		.argv = argv,
+		.argsize = argsize,
+		.argc = argc,
+		.allocator = nssync__alloc_current(),
+	};
+	struct workqueue_batch *ringbatch;
+	size_t argidx;
+
+	if ((wq == NULL) || (wq->threadc == 0) || (argc < 2)) {
+		/* not worth handing off */
+		for (argidx = 0; argidx < argc; argidx++) {
+			job(batch.argv + (argidx * argsize));
+		}
+		return NSSYNC_ERROR_OK;
+	}
+
+	pthread_cond_init(&batch.complete, NULL);
+
+	pthread_mutex_lock(&wq->lock);
+
+	/* add to the ring just before the cursor so it is served last */
+	if (wq->cursor == NULL) {
+		batch.next = &batch;
+		wq->cursor = &batch;
+	} else {
+		ringbatch = wq->cursor;
+		while (ringbatch->next != wq->cursor) {
+			ringbatch = ringbatch->next;
+		}
+		ringbatch->next = &batch;
+		batch.next = wq->cursor;
+	}
+	pthread_cond_broadcast(&wq->work);
+
+	while (batch.done < batch.argc) {
+		if (batch.next_arg < batch.argc) {
+			/* help with our own batch */
+			wq->cursor = &batch;
+			ringbatch = next_job(wq, &argidx);
+			run_job(wq, ringbatch, argidx);
+		} else {
+			pthread_cond_wait(&batch.complete, &wq->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&wq->lock);
+
+	pthread_cond_destroy(&batch.complete);
+
+	return NSSYNC_ERROR_OK;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2013 Vincent Sanders <vince@netsurf-browser.org>
+ *
+ * This file is part of libnssync, http://www.netsurf-browser.org/
+ *
+ * Released under the Expat MIT License (see COPYING),
+ *
+ */
+
+struct nssync_workqueue;
+
+/** job run on a worker thread */
+typedef void (nssync_workqueue_job)(void *arg);
+
+/** create a pool of worker threads
+ *
+ * @param threadc Number of worker threads, zero runs all jobs on the
+ *                submitting thread.
+ */
+enum nssync_error nssync_workqueue_new(unsigned int threadc, struct nssync_workqueue **workqueue_out);
+
+enum nssync_error nssync_workqueue_free(struct nssync_workqueue *workqueue);
+
+/** number of worker threads, zero if jobs run on the submitting thread */
+unsigned int nssync_workqueue_get_threadc(struct nssync_workqueue *workqueue);
+
+/** run a batch of jobs and wait for them all to complete
+ *
+ * Workers take jobs from the queued batches in turn so a large batch
+ *   from one session cannot starve the batches of other sessions. The
+ *   submitting thread also runs jobs from its own batch while waiting.
+ *
+ * @param workqueue The worker pool or NULL to run on the calling thread.
+ * @param job The job to run on each argument.
+ * @param argv Array of job arguments.
+ * @param argsize Size of each job argument.
+ * @param argc Number of job arguments.
+ */
+enum nssync_error nssync_workqueue_run(struct nssync_workqueue *workqueue, nssync_workqueue_job *job, void *argv, size_t argsize, size_t argc);
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "alloc.h"
+#include "arena.h"
+
+/* blocks the arena holds from the allocator */
+static int blocks;
+
+static void *count_malloc(void *ctx, size_t size)
+{
+	blocks++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		blocks++;
+	}
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+	if (ptr != NULL) {
+		blocks--;
+	}
+	free(ptr);
+}
+
+static const struct nssync_allocator count_allocator = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = count_free,
+};
+
+/* cleanups run so far */
+static int cleanups;
+
+static void count_cleanup(void *arg)
+{
+	int *order = arg;
+
+	*order = ++cleanups;
+}
+
+static bool arena_alloc_test(void)
+{
+	struct nssync_arena *arena;
+	uint8_t *ptrv[64];
+	uint8_t *big;
+	char *str;
+	bool passed;
+	int idx;
+
+	printf("Arena allocation:");
+
+	passed = (nssync_arena_new(256, &arena) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		return false;
+	}
+
+	/* allocations are aligned and do not overlap */
+	for (idx = 0; idx < 64; idx++) {
+		ptrv[idx] = nssync_arena_alloc(arena, idx + 1);
+		passed = passed && (ptrv[idx] != NULL) &&
+			(((uintptr_t)ptrv[idx] % 16) == 0);
+		if (ptrv[idx] != NULL) {
+			memset(ptrv[idx], idx, idx + 1);
+		}
+	}
+	for (idx = 0; idx < 64; idx++) {
+		passed = passed &&
+			(ptrv[idx][0] == idx) &&
+			(ptrv[idx][idx] == idx);
+	}
+
+	/* allocations larger than a block get their own */
+	big = nssync_arena_calloc(arena, 100, 10);
+	passed = passed && (big != NULL) && (big[0] == 0) && (big[999] == 0);
+
+	passed = passed &&
+		(nssync_arena_calloc(arena, SIZE_MAX / 2, 4) == NULL);
+
+	str = nssync_arena_strdup(arena, "record");
+	passed = passed && (str != NULL) && (strcmp(str, "record") == 0);
+
+	passed = passed &&
+		(nssync_arena_saprintf(arena, &str, "%s/%d", "page", 42) == 7) &&
+		(strcmp(str, "page/42") == 0);
+
+	nssync_arena_free(arena);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool arena_reset_test(void)
+{
+	const struct nssync_allocator *prev;
+	struct nssync_arena *arena;
+	int order[3] = { 0, 0, 0 };
+	bool passed;
+	int idx;
+
+	printf("Arena reset:");
+
+	prev = nssync__alloc_enter(&count_allocator);
+	blocks = 0;
+
+	passed = (nssync_arena_new(128, &arena) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		nssync__alloc_leave(prev);
+		printf("failed\n");
+		return false;
+	}
+
+	/* cleanups run in the reverse order they were added */
+	cleanups = 0;
+	passed = (nssync_arena_cleanup(arena, count_cleanup, &order[0]) == NSSYNC_ERROR_OK) &&
+		(nssync_arena_cleanup(arena, count_cleanup, &order[1]) == NSSYNC_ERROR_OK) &&
+		(nssync_arena_cleanup(arena, count_cleanup, &order[2]) == NSSYNC_ERROR_OK);
+
+	for (idx = 0; idx < 100; idx++) {
+		passed = passed && (nssync_arena_alloc(arena, 64) != NULL);
+	}
+	passed = passed && (blocks > 2);
+
+	/* reset keeps only the first block */
+	nssync_arena_reset(arena);
+	passed = passed &&
+		(blocks == 2) &&
+		(order[2] == 1) &&
+		(order[1] == 2) &&
+		(order[0] == 3);
+
+	/* cleanups only run once */
+	passed = passed && (nssync_arena_alloc(arena, 64) != NULL);
+	nssync_arena_free(arena);
+	passed = passed && (blocks == 0) && (cleanups == 3);
+
+	nssync__alloc_leave(prev);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = arena_alloc_test() && passed;
+	passed = arena_reset_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -38,6 +38,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	ret = nssync_bookmarks_sync(sync_bookmarks);
+	if (ret != NSSYNC_ERROR_OK) {
+		fprintf(stderr, "error (%d) syncing bookmarks\n", ret);
+		nssync_bookmarks_free(sync_bookmarks);
+		nssync_sync_free(sync);
+		return 1;
+	}
+
 	nssync_bookmarks_free(sync_bookmarks);
 
 	nssync_sync_free(sync);
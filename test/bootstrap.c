@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+#define SESSIONS 3
+
+/* outcome of an asynchronous session creation */
+struct created {
+	int calls;
+	enum nssync_error ret;
+	struct nssync_sync *sync;
+};
+
+static void created_cb(void *ctx, enum nssync_error ret, struct nssync_sync *sync)
+{
+	struct created *created = ctx;
+
+	created->calls++;
+	created->ret = ret;
+	created->sync = sync;
+}
+
+/* answer fetches as an event loop would until nothing is active */
+static void pump(struct nssync_context *context)
+{
+	unsigned int active;
+	int loops;
+
+	for (loops = 0; loops < 100; loops++) {
+		ts_run();
+		nssync_context_perform(context, 0, &active);
+		if ((active == 0) && (ts.pendingc == 0)) {
+			break;
+		}
+	}
+}
+
+static struct nssync_context *context_new(void)
+{
+	struct nssync_context_params params;
+	struct nssync_context *context;
+
+	memset(&params, 0, sizeof(params));
+	params.fetcher = ts_fetcher;
+	if (nssync_context_new(&params, &context) != NSSYNC_ERROR_OK) {
+		return NULL;
+	}
+	return context;
+}
+
+static bool bootstrap_test(void)
+{
+	struct nssync_context *context;
+	struct nssync_provider provider;
+	struct created created[SESSIONS];
+	struct nssync_engine *engine;
+	struct ts_decoded decoded = { 0 };
+	bool passed = true;
+	int idx;
+
+	printf("Asynchronous bootstrap:");
+
+	ts_init();
+	ts_bookmarks(0, 1);
+	ts.defer = true;
+	context = context_new();
+	if (context == NULL) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	ts_provider(&provider, context);
+	memset(created, 0, sizeof(created));
+
+	/* several sessions set up at once without blocking */
+	for (idx = 0; idx < SESSIONS; idx++) {
+		passed = passed &&
+			(nssync_sync_new_async(&provider, created_cb,
+					       &created[idx]) == NSSYNC_ERROR_RETRY);
+	}
+
+	/* nothing completes until fetches are answered */
+	passed = passed &&
+		(ts.pendingc > 0) &&
+		(created[0].calls == 0);
+
+	pump(context);
+
+	/* every step was made and each callback made once */
+	for (idx = 0; idx < SESSIONS; idx++) {
+		passed = passed &&
+			(created[idx].calls == 1) &&
+			(created[idx].ret == NSSYNC_ERROR_OK) &&
+			(created[idx].sync != NULL);
+	}
+
+	/* identical steps of the sessions shared their fetches */
+	passed = passed && (ts.node_fetches == 1);
+
+	/* the sessions are usable once set up */
+	ts.defer = false;
+	passed = passed &&
+		(nssync_engine_register(created[0].sync, &ts_bookmarks_ops, NULL,
+					&decoded, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_engines(created[0].sync) == NSSYNC_ERROR_OK) &&
+		ts_decoded_all(&decoded, 1);
+
+	for (idx = 0; idx < SESSIONS; idx++) {
+		if (created[idx].sync != NULL) {
+			nssync_sync_free(created[idx].sync);
+		}
+	}
+	nssync_context_free(context);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool bootstrap_fail_test(void)
+{
+	struct nssync_context *context;
+	struct nssync_provider provider;
+	struct created created;
+	bool passed;
+
+	printf("Asynchronous bootstrap failure:");
+
+	ts_init();
+	ts.defer = true;
+	ts.node_status = 401;
+	context = context_new();
+	if (context == NULL) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	memset(&created, 0, sizeof(created));
+
+	/* a context must be given to make fetches through */
+	ts_provider(&provider, NULL);
+	passed = (nssync_sync_new_async(&provider, created_cb,
+					&created) == NSSYNC_ERROR_INVAL) &&
+		(created.calls == 0);
+
+	/* a failed step ends the bootstrap with an error */
+	ts_provider(&provider, context);
+	passed = passed &&
+		(nssync_sync_new_async(&provider, created_cb,
+				       &created) == NSSYNC_ERROR_RETRY);
+	pump(context);
+	passed = passed &&
+		(created.calls == 1) &&
+		(created.ret != NSSYNC_ERROR_OK) &&
+		(created.sync == NULL);
+
+	passed = (nssync_context_free(context) == NSSYNC_ERROR_OK) && passed;
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = bootstrap_test() && passed;
+	passed = bootstrap_fail_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+#define RECORDS 450
+
+/* listing offset the interrupted download fails at */
+#define FAIL_OFFSET 200
+
+/* create a session with an engine decoding into decoded */
+static bool
+session_new(const char *cachedir, struct ts_decoded *decoded, struct nssync_sync **sync_out)
+{
+	struct nssync_provider provider;
+	struct nssync_engine *engine;
+
+	ts_provider(&provider, NULL);
+	provider.cachedir = cachedir;
+
+	if (nssync_sync_new(&provider, sync_out) != NSSYNC_ERROR_OK) {
+		return false;
+	}
+	if (nssync_engine_register(*sync_out, &ts_bookmarks_ops, NULL,
+				   decoded, &engine) != NSSYNC_ERROR_OK) {
+		nssync_sync_free(*sync_out);
+		return false;
+	}
+	return true;
+}
+
+/* sync the session so the download fails part way */
+static bool interrupted_sync(struct nssync_sync *sync, struct ts_decoded *decoded)
+{
+	bool passed;
+
+	ts.fail_offset = FAIL_OFFSET;
+	passed = (nssync_sync_engines(sync) != NSSYNC_ERROR_OK) &&
+		(decoded->count == FAIL_OFFSET);
+	ts.fail_offset = 0;
+	ts_reset_counts();
+
+	return passed;
+}
+
+static bool checkpoint_resume_test(void)
+{
+	struct nssync_sync *sync;
+	struct ts_decoded decoded = { 0 };
+	bool passed;
+
+	printf("Checkpoint resume:");
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+	if (!session_new(NULL, &decoded, &sync)) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	/* the next sync continues where the failed one stopped */
+	passed = interrupted_sync(sync, &decoded) &&
+		(nssync_sync_engines(sync) == NSSYNC_ERROR_OK) &&
+		(ts.first_offset == FAIL_OFFSET) &&
+		(ts.first_unmodified != 0) &&
+		ts_decoded_all(&decoded, RECORDS);
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool checkpoint_file_test(void)
+{
+	struct nssync_sync *sync;
+	struct ts_decoded decoded = { 0 };
+	char cachedir[] = "/tmp/nssync-checkpoint-XXXXXX";
+	bool passed;
+
+	printf("Checkpoint file:");
+
+	if (mkdtemp(cachedir) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+
+	passed = session_new(cachedir, &decoded, &sync) &&
+		interrupted_sync(sync, &decoded);
+	if (passed) {
+		nssync_sync_free(sync);
+	}
+	passed = passed && (ts_cache_entries(cachedir, "checkpoint-") == 1);
+
+	/* a new session continues from the saved checkpoint */
+	passed = passed &&
+		session_new(cachedir, &decoded, &sync);
+	if (passed) {
+		passed = (nssync_sync_engines(sync) == NSSYNC_ERROR_OK) &&
+			(ts.first_offset == FAIL_OFFSET) &&
+			ts_decoded_all(&decoded, RECORDS);
+		nssync_sync_free(sync);
+	}
+
+	/* a finished download removes its checkpoint */
+	passed = passed && (ts_cache_entries(cachedir, "checkpoint-") == 0);
+
+	ts_fini();
+	ts_cache_remove(cachedir);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool checkpoint_changed_test(void)
+{
+	struct nssync_sync *sync;
+	struct ts_decoded decoded = { 0 };
+	bool passed;
+
+	printf("Checkpoint of changed collection:");
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+	if (!session_new(NULL, &decoded, &sync)) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	/* the download stays conditional on the collection time it
+	 * started at until the new time is known
+	 */
+	passed = interrupted_sync(sync, &decoded);
+	ts_bookmarks(RECORDS, RECORDS + 1);
+	passed = passed &&
+		(nssync_sync_engines(sync) != NSSYNC_ERROR_OK) &&
+		(ts.first_offset == FAIL_OFFSET) &&
+		(ts.first_unmodified != 0) &&
+		(decoded.count == FAIL_OFFSET);
+
+	/* the first poll uses the collection times the session started with */
+	passed = passed && (ts_poll(sync) != NSSYNC_ERROR_OK);
+
+	/* offsets are no longer valid once another client changed the
+	 * collection so the download continues from the high water mark,
+	 * which the last record of a page may share with the next page
+	 */
+	ts_reset_counts();
+	decoded.count = FAIL_OFFSET - 1;
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(ts.first_offset == 0) &&
+		(ts.first_unmodified == (TS_NOW + 1 + RECORDS)) &&
+		ts_decoded_all(&decoded, RECORDS + 1);
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool checkpoint_discard_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_sync_bookmarks *sync_bookmarks;
+	char cachedir[] = "/tmp/nssync-checkpoint-XXXXXX";
+	bool passed;
+
+	printf("Checkpoint of discarding engine:");
+
+	if (mkdtemp(cachedir) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+	ts_provider(&provider, NULL);
+	provider.cachedir = cachedir;
+
+	if (nssync_sync_new(&provider, &sync) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		ts_cache_remove(cachedir);
+		return false;
+	}
+	passed = (nssync_bookmarks_new(sync, &sync_bookmarks) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		nssync_sync_free(sync);
+		ts_fini();
+		ts_cache_remove(cachedir);
+		return false;
+	}
+
+	/* the bookmarks engine discards its records before each sync so
+	 * its progress is not kept
+	 */
+	ts.fail_offset = FAIL_OFFSET;
+	passed = (nssync_bookmarks_sync(sync_bookmarks) != NSSYNC_ERROR_OK) &&
+		(ts_cache_entries(cachedir, "checkpoint-") == 0);
+	ts.fail_offset = 0;
+
+	/* and the next sync delivers the whole collection again */
+	ts_reset_counts();
+	passed = passed &&
+		(nssync_bookmarks_sync(sync_bookmarks) == NSSYNC_ERROR_OK) &&
+		(ts.first_offset == 0) &&
+		(ts.listed == RECORDS);
+
+	nssync_bookmarks_free(sync_bookmarks);
+	nssync_sync_free(sync);
+	ts_fini();
+	ts_cache_remove(cachedir);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+/* collection name leading out of the cache directory */
+#define ESCAPE "x/../../esc"
+
+static enum nssync_error
+count_change(void *ctx, const char *collection, const struct nssync_change *changev, int changec)
+{
+	int *count = ctx;
+
+	*count += changec;
+
+	return NSSYNC_ERROR_OK;
+}
+
+static bool checkpoint_name_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_subscription *sub;
+	char root[] = "/tmp/nssync-checkpoint-XXXXXX";
+	char cachedir[64];
+	char subdir[128];
+	char id[16];
+	int changes = 0;
+	bool passed;
+	int idx;
+
+	printf("Checkpoint of unsafe collection name:");
+
+	if (mkdtemp(root) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+	snprintf(cachedir, sizeof(cachedir), "%s/cache", root);
+	snprintf(subdir, sizeof(subdir), "%s/checkpoint-" TS_USER "-x", cachedir);
+	mkdir(cachedir, 0700);
+	mkdir(subdir, 0700);
+
+	ts_init();
+	for (idx = 0; idx < RECORDS; idx++) {
+		snprintf(id, sizeof(id), "rec%04d", idx);
+		ts_put(ESCAPE, id, TS_NOW + 1 + idx, "{\"id\":\"rec\"}");
+	}
+	ts_provider(&provider, NULL);
+	provider.cachedir = cachedir;
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		rmdir(subdir);
+		ts_cache_remove(cachedir);
+		rmdir(root);
+		return false;
+	}
+
+	/* a collection name from the server is not used as a path */
+	ts.fail_offset = FAIL_OFFSET;
+	passed = (nssync_sync_subscribe(sync, ESCAPE, NSSYNC_SUBSCRIBE_IDS,
+					count_change, &changes,
+					&sub) == NSSYNC_ERROR_OK) &&
+		(ts_poll(sync) != NSSYNC_ERROR_OK) &&
+		(changes == FAIL_OFFSET) &&
+		(ts_cache_entries(root, "esc") == 0) &&
+		(ts_cache_entries(cachedir, "checkpoint-") == 1) &&
+		(ts_cache_entries(subdir, "esc") == 0);
+	ts.fail_offset = 0;
+
+	nssync_sync_free(sync);
+	ts_fini();
+	rmdir(subdir);
+	ts_cache_remove(cachedir);
+	rmdir(root);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = checkpoint_resume_test() && passed;
+	passed = checkpoint_file_test() && passed;
+	passed = checkpoint_changed_test() && passed;
+	passed = checkpoint_discard_test() && passed;
+	passed = checkpoint_name_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "scheduler.h"
+#include "retry.h"
+#include "coalesce.h"
+
+#define RESPONSE "{\"bookmarks\":1380000000.00}"
+
+static struct nssync_scheduler *scheduler;
+static struct nssync_retry *retry;
+static struct nssync_coalesce *coalesce;
+
+static struct nssync_fetcher_fetch *started[2];
+static int startedc;
+static int completedc;
+
+/* fetcher that leaves every fetch in progress */
+static enum nssync_error test_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	if (startedc < 2) {
+		started[startedc] = fetch;
+	}
+	startedc++;
+	return NSSYNC_ERROR_RETRY;
+}
+
+static enum nssync_error test_completion(struct nssync_fetcher_fetch *fetch)
+{
+	if ((fetch->result == NSSYNC_ERROR_OK) &&
+	    (fetch->data_used == strlen(RESPONSE)) &&
+	    (strcmp(fetch->data, RESPONSE) == 0)) {
+		completedc++;
+	}
+	free(fetch->data);
+
+	return NSSYNC_ERROR_OK;
+}
+
+static void
+fetch_init(struct nssync_fetcher_fetch *fetch, char *url, char *username)
+{
+	memset(fetch, 0, sizeof(*fetch));
+	fetch->flags = NSSYNC_FETCHER_ASYNC;
+	fetch->url = url;
+	fetch->username = username;
+	fetch->completion = test_completion;
+}
+
+/* complete a request with a response */
+static void complete(struct nssync_fetcher_fetch *fetch)
+{
+	fetch->data = malloc(sizeof(RESPONSE));
+	memcpy(fetch->data, RESPONSE, sizeof(RESPONSE));
+	fetch->data_size = sizeof(RESPONSE);
+	fetch->data_used = strlen(RESPONSE);
+	fetch->result = NSSYNC_ERROR_OK;
+	fetch->completion(fetch);
+	nssync_scheduler_run(scheduler);
+}
+
+static bool coalesce_test(void)
+{
+	struct nssync_fetcher_fetch fetchv[4];
+	char url1[] = "https://node.example/1.1/a/info/collections";
+	char url2[] = "https://node.example/1.1/b/info/collections";
+	char user1[] = "a";
+	char user2[] = "b";
+	int idx;
+	bool passed;
+
+	printf("Coalescing:");
+
+	nssync_scheduler_new(test_fetcher, 4, 4, &scheduler);
+	nssync_retry_new(scheduler, 0, &retry);
+	nssync_coalesce_new(scheduler, retry, &coalesce);
+
+	/* three fetches of one url and credentials and one of another */
+	fetch_init(&fetchv[0], url1, user1);
+	fetch_init(&fetchv[1], url1, user1);
+	fetch_init(&fetchv[2], url2, user2);
+	fetch_init(&fetchv[3], url1, user1);
+
+	for (idx = 0; idx < 4; idx++) {
+		nssync_coalesce_fetch(coalesce, &fetchv[idx]);
+	}
+	passed = (startedc == 2);
+
+	/* each request completes every fetch joined to it */
+	complete(started[1]);
+	passed = passed && (completedc == 1);
+
+	complete(started[0]);
+	passed = passed && (completedc == 4) && (nssync_scheduler_run(scheduler) == 0);
+
+	nssync_coalesce_free(coalesce);
+	nssync_retry_free(retry);
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = coalesce_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "workqueue.h"
+#include "testserver.h"
+
+#define JOBS 1000
+
+struct job {
+	unsigned int value;
+	unsigned int result;
+};
+
+static void square_job(void *arg)
+{
+	struct job *job = arg;
+
+	job->result = job->value * job->value;
+}
+
+struct batch {
+	struct nssync_workqueue *workqueue;
+	struct job jobv[JOBS];
+	bool passed;
+};
+
+static void *batch_thread(void *arg)
+{
+	struct batch *batch = arg;
+	unsigned int idx;
+
+	for (idx = 0; idx < JOBS; idx++) {
+		batch->jobv[idx].value = idx;
+		batch->jobv[idx].result = 0;
+	}
+
+	batch->passed = (nssync_workqueue_run(batch->workqueue, square_job,
+					      batch->jobv, sizeof(struct job),
+					      JOBS) == NSSYNC_ERROR_OK);
+	for (idx = 0; idx < JOBS; idx++) {
+		if (batch->jobv[idx].result != (idx * idx)) {
+			batch->passed = false;
+		}
+	}
+
+	return NULL;
+}
+
+static bool workqueue_test(void)
+{
+	struct nssync_workqueue *workqueue;
+	struct batch batchv[4];
+	pthread_t threadv[4];
+	bool passed;
+	int idx;
+
+	printf("Workqueue:");
+
+	/* jobs run on the calling thread without workers */
+	batchv[0].workqueue = NULL;
+	batch_thread(&batchv[0]);
+	passed = batchv[0].passed;
+
+	passed = passed &&
+		(nssync_workqueue_new(0, &workqueue) == NSSYNC_ERROR_OK) &&
+		(nssync_workqueue_get_threadc(workqueue) == 0);
+	batchv[0].workqueue = workqueue;
+	batch_thread(&batchv[0]);
+	passed = passed && batchv[0].passed;
+	nssync_workqueue_free(workqueue);
+
+	/* batches from several threads share the workers */
+	passed = passed &&
+		(nssync_workqueue_new(3, &workqueue) == NSSYNC_ERROR_OK) &&
+		(nssync_workqueue_get_threadc(workqueue) == 3);
+	for (idx = 0; idx < 4; idx++) {
+		batchv[idx].workqueue = workqueue;
+		pthread_create(&threadv[idx], NULL, batch_thread, &batchv[idx]);
+	}
+	for (idx = 0; idx < 4; idx++) {
+		pthread_join(threadv[idx], NULL);
+		passed = passed && batchv[idx].passed;
+	}
+	nssync_workqueue_free(workqueue);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static void count_hook(void *ctx, const struct nssync_fetcher_fetch *fetch)
+{
+	int *hooked = ctx;
+
+	(*hooked)++;
+}
+
+static bool context_share_test(void)
+{
+	struct nssync_context_params params;
+	struct nssync_context *context;
+	struct nssync_provider provider;
+	struct nssync_sync *syncv[2];
+	struct nssync_engine *engine;
+	struct ts_decoded bookmarks[2];
+	int hooked = 0;
+	bool passed;
+	int idx;
+
+	printf("Context sharing:");
+
+	ts_init();
+	ts_bookmarks(0, 50);
+
+	memset(&params, 0, sizeof(params));
+	params.fetcher = ts_fetcher;
+	params.workers = 2;
+	params.fetch_hook = count_hook;
+	params.fetch_hook_ctx = &hooked;
+	if (nssync_context_new(&params, &context) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	ts_provider(&provider, context);
+	memset(bookmarks, 0, sizeof(bookmarks));
+
+	/* sessions share the context fetcher and workers */
+	passed = (nssync_sync_new(&provider, &syncv[0]) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		nssync_context_free(context);
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	passed = (nssync_sync_new(&provider, &syncv[1]) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		nssync_sync_free(syncv[0]);
+		nssync_context_free(context);
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	for (idx = 0; idx < 2; idx++) {
+		passed = passed &&
+			(nssync_engine_register(syncv[idx], &ts_bookmarks_ops, NULL,
+						&bookmarks[idx], &engine) == NSSYNC_ERROR_OK) &&
+			(nssync_sync_engines(syncv[idx]) == NSSYNC_ERROR_OK) &&
+			ts_decoded_all(&bookmarks[idx], 50);
+	}
+
+	/* every fetch went through the shared context */
+	passed = passed && (hooked == ts.fetches);
+
+	/* the context outlives its sessions */
+	passed = passed &&
+		(nssync_context_free(context) == NSSYNC_ERROR_INVAL);
+	nssync_sync_free(syncv[0]);
+	passed = passed &&
+		(nssync_context_free(context) == NSSYNC_ERROR_INVAL);
+	nssync_sync_free(syncv[1]);
+	passed = (nssync_context_free(context) == NSSYNC_ERROR_OK) && passed;
+
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+#define CREATORS 4
+
+static void *creator_thread(void *arg)
+{
+	struct nssync_context_params params;
+	struct nssync_context *context;
+	bool *passed = arg;
+	int idx;
+
+	/* contexts using the default fetcher set curl up */
+	memset(&params, 0, sizeof(params));
+	for (idx = 0; idx < 20; idx++) {
+		if ((nssync_context_new(&params, &context) != NSSYNC_ERROR_OK) ||
+		    (nssync_context_free(context) != NSSYNC_ERROR_OK)) {
+			*passed = false;
+		}
+	}
+
+	return NULL;
+}
+
+static bool context_concurrent_test(void)
+{
+	pthread_t threadv[CREATORS];
+	bool passedv[CREATORS];
+	bool passed = true;
+	int idx;
+
+	printf("Concurrent contexts:");
+
+	/* contexts are made and freed on many threads at once */
+	for (idx = 0; idx < CREATORS; idx++) {
+		passedv[idx] = true;
+		pthread_create(&threadv[idx], NULL, creator_thread, &passedv[idx]);
+	}
+	for (idx = 0; idx < CREATORS; idx++) {
+		pthread_join(threadv[idx], NULL);
+		passed = passed && passedv[idx];
+	}
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = workqueue_test() && passed;
+	passed = context_share_test() && passed;
+	passed = context_concurrent_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
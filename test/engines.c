@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+static enum nssync_error test_reset(void *ctx, const char *syncid)
+{
+	struct ts_decoded *decoded = ctx;
+
+	snprintf(decoded->syncid, sizeof(decoded->syncid), "%s", syncid);
+
+	return NSSYNC_ERROR_OK;
+}
+
+static const struct nssync_engine_ops bookmarks_ops = {
+	.name = "bookmarks",
+	.min_version = 1,
+	.max_version = 2,
+	.decode = ts_decode,
+};
+
+static const struct nssync_engine_ops bookmarks_reset_ops = {
+	.name = "bookmarks",
+	.min_version = 2,
+	.max_version = 2,
+	.reset = test_reset,
+	.decode = ts_decode,
+};
+
+static const struct nssync_engine_ops history_ops = {
+	.name = "history",
+	.min_version = 2,
+	.max_version = 3,
+	.decode = ts_decode,
+};
+
+static const struct nssync_engine_ops tabs_ops = {
+	.name = "tabs",
+	.min_version = 1,
+	.max_version = 1,
+	.decode = ts_decode,
+};
+
+static const struct nssync_engine_ops forms_ops = {
+	.name = "forms",
+	.min_version = 1,
+	.max_version = 1,
+	.decode = ts_decode,
+};
+
+static const struct nssync_engine_ops invalid_ops = {
+	.name = "prefs",
+};
+
+static bool engine_state_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *bookmarks;
+	struct nssync_engine *stale;
+	struct nssync_engine *reset;
+	struct nssync_engine *history;
+	struct nssync_engine *tabs;
+	struct nssync_engine *forms;
+	struct nssync_engine *invalid = NULL;
+	struct ts_decoded decoded[4];
+	bool passed;
+
+	printf("Engine state:");
+
+	ts_init();
+	ts_provider(&provider, NULL);
+	memset(decoded, 0, sizeof(decoded));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	nssync_engine_register(sync, &bookmarks_ops, "bmksyncid", &decoded[0], &bookmarks);
+	nssync_engine_register(sync, &bookmarks_ops, "stale", &decoded[1], &stale);
+	nssync_engine_register(sync, &bookmarks_reset_ops, "stale", &decoded[2], &reset);
+	nssync_engine_register(sync, &history_ops, NULL, &decoded[3], &history);
+	nssync_engine_register(sync, &tabs_ops, NULL, NULL, &tabs);
+	nssync_engine_register(sync, &forms_ops, NULL, NULL, &forms);
+
+	/* versions and syncIDs are checked against meta/global */
+	passed = (nssync_engine_get_state(bookmarks) == NSSYNC_ENGINE_ENABLED) &&
+		(nssync_engine_get_state(stale) == NSSYNC_ENGINE_RESET) &&
+		(nssync_engine_get_state(reset) == NSSYNC_ENGINE_ENABLED) &&
+		(strcmp(decoded[2].syncid, "bmksyncid") == 0) &&
+		(nssync_engine_get_state(history) == NSSYNC_ENGINE_VERSION) &&
+		(strcmp(nssync_engine_get_syncid(history), "histsyncid") == 0);
+
+	/* declined and absent engines are disabled */
+	passed = passed &&
+		(nssync_engine_get_state(tabs) == NSSYNC_ENGINE_DISABLED) &&
+		(nssync_engine_get_syncid(tabs) == NULL) &&
+		(nssync_engine_get_state(forms) == NSSYNC_ENGINE_DISABLED) &&
+		(nssync_engine_get_syncid(forms) == NULL);
+
+	/* an engine must be able to decode */
+	passed = passed &&
+		(nssync_engine_register(sync, &invalid_ops, NULL, NULL, &invalid) == NSSYNC_ERROR_INVAL) &&
+		(invalid == NULL);
+
+	nssync_engine_unregister(stale);
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool engine_dispatch_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *bookmarks;
+	struct nssync_engine *history;
+	struct nssync_engine *tabs;
+	struct ts_decoded decoded[3];
+	bool passed;
+
+	printf("Engine dispatch:");
+
+	ts_init();
+	ts_bookmarks(0, 3);
+	ts_put("history", "hist0", TS_NOW + 1, "{\"id\":\"hist0\",\"histUri\":\"http://example.com/\"}");
+	ts_put("tabs", "tabs0", TS_NOW + 1, "{\"id\":\"tabs0\",\"tabs\":[]}");
+	ts_provider(&provider, NULL);
+	memset(decoded, 0, sizeof(decoded));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	nssync_engine_register(sync, &bookmarks_ops, NULL, &decoded[0], &bookmarks);
+	nssync_engine_register(sync, &history_ops, NULL, &decoded[1], &history);
+	nssync_engine_register(sync, &tabs_ops, NULL, &decoded[2], &tabs);
+
+	/* only enabled engines are given records, and only their own */
+	passed = (nssync_sync_engines(sync) == NSSYNC_ERROR_OK) &&
+		ts_decoded_all(&decoded[0], 3) &&
+		(decoded[1].count == 0) &&
+		(decoded[2].count == 0);
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = engine_state_test() && passed;
+	passed = engine_dispatch_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
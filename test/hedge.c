@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <curl/curl.h>
+
+#include <nssync/nssync.h>
+
+#include "fetcher.h"
+
+#define BODY "{\"bookmarks\":1380000000.00}"
+
+/* loopback HTTP server answering each connection on a thread */
+static struct {
+	int listener;
+	int port;
+	pthread_t thread;
+
+	int stall_ms; /* the next request is answered after this long */
+	int stop;
+	int active; /* connections being answered */
+} hs;
+
+static long hs_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static void *hs_connection(void *arg)
+{
+	int fd = (intptr_t)arg;
+	char request[4096];
+	char response[256];
+	size_t used = 0;
+	ssize_t rd;
+	int stall_ms;
+	long until;
+	int length;
+
+	while ((used < (sizeof(request) - 1)) &&
+	       ((rd = read(fd, request + used, sizeof(request) - 1 - used)) > 0)) {
+		used += rd;
+		request[used] = 0;
+		if (strstr(request, "\r\n\r\n") != NULL) {
+			break;
+		}
+	}
+
+	stall_ms = __atomic_exchange_n(&hs.stall_ms, 0, __ATOMIC_SEQ_CST);
+	until = hs_now_ms() + stall_ms;
+	while ((hs_now_ms() < until) &&
+	       !__atomic_load_n(&hs.stop, __ATOMIC_SEQ_CST)) {
+		usleep(10000);
+	}
+
+	length = snprintf(response, sizeof(response),
+			  "HTTP/1.1 200 OK\r\n"
+			  "Content-Type: application/json\r\n"
+			  "Content-Length: %d\r\n"
+			  "Connection: close\r\n\r\n%s",
+			  (int)strlen(BODY), BODY);
+	if (write(fd, response, length) != length) {
+		/* client went away, as a request lost to a hedge does */
+	}
+	close(fd);
+
+	__atomic_sub_fetch(&hs.active, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+static void *hs_accept(void *arg)
+{
+	pthread_t thread;
+	int fd;
+
+	for (;;) {
+		fd = accept(hs.listener, NULL, NULL);
+		if (fd < 0) {
+			break;
+		}
+		__atomic_add_fetch(&hs.active, 1, __ATOMIC_SEQ_CST);
+		pthread_create(&thread, NULL, hs_connection, (void *)(intptr_t)fd);
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static bool hs_start(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	memset(&hs, 0, sizeof(hs));
+	signal(SIGPIPE, SIG_IGN);
+
+	hs.listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (hs.listener < 0) {
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(hs.listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    (listen(hs.listener, 16) != 0) ||
+	    (getsockname(hs.listener, (struct sockaddr *)&addr, &addrlen) != 0)) {
+		close(hs.listener);
+		return false;
+	}
+	hs.port = ntohs(addr.sin_port);
+
+	pthread_create(&hs.thread, NULL, hs_accept, NULL);
+
+	return true;
+}
+
+static void hs_stop(void)
+{
+	__atomic_store_n(&hs.stop, 1, __ATOMIC_SEQ_CST);
+	shutdown(hs.listener, SHUT_RDWR);
+	pthread_join(hs.thread, NULL);
+	close(hs.listener);
+
+	while (__atomic_load_n(&hs.active, __ATOMIC_SEQ_CST) > 0) {
+		usleep(1000);
+	}
+}
+
+/* check the timing of a fetch from the server is filled in */
+static bool timing_valid(const struct nssync_fetcher_timing *timing)
+{
+	return (timing->total > 0) &&
+		(timing->connect <= timing->pretransfer) &&
+		(timing->pretransfer <= timing->starttransfer) &&
+		(timing->starttransfer <= timing->total) &&
+		(timing->appconnect == 0) &&
+		(timing->bytes_in > strlen(BODY)) &&
+		(timing->bytes_out > 0);
+}
+
+/* fetch the collection times, returning how long it took */
+static long fetch_info(void *share, bool *ok_out)
+{
+	struct nssync_fetcher_fetch fetch;
+	char url[64];
+	long start;
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/info/collections", hs.port);
+
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.url = url;
+	fetch.share = share;
+	fetch.endpoint = NSSYNC_FETCHER_ENDPOINT_INFO;
+
+	start = hs_now_ms();
+	*ok_out = (nssync_fetcher_curl(&fetch) == NSSYNC_ERROR_OK) &&
+		(fetch.http_code == 200) &&
+		(fetch.data != NULL) &&
+		(strcmp(fetch.data, BODY) == 0) &&
+		timing_valid(&fetch.timing);
+	free(fetch.data);
+
+	return hs_now_ms() - start;
+}
+
+static uint64_t hedges(enum nssync_metric_counter counter)
+{
+	struct nssync_metrics *metrics;
+	uint64_t value;
+
+	nssync_metrics_snapshot(&metrics);
+	value = nssync_metrics_counter(metrics, counter);
+	nssync_metrics_free(metrics);
+
+	return value;
+}
+
+static bool hedge_test(void)
+{
+	void *share;
+	uint64_t won;
+	uint64_t lost;
+	bool passed = true;
+	bool ok;
+	long elapsed;
+	int idx;
+
+	printf("Hedged fetch:");
+
+	share = nssync_fetcher_curl_share_new();
+	nssync_fetcher_curl_share_hedge(share, 50, 100);
+
+	/* quick fetches give the latency to hedge after */
+	for (idx = 0; idx < 25; idx++) {
+		fetch_info(share, &ok);
+		passed = passed && ok;
+	}
+
+	/* a stalled request is overtaken by its duplicate */
+	won = hedges(NSSYNC_METRIC_HEDGES_WON);
+	__atomic_store_n(&hs.stall_ms, 3000, __ATOMIC_SEQ_CST);
+	elapsed = fetch_info(share, &ok);
+	passed = passed &&
+		ok &&
+		(elapsed < 1000) &&
+		(hedges(NSSYNC_METRIC_HEDGES_WON) == (won + 1));
+
+	nssync_fetcher_curl_share_free(share);
+
+	/* without hedging a stalled request is waited for */
+	share = nssync_fetcher_curl_share_new();
+	for (idx = 0; idx < 25; idx++) {
+		fetch_info(share, &ok);
+		passed = passed && ok;
+	}
+	won = hedges(NSSYNC_METRIC_HEDGES_WON);
+	lost = hedges(NSSYNC_METRIC_HEDGES_LOST);
+	__atomic_store_n(&hs.stall_ms, 300, __ATOMIC_SEQ_CST);
+	elapsed = fetch_info(share, &ok);
+	passed = passed &&
+		ok &&
+		(elapsed >= 300) &&
+		(hedges(NSSYNC_METRIC_HEDGES_WON) == won) &&
+		(hedges(NSSYNC_METRIC_HEDGES_LOST) == lost);
+
+	nssync_fetcher_curl_share_free(share);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool deadline_test(void)
+{
+	struct nssync_fetcher_fetch fetch;
+	void *share;
+	char url[64];
+	long start;
+	long elapsed;
+	bool passed;
+
+	printf("Fetch deadline:");
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/info/collections", hs.port);
+
+	/* the expected failures are not reported */
+	nssync_log_set_sink(NULL, NULL, NSSYNC_LOG_NONE);
+
+	/* a stalled server is given up on when the deadline passes */
+	share = nssync_fetcher_curl_share_new();
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.url = url;
+	fetch.share = share;
+	fetch.endpoint = NSSYNC_FETCHER_ENDPOINT_INFO;
+	fetch.deadline = nssync_fetcher_deadline(300);
+
+	__atomic_store_n(&hs.stall_ms, 3000, __ATOMIC_SEQ_CST);
+	start = hs_now_ms();
+	passed = (nssync_fetcher_curl(&fetch) == NSSYNC_ERROR_TIMEOUT) &&
+		(fetch.result == NSSYNC_ERROR_TIMEOUT);
+	elapsed = hs_now_ms() - start;
+	passed = passed && (elapsed >= 300) && (elapsed < 2000);
+	free(fetch.data);
+
+	/* one already past is not made */
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.url = url;
+	fetch.share = share;
+	fetch.deadline = nssync_fetcher_deadline(0);
+	passed = passed &&
+		(nssync_fetcher_curl(&fetch) == NSSYNC_ERROR_TIMEOUT) &&
+		(fetch.http_code == 0);
+	free(fetch.data);
+
+	nssync_fetcher_curl_share_free(share);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	/* the loopback server must be reached directly */
+	setenv("no_proxy", "127.0.0.1", 1);
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	if (!hs_start()) {
+		printf("unable to start server\n");
+		return 1;
+	}
+
+	passed = hedge_test() && passed;
+	passed = deadline_test() && passed;
+
+	hs_stop();
+	curl_global_cleanup();
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+#define ROTATIONS 20
+
+#define PLAINTEXT "{\"id\":\"bmk0\",\"type\":\"bookmark\",\"title\":\"zero\"}"
+
+/* a record encrypted with each of the keys being rotated between */
+struct reader {
+	struct nssync_sync *sync;
+	char *payload[2];
+	bool stop;
+	int decrypts[2]; /* successful decrypts with each set of keys */
+	bool passed;
+};
+
+/* decrypt a record checking any plaintext is the one encrypted */
+static enum nssync_error
+decrypt(struct nssync_sync *sync, const char *collection, const char *payload)
+{
+	enum nssync_error ret;
+	uint8_t plaintext[512];
+	size_t length;
+
+	ret = nssync_sync_decrypt(sync, collection, payload, strlen(payload),
+				  plaintext, sizeof(plaintext), &length);
+	if ((ret == NSSYNC_ERROR_OK) &&
+	    ((length != strlen(PLAINTEXT)) ||
+	     (strcmp((char *)plaintext, PLAINTEXT) != 0))) {
+		ret = NSSYNC_ERROR_PROTOCOL;
+	}
+
+	return ret;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader *reader = arg;
+	enum nssync_error ret;
+	int idx;
+
+	reader->passed = true;
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_SEQ_CST)) {
+		/* a call uses one set of keys throughout so a record
+		 * either decrypts correctly or fails verification
+		 */
+		for (idx = 0; idx < 2; idx++) {
+			ret = decrypt(reader->sync, "history", reader->payload[idx]);
+			if (ret == NSSYNC_ERROR_OK) {
+				reader->decrypts[idx]++;
+			} else if (ret != NSSYNC_ERROR_HMAC) {
+				reader->passed = false;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static bool key_rotation_test(void)
+{
+	struct nssync_provider provider;
+	struct reader reader;
+	uint8_t key[2][32];
+	pthread_t thread;
+	bool passed = true;
+	int idx;
+
+	printf("Key rotation:");
+
+	ts_init();
+	ts_provider(&provider, NULL);
+	memset(&reader, 0, sizeof(reader));
+
+	ts_keyfill(key, 1);
+	reader.payload[0] = ts_encrypt((const uint8_t (*)[32])key, PLAINTEXT);
+	ts_keyfill(key, 2);
+	reader.payload[1] = ts_encrypt((const uint8_t (*)[32])key, PLAINTEXT);
+
+	if (nssync_sync_new(&provider, &reader.sync) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	/* the first poll uses the collection times the session started with */
+	passed = (ts_poll(reader.sync) == NSSYNC_ERROR_OK);
+
+	pthread_create(&thread, NULL, reader_thread, &reader);
+
+	/* another client rotates the keys while records are decrypted */
+	for (idx = 0; idx < ROTATIONS; idx++) {
+		ts_rotate(1 + ((idx + 1) % 2), false);
+		passed = passed && (ts_poll(reader.sync) == NSSYNC_ERROR_OK);
+		usleep(1000);
+	}
+
+	__atomic_store_n(&reader.stop, true, __ATOMIC_SEQ_CST);
+	pthread_join(thread, NULL);
+
+	passed = passed &&
+		reader.passed &&
+		(reader.decrypts[0] > 0) &&
+		(reader.decrypts[1] > 0);
+
+	/* the keys last fetched are used once rotation stops */
+	passed = passed &&
+		(decrypt(reader.sync, "history", reader.payload[0]) == NSSYNC_ERROR_OK) &&
+		(decrypt(reader.sync, "history", reader.payload[1]) == NSSYNC_ERROR_HMAC);
+
+	nssync_sync_free(reader.sync);
+	free(reader.payload[0]);
+	free(reader.payload[1]);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool collection_keys_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	uint8_t key[2][32];
+	char *payload[2];
+	bool passed;
+
+	printf("Collection keys:");
+
+	ts_init();
+	ts_rotate(5, true);
+	ts_provider(&provider, NULL);
+
+	ts_keyfill(key, 5);
+	payload[0] = ts_encrypt((const uint8_t (*)[32])key, PLAINTEXT);
+	ts_keyfill(key, 1005);
+	payload[1] = ts_encrypt((const uint8_t (*)[32])key, PLAINTEXT);
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		free(payload[0]);
+		free(payload[1]);
+		ts_fini();
+		return false;
+	}
+
+	/* a collection with its own keys uses them, others the default */
+	passed = (ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(decrypt(sync, "bookmarks", payload[1]) == NSSYNC_ERROR_OK) &&
+		(decrypt(sync, "bookmarks", payload[0]) == NSSYNC_ERROR_HMAC) &&
+		(decrypt(sync, "history", payload[0]) == NSSYNC_ERROR_OK) &&
+		(decrypt(sync, "history", payload[1]) == NSSYNC_ERROR_HMAC);
+
+	/* collection keys dropped by a rotation are no longer used */
+	ts_rotate(5, false);
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(decrypt(sync, "bookmarks", payload[0]) == NSSYNC_ERROR_OK) &&
+		(decrypt(sync, "bookmarks", payload[1]) == NSSYNC_ERROR_HMAC);
+
+	nssync_sync_free(sync);
+	free(payload[0]);
+	free(payload[1]);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	/* records failing verification are expected */
+	nssync_log_set_sink(NULL, NULL, NSSYNC_LOG_NONE);
+
+	passed = key_rotation_test() && passed;
+	passed = collection_keys_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <curl/curl.h>
+
+#include <nssync/nssync.h>
+
+#include "fetcher.h"
+#include "log.h"
+
+#define RECORDS 8
+
+/* records the sink was given, copied as they only last for the call */
+static struct sunk {
+	int count;
+	struct {
+		enum nssync_log_level level;
+		char message[128];
+		char url[64];
+		enum nssync_error error;
+	} recordv[RECORDS];
+} sunk;
+
+static void test_sink(void *ctx, const struct nssync_log_record *record)
+{
+	struct sunk *to = ctx;
+
+	if (to->count < RECORDS) {
+		to->recordv[to->count].level = record->level;
+		snprintf(to->recordv[to->count].message,
+			 sizeof(to->recordv[0].message), "%s", record->message);
+		snprintf(to->recordv[to->count].url,
+			 sizeof(to->recordv[0].url), "%s",
+			 (record->fields->url != NULL) ? record->fields->url : "");
+		to->recordv[to->count].error = record->fields->error;
+	}
+	to->count++;
+}
+
+/* a loopback url nothing is listening on */
+static bool closed_url(char *url, size_t size)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    (getsockname(fd, (struct sockaddr *)&addr, &addrlen) != 0)) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	snprintf(url, size, "http://127.0.0.1:%d/info/collections",
+		 ntohs(addr.sin_port));
+
+	return true;
+}
+
+/* make a fetch which fails to connect and log what it reports */
+static enum nssync_error failed_fetch(const char *url, enum nssync_log_level level)
+{
+	struct nssync_fetcher_fetch fetch;
+	enum nssync_error ret;
+
+	memset(&sunk, 0, sizeof(sunk));
+	nssync_log_set_sink(test_sink, &sunk, level);
+
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.url = (char *)url;
+	ret = nssync_fetcher_curl(&fetch);
+	free(fetch.data);
+
+	nssync_log_set_sink(NULL, NULL, NSSYNC_LOG_NONE);
+
+	return ret;
+}
+
+static bool log_fetch_test(void)
+{
+	char url[64];
+	bool passed;
+
+	printf("Failed fetch logging:");
+
+	if (!closed_url(url, sizeof(url))) {
+		printf("failed\n");
+		return false;
+	}
+
+	/* the failure is a warning about the url with its error */
+	passed = (failed_fetch(url, NSSYNC_LOG_WARNING) == NSSYNC_ERROR_FETCH) &&
+		(sunk.count == 1) &&
+		(sunk.recordv[0].level == NSSYNC_LOG_WARNING) &&
+		(strncmp(sunk.recordv[0].message, "unable to request data: ",
+			 strlen("unable to request data: ")) == 0) &&
+		(strcmp(sunk.recordv[0].url, url) == 0) &&
+		(sunk.recordv[0].error == NSSYNC_ERROR_FETCH);
+
+	/* debug messages come before it when asked for */
+	passed = passed &&
+		(failed_fetch(url, NSSYNC_LOG_DEBUG) == NSSYNC_ERROR_FETCH) &&
+		(sunk.count == 2) &&
+		(sunk.recordv[0].level == NSSYNC_LOG_DEBUG) &&
+		(strcmp(sunk.recordv[0].message, "fetching") == 0) &&
+		(strcmp(sunk.recordv[0].url, url) == 0) &&
+		(sunk.recordv[0].error == NSSYNC_ERROR_OK) &&
+		(sunk.recordv[1].level == NSSYNC_LOG_WARNING);
+
+	/* nothing below the level reaches the sink */
+	passed = passed &&
+		(failed_fetch(url, NSSYNC_LOG_ERROR) == NSSYNC_ERROR_FETCH) &&
+		(sunk.count == 0);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool log_message_test(void)
+{
+	bool passed;
+
+	printf("Log messages:");
+
+	/* trailing newlines are removed and fields default to none */
+	memset(&sunk, 0, sizeof(sunk));
+	nssync_log_set_sink(test_sink, &sunk, NSSYNC_LOG_INFO);
+	log_info(NULL, "%d records\n\n", 3);
+	log_info(LOG_FIELDS(.error = NSSYNC_ERROR_PROTOCOL), "line one\nline two\n");
+	log_debug(NULL, "not sent");
+	nssync_log_set_sink(NULL, NULL, NSSYNC_LOG_NONE);
+
+	passed = (sunk.count == 2) &&
+		(sunk.recordv[0].level == NSSYNC_LOG_INFO) &&
+		(strcmp(sunk.recordv[0].message, "3 records") == 0) &&
+		(sunk.recordv[0].url[0] == 0) &&
+		(sunk.recordv[0].error == NSSYNC_ERROR_OK) &&
+		(strcmp(sunk.recordv[1].message, "line one\nline two") == 0) &&
+		(sunk.recordv[1].error == NSSYNC_ERROR_PROTOCOL);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	/* the loopback address must be reached directly */
+	setenv("no_proxy", "127.0.0.1", 1);
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	passed = log_fetch_test() && passed;
+	passed = log_message_test() && passed;
+
+	curl_global_cleanup();
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
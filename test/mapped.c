@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+#define RECORDS 250
+
+/* fetcher that answers on the heap whatever the fetch asks for */
+static enum nssync_error heap_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	fetch->flags &= ~NSSYNC_FETCHER_FILE;
+
+	return ts_fetcher(fetch);
+}
+
+/* listing bodies are made a multiple of the page size, ending in a
+ * number if unterminated is set
+ */
+static bool unterminated;
+
+static void page_fill(struct nssync_fetcher_fetch *fetch)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	const char *head = "[{\"id\":\"bmk0000\",\"modified\":";
+	char *body;
+	size_t length;
+
+	length = ((fetch->data_used / page) + 1) * page;
+	body = malloc(length);
+	if (unterminated) {
+		/* a truncated listing */
+		memset(body, '1', length);
+		memcpy(body, head, strlen(head));
+	} else {
+		/* the listing with whitespace after the opening bracket */
+		memset(body, ' ', length);
+		body[0] = '[';
+		if (pread(fetch->fd, body + length - fetch->data_used + 1,
+			  fetch->data_used - 1, 1) != (ssize_t)(fetch->data_used - 1)) {
+			fetch->result = NSSYNC_ERROR_FETCH;
+		}
+	}
+	if ((ftruncate(fetch->fd, 0) != 0) ||
+	    (pwrite(fetch->fd, body, length, 0) != (ssize_t)length)) {
+		fetch->result = NSSYNC_ERROR_FETCH;
+	}
+	fetch->data_used = length;
+	free(body);
+}
+
+/* fetcher answering listings to files a page multiple long */
+static enum nssync_error page_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	enum nssync_error ret;
+
+	if (((fetch->flags & NSSYNC_FETCHER_FILE) == 0) ||
+	    (strstr(fetch->url, "/storage/bookmarks") == NULL)) {
+		return ts_fetcher(fetch);
+	}
+
+	ret = nssync_fetcher_check(fetch);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	ts_respond(fetch);
+	if (fetch->result == NSSYNC_ERROR_OK) {
+		page_fill(fetch);
+	}
+	if (fetch->completion == NULL) {
+		return fetch->result;
+	}
+	ret = fetch->completion(fetch);
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+		return NSSYNC_ERROR_RETRY;
+	}
+	return ret;
+}
+
+static bool mapped_test(const char *name, nssync_fetcher *fetcher, bool mapped)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *engine;
+	struct ts_decoded decoded;
+	char cachedir[] = "/tmp/nssync-mapped-XXXXXX";
+	bool passed;
+
+	printf("%s:", name);
+
+	if (mkdtemp(cachedir) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+	ts_provider(&provider, NULL);
+	provider.fetcher = fetcher;
+	provider.cachedir = cachedir;
+
+	memset(&decoded, 0, sizeof(decoded));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		ts_cache_remove(cachedir);
+		return false;
+	}
+
+	ts_reset_counts();
+	passed = (nssync_engine_register(sync, &ts_bookmarks_ops, NULL,
+					 &decoded, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_engines(sync) == NSSYNC_ERROR_OK) &&
+		ts_decoded_all(&decoded, RECORDS) &&
+		(ts.listings > 1);
+
+	/* listings go to files when the fetcher honours the flag */
+	passed = passed &&
+		(ts.file_listings == (mapped ? ts.listings : 0));
+
+	/* the download files are unlinked as they are made */
+	passed = passed &&
+		(ts_cache_entries(cachedir, "collection") == 0);
+
+	nssync_sync_free(sync);
+	ts_fini();
+	ts_cache_remove(cachedir);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool unterminated_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *engine;
+	struct ts_decoded decoded;
+	char cachedir[] = "/tmp/nssync-mapped-XXXXXX";
+	bool passed;
+
+	printf("Unterminated mapped listing:");
+
+	if (mkdtemp(cachedir) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+
+	ts_init();
+	ts_bookmarks(0, 1);
+	ts_provider(&provider, NULL);
+	provider.fetcher = page_fetcher;
+	provider.cachedir = cachedir;
+
+	memset(&decoded, 0, sizeof(decoded));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		ts_cache_remove(cachedir);
+		return false;
+	}
+
+	/* a listing ending part way through a number is not read past */
+	unterminated = true;
+	passed = (nssync_engine_register(sync, &ts_bookmarks_ops, NULL,
+					 &decoded, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_engines(sync) != NSSYNC_ERROR_OK) &&
+		(ts.file_listings > 0) &&
+		(decoded.count == 0);
+	unterminated = false;
+
+	nssync_sync_free(sync);
+	ts_fini();
+	ts_cache_remove(cachedir);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = mapped_test("Mapped listings", ts_fetcher, true) && passed;
+	passed = mapped_test("Heap listings", heap_fetcher, false) && passed;
+	passed = mapped_test("Page multiple listings", page_fetcher, true) && passed;
+	passed = unterminated_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
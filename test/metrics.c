@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <nssync/nssync.h>
+
+#include "metrics.h"
+
+#define THREADS 4
+#define COUNT 10000
+
+static void *count_thread(void *arg)
+{
+	int idx;
+
+	for (idx = 0; idx < COUNT; idx++) {
+		nssync__metrics_add(NSSYNC_METRIC_RECORDS_FETCHED, 1);
+	}
+
+	return NULL;
+}
+
+static bool metrics_counter_test(void)
+{
+	pthread_t threads[THREADS];
+	struct nssync_metrics *metrics;
+	uint64_t count;
+	int idx;
+
+	printf("Metrics counters:");
+
+	for (idx = 0; idx < THREADS; idx++) {
+		pthread_create(&threads[idx], NULL, count_thread, NULL);
+	}
+	for (idx = 0; idx < THREADS; idx++) {
+		pthread_join(threads[idx], NULL);
+	}
+
+	/* counts of exited threads are kept */
+	if (nssync_metrics_snapshot(&metrics) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		return false;
+	}
+	count = nssync_metrics_counter(metrics, NSSYNC_METRIC_RECORDS_FETCHED);
+	nssync_metrics_free(metrics);
+
+	if (count != THREADS * COUNT) {
+		printf("incorrect %llu\n", (unsigned long long)count);
+		return false;
+	}
+
+	printf("passed\n");
+	return true;
+}
+
+static bool metrics_histogram_test(void)
+{
+	struct nssync_metrics *metrics;
+	uint64_t median;
+	uint64_t now;
+	int idx;
+
+	printf("Metrics histogram:");
+
+	/* values a millisecond in the past */
+	for (idx = 0; idx < 100; idx++) {
+		now = nssync__metrics_now();
+		nssync__metrics_since(NSSYNC_METRIC_PARSE, now - 1000000);
+	}
+
+	if (nssync_metrics_snapshot(&metrics) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		return false;
+	}
+	median = nssync_metrics_quantile(metrics, NSSYNC_METRIC_PARSE, 0.5);
+	idx = nssync_metrics_histogram_count(metrics, NSSYNC_METRIC_PARSE);
+	nssync_metrics_free(metrics);
+
+	if ((idx != 100) || (median < 1000000) || (median > 1250000)) {
+		printf("incorrect count %d median %llu\n",
+		       idx, (unsigned long long)median);
+		return false;
+	}
+
+	printf("passed\n");
+	return true;
+}
+
+static bool metrics_prometheus_test(void)
+{
+	struct nssync_metrics *metrics;
+	char text[8192];
+	size_t length;
+	enum nssync_error ret;
+	bool passed;
+
+	printf("Metrics prometheus:");
+
+	if (nssync_metrics_snapshot(&metrics) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		return false;
+	}
+
+	ret = nssync_metrics_prometheus(metrics, text, 16, &length);
+	passed = ((ret == NSSYNC_ERROR_INVAL) && (length > 16));
+
+	ret = nssync_metrics_prometheus(metrics, text, sizeof(text), &length);
+	nssync_metrics_free(metrics);
+
+	passed = passed &&
+		(ret == NSSYNC_ERROR_OK) &&
+		(length == strlen(text)) &&
+		(strstr(text, "\nnssync_records_fetched_total 40000\n") != NULL) &&
+		(strstr(text, "nssync_parse_duration_seconds_bucket{le=\"0.001\"} 0\n") != NULL) &&
+		(strstr(text, "nssync_parse_duration_seconds_bucket{le=\"0.01\"} 100\n") != NULL) &&
+		(strstr(text, "nssync_parse_duration_seconds_count 100\n") != NULL);
+
+	printf("%s\n", passed ? "passed" : "failed");
+	if (!passed) {
+		printf("%s", text);
+	}
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = metrics_counter_test() && passed;
+	passed = metrics_histogram_test() && passed;
+	passed = metrics_prometheus_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
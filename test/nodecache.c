@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+static bool node_cache_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_metrics *metrics;
+	char cachedir[] = "/tmp/nssync-nodecache-XXXXXX";
+	char path[64];
+	char line[512];
+	uint64_t hits;
+	FILE *fp;
+	bool passed;
+
+	printf("Node cache:");
+
+	if (mkdtemp(cachedir) == NULL) {
+		printf("failed\n");
+		return false;
+	}
+
+	ts_init();
+	ts_provider(&provider, NULL);
+	provider.cachedir = cachedir;
+
+	/* the first session looks the node up and caches it */
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (passed) {
+		nssync_sync_free(sync);
+	}
+	passed = passed && (ts.node_fetches == 1);
+
+	snprintf(path, sizeof(path), "%s/nodes", cachedir);
+	fp = fopen(path, "r");
+	passed = passed && (fp != NULL) &&
+		(fgets(line, sizeof(line), fp) != NULL) &&
+		(strstr(line, TS_USER) != NULL) &&
+		(strstr(line, TS_SERVER) != NULL);
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	/* the rewrite leaves no temporary files behind */
+	passed = passed && (ts_cache_entries(cachedir, "nodes") == 1);
+
+	/* a later session uses the cached node */
+	nssync_metrics_snapshot(&metrics);
+	hits = nssync_metrics_counter(metrics, NSSYNC_METRIC_CACHE_HITS);
+	nssync_metrics_free(metrics);
+
+	ts_reset_counts();
+	passed = passed &&
+		(nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (passed) {
+		nssync_sync_free(sync);
+	}
+	passed = passed && (ts.node_fetches == 0);
+
+	nssync_metrics_snapshot(&metrics);
+	passed = passed &&
+		(nssync_metrics_counter(metrics, NSSYNC_METRIC_CACHE_HITS) == (hits + 1));
+	nssync_metrics_free(metrics);
+
+	/* a session without a cache directory always looks up */
+	ts_reset_counts();
+	provider.cachedir = NULL;
+	passed = passed &&
+		(nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (passed) {
+		nssync_sync_free(sync);
+	}
+	passed = passed && (ts.node_fetches == 1);
+
+	ts_fini();
+	ts_cache_remove(cachedir);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool node_assignment_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	bool passed;
+
+	printf("Node assignment:");
+
+	ts_init();
+	ts_provider(&provider, NULL);
+
+	/* a node ending in a newline is used without it */
+	ts.node = TS_SERVER "\r\n";
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (passed) {
+		nssync_sync_free(sync);
+	}
+
+	/* whitespace within a node makes it unusable */
+	ts.node = "https://sync.example/ 1.1/";
+	passed = passed &&
+		(nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_REGISTRATION);
+
+	ts.node = "sync.example";
+	passed = passed &&
+		(nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_REGISTRATION);
+
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = node_cache_test() && passed;
+	passed = node_assignment_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+#define RECORDS 1000
+
+/* records to a page and pages in flight, as the pipeline uses */
+#define PAGE_RECORDS 100
+#define DEPTH 4
+
+/* records decoded and how far fetching ran ahead */
+struct decoded {
+	struct ts_decoded records;
+	int ahead; /* most records fetched ahead of those decoded */
+};
+
+static enum nssync_error
+ahead_decode(void *ctx, const char *id, const uint8_t *record, size_t record_length)
+{
+	struct decoded *decoded = ctx;
+	int ahead;
+
+	pthread_mutex_lock(&ts.lock);
+	ahead = ts.max_offset - decoded->records.count;
+	pthread_mutex_unlock(&ts.lock);
+	if (ahead > decoded->ahead) {
+		decoded->ahead = ahead;
+	}
+
+	/* a slow consumer lets the fetch stage run ahead */
+	usleep(100);
+
+	return ts_decode(&decoded->records, id, record, record_length);
+}
+
+static const struct nssync_engine_ops bookmarks_ops = {
+	.name = "bookmarks",
+	.min_version = 2,
+	.max_version = 2,
+	.decode = ahead_decode,
+};
+
+static bool pipeline_test(unsigned int workers)
+{
+	struct nssync_context_params params;
+	struct nssync_context *context;
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *engine;
+	struct decoded decoded;
+	char id[16];
+	bool passed;
+	int idx;
+
+	printf("Pipeline with %u workers:", workers);
+
+	ts_init();
+	for (idx = 0; idx < RECORDS; idx++) {
+		snprintf(id, sizeof(id), "bmk%04d", idx);
+		ts_bookmark(id, TS_NOW + 1 + (idx / 10), id);
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.fetcher = ts_fetcher;
+	params.workers = workers;
+	if (nssync_context_new(&params, &context) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	ts_provider(&provider, context);
+
+	memset(&decoded, 0, sizeof(decoded));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		nssync_context_free(context);
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	ts_reset_counts();
+	passed = (nssync_engine_register(sync, &bookmarks_ops, NULL,
+					 &decoded, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_engines(sync) == NSSYNC_ERROR_OK);
+
+	/* every record is decoded once in collection order */
+	passed = passed &&
+		ts_decoded_all(&decoded.records, RECORDS) &&
+		(ts.listings == (RECORDS / PAGE_RECORDS) + 1);
+
+	/* fetching stays a bounded number of pages ahead of decoding */
+	passed = passed && (decoded.ahead <= (DEPTH * PAGE_RECORDS));
+
+	nssync_sync_free(sync);
+	nssync_context_free(context);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+/* decoder subscribing to another collection with each record */
+struct interning {
+	struct nssync_sync *sync;
+	int count;
+	bool subscribed;
+};
+
+static enum nssync_error
+ignore_change(void *ctx, const char *collection, const struct nssync_change *changev, int changec)
+{
+	return NSSYNC_ERROR_OK;
+}
+
+static enum nssync_error
+intern_decode(void *ctx, const char *id, const uint8_t *record, size_t record_length)
+{
+	struct interning *interning = ctx;
+	struct nssync_subscription *sub;
+	char name[16];
+
+	snprintf(name, sizeof(name), "col%d", interning->count++);
+	if (nssync_sync_subscribe(interning->sync, name, NSSYNC_SUBSCRIBE_IDS,
+				  ignore_change, NULL, &sub) != NSSYNC_ERROR_OK) {
+		interning->subscribed = false;
+	}
+
+	return NSSYNC_ERROR_OK;
+}
+
+static const struct nssync_engine_ops interning_ops = {
+	.name = "bookmarks",
+	.min_version = 2,
+	.max_version = 2,
+	.decode = intern_decode,
+};
+
+static bool pipeline_intern_test(void)
+{
+	struct nssync_context_params params;
+	struct nssync_context *context;
+	struct nssync_provider provider;
+	struct nssync_engine *engine;
+	struct interning interning;
+	bool passed;
+
+	printf("Pipeline interning collections:");
+
+	ts_init();
+	ts_bookmarks(0, RECORDS);
+
+	memset(&params, 0, sizeof(params));
+	params.fetcher = ts_fetcher;
+	params.workers = 3;
+	if (nssync_context_new(&params, &context) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+	ts_provider(&provider, context);
+
+	memset(&interning, 0, sizeof(interning));
+	interning.subscribed = true;
+
+	passed = (nssync_sync_new(&provider, &interning.sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		nssync_context_free(context);
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	/* collections interned on delivery while pages are fetched */
+	passed = (nssync_engine_register(interning.sync, &interning_ops, NULL,
+					 &interning, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_engines(interning.sync) == NSSYNC_ERROR_OK) &&
+		(interning.count == RECORDS) &&
+		interning.subscribed;
+
+	nssync_sync_free(interning.sync);
+	nssync_context_free(context);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = pipeline_test(0) && passed;
+	passed = pipeline_test(3) && passed;
+	passed = pipeline_intern_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "testserver.h"
+
+/* poll intervals the session uses while active and at most when idle */
+#define ACTIVE_INTERVAL 60
+#define IDLE_INTERVAL (30 * 60)
+
+#define BACKOFF 3600
+
+/* move the clock on to a time and run the session */
+static enum nssync_error
+poll_at(struct nssync_sync *sync, time_t when, time_t *next_out)
+{
+	ts_clock_offset += when - time(NULL);
+	return nssync_sync_schedule(sync, next_out);
+}
+
+/* check the next poll is an interval after a time, the clock may tick */
+static bool waits(time_t next, time_t from, time_t interval)
+{
+	return (next >= (from + interval)) && (next <= (from + interval + 1));
+}
+
+static bool poll_interval_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *engine;
+	struct ts_decoded decoded = { 0 };
+	time_t interval;
+	time_t from;
+	time_t next;
+	time_t prev;
+	bool passed;
+
+	printf("Poll interval:");
+
+	ts_init();
+	ts_bookmarks(0, 1);
+	ts_provider(&provider, NULL);
+
+	if (nssync_sync_new(&provider, &sync) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	/* the first poll syncs with the times the session started with */
+	ts_reset_counts();
+	from = time(NULL);
+	passed = (nssync_engine_register(sync, &ts_bookmarks_ops, NULL,
+					 &decoded, &engine) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_schedule(sync, &next) == NSSYNC_ERROR_OK) &&
+		waits(next, from, ACTIVE_INTERVAL) &&
+		ts_decoded_all(&decoded, 1) &&
+		(ts.info_fetches == 0);
+
+	/* nothing is done before the poll is due */
+	ts_reset_counts();
+	prev = next;
+	passed = passed &&
+		(nssync_sync_schedule(sync, &next) == NSSYNC_ERROR_OK) &&
+		(next == prev) &&
+		(ts.fetches == 0);
+
+	/* the interval doubles while the account is idle, up to a limit */
+	for (interval = ACTIVE_INTERVAL * 2;
+	     interval <= (IDLE_INTERVAL * 2);
+	     interval *= 2) {
+		ts_reset_counts();
+		prev = next;
+		passed = passed &&
+			(poll_at(sync, prev, &next) == NSSYNC_ERROR_OK) &&
+			waits(next, prev,
+			      (interval < IDLE_INTERVAL) ? interval : IDLE_INTERVAL) &&
+			(ts.info_fetches == 1) &&
+			(ts.keys_fetches == 0) &&
+			(ts.listings == 0);
+	}
+
+	/* a change on the server is synced, the engine being given the
+	 * whole collection, and polls become frequent
+	 */
+	ts_bookmarks(1, 2);
+	memset(&decoded, 0, sizeof(decoded));
+	prev = next;
+	passed = passed &&
+		(poll_at(sync, prev, &next) == NSSYNC_ERROR_OK) &&
+		waits(next, prev, ACTIVE_INTERVAL) &&
+		ts_decoded_all(&decoded, 2);
+
+	/* keys rotated by another client are refetched */
+	ts_rotate(2, false);
+	ts_reset_counts();
+	prev = next;
+	passed = passed &&
+		(poll_at(sync, prev, &next) == NSSYNC_ERROR_OK) &&
+		waits(next, prev, ACTIVE_INTERVAL * 2) &&
+		(ts.keys_fetches == 1) &&
+		(ts.listings == 0);
+
+	/* a local change brings the next poll forward */
+	from = time(NULL);
+	passed = passed &&
+		(nssync_sync_local_change(sync) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_schedule(sync, &next) == NSSYNC_ERROR_OK) &&
+		waits(next, from, ACTIVE_INTERVAL);
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool poll_backoff_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	time_t next;
+	time_t prev;
+	bool passed;
+
+	printf("Poll backoff:");
+
+	ts_init();
+	ts_provider(&provider, NULL);
+
+	if (nssync_sync_new(&provider, &sync) != NSSYNC_ERROR_OK) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	passed = (nssync_sync_schedule(sync, &next) == NSSYNC_ERROR_OK);
+
+	/* the server asking for backoff puts the next poll after it */
+	ts.backoff = BACKOFF;
+	prev = next;
+	passed = passed &&
+		(poll_at(sync, prev, &next) == NSSYNC_ERROR_OK) &&
+		waits(next, prev, BACKOFF);
+	ts.backoff = 0;
+
+	/* no requests are made until it has passed */
+	ts_reset_counts();
+	prev = next;
+	passed = passed &&
+		(poll_at(sync, prev - (BACKOFF / 2), &next) == NSSYNC_ERROR_OK) &&
+		(next == prev) &&
+		(ts.fetches == 0);
+
+	passed = passed &&
+		(poll_at(sync, prev, &next) == NSSYNC_ERROR_OK) &&
+		(next > prev) &&
+		(ts.info_fetches == 1);
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = poll_interval_test() && passed;
+	passed = poll_backoff_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
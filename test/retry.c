@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <nssync/nssync.h>
+
+#include "scheduler.h"
+#include "retry.h"
+
+static struct nssync_scheduler *scheduler;
+static struct nssync_retry *retry;
+
+/* status codes the fetcher answers with in turn, 200 for the rest */
+static long codes[4];
+static int fetchc;
+static int completedc;
+
+/* backoff the fetcher asks for and a cancel it triggers, if any */
+static unsigned int answer_backoff;
+static struct nssync_fetcher_cancel *answer_cancel;
+
+static enum nssync_error test_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	long code = 200;
+
+	if (fetchc < 4) {
+		code = codes[fetchc];
+	}
+	fetchc++;
+
+	fetch->http_code = code;
+	fetch->result = (code == 200) ? NSSYNC_ERROR_OK : NSSYNC_ERROR_FETCH;
+	fetch->backoff = answer_backoff;
+	if (answer_cancel != NULL) {
+		nssync_fetcher_cancel(answer_cancel);
+	}
+
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+		fetch->completion(fetch);
+		return NSSYNC_ERROR_RETRY;
+	}
+	return fetch->result;
+}
+
+static enum nssync_error test_completion(struct nssync_fetcher_fetch *fetch)
+{
+	completedc++;
+	return fetch->result;
+}
+
+/* asynchronous completion asking for retries as the coalescing does */
+static enum nssync_error async_completion(struct nssync_fetcher_fetch *fetch)
+{
+	static unsigned int attempt;
+
+	nssync_scheduler_complete(scheduler, fetch, 0);
+	if (nssync_retry_later(retry, fetch, attempt)) {
+		attempt++;
+		return NSSYNC_ERROR_OK;
+	}
+	completedc++;
+	return NSSYNC_ERROR_OK;
+}
+
+static void
+fetch_init(struct nssync_fetcher_fetch *fetch, char *url, long c0, long c1)
+{
+	memset(fetch, 0, sizeof(*fetch));
+	fetch->url = url;
+	fetch->completion = test_completion;
+	codes[0] = c0;
+	codes[1] = c1;
+	codes[2] = 200;
+	fetchc = 0;
+	completedc = 0;
+}
+
+static bool retry_test(void)
+{
+	struct nssync_fetcher_fetch fetch;
+	char url[] = "https://node.example/1.1/a/info/collections";
+	enum nssync_error ret;
+	struct timespec sleep = { 0, 10000000 };
+	int wait;
+	bool passed;
+
+	printf("Retry:");
+
+	nssync_scheduler_new(test_fetcher, 4, 4, &scheduler);
+	nssync_retry_new(scheduler, 3, &retry);
+
+	/* unavailable and a lost connection are retried, the completion
+	 * only sees the final result
+	 */
+	fetch_init(&fetch, url, 503, 0);
+	ret = nssync_retry_fetch(retry, &fetch);
+	passed = (ret == NSSYNC_ERROR_OK) && (fetchc == 3) && (completedc == 1);
+
+	/* an answer that will not change is not */
+	fetch_init(&fetch, url, 404, 200);
+	ret = nssync_retry_fetch(retry, &fetch);
+	passed = passed && (ret == NSSYNC_ERROR_FETCH) &&
+		(fetch.http_code == 404) && (fetchc == 1) && (completedc == 1);
+
+	/* asynchronous fetches are made again by running the retries */
+	fetch_init(&fetch, url, 500, 502);
+	fetch.flags = NSSYNC_FETCHER_ASYNC;
+	fetch.completion = async_completion;
+	nssync_scheduler_fetch(scheduler, &fetch);
+	nssync_scheduler_run(scheduler);
+	while (nssync_retry_run(retry, &wait) > 0) {
+		nssync_scheduler_run(scheduler);
+		nanosleep(&sleep, NULL);
+	}
+	nssync_scheduler_run(scheduler);
+	passed = passed && (fetchc == 3) && (completedc == 1) &&
+		(fetch.result == NSSYNC_ERROR_OK);
+
+	nssync_retry_free(retry);
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool backoff_test(void)
+{
+	struct nssync_fetcher_fetch fetch;
+	char url[] = "https://node.example/1.1/a/storage/tabs";
+	enum nssync_error ret;
+	time_t backoff;
+	bool passed;
+
+	printf("Backoff:");
+
+	nssync_scheduler_new(test_fetcher, 4, 4, &scheduler);
+	nssync_retry_new(scheduler, 3, &retry);
+
+	/* a server asking for longer than a retry waits fails the fetch
+	 * and the backoff applies to the whole host
+	 */
+	fetch_init(&fetch, url, 200, 200);
+	fetch.result = NSSYNC_ERROR_FETCH;
+	fetch.http_code = 503;
+	fetch.backoff = 3600;
+	passed = !nssync_retry_later(retry, &fetch, 0);
+
+	backoff = nssync_retry_get_backoff(retry, "https://node.example/1.1/b");
+	passed = passed && (backoff >= time(NULL) + 3599) &&
+		(nssync_retry_get_backoff(retry, "https://other.example/") == 0);
+
+	/* later fetches to the host are not made during the backoff */
+	fetch_init(&fetch, url, 200, 200);
+	ret = nssync_retry_fetch(retry, &fetch);
+	passed = passed && (ret == NSSYNC_ERROR_FETCH) &&
+		(fetchc == 0) && (completedc == 1);
+
+	nssync_retry_free(retry);
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool cancel_test(void)
+{
+	struct nssync_fetcher_fetch fetch;
+	struct nssync_fetcher_cancel cancel = { 0, NULL };
+	char url[] = "https://node.example/1.1/a/storage/history";
+	enum nssync_error ret;
+	time_t start;
+	bool passed;
+
+	printf("Cancel:");
+
+	nssync_scheduler_new(test_fetcher, 4, 4, &scheduler);
+	nssync_retry_new(scheduler, 3, &retry);
+
+	/* a fetch cancelled while waiting to retry stops waiting */
+	fetch_init(&fetch, url, 503, 200);
+	fetch.cancel = &cancel;
+	answer_backoff = 10;
+	answer_cancel = &cancel;
+	start = time(NULL);
+	ret = nssync_retry_fetch(retry, &fetch);
+	passed = (ret == NSSYNC_ERROR_CANCELLED) && (fetchc == 1) &&
+		(completedc == 1) && ((time(NULL) - start) < 5);
+	answer_backoff = 0;
+	answer_cancel = NULL;
+
+	nssync_retry_free(retry);
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = retry_test() && passed;
+	passed = backoff_test() && passed;
+	passed = cancel_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "scheduler.h"
+
+#define FETCHES 8
+
+static struct nssync_scheduler *scheduler;
+
+/* fetches in the order the fetcher was asked to start them */
+static struct nssync_fetcher_fetch *started[FETCHES];
+static int startedc;
+
+/* fetcher that leaves every fetch in progress */
+static enum nssync_error test_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	started[startedc++] = fetch;
+	return NSSYNC_ERROR_RETRY;
+}
+
+static enum nssync_error test_completion(struct nssync_fetcher_fetch *fetch)
+{
+	nssync_scheduler_complete(scheduler, fetch, 0);
+	return NSSYNC_ERROR_OK;
+}
+
+static void
+fetch_init(struct nssync_fetcher_fetch *fetch,
+	   char *url,
+	   const char *username,
+	   enum nssync_fetcher_priority priority)
+{
+	memset(fetch, 0, sizeof(*fetch));
+	fetch->flags = NSSYNC_FETCHER_ASYNC;
+	fetch->url = url;
+	fetch->username = (char *)username;
+	fetch->priority = priority;
+	fetch->completion = test_completion;
+}
+
+/* complete the oldest fetch in progress and start those let through */
+static void complete_next(int *completed)
+{
+	struct nssync_fetcher_fetch *fetch = started[(*completed)++];
+
+	fetch->completion(fetch);
+	nssync_scheduler_run(scheduler);
+}
+
+static bool scheduler_priority_test(void)
+{
+	struct nssync_fetcher_fetch fetchv[7];
+	char url[] = "https://node.example/1.1/";
+	int completed = 0;
+	bool passed;
+	int idx;
+
+	printf("Scheduler priority:");
+
+	nssync_scheduler_new(test_fetcher, 1, 1, &scheduler);
+	startedc = 0;
+
+	/* a backfill is in progress when other work arrives */
+	fetch_init(&fetchv[0], url, "a", NSSYNC_FETCHER_PRIORITY_HISTORY);
+	fetch_init(&fetchv[1], url, "a", NSSYNC_FETCHER_PRIORITY_HISTORY);
+	fetch_init(&fetchv[2], url, "a", NSSYNC_FETCHER_PRIORITY_HISTORY);
+	fetch_init(&fetchv[3], url, "b", NSSYNC_FETCHER_PRIORITY_BOOKMARKS);
+	fetch_init(&fetchv[4], url, "c", NSSYNC_FETCHER_PRIORITY_BOOTSTRAP);
+	fetch_init(&fetchv[5], url, "b", NSSYNC_FETCHER_PRIORITY_HISTORY);
+	fetch_init(&fetchv[6], url, "a", NSSYNC_FETCHER_PRIORITY_HISTORY);
+
+	for (idx = 0; idx < 7; idx++) {
+		nssync_scheduler_fetch(scheduler, &fetchv[idx]);
+	}
+
+	passed = (startedc == 1) && (started[0] == &fetchv[0]);
+
+	while (completed < startedc) {
+		complete_next(&completed);
+	}
+
+	/* session set up first, then bookmarks, then accounts take turns */
+	passed = passed &&
+		(startedc == 7) &&
+		(started[1] == &fetchv[4]) &&
+		(started[2] == &fetchv[3]) &&
+		(started[3] == &fetchv[1]) &&
+		(started[4] == &fetchv[5]) &&
+		(started[5] == &fetchv[2]) &&
+		(started[6] == &fetchv[6]) &&
+		(nssync_scheduler_run(scheduler) == 0);
+
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool scheduler_host_test(void)
+{
+	struct nssync_fetcher_fetch fetchv[3];
+	char url1[] = "https://one.example/1.1/";
+	char url2[] = "https://two.example/1.1/";
+	int completed = 0;
+	bool passed;
+	int idx;
+
+	printf("Scheduler host limit:");
+
+	nssync_scheduler_new(test_fetcher, 4, 1, &scheduler);
+	startedc = 0;
+
+	fetch_init(&fetchv[0], url1, "a", NSSYNC_FETCHER_PRIORITY_BOOTSTRAP);
+	fetch_init(&fetchv[1], url1, "a", NSSYNC_FETCHER_PRIORITY_BOOTSTRAP);
+	fetch_init(&fetchv[2], url2, "a", NSSYNC_FETCHER_PRIORITY_HISTORY);
+
+	for (idx = 0; idx < 3; idx++) {
+		nssync_scheduler_fetch(scheduler, &fetchv[idx]);
+	}
+
+	/* the second fetch to the first host waits for the first */
+	passed = (startedc == 2) &&
+		(started[0] == &fetchv[0]) &&
+		(started[1] == &fetchv[2]) &&
+		(nssync_scheduler_run(scheduler) == 1);
+
+	complete_next(&completed);
+	passed = passed && (startedc == 3) && (started[2] == &fetchv[1]);
+
+	while (completed < startedc) {
+		complete_next(&completed);
+	}
+
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool scheduler_cancel_test(void)
+{
+	struct nssync_fetcher_fetch fetchv[5];
+	struct nssync_fetcher_cancel cancel = { 0, NULL };
+	char url[] = "https://node.example/1.1/";
+	int completed = 0;
+	bool passed;
+	int idx;
+
+	printf("Scheduler cancel:");
+
+	nssync_scheduler_new(test_fetcher, 1, 1, &scheduler);
+	startedc = 0;
+
+	for (idx = 0; idx < 4; idx++) {
+		fetch_init(&fetchv[idx], url, "a", NSSYNC_FETCHER_PRIORITY_OTHER);
+	}
+	fetchv[1].cancel = &cancel;
+	fetchv[2].deadline = 1; /* long passed */
+
+	for (idx = 0; idx < 4; idx++) {
+		nssync_scheduler_fetch(scheduler, &fetchv[idx]);
+	}
+
+	/* waiting fetches give up without being made */
+	nssync_fetcher_cancel(&cancel);
+	passed = (nssync_scheduler_run(scheduler) == 1) &&
+		(fetchv[1].result == NSSYNC_ERROR_CANCELLED) &&
+		(fetchv[2].result == NSSYNC_ERROR_TIMEOUT);
+
+	complete_next(&completed);
+	passed = passed && (startedc == 2) && (started[1] == &fetchv[3]);
+	complete_next(&completed);
+
+	/* as do synchronous ones */
+	fetch_init(&fetchv[4], url, "a", NSSYNC_FETCHER_PRIORITY_OTHER);
+	fetchv[4].flags = NSSYNC_FETCHER_SYNC;
+	fetchv[4].deadline = 1;
+	passed = passed &&
+		(nssync_scheduler_fetch(scheduler, &fetchv[4]) == NSSYNC_ERROR_TIMEOUT) &&
+		(startedc == 2);
+
+	nssync_scheduler_free(scheduler);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool scheduler_free_test(void)
+{
+	struct nssync_fetcher_fetch fetchv[3];
+	char url[] = "https://node.example/1.1/";
+	bool passed;
+	int idx;
+
+	printf("Scheduler free:");
+
+	nssync_scheduler_new(test_fetcher, 1, 1, &scheduler);
+	startedc = 0;
+
+	for (idx = 0; idx < 3; idx++) {
+		fetch_init(&fetchv[idx], url, "a", NSSYNC_FETCHER_PRIORITY_OTHER);
+		fetchv[idx].result = NSSYNC_ERROR_RETRY;
+		nssync_scheduler_fetch(scheduler, &fetchv[idx]);
+	}
+
+	/* fetches that never started hear they were cancelled */
+	nssync_scheduler_free(scheduler);
+	passed = (startedc == 1) &&
+		(fetchv[0].result == NSSYNC_ERROR_RETRY) &&
+		(fetchv[1].result == NSSYNC_ERROR_CANCELLED) &&
+		(fetchv[2].result == NSSYNC_ERROR_CANCELLED);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = scheduler_priority_test() && passed;
+	passed = scheduler_host_test() && passed;
+	passed = scheduler_cancel_test() && passed;
+	passed = scheduler_free_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "idset.h"
+#include "testserver.h"
+
+#define CHANGES 16
+
+/* changes a subscriber was told of */
+struct changes {
+	enum nssync_error ret; /* result the callback gives */
+	int calls;
+	int count;
+	enum nssync_change_type type[CHANGES];
+	char id[CHANGES][32];
+	bool record[CHANGES]; /* record was given */
+};
+
+static enum nssync_error
+test_change(void *ctx, const char *collection, const struct nssync_change *changev, int changec)
+{
+	struct changes *changes = ctx;
+	int idx;
+
+	if (strcmp(collection, "bookmarks") != 0) {
+		return NSSYNC_ERROR_INVAL;
+	}
+
+	changes->calls++;
+	for (idx = 0; (idx < changec) && (changes->count < CHANGES); idx++) {
+		changes->type[changes->count] = changev[idx].type;
+		snprintf(changes->id[changes->count], 32, "%s", changev[idx].id);
+		changes->record[changes->count] = (changev[idx].record != NULL);
+		changes->count++;
+	}
+
+	return changes->ret;
+}
+
+static bool
+change_is(struct changes *changes, int idx, enum nssync_change_type type, const char *id)
+{
+	return (idx < changes->count) &&
+		(changes->type[idx] == type) &&
+		(strcmp(changes->id[idx], id) == 0);
+}
+
+static bool idset_test(void)
+{
+	struct nssync_idset *idset;
+	char id[16];
+	bool added;
+	bool passed;
+	int idx;
+
+	printf("Id set:");
+
+	passed = (nssync_idset_new(&idset) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		return false;
+	}
+
+	passed = (nssync_idset_add(idset, "one", &added) == NSSYNC_ERROR_OK) &&
+		added &&
+		(nssync_idset_add(idset, "one", &added) == NSSYNC_ERROR_OK) &&
+		!added &&
+		nssync_idset_contains(idset, "one") &&
+		!nssync_idset_contains(idset, "two") &&
+		nssync_idset_remove(idset, "one") &&
+		!nssync_idset_remove(idset, "one") &&
+		!nssync_idset_contains(idset, "one");
+
+	/* the set grows to hold many ids */
+	for (idx = 0; idx < 1000; idx++) {
+		snprintf(id, sizeof(id), "id%d", idx);
+		passed = passed &&
+			(nssync_idset_add(idset, id, &added) == NSSYNC_ERROR_OK) &&
+			added;
+	}
+	for (idx = 0; idx < 1000; idx += 2) {
+		snprintf(id, sizeof(id), "id%d", idx);
+		passed = passed && nssync_idset_remove(idset, id);
+	}
+	for (idx = 0; idx < 1000; idx++) {
+		snprintf(id, sizeof(id), "id%d", idx);
+		passed = passed &&
+			(nssync_idset_contains(idset, id) == ((idx % 2) == 1));
+	}
+
+	nssync_idset_free(idset);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool subscription_test(void)
+{
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_subscription *records;
+	struct nssync_subscription *ids;
+	struct changes changes[2];
+	bool passed;
+
+	printf("Subscriptions:");
+
+	ts_init();
+	ts_bookmark("bmk0", TS_NOW + 1, "zero");
+	ts_bookmark("bmk1", TS_NOW + 2, "one");
+	ts_bookmark("bmk2", TS_NOW + 3, "two");
+	ts_provider(&provider, NULL);
+	memset(changes, 0, sizeof(changes));
+
+	passed = (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK);
+	if (!passed) {
+		printf("failed\n");
+		ts_fini();
+		return false;
+	}
+
+	passed = (nssync_sync_subscribe(sync, "bookmarks", NSSYNC_SUBSCRIBE_RECORDS,
+					test_change, &changes[0], &records) == NSSYNC_ERROR_OK) &&
+		(nssync_sync_subscribe(sync, "bookmarks", NSSYNC_SUBSCRIBE_IDS,
+				       test_change, &changes[1], &ids) == NSSYNC_ERROR_OK);
+
+	/* the first pass reports every record as added */
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(changes[0].count == 3) &&
+		change_is(&changes[0], 0, NSSYNC_CHANGE_ADDED, "bmk0") &&
+		change_is(&changes[0], 1, NSSYNC_CHANGE_ADDED, "bmk1") &&
+		change_is(&changes[0], 2, NSSYNC_CHANGE_ADDED, "bmk2") &&
+		changes[0].record[0] &&
+		(changes[1].count == 3) &&
+		!changes[1].record[0];
+
+	/* later passes only report what changed, in collection order */
+	ts_bookmark("bmk1", TS_NOW + 10, "one again");
+	ts_delete("bookmarks", "bmk2", TS_NOW + 11);
+	ts_bookmark("bmk3", TS_NOW + 12, "three");
+	ts_delete("bookmarks", "unseen", TS_NOW + 13);
+	memset(changes, 0, sizeof(changes));
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(changes[0].count == 3) &&
+		change_is(&changes[0], 0, NSSYNC_CHANGE_MODIFIED, "bmk1") &&
+		change_is(&changes[0], 1, NSSYNC_CHANGE_DELETED, "bmk2") &&
+		change_is(&changes[0], 2, NSSYNC_CHANGE_ADDED, "bmk3") &&
+		!changes[0].record[1] &&
+		(changes[1].count == 3);
+
+	/* an unchanged collection reports nothing */
+	memset(changes, 0, sizeof(changes));
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(changes[0].calls == 0) &&
+		(changes[1].calls == 0);
+
+	/* changes a subscriber refused are reported again */
+	nssync_sync_unsubscribe(ids);
+	ts_bookmark("bmk4", TS_NOW + 20, "four");
+	ts_bookmark("bmk2", TS_NOW + 21, "two again");
+	memset(changes, 0, sizeof(changes));
+	changes[0].ret = NSSYNC_ERROR_NOMEM;
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_NOMEM) &&
+		(changes[0].count == 2) &&
+		change_is(&changes[0], 0, NSSYNC_CHANGE_ADDED, "bmk4") &&
+		change_is(&changes[0], 1, NSSYNC_CHANGE_ADDED, "bmk2");
+
+	memset(changes, 0, sizeof(changes));
+	passed = passed &&
+		(ts_poll(sync) == NSSYNC_ERROR_OK) &&
+		(changes[0].count == 2) &&
+		change_is(&changes[0], 0, NSSYNC_CHANGE_ADDED, "bmk4") &&
+		change_is(&changes[0], 1, NSSYNC_CHANGE_ADDED, "bmk2");
+
+	nssync_sync_free(sync);
+	ts_fini();
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = idset_test() && passed;
+	passed = subscription_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,745 @@
+/* in-process sync server for tests
+ *
+ * Serves the node lookup, collection times, meta/global, crypto/keys
+ *   and collection listings of one account from memory through a stub
+ *   fetcher, so sessions are tested without a network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <jansson.h>
+
+#include <nssync/nssync.h>
+
+#include "crypto.h"
+
+#define TS_SERVER "https://sync.example/"
+#define TS_ACCOUNT "vince@kyllikki.org"
+#define TS_PASSWORD "password"
+#define TS_KEY "i-xsxyz-wd3yj-5ytjx-9i7mj-wiwyy"
+
+/* storage username the account hashes to */
+#define TS_USER "pnaksjwjnjiepjumadlhvtn44jrs44uf"
+
+/* time the account was set up */
+#define TS_NOW 1380000000.00
+
+#define TS_RECORDS 2048
+#define TS_COLLECTIONS 8
+#define TS_PENDING 16
+
+#define TS_META "{\"syncID\":\"globalsyncid\",\"storageVersion\":5," \
+	"\"engines\":{\"bookmarks\":{\"version\":2,\"syncID\":\"bmksyncid\"}," \
+	"\"history\":{\"version\":1,\"syncID\":\"histsyncid\"}," \
+	"\"tabs\":{\"version\":1,\"syncID\":\"tabsyncid\"}}," \
+	"\"declined\":[\"tabs\"]}"
+
+struct ts_record {
+	char collection[16];
+	char id[32];
+	double modified;
+	unsigned int seq; /* order records were stored in */
+	char *payload; /* encrypted record */
+};
+
+struct ts_collection {
+	char name[16];
+	double modified;
+};
+
+static struct {
+	pthread_mutex_t lock;
+
+	uint8_t key[2][32]; /* default encryption and hmac keys */
+	uint8_t bookmarks_key[2][32]; /* keys of bookmarks if keyed */
+	bool bookmarks_keyed;
+
+	const char *meta; /* meta/global payload */
+	const char *node; /* node lookup response */
+	long node_status; /* node lookup response code */
+
+	int recordc;
+	struct ts_record records[TS_RECORDS];
+	unsigned int seq;
+	int collectionc;
+	struct ts_collection collections[TS_COLLECTIONS];
+
+	int fail_offset; /* listings from this offset fail, 0 for none */
+	unsigned int backoff; /* seconds of backoff asked for with responses */
+
+	bool defer; /* asynchronous fetches wait for ts_run() */
+	int pendingc;
+	struct nssync_fetcher_fetch *pending[TS_PENDING];
+
+	/* requests seen */
+	int fetches;
+	int node_fetches;
+	int info_fetches;
+	int keys_fetches;
+	int listings;
+	int file_listings; /* listings written to a file */
+	int listed; /* records answered in listings */
+	int first_offset; /* offset of the first listing since ts_reset_counts() */
+	double first_unmodified; /* and the time it was conditional on */
+	int max_offset; /* highest listing offset requested */
+} ts;
+
+/** collection time entry, added if not known */
+static struct ts_collection *ts_collection(const char *name)
+{
+	int idx;
+
+	for (idx = 0; idx < ts.collectionc; idx++) {
+		if (strcmp(ts.collections[idx].name, name) == 0) {
+			return &ts.collections[idx];
+		}
+	}
+	snprintf(ts.collections[idx].name, sizeof(ts.collections[idx].name), "%s", name);
+	ts.collections[idx].modified = TS_NOW;
+	ts.collectionc++;
+
+	return &ts.collections[idx];
+}
+
+static void ts_keyfill(uint8_t key[2][32], unsigned int seed)
+{
+	int idx;
+
+	for (idx = 0; idx < 32; idx++) {
+		key[0][idx] = (seed * 31) + idx;
+		key[1][idx] = (seed * 17) + (idx * 3);
+	}
+}
+
+/** encrypt a record as a client would */
+static char *
+ts_encrypt(const uint8_t key[2][32], const char *plaintext)
+{
+	EVP_CIPHER_CTX *ctx;
+	uint8_t iv[16];
+	size_t length = strlen(plaintext);
+	uint8_t *ciphertext;
+	char *ciphertext_b64;
+	char iv_b64[32];
+	uint8_t mac[32];
+	unsigned int mac_length;
+	char mac_hex[65];
+	int outl;
+	int finl;
+	int idx;
+	json_t *root;
+	char *payload;
+
+	for (idx = 0; idx < 16; idx++) {
+		iv[idx] = rand();
+	}
+
+	ciphertext = malloc(length + 16);
+	ctx = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key[0], iv);
+	EVP_EncryptUpdate(ctx, ciphertext, &outl, (const uint8_t *)plaintext, length);
+	EVP_EncryptFinal_ex(ctx, ciphertext + outl, &finl);
+	EVP_CIPHER_CTX_free(ctx);
+
+	ciphertext_b64 = malloc((((outl + finl) / 3) + 1) * 4 + 1);
+	EVP_EncodeBlock((uint8_t *)ciphertext_b64, ciphertext, outl + finl);
+	EVP_EncodeBlock((uint8_t *)iv_b64, iv, 16);
+	free(ciphertext);
+
+	HMAC(EVP_sha256(), key[1], 32,
+	     (uint8_t *)ciphertext_b64, strlen(ciphertext_b64),
+	     mac, &mac_length);
+	for (idx = 0; idx < 32; idx++) {
+		snprintf(mac_hex + (idx * 2), 3, "%02x", mac[idx]);
+	}
+
+	root = json_pack("{s:s,s:s,s:s}",
+			 "ciphertext", ciphertext_b64,
+			 "IV", iv_b64,
+			 "hmac", mac_hex);
+	payload = json_dumps(root, JSON_COMPACT);
+	json_decref(root);
+	free(ciphertext_b64);
+
+	return payload;
+}
+
+/** store a record replacing any with the same id, caller holds no lock */
+static inline void
+ts_put(const char *collection, const char *id, double modified, const char *plaintext)
+{
+	struct ts_record *record = NULL;
+	struct ts_collection *col;
+	int idx;
+
+	pthread_mutex_lock(&ts.lock);
+	for (idx = 0; idx < ts.recordc; idx++) {
+		if ((strcmp(ts.records[idx].collection, collection) == 0) &&
+		    (strcmp(ts.records[idx].id, id) == 0)) {
+			record = &ts.records[idx];
+			free(record->payload);
+			break;
+		}
+	}
+	if (record == NULL) {
+		record = &ts.records[ts.recordc++];
+		snprintf(record->collection, sizeof(record->collection), "%s", collection);
+		snprintf(record->id, sizeof(record->id), "%s", id);
+	}
+	record->modified = modified;
+	record->seq = ts.seq++;
+	if ((strcmp(collection, "bookmarks") == 0) && ts.bookmarks_keyed) {
+		record->payload = ts_encrypt(ts.bookmarks_key, plaintext);
+	} else {
+		record->payload = ts_encrypt(ts.key, plaintext);
+	}
+
+	col = ts_collection(collection);
+	if (modified > col->modified) {
+		col->modified = modified;
+	}
+	pthread_mutex_unlock(&ts.lock);
+}
+
+/** store a bookmark record */
+static inline void ts_bookmark(const char *id, double modified, const char *title)
+{
+	char plaintext[256];
+
+	snprintf(plaintext, sizeof(plaintext),
+		 "{\"id\":\"%s\",\"type\":\"bookmark\",\"title\":\"%s\","
+		 "\"bmkUri\":\"http://example.com/%s\",\"parentid\":\"toolbar\"}",
+		 id, title, id);
+	ts_put("bookmarks", id, modified, plaintext);
+}
+
+/** store bookmarks bmk<first> up to bmk<last>, each newer than the one before */
+static inline void ts_bookmarks(int first, int last)
+{
+	char id[16];
+	int idx;
+
+	for (idx = first; idx < last; idx++) {
+		snprintf(id, sizeof(id), "bmk%04d", idx);
+		ts_bookmark(id, TS_NOW + 1 + idx, id);
+	}
+}
+
+/* records an engine decoded with ts_decode() */
+struct ts_decoded {
+	int count;
+	int misordered; /* records other than bmk<count> */
+	int mismatched; /* records without their own id */
+	char syncid[32]; /* syncID the engine was reset to */
+};
+
+/** decoder recording the records it is given */
+static inline enum nssync_error
+ts_decode(void *ctx, const char *id, const uint8_t *record, size_t record_length)
+{
+	struct ts_decoded *decoded = ctx;
+	char expected[48];
+	size_t length;
+	size_t idx;
+
+	snprintf(expected, sizeof(expected), "bmk%04d", decoded->count);
+	if (strcmp(id, expected) != 0) {
+		decoded->misordered++;
+	}
+
+	/* the record is not null terminated so is searched by length */
+	length = snprintf(expected, sizeof(expected), "\"id\":\"%s\"", id);
+	for (idx = 0; (idx + length) <= record_length; idx++) {
+		if (memcmp(record + idx, expected, length) == 0) {
+			break;
+		}
+	}
+	if ((idx + length) > record_length) {
+		decoded->mismatched++;
+	}
+
+	decoded->count++;
+
+	return NSSYNC_ERROR_OK;
+}
+
+/** check count records were decoded, each once in order */
+static inline bool ts_decoded_all(const struct ts_decoded *decoded, int count)
+{
+	return (decoded->count == count) &&
+		(decoded->misordered == 0) &&
+		(decoded->mismatched == 0);
+}
+
+/* bookmarks engine keeping what it decodes between syncs */
+static const struct nssync_engine_ops ts_bookmarks_ops = {
+	.name = "bookmarks",
+	.min_version = 2,
+	.max_version = 2,
+	.decode = ts_decode,
+	.resume = true,
+};
+
+/** store a deletion tombstone */
+static inline void ts_delete(const char *collection, const char *id, double modified)
+{
+	char plaintext[128];
+
+	snprintf(plaintext, sizeof(plaintext),
+		 "{\"id\":\"%s\",\"deleted\":true}", id);
+	ts_put(collection, id, modified, plaintext);
+}
+
+/** replace the keys, as another client rotating them would */
+static inline void ts_rotate(unsigned int seed, bool bookmarks_keyed)
+{
+	pthread_mutex_lock(&ts.lock);
+	ts_keyfill(ts.key, seed);
+	ts_keyfill(ts.bookmarks_key, seed + 1000);
+	ts.bookmarks_keyed = bookmarks_keyed;
+	ts_collection("crypto")->modified += 1;
+	pthread_mutex_unlock(&ts.lock);
+}
+
+static inline void ts_reset_counts(void)
+{
+	pthread_mutex_lock(&ts.lock);
+	ts.fetches = 0;
+	ts.node_fetches = 0;
+	ts.info_fetches = 0;
+	ts.keys_fetches = 0;
+	ts.listings = 0;
+	ts.file_listings = 0;
+	ts.listed = 0;
+	ts.first_offset = -1;
+	ts.first_unmodified = 0;
+	ts.max_offset = -1;
+	pthread_mutex_unlock(&ts.lock);
+}
+
+/** set up the account with no records */
+static inline void ts_init(void)
+{
+	int idx;
+
+	for (idx = 0; idx < ts.recordc; idx++) {
+		free(ts.records[idx].payload);
+	}
+	memset(&ts, 0, sizeof(ts));
+	pthread_mutex_init(&ts.lock, NULL);
+
+	ts_keyfill(ts.key, 1);
+	ts.meta = TS_META;
+	ts.node = TS_SERVER;
+	ts.node_status = 200;
+	ts_collection("meta");
+	ts_collection("crypto");
+	ts_reset_counts();
+}
+
+static inline void ts_fini(void)
+{
+	int idx;
+
+	for (idx = 0; idx < ts.recordc; idx++) {
+		free(ts.records[idx].payload);
+	}
+	ts.recordc = 0;
+	pthread_mutex_destroy(&ts.lock);
+}
+
+/** crypto/keys payload encrypted with the sync key, lock held */
+static char *ts_crypto_keys(void)
+{
+	struct nssync_crypto_keybundle *sync_keybundle;
+	uint8_t sync_key[2][32];
+	uint8_t *part;
+	char b64[4][48];
+	char plaintext[512];
+	int idx;
+
+	nssync_crypto_keybundle_new_user_synckey(TS_KEY, TS_USER, &sync_keybundle);
+	nssync_crypto_keybundle_get_encryption(sync_keybundle, &part, NULL);
+	memcpy(sync_key[0], part, 32);
+	nssync_crypto_keybundle_get_hmac(sync_keybundle, &part, NULL);
+	memcpy(sync_key[1], part, 32);
+	free(sync_keybundle);
+
+	EVP_EncodeBlock((uint8_t *)b64[0], ts.key[0], 32);
+	EVP_EncodeBlock((uint8_t *)b64[1], ts.key[1], 32);
+	EVP_EncodeBlock((uint8_t *)b64[2], ts.bookmarks_key[0], 32);
+	EVP_EncodeBlock((uint8_t *)b64[3], ts.bookmarks_key[1], 32);
+
+	idx = snprintf(plaintext, sizeof(plaintext),
+		       "{\"id\":\"keys\",\"collection\":\"crypto\","
+		       "\"default\":[\"%s\",\"%s\"]", b64[0], b64[1]);
+	if (ts.bookmarks_keyed) {
+		idx += snprintf(plaintext + idx, sizeof(plaintext) - idx,
+				",\"collections\":{\"bookmarks\":[\"%s\",\"%s\"]}",
+				b64[2], b64[3]);
+	}
+	snprintf(plaintext + idx, sizeof(plaintext) - idx, "}");
+
+	return ts_encrypt((const uint8_t (*)[32])sync_key, plaintext);
+}
+
+static json_t *ts_wbo(const char *id, double modified, const char *payload)
+{
+	return json_pack("{s:s,s:f,s:s}",
+			 "id", id,
+			 "modified", modified,
+			 "payload", payload);
+}
+
+static int ts_record_cmp(const void *a, const void *b)
+{
+	const struct ts_record *ra = *(const struct ts_record * const *)a;
+	const struct ts_record *rb = *(const struct ts_record * const *)b;
+
+	if (ra->modified != rb->modified) {
+		return (ra->modified > rb->modified) ? 1 : -1;
+	}
+	return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+static double ts_query(const char *query, const char *name, double value)
+{
+	const char *found;
+
+	found = strstr(query, name);
+	if (found != NULL) {
+		value = strtod(found + strlen(name), NULL);
+	}
+	return value;
+}
+
+/** answer a collection listing, lock held */
+static long
+ts_listing(struct nssync_fetcher_fetch *fetch, const char *collection, const char *query, char **body_out)
+{
+	struct ts_record *matchv[TS_RECORDS];
+	int matchc = 0;
+	double newer;
+	int limit;
+	int offset;
+	int idx;
+	json_t *list;
+
+	newer = ts_query(query, "newer=", 0);
+	limit = ts_query(query, "limit=", 0);
+	offset = ts_query(query, "offset=", 0);
+
+	ts.listings++;
+	if ((fetch->flags & NSSYNC_FETCHER_FILE) != 0) {
+		ts.file_listings++;
+	}
+	if (ts.first_offset == -1) {
+		ts.first_offset = offset;
+		ts.first_unmodified = fetch->unmodified;
+	}
+	if (offset > ts.max_offset) {
+		ts.max_offset = offset;
+	}
+
+	if ((fetch->unmodified != 0) &&
+	    (ts_collection(collection)->modified > fetch->unmodified)) {
+		return 412;
+	}
+	if ((ts.fail_offset != 0) && (offset >= ts.fail_offset)) {
+		return 400;
+	}
+
+	for (idx = 0; idx < ts.recordc; idx++) {
+		if ((strcmp(ts.records[idx].collection, collection) == 0) &&
+		    (ts.records[idx].modified > newer)) {
+			matchv[matchc++] = &ts.records[idx];
+		}
+	}
+	qsort(matchv, matchc, sizeof(*matchv), ts_record_cmp);
+
+	if (limit == 0) {
+		limit = matchc;
+	}
+
+	list = json_array();
+	for (idx = offset; (idx < matchc) && (idx < (offset + limit)); idx++) {
+		json_array_append_new(list, ts_wbo(matchv[idx]->id,
+						   matchv[idx]->modified,
+						   matchv[idx]->payload));
+		ts.listed++;
+	}
+	*body_out = json_dumps(list, JSON_COMPACT);
+	json_decref(list);
+
+	return 200;
+}
+
+/** answer a request, lock held */
+static long ts_answer(struct nssync_fetcher_fetch *fetch, char **body_out)
+{
+	char path[256];
+	char *query;
+	char *name;
+	char *id;
+	char *payload;
+	json_t *root;
+	int idx;
+
+	ts.fetches++;
+
+	if (strcmp(fetch->url, TS_SERVER "user/1.0/" TS_USER "/node/weave") == 0) {
+		ts.node_fetches++;
+		*body_out = strdup(ts.node);
+		return ts.node_status;
+	}
+
+	if (strncmp(fetch->url, TS_SERVER "1.1/" TS_USER "/",
+		    strlen(TS_SERVER "1.1/" TS_USER "/")) != 0) {
+		return 404;
+	}
+	snprintf(path, sizeof(path), "%s",
+		 fetch->url + strlen(TS_SERVER "1.1/" TS_USER "/"));
+
+	if (strcmp(path, "info/collections") == 0) {
+		ts.info_fetches++;
+		root = json_object();
+		for (idx = 0; idx < ts.collectionc; idx++) {
+			json_object_set_new(root, ts.collections[idx].name,
+					    json_real(ts.collections[idx].modified));
+		}
+		*body_out = json_dumps(root, JSON_COMPACT);
+		json_decref(root);
+		return 200;
+	}
+
+	if (strncmp(path, "storage/", 8) != 0) {
+		return 404;
+	}
+	name = path + 8;
+
+	query = strchr(name, '?');
+	if (query != NULL) {
+		*query++ = 0;
+		return ts_listing(fetch, name, query, body_out);
+	}
+
+	id = strchr(name, '/');
+	if (id == NULL) {
+		return ts_listing(fetch, name, "", body_out);
+	}
+	*id++ = 0;
+
+	if ((strcmp(name, "meta") == 0) && (strcmp(id, "global") == 0)) {
+		root = ts_wbo("global", ts_collection("meta")->modified, ts.meta);
+	} else if ((strcmp(name, "crypto") == 0) && (strcmp(id, "keys") == 0)) {
+		ts.keys_fetches++;
+		payload = ts_crypto_keys();
+		root = ts_wbo("keys", ts_collection("crypto")->modified, payload);
+		free(payload);
+	} else {
+		root = NULL;
+		for (idx = 0; idx < ts.recordc; idx++) {
+			if ((strcmp(ts.records[idx].collection, name) == 0) &&
+			    (strcmp(ts.records[idx].id, id) == 0)) {
+				root = ts_wbo(id, ts.records[idx].modified,
+					      ts.records[idx].payload);
+			}
+		}
+		if (root == NULL) {
+			return 404;
+		}
+	}
+	*body_out = json_dumps(root, JSON_COMPACT);
+	json_decref(root);
+
+	return 200;
+}
+
+/** make a fetch and store its response */
+static void ts_respond(struct nssync_fetcher_fetch *fetch)
+{
+	char *body = NULL;
+	size_t length;
+	void *data;
+
+	pthread_mutex_lock(&ts.lock);
+	fetch->http_code = ts_answer(fetch, &body);
+	fetch->backoff = ts.backoff;
+	pthread_mutex_unlock(&ts.lock);
+
+	fetch->result = NSSYNC_ERROR_FETCH;
+	if ((fetch->http_code == 200) && (body != NULL)) {
+		length = strlen(body);
+		fetch->result = NSSYNC_ERROR_OK;
+		if ((fetch->flags & NSSYNC_FETCHER_FILE) != 0) {
+			if ((ftruncate(fetch->fd, 0) != 0) ||
+			    (pwrite(fetch->fd, body, length, 0) != (ssize_t)length)) {
+				fetch->result = NSSYNC_ERROR_FETCH;
+			}
+		} else {
+			if (fetch->data_size < (length + 1)) {
+				data = realloc(fetch->data, length + 1);
+				if (data == NULL) {
+					free(body);
+					fetch->result = NSSYNC_ERROR_NOMEM;
+					return;
+				}
+				fetch->data = data;
+				fetch->data_size = length + 1;
+			}
+			memcpy(fetch->data, body, length + 1);
+		}
+		fetch->data_used = length;
+	}
+	free(body);
+}
+
+/** stub fetcher answering from the server */
+static enum nssync_error ts_fetcher(struct nssync_fetcher_fetch *fetch)
+{
+	enum nssync_error ret;
+
+	ret = nssync_fetcher_check(fetch);
+	if (ret != NSSYNC_ERROR_OK) {
+		return ret;
+	}
+
+	if ((fetch->flags & NSSYNC_FETCHER_ASYNC) != 0) {
+		pthread_mutex_lock(&ts.lock);
+		if (ts.defer) {
+			ts.pending[ts.pendingc++] = fetch;
+			pthread_mutex_unlock(&ts.lock);
+			return NSSYNC_ERROR_RETRY;
+		}
+		pthread_mutex_unlock(&ts.lock);
+
+		ts_respond(fetch);
+		fetch->completion(fetch);
+		return NSSYNC_ERROR_RETRY;
+	}
+
+	ts_respond(fetch);
+	if (fetch->completion != NULL) {
+		return fetch->completion(fetch);
+	}
+	return fetch->result;
+}
+
+/** answer deferred asynchronous fetches
+ *
+ * @return The number of fetches answered.
+ */
+static inline int ts_run(void)
+{
+	struct nssync_fetcher_fetch *fetch;
+	int count = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ts.lock);
+		if (ts.pendingc == 0) {
+			pthread_mutex_unlock(&ts.lock);
+			return count;
+		}
+		fetch = ts.pending[0];
+		ts.pendingc--;
+		memmove(&ts.pending[0], &ts.pending[1],
+			ts.pendingc * sizeof(*ts.pending));
+		pthread_mutex_unlock(&ts.lock);
+
+		ts_respond(fetch);
+		fetch->completion(fetch);
+		count++;
+	}
+}
+
+/* seconds the clock seen by the library is moved on by */
+static time_t ts_clock_offset;
+
+/* polls are only made once due, so sessions are given a clock the
+ * test can move on
+ */
+time_t time(time_t *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	now.tv_sec += ts_clock_offset;
+	if (t != NULL) {
+		*t = now.tv_sec;
+	}
+	return now.tv_sec;
+}
+
+/** run a poll of a session as if it were due */
+static inline enum nssync_error ts_poll(struct nssync_sync *sync)
+{
+	time_t next;
+
+	ts_clock_offset += 24 * 60 * 60;
+	return nssync_sync_schedule(sync, &next);
+}
+
+/* count the cache directory entries starting with prefix */
+static inline int ts_cache_entries(const char *cachedir, const char *prefix)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int count = 0;
+
+	dir = opendir(cachedir);
+	if (dir == NULL) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+			count++;
+		}
+	}
+	closedir(dir);
+
+	return count;
+}
+
+/** remove a cache directory and its files */
+static inline void ts_cache_remove(const char *cachedir)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[512];
+
+	dir = opendir(cachedir);
+	if (dir == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", cachedir, entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+	rmdir(cachedir);
+}
+
+/** fill in the parameters of a session on the server */
+static inline void ts_provider(struct nssync_provider *provider, struct nssync_context *context)
+{
+	memset(provider, 0, sizeof(*provider));
+	provider->type = NSSYNC_SERVICE_MOZILLA;
+	provider->context = context;
+	provider->fetcher = ts_fetcher;
+	provider->params.mozilla.server = TS_SERVER;
+	provider->params.mozilla.account = TS_ACCOUNT;
+	provider->params.mozilla.password = TS_PASSWORD;
+	provider->params.mozilla.key = TS_KEY;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include <nssync/nssync.h>
+
+#include "trace.h"
+#include "testserver.h"
+
+#ifdef NSSYNC_TRACE
+
+/* check an event is a complete span and note if it is a wanted one */
+static bool
+trace_event(json_t *event, const char **namev, bool *seenv, int namec)
+{
+	json_t *name = json_object_get(event, "name");
+	json_t *dur = json_object_get(event, "dur");
+	int idx;
+
+	if (!json_is_string(name) ||
+	    !json_is_string(json_object_get(event, "cat")) ||
+	    !json_is_string(json_object_get(event, "ph")) ||
+	    (strcmp(json_string_value(json_object_get(event, "ph")), "X") != 0) ||
+	    !json_is_number(json_object_get(event, "ts")) ||
+	    !json_is_number(dur) ||
+	    (json_number_value(dur) < 0) ||
+	    (json_integer_value(json_object_get(event, "pid")) != getpid()) ||
+	    (json_integer_value(json_object_get(event, "tid")) < 1)) {
+		return false;
+	}
+
+	for (idx = 0; idx < namec; idx++) {
+		if (strcmp(json_string_value(name), namev[idx]) == 0) {
+			seenv[idx] = true;
+		}
+	}
+	return true;
+}
+
+static bool trace_test(void)
+{
+	static const char *namev[] = {
+		"fetch", "key derivation", "decrypt record", "test",
+	};
+	bool seenv[sizeof(namev) / sizeof(namev[0])] = { false };
+	char filename[] = "/tmp/nssync-trace-XXXXXX";
+	struct nssync_provider provider;
+	struct nssync_sync *sync;
+	struct nssync_engine *engine;
+	struct ts_decoded decoded = { 0 };
+	json_error_t error;
+	json_t *events;
+	json_t *detail;
+	size_t idx;
+	bool passed;
+	int fd;
+
+	printf("Trace file:");
+
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		printf("failed\n");
+		return false;
+	}
+	close(fd);
+
+	/* a sync with the spans of a session and one made here */
+	ts_init();
+	ts_bookmarks(0, 2);
+	ts_provider(&provider, NULL);
+
+	passed = (nssync_trace_start(filename) == NSSYNC_ERROR_OK) &&
+		(nssync_trace_start(filename) == NSSYNC_ERROR_INVAL);
+	if (passed && (nssync_sync_new(&provider, &sync) == NSSYNC_ERROR_OK)) {
+		passed = (nssync_engine_register(sync, &ts_bookmarks_ops, NULL,
+						 &decoded, &engine) == NSSYNC_ERROR_OK) &&
+			(nssync_engine_sync(engine) == NSSYNC_ERROR_OK) &&
+			ts_decoded_all(&decoded, 2);
+		nssync_sync_free(sync);
+	} else {
+		passed = false;
+	}
+	TRACE_PAST(1000, "test", "test", "a \"quoted\"\nline");
+	passed = passed &&
+		(nssync_trace_stop() == NSSYNC_ERROR_OK) &&
+		(nssync_trace_stop() == NSSYNC_ERROR_INVAL);
+
+	ts_fini();
+
+	/* the file loads as an array of the spans */
+	events = json_load_file(filename, 0, &error);
+	passed = passed && json_is_array(events) && (json_array_size(events) > 0);
+	for (idx = 0; passed && (idx < json_array_size(events)); idx++) {
+		passed = trace_event(json_array_get(events, idx),
+				     namev, seenv, sizeof(namev) / sizeof(namev[0]));
+	}
+	for (idx = 0; idx < (sizeof(namev) / sizeof(namev[0])); idx++) {
+		passed = passed && seenv[idx];
+	}
+
+	/* details are escaped, the last span being the one made here */
+	if (passed) {
+		detail = json_object_get(json_object_get(
+			json_array_get(events, json_array_size(events) - 1),
+			"args"), "detail");
+		passed = json_is_string(detail) &&
+			(strcmp(json_string_value(detail), "a \"quoted\"\nline") == 0);
+	}
+
+	json_decref(events);
+	unlink(filename);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+#else
+
+static bool trace_test(void)
+{
+	bool passed;
+
+	printf("Trace file:");
+
+	/* without tracing compiled in it cannot be started */
+	passed = (nssync_trace_start("/tmp/nssync-trace") == NSSYNC_ERROR_INVAL) &&
+		(nssync_trace_stop() == NSSYNC_ERROR_INVAL) &&
+		(access("/tmp/nssync-trace", F_OK) != 0);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = trace_test() && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nssync/nssync.h>
+
+#include "wbo.h"
+
+/* parse a copy of a test string as the parser modifies its input */
+static char *wbo_dup(const char *str, char **end_out)
+{
+	char *buf;
+
+	buf = strdup(str);
+	*end_out = buf + strlen(buf);
+
+	return buf;
+}
+
+static bool wbo_envelope_test(void)
+{
+	const char *wbo = "{\"id\": \"rec\\u00e91\", \"modified\": 1380000014.25,"
+		" \"unknown\": {\"a\": [1, \"]}\", {\"b\": null}]},"
+		" \"payload\": \"{\\\"IV\\\": \\\"a\\\\/b\\\"}\","
+		" \"sortindex\": -3}";
+	struct nssync_wbo_field fieldv[4] = {
+		{ .name = "id" },
+		{ .name = "payload" },
+		{ .name = "modified" },
+		{ .name = "sortindex" },
+	};
+	char *buf;
+	char *end;
+	char *next;
+	bool passed;
+
+	printf("WBO envelope:");
+
+	buf = wbo_dup(wbo, &end);
+	passed = ((nssync_wbo_parse(buf, end, fieldv, 4, &next) == NSSYNC_ERROR_OK) &&
+		  (next == end) &&
+		  (fieldv[0].type == NSSYNC_WBO_STRING) &&
+		  (strcmp(fieldv[0].str, "rec\xc3\xa9" "1") == 0) &&
+		  (fieldv[0].length == 6) &&
+		  (fieldv[1].type == NSSYNC_WBO_STRING) &&
+		  (strcmp(fieldv[1].str, "{\"IV\": \"a\\/b\"}") == 0) &&
+		  (fieldv[2].type == NSSYNC_WBO_NUMBER) &&
+		  (fieldv[2].number == 1380000014.25) &&
+		  (fieldv[3].type == NSSYNC_WBO_NUMBER) &&
+		  (fieldv[3].number == -3));
+	free(buf);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool wbo_surrogate_test(void)
+{
+	const char *wbo = "{\"id\": \"\\ud83d\\ude00\", \"ttl\": true}";
+	struct nssync_wbo_field fieldv[3] = {
+		{ .name = "id" }, { .name = "ttl" }, { .name = "payload" }
+	};
+	char *buf;
+	char *end;
+	bool passed;
+
+	printf("WBO surrogate pair:");
+
+	buf = wbo_dup(wbo, &end);
+	passed = ((nssync_wbo_parse(buf, end, fieldv, 3, NULL) == NSSYNC_ERROR_OK) &&
+		  (strcmp(fieldv[0].str, "\xf0\x9f\x98\x80") == 0) &&
+		  (fieldv[1].type == NSSYNC_WBO_OTHER) &&
+		  (fieldv[1].length == 4) &&
+		  (strncmp(fieldv[1].str, "true", 4) == 0) &&
+		  (fieldv[2].type == NSSYNC_WBO_ABSENT));
+	free(buf);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool wbo_invalid_test(void)
+{
+	const char *invalid[] = {
+		"",
+		"[]",
+		"{\"id\": \"unterminated}",
+		"{\"id\" \"x\"}",
+		"{\"id\": \"x\",}",
+		"{\"id\": \"\\ude00\"}",
+		"{\"id\": \"\\q\"}",
+		"{\"id\": \"x\"",
+	};
+	struct nssync_wbo_field fieldv[1] = { { .name = "id" } };
+	unsigned int idx;
+	char *buf;
+	char *end;
+	bool passed = true;
+
+	printf("WBO invalid:");
+
+	for (idx = 0; idx < sizeof(invalid) / sizeof(invalid[0]); idx++) {
+		buf = wbo_dup(invalid[idx], &end);
+		if (nssync_wbo_parse(buf, end, fieldv, 1, NULL) != NSSYNC_ERROR_PROTOCOL) {
+			printf("accepted %s ", invalid[idx]);
+			passed = false;
+		}
+		free(buf);
+	}
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+static bool wbo_list_test(const char *name, const char *list)
+{
+	struct nssync_wbo_field fieldv[1] = { { .name = "id" } };
+	const char *ids[] = { "a", "b\"", "c" };
+	char *buf;
+	char *end;
+	char *cursor;
+	bool found;
+	int count;
+	int idx = 0;
+	bool passed;
+
+	printf("WBO %s listing:", name);
+
+	buf = wbo_dup(list, &end);
+	passed = ((nssync_wbo_list_count(buf, end, &count) == NSSYNC_ERROR_OK) &&
+		  (count == 3));
+
+	cursor = buf;
+	while (passed) {
+		if (nssync_wbo_list_next(&cursor, end, fieldv, 1, &found) != NSSYNC_ERROR_OK) {
+			passed = false;
+		} else if (!found) {
+			break;
+		} else if ((idx >= 3) || (strcmp(fieldv[0].str, ids[idx]) != 0)) {
+			passed = false;
+		}
+		idx++;
+	}
+	free(buf);
+
+	passed = passed && (idx == 3);
+
+	printf("%s\n", passed ? "passed" : "failed");
+
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+
+	passed = wbo_envelope_test() && passed;
+	passed = wbo_surrogate_test() && passed;
+	passed = wbo_invalid_test() && passed;
+	passed = wbo_list_test("array",
+			       "[{\"id\": \"a\"}, {\"id\": \"b\\\"\", \"x\": [{}]},"
+			       "{\"id\":\"c\"}]") && passed;
+	passed = wbo_list_test("newline",
+			       "{\"id\": \"a\"}\n{\"id\": \"b\\\"\"}\r\n"
+			       "{\"id\": \"c\"}\n") && passed;
+
+	if (!passed) {
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}